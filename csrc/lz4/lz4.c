@@ -0,0 +1,315 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include "lz4.h"
+
+#include <string.h>
+#include <errno.h>
+
+/* Every sequence is a token (literal length over match length, four bits
+   each), any literal length overflow bytes, the literals, a little-endian
+   16-bit match offset, and any match length overflow bytes. The last sequence
+   has literals only. */
+#define MIN_MATCH (4)
+#define LAST_LITERALS (5)   /* The last bytes of a block are always literal. */
+#define MF_LIMIT (12)       /* No match may start within this many bytes of the
+                               end of a block. */
+#define MAX_OFFSET (65535)
+#define RUN_MASK (15)
+#define HASH_LOG (12)
+#define WILD_COPY (16)      /* Copies are made in chunks of this many bytes
+                               while there's room to overrun. */
+#define SKIP_TRIGGER (6)    /* Search faster through incompressible data, by
+                               skipping further ahead every 2^SKIP_TRIGGER
+                               failed probes. */
+
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static inline uint32_t
+hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* Returns the number of bytes from P (up to LIMIT) equal to those at REF. */
+static inline size_t
+count_match(const uint8_t *p, const uint8_t *ref, const uint8_t *limit)
+{
+    const uint8_t *start = p;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (p + sizeof(uint64_t) <= limit) {
+        uint64_t diff = read64(p) ^ read64(ref);
+        if (diff != 0) {
+            return p - start + (__builtin_ctzll(diff) >> 3);
+        }
+        p += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+#endif
+    while (p < limit && *p == *ref) {
+        p++;
+        ref++;
+    }
+
+    return p - start;
+}
+
+/* Write the overflow bytes of a LEN of at least RUN_MASK to OP. */
+static inline uint8_t *
+write_length(uint8_t *op, size_t len)
+{
+    for (len -= RUN_MASK; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t) len;
+
+    return op;
+}
+
+/* Compress the SIZE bytes at SRC into a single LZ4 block at DST, which has room
+   for MAX bytes. A MAX of LZ4_BOUND(SIZE) always suffices. Returns the size
+   of the block, -ENOSPC if it wouldn't fit in MAX bytes, or -E2BIG if SIZE
+   exceeds LZ4_MAX_INPUT_SIZE. */
+ssize_t
+lz4_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t max)
+{
+    if (size > LZ4_MAX_INPUT_SIZE) {
+        return -E2BIG;
+    }
+
+    uint32_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + max;
+
+    if (size > MF_LIMIT) {
+        const uint8_t *mf_limit = end - MF_LIMIT;
+        const uint8_t *match_limit = end - LAST_LITERALS;
+        size_t probes = 1 << SKIP_TRIGGER;
+        while (ip <= mf_limit) {
+            uint32_t h = hash32(read32(ip));
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip += probes++ >> SKIP_TRIGGER;
+                continue;
+            }
+            probes = 1 << SKIP_TRIGGER;
+
+            /* Grow the match backwards into the pending literals. */
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t lit = ip - anchor;
+            size_t len = count_match(ip + MIN_MATCH, ref + MIN_MATCH, match_limit);
+
+            /* Token, literals, offset and lengths. */
+            if ((size_t) (oend - op) < 1 + lit + lit / 255 + 1 + 2 + len / 255 + 1) {
+                return -ENOSPC;
+            }
+            uint8_t *token = op++;
+            if (lit >= RUN_MASK) {
+                *token = RUN_MASK << 4;
+                op = write_length(op, lit);
+            } else {
+                *token = lit << 4;
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+            size_t offset = ip - ref;
+            *op++ = (uint8_t) offset;
+            *op++ = (uint8_t) (offset >> 8);
+            if (len >= RUN_MASK) {
+                *token |= RUN_MASK;
+                op = write_length(op, len);
+            } else {
+                *token |= len;
+            }
+
+            ip += MIN_MATCH + len;
+            anchor = ip;
+            if (ip - 2 >= src) {
+                table[hash32(read32(ip - 2))] = ip - 2 - src;
+            }
+        }
+    }
+
+    /* The remainder goes out as literals. */
+    size_t lit = end - anchor;
+    if ((size_t) (oend - op) < 1 + lit + lit / 255 + 1) {
+        return -ENOSPC;
+    }
+    if (lit >= RUN_MASK) {
+        *op++ = RUN_MASK << 4;
+        op = write_length(op, lit);
+    } else {
+        *op++ = lit << 4;
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+/* Read the overflow bytes of a length from *IP (before END) onto LEN. Returns
+   false if the input ends first. */
+static inline int
+read_length(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return 0;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 1;
+}
+
+/* Decompress the LZ4 block of SIZE bytes at SRC into DST, which has room for MAX
+   bytes. Safe against malformed input, which never reads or writes out of
+   bounds. Returns the decompressed size, or -EINVAL if SRC isn't a valid block
+   or doesn't fit in MAX bytes. */
+ssize_t
+lz4_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t max)
+{
+    const uint8_t *ip = src;
+    const uint8_t *end = src + size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + max;
+
+    /* Bytes copied past the end of literals or a match are overwritten by
+       whatever follows them, so away from either end of the buffers copies are
+       made in fixed-size chunks. */
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        size_t len = token & RUN_MASK;
+        size_t offset;
+
+        /* Short sequences are the common case, and take a few moves. */
+        if (lit < RUN_MASK && len < RUN_MASK &&
+            end - ip >= 2 * WILD_COPY && oend - op >= 3 * WILD_COPY) {
+            memcpy(op, ip, WILD_COPY);
+            op += lit;
+            ip += lit;
+            offset = ip[0] | ((size_t) ip[1] << 8);
+            ip += 2;
+            if (offset >= sizeof(uint64_t) && offset <= (size_t) (op - dst)) {
+                const uint8_t *ref = op - offset;
+                memcpy(op, ref, sizeof(uint64_t));
+                memcpy(op + 8, ref + 8, sizeof(uint64_t));
+                memcpy(op + 16, ref + 16, 2);
+                op += len + MIN_MATCH;
+                continue;
+            }
+            goto match;
+        }
+
+        /* Literals. */
+        if (lit == RUN_MASK && !read_length(&ip, end, &lit)) {
+            return -EINVAL;
+        }
+        if (lit > (size_t) (end - ip) || lit > (size_t) (oend - op)) {
+            return -EINVAL;
+        }
+        if (lit <= WILD_COPY && end - ip >= 2 * WILD_COPY && oend - op >= 2 * WILD_COPY) {
+            memcpy(op, ip, WILD_COPY);
+        } else {
+            memcpy(op, ip, lit);
+        }
+        op += lit;
+        ip += lit;
+        if (ip == end) {
+            break;
+        }
+
+        /* Match. */
+        if (end - ip < 2) {
+            return -EINVAL;
+        }
+        offset = ip[0] | ((size_t) ip[1] << 8);
+        ip += 2;
+    match:
+        if (offset == 0 || offset > (size_t) (op - dst)) {
+            return -EINVAL;
+        }
+        if (len == RUN_MASK && !read_length(&ip, end, &len)) {
+            return -EINVAL;
+        }
+        len += MIN_MATCH;
+        if (len > (size_t) (oend - op)) {
+            return -EINVAL;
+        }
+        const uint8_t *ref = op - offset;
+        if ((size_t) (oend - op) >= len + WILD_COPY) {
+            if (offset >= WILD_COPY) {
+                for (size_t i = 0; i < len; i += WILD_COPY) {
+                    memcpy(op + i, ref + i, WILD_COPY);
+                }
+                op += len;
+                continue;
+            }
+            if (offset >= sizeof(uint64_t)) {
+                for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+                    memcpy(op + i, ref + i, sizeof(uint64_t));
+                }
+                op += len;
+                continue;
+            }
+        }
+
+        /* Closely overlapping matches repeat the few bytes before them, and
+           are copied a byte at a time. */
+        for (size_t i = 0; i < len; i++) {
+            op[i] = ref[i];
+        }
+        op += len;
+    }
+
+    return op - dst;
+}
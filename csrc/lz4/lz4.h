@@ -0,0 +1,44 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef __LZ4_H_
+#define __LZ4_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Minimal codec for the LZ4 block format, so no liblz4 dependency is needed.
+   Blocks are interchangeable with those of the reference implementation's
+   LZ4_compress_default and LZ4_decompress_safe. */
+
+/* Largest input lz4_compress accepts. */
+#define LZ4_MAX_INPUT_SIZE (0x7E000000)
+
+/* Worst-case compressed size of SIZE bytes of input. */
+#define LZ4_BOUND(size) ((size) + (size) / 255 + 16)
+
+ssize_t lz4_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t max);
+ssize_t lz4_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t max);
+
+#endif
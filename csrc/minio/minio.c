@@ -1,370 +1,5048 @@
-/* MIT License
-
-    Copyright (c) 2023 Gus Waldspurger
-
-    Permission is hereby granted, free of charge, to any person obtaining a copy
-    of this software and associated documentation files (the "Software"), to deal
-    in the Software without restriction, including without limitation the rights
-    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
-    copies of the Software, and to permit persons to whom the Software is
-    furnished to do so, subject to the following conditions:
-
-    The above copyright notice and this permission notice shall be included in all
-    copies or substantial portions of the Software.
-
-    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-    SOFTWARE.
-    */
-
-#define _GNU_SOURCE
-
-#include "minio.h"
-#include "../utils/utils.h"
-
-#include <string.h>
-#include <errno.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <stdint.h>
-#include <stdbool.h>
-#include <assert.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <stdatomic.h>
-#include <pthread.h>
-#include <sys/shm.h>
-#include <sys/mman.h>
-
-#include "../include/uthash.h"
-
-#define AVERAGE_FILE_SIZE (100 * 1024)
-#define ENTRIES_PER_LOCK (16)
-#define MIN_LOCKS (8)
-
-#define STAT_INC(cache, field) atomic_fetch_add(&cache->field, 1)
-
-
-/* Check if CACHE contains PATH. Returns true if cached, else false. */
-bool
-cache_contains(cache_t *c, char *path)
-{
-    hash_entry_t *entry = NULL;
-    pthread_spin_lock(&c->ht_lock);
-    HASH_FIND_STR(c->ht, path, entry);
-    pthread_spin_unlock(&c->ht_lock);
-
-    return (entry != NULL);
-}
-
-/* Store DATA into CACHE indexed by PATH. On success, returns 0. On failure,
-   returns negative errno value. */
-int
-cache_store(cache_t *c, char *path, uint8_t *data, size_t size)
-{
-    /* Check size constraint. */
-    if (size > c->max_item_size) {
-        return -E2BIG;
-    }
-
-    /* Acquire an entry. */
-    size_t n = atomic_fetch_add(&c->n_ht_entries, 1);
-    if (n >= c->max_ht_entries) {
-        return -ENOMEM;
-    }
-    hash_entry_t *entry = &c->ht_entries[n];
-
-    /* Figure out where the data goes. */
-    entry->size = size;
-    size_t used = atomic_fetch_add(&c->used, size);
-    entry->ptr = c->data + used;
-
-    /* Check that this data is being placed in-range before continuing. If we're
-       out-of-range, undo the expansion and abort. */
-    if (used + size > c->size) {
-        atomic_fetch_sub(&c->used, size);
-        return -ENOMEM;
-    }
-
-    /* Copy the path into the entry. */
-    strncpy(entry->path, path, MAX_PATH_LEN);
-
-    /* Prepare the filepath according to shm requirements. */
-    entry->shm_path[0] = '/';
-    for (int i = 0; i < MAX_PATH_LEN + 1; i++) {
-        /* Replace all occurences of '/' with '_'. */
-        entry->shm_path[i + 1] = entry->path[i] == '/' ? '_' : entry->path[i];
-        if (entry->path[i] == '\0') {
-            break;
-        }
-    }
-
-    /* Allocate an shm object for this entry's data. */
-    entry->shm_fd = shm_open(entry->shm_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (entry->shm_fd < 0) {
-        fprintf(stderr, "failed to shm_open %s\n", entry->path);
-        return -errno;
-    }
-
-    /* Appropriately size the shm object. */
-    if (ftruncate(entry->shm_fd, entry->size) < 0) {
-        shm_unlink(entry->shm_path);
-        close(entry->shm_fd);
-        return -errno;
-    }
-
-    /* Create the mmap for the shm object. */
-    entry->ptr = mmap(NULL, entry->size, PROT_WRITE, MAP_SHARED, entry->shm_fd, 0);
-    if (entry->ptr == NULL) {
-        shm_unlink(entry->shm_path);
-        close(entry->shm_fd);
-        return -ENOMEM;
-    }
-
-    /* Page-lock the memory. */
-    mlock(entry->ptr, entry->size);
-
-    /* Copy data to the cache. */
-    memcpy(entry->ptr, data, size);
-
-    /* Insert into hash table. */
-    pthread_spin_lock(&c->ht_lock);
-    HASH_ADD_STR(c->ht, path, entry);
-    pthread_spin_unlock(&c->ht_lock);
-
-    return 0;
-}
-
-/* Load the data at PATH in CACHE into DATA (a maximum of MAX bytes), storing
-   the size of the file into SIZE. A cache miss is considered a failure
-   (-ENODATA is returned without any IO being issued). On success returns 0.
-   On failure returns negative errno. */
-int
-cache_load(cache_t *c, char *path, uint8_t *data, size_t *size, size_t max)
-{
-    hash_entry_t *entry = NULL;
-    pthread_spin_lock(&c->ht_lock);
-    HASH_FIND_STR(c->ht, path, entry);
-    if (entry == NULL) {
-        pthread_spin_unlock(&c->ht_lock);
-        return -ENODATA;
-    }
-
-    pthread_spinlock_t *lock = &c->entry_locks[entry->lock_id];
-    pthread_spin_lock(lock);
-    pthread_spin_unlock(&c->ht_lock);
-
-    /* Open the shm object containing the file data. Because there was a hit in
-       the hashtable, an shm object with PATH must exist, and thus if this call
-       fails, something is deeply broken/corrupted. */
-    int fd = shm_open(entry->shm_path, O_RDWR, S_IRUSR | S_IWUSR);
-    assert(fd >= 0);
-
-    /* This call should also not fail unless something is deeply broken or
-       corrupted, as this memory has already been allocated elsewhere, and given
-       it's shared, there should be no real impact to system memory utilization
-       from this call. */
-    uint8_t *ptr = mmap(NULL, entry->size, PROT_WRITE, MAP_SHARED, fd, 0);
-    assert(ptr != NULL);
-
-    /* Copy the data into the user's DATA buffer, but don't overflow it. */
-    *size = entry->size;
-    if (entry->size > max) {
-        pthread_spin_unlock(lock);
-        return -EINVAL;
-    }
-    memcpy(data, ptr, entry->size);
-
-    /* Close our references to the file data. */
-    close(fd);
-    munmap(ptr, entry->size);
-    pthread_spin_unlock(lock);
-
-    return 0;
-}
-
-/* Read an item from CACHE into DATA, indexed by PATH, and located on the
-   filesystem at PATH. On failure returns errno code with negative value,
-   otherwise returns bytes read on success.
-   
-   DATA must be block-aligned, in order for direct IO to work properly.
-   
-   Note we use atomics to implement thread safe options because pthreads and
-   traditional synchronization primitives are not safe to use with the Python
-   interpreter, and may cause deadlock to occur, regardless of the correctness
-   of primitives' usage.
-   
-   It should be noted that the cache is only thread/process safe so long as the
-   cache entries are only written once (as is the case with MinIO). */
-ssize_t
-cache_read(cache_t *c, char *path, void *data, uint64_t max_size)
-{
-    size_t n_accs = STAT_INC(c, n_accs);
-    if (n_accs % 2500 == 0) {
-        DEBUG_LOG("[MinIO debug] accesses = %lu, hits = %lu, cold misses = %lu, capacity misses = %lu, fails = %lu (usage = %lu/%lu MB) (cache->data = %p) (&cache->used = %p) (pid = %d, ppid = %d)\n", c->n_accs, c->n_hits, c->n_miss_cold, c->n_miss_capacity, c->n_fail, c->used / (1024 * 1024), c->size / (1024 * 1024), c->data, &c->used, getpid(), getppid());
-    }
-
-    /* Check if the file is cached. */
-    size_t bytes = 0;
-    int status = cache_load(c, path, data, &bytes, max_size);
-    if (status < 0) {
-        /* Don't fail if the error was the file not being cached. */
-        if (status != -ENODATA) {
-            return (ssize_t) status;
-        }
-    } else {
-        STAT_INC(c, n_hits);
-        return (ssize_t) bytes;
-    }
-
-    /* Open the file in DIRECT mode. */
-    int fd = open(path, O_RDONLY | __O_DIRECT);
-    if (fd < 0) {
-        STAT_INC(c, n_fail);
-        return -ENOENT;
-    }
-
-    /* Ensure the size of the file is OK. */
-    size_t size = lseek(fd, 0L, SEEK_END);
-    if (size > max_size || size == 0) {
-        close(fd);
-        STAT_INC(c, n_fail);
-        return -EINVAL;
-    }
-    lseek(fd, 0L, SEEK_SET);
-
-    /* Note there is an implicit assumption that two threads/processes will not
-       simultaneously attempt to access the same path for the *first* time.
-       For ML data-loader applications this is satisfied, since each element is
-       accessed only once per epoch, however this will present a race condition
-       in applications where this scenario can occur. */
-
-    /* Read into data. */
-    read(fd, data, (size | 0xFFF) + 1);
-    close(fd);
-
-    /* Cache the data. If this call fails, the data didn't fit. */
-    if (cache_store(c, path, data, size) < 0) {
-        STAT_INC(c, n_miss_capacity);
-    } else {
-        STAT_INC(c, n_miss_cold);
-    }
-
-    return size;
-}
-
-/* Clear the cache's hash table and reset used bytes to zero. */
-void
-cache_flush(cache_t *c)
-{
-
-    /* Free each entry's shm object. */
-    hash_entry_t *entry, *tmp;
-    pthread_spin_lock(&c->ht_lock);
-    HASH_ITER(hh, c->ht_entries, entry, tmp) {
-        pthread_spin_lock(&c->entry_locks[entry->lock_id]);
-        shm_unlink(entry->shm_path);
-        close(entry->shm_fd);
-        munmap(entry->ptr, entry->size);
-        pthread_spin_unlock(&c->entry_locks[entry->lock_id]);
-    }
-
-    /* Clear the HT and the cache metadata. */
-    HASH_CLEAR(hh, c->ht);
-    atomic_store(&c->used, 0);
-    atomic_store(&c->n_ht_entries, 0);
-    pthread_spin_unlock(&c->ht_lock);
-}
-
-/* Initialize a cache CACHE with SIZE bytes and POLICY replacement policy. On
-   success, 0 is returned. On failure, negative errno value is returned. */
-int
-cache_init(cache_t *c,
-           size_t size,
-           size_t max_item_size,
-           size_t avg_item_size,
-           policy_t policy)
-{
-    /* Cache configuration. */
-    c->size = size;
-    c->used = 0;
-    c->policy = policy;
-    c->max_item_size = max_item_size;
-
-    /* Zero initial stats. */
-    c->n_accs = 0;
-    c->n_fail = 0;
-    c->n_hits = 0;
-    c->n_miss_capacity = 0;
-    c->n_miss_cold = 0;
-
-    /* Initialize the hash table. Allocate more entries than we'll likely need,
-       since file size may vary, and entries are relatively small. */
-    c->n_ht_entries = 0;
-    if (avg_item_size != 0) {
-        c->max_ht_entries = (2 * size) / avg_item_size;
-    } else {
-        c->max_ht_entries = (2 * size) / AVERAGE_FILE_SIZE;
-    }
-    assert(c->max_ht_entries > 0);
-    c->ht_size = (c->max_ht_entries + 1) * sizeof(hash_entry_t);
-    if ((c->ht_entries = mmap_alloc(c->ht_size)) == NULL) {
-        return -ENOMEM;
-    }
-    c->ht = &c->ht_entries[c->max_ht_entries];
-    memset(c->ht_entries, 0, c->ht_size);
-
-    /* Synchronization initialization. */
-    assert(!pthread_spin_init(&c->ht_lock, PTHREAD_PROCESS_SHARED));
-    c->n_entry_locks = MAX(MIN_LOCKS, c->max_ht_entries / ENTRIES_PER_LOCK);
-    c->entry_locks = mmap_alloc(c->n_entry_locks * sizeof(pthread_spinlock_t));
-    for (size_t i = 0; i < c->n_entry_locks; i++) {
-        assert(!pthread_spin_init(&c->entry_locks[i], PTHREAD_PROCESS_SHARED));
-    }
-    for (size_t i = 0; i < c->max_ht_entries; i++) {
-        c->ht_entries[i].lock_id = utils_hash(i) % c->n_entry_locks;
-    }
-
-    /* Get log2 of the number of entries. */
-    int max_ht_entries_copy = c->max_ht_entries;
-    int max_ht_entries_log2 = 0;
-    while (max_ht_entries_copy >>= 1) max_ht_entries_log2++;
-    HASH_MAKE_TABLE(hh, c->ht, 0, c->max_ht_entries, max_ht_entries_log2);
-
-    /* We don't allocate the memory used to cache actual data yet. This memory
-       will be allocated on-demand using SHM objects named with the entry's key
-       in the hash table. */
-
-    return 0;
-}
-
-/* Destroy a cache. Deallocates all allocated memory. Not thread safe. */
-void
-cache_destroy(cache_t *c)
-{
-    if (c == NULL) {
-        return;
-    }
-
-    /* Free each entry's shm object. */
-    hash_entry_t *entry, *tmp;
-    HASH_ITER(hh, c->ht_entries, entry, tmp) {
-        shm_unlink(entry->shm_path);
-        close(entry->shm_fd);
-        munmap(entry->ptr, entry->size);
-    }
-
-    /* Free the hash table. */
-    if (c->ht_entries != NULL) {
-        munmap(c->ht_entries, sizeof(hash_entry_t) * c->max_ht_entries + 1);
-    }
-
-    /* Free the spinlocks. */
-    if (c->entry_locks != NULL) {
-        munmap((void *) c->entry_locks, sizeof(pthread_spinlock_t) * c->n_entry_locks);
-    }
-}
\ No newline at end of file
+/* MIT License
+
+    Copyright (c) 2023 Gus Waldspurger
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+    */
+
+#define _GNU_SOURCE
+
+#include "minio.h"
+#include "../utils/utils.h"
+#include "../uring/uring.h"
+#include "../lz4/lz4.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define AVERAGE_FILE_SIZE (100 * 1024)
+#define SLOTS_PER_ENTRY (2)
+#define KEY_BYTES_PER_ENTRY (512)
+#define KEY_BYTES_PER_PATH (64)
+#define SHM_NAME_LEN (64)
+#define ARENA_ALIGN (64)
+#define BATCH_BLOCK_SIZE (4096)
+#define BATCH_QUEUE_DEPTH (128)
+#define BATCH_THREADS (16)
+#define CACHE_LAYOUT_VERSION (5)
+#define ATTACH_TRIES (5000)
+#define ATTACH_WAIT_US (1000)
+#define SPILL_ALIGN (4096)
+#define TAR_BLOCK (512)
+#define SHARD_EXTENT (32 * 1024 * 1024)
+#define SHARD_MEMBERS_PER_ENTRY (4)
+#define MAX_SHARDS (1 << 14)
+
+/* Configuration flag of the caches indexing a spill tier or shard members: an
+   arena whose data lives on disk, rather than in memory. */
+#define CACHE_SPILL_TIER (1 << 16)
+
+#define STAT_ADD(cache, field, n) \
+    atomic_fetch_add_explicit(&cache_stat_shard(cache)->field, (n), memory_order_relaxed)
+#define STAT_INC(cache, field) STAT_ADD(cache, field, 1)
+
+_Static_assert(sizeof(hash_entry_t) == 32, "hash entries should pack two to a cache line");
+_Static_assert(sizeof(cache_variant_t) == 128, "variant data should stay cache line aligned");
+
+/* An entry's state packs its pin count, its CLOCK reference bit and its
+   generation. The generation is odd while the entry is live, and advances
+   whenever the entry is evicted, flushed or reused, which is how readers detect
+   that an entry they found was recycled before they could pin it. */
+#define ENTRY_PIN_MASK ((1u << 20) - 1)
+#define ENTRY_REF (1u << 20)
+#define ENTRY_GEN_SHIFT (21)
+#define ENTRY_GEN_INC (1u << ENTRY_GEN_SHIFT)
+#define ENTRY_GEN(state) ((state) >> ENTRY_GEN_SHIFT)
+#define ENTRY_LIVE(state) (ENTRY_GEN(state) & 1)
+
+/* Entries indexed from a snapshot by cache_open keep their data in the
+   snapshot's mapping, at the offset below the flags. Compressed entries store
+   the file's size (LZ4_HEADER_SIZE bytes), followed by an LZ4 block. */
+#define OFFSET_SNAPSHOT (1ULL << 63)
+#define OFFSET_LZ4 (1ULL << 62)
+#define OFFSET_FLAGS (OFFSET_SNAPSHOT | OFFSET_LZ4)
+#define ENTRY_OFFSET(entry) ((entry)->offset & ~OFFSET_FLAGS)
+#define ENTRY_IN_SNAPSHOT(entry) ((entry)->offset & OFFSET_SNAPSHOT)
+#define ENTRY_COMPRESSED(entry) ((entry)->offset & OFFSET_LZ4)
+
+/* Shard members' entries hold their shard's ID above their offset into it,
+   clear of the flags. */
+#define MEMBER_SHARD_SHIFT (48)
+#define MEMBER_OFFSET(entry) ((entry)->offset & ((1ULL << MEMBER_SHARD_SHIFT) - 1))
+#define MEMBER_SHARD(entry) (ENTRY_OFFSET(entry) >> MEMBER_SHARD_SHIFT)
+#define ENTRY_SNAPSHOT_DATA(cache, entry) ((cache)->snap + ENTRY_OFFSET(entry))
+#define LZ4_HEADER_SIZE (sizeof(uint64_t))
+
+/* Snapshot files written by cache_save start with a header, followed by one
+   record per entry, the entries' NUL-terminated paths, and finally (at a page
+   boundary) their data. Offsets are from the start of the file. */
+#define SNAPSHOT_MAGIC (0x50414e534f494e4dULL)  /* "MINIOSNAP" */
+#define SNAPSHOT_VERSION (3)
+#define SNAPSHOT_ALIGN (4096)
+
+typedef struct {
+    uint64_t magic;         /* SNAPSHOT_MAGIC. */
+    uint64_t version;       /* SNAPSHOT_VERSION. */
+    uint64_t n_entries;     /* Number of records. */
+    uint64_t keys_offset;   /* Offset of the paths. */
+    uint64_t keys_size;     /* Bytes of paths. */
+    uint64_t data_offset;   /* Offset of the data. */
+    uint64_t data_size;     /* Bytes of data. */
+} snapshot_header_t;
+
+typedef struct {
+    uint64_t key;           /* Offset of the entry's path. */
+    uint64_t offset;        /* Offset of the entry's data. */
+    uint64_t size;          /* Size of the entry's data in bytes. */
+    uint64_t flags;         /* SNAPSHOT_* flags. */
+} snapshot_record_t;
+
+#define SNAPSHOT_LZ4 (1 << 0)       /* The data is compressed, as in the cache. */
+#define SNAPSHOT_DERIVED (1 << 1)   /* The key is derived from a path. */
+
+/* Keys derived from a path (range blocks and variants) hash into the top half
+   of the hash space, and paths into the bottom half, so that no path matches
+   a derived key, however it's spelled. */
+#define HASH_DERIVED (1ULL << 63)
+
+#define SLOT_TAG(hash) ((hash) >> 32)
+#define SLOT_ID(slot) ((uint32_t) (slot))
+#define SLOT_MAKE(hash, id) ((SLOT_TAG(hash) << 32) | (id))
+
+/* Number of slots cache_find compares at once, where it can. */
+#define SLOT_GROUP (4)
+
+/* A registered path's hint holds the flush count (as much of it as fits) and
+   generation its entry was found in, over the entry's offset plus one. Flushes
+   leave detached entries' generations to be moved on as they're reclaimed, so
+   it's the flush count that rules out a hint from before one. */
+#define HINT_GEN_BITS (32 - ENTRY_GEN_SHIFT)
+#define HINT_FLUSH_SHIFT (32 + HINT_GEN_BITS)
+#define HINT_MAKE(epoch, gen, id) \
+    (((uint64_t) ((epoch) / 2) << HINT_FLUSH_SHIFT) | ((uint64_t) (gen) << 32) | (id))
+#define HINT_GEN(hint) ((unsigned) ((hint) >> 32) & ((1u << HINT_GEN_BITS) - 1))
+#define HINT_CURRENT(hint, epoch) \
+    (((hint) >> HINT_FLUSH_SHIFT) == (((epoch) / 2) & ((1ULL << (64 - HINT_FLUSH_SHIFT)) - 1)))
+
+
+/* Number of caches initialized by this process, used to give each one a
+   distinct shm namespace. */
+static atomic_uint n_caches = 0;
+
+/* This thread's statistics shard, or -1 until its first update. Forked
+   children reset it, so they don't keep updating their parent's shard. */
+static _Thread_local int stat_shard = -1;
+static atomic_uint n_stat_threads = 0;
+static pthread_once_t stat_once = PTHREAD_ONCE_INIT;
+
+static void
+stat_shard_reset(void)
+{
+    stat_shard = -1;
+}
+
+static void
+stat_shard_init(void)
+{
+    pthread_atfork(NULL, NULL, stat_shard_reset);
+}
+
+/* Returns this thread's statistics shard of CACHE. Threads are spread over
+   shards round-robin, offset by process. */
+static inline cache_stat_shard_t *
+cache_stat_shard(cache_t *c)
+{
+    if (stat_shard < 0) {
+        stat_shard = (utils_hash(getpid()) + atomic_fetch_add(&n_stat_threads, 1)) % N_STAT_SHARDS;
+    }
+
+    return &CACHE_STATS(c)[stat_shard];
+}
+
+/* Count VALUE in histogram HIST of CACHE. */
+static inline void
+cache_stat_hist(cache_t *c, hist_t hist, size_t value)
+{
+    int bucket = value == 0 ? 0 : MIN(64 - __builtin_clzll(value), N_HIST_BUCKETS - 1);
+    cache_stat_shard_t *shard = cache_stat_shard(c);
+    atomic_fetch_add_explicit(&shard->hists[hist].buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->hists[hist].sum, value, memory_order_relaxed);
+}
+
+/* Monotonic time in nanoseconds. */
+static inline uint64_t
+cache_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Record a read of SIZE bytes served from CACHE, which began at START. */
+static inline void
+cache_stat_hit(cache_t *c, uint64_t start, size_t size)
+{
+    STAT_INC(c, n_hits);
+    cache_stat_hist(c, HIST_HIT_NS, cache_now_ns() - start);
+    cache_stat_hist(c, HIST_CACHE_BYTES, size);
+}
+
+/* Record a read of SIZE bytes from the filesystem, which began at START. */
+static inline void
+cache_stat_miss(cache_t *c, uint64_t start, size_t size)
+{
+    cache_stat_hist(c, HIST_MISS_NS, cache_now_ns() - start);
+    cache_stat_hist(c, HIST_DISK_BYTES, size);
+}
+
+
+/* Returns the size of the huge pages CACHE asked for, or zero. */
+static inline size_t
+cache_huge_page_size(cache_t *c)
+{
+    if (c->flags & CACHE_HUGE_1GB) {
+        return HUGE_PAGE_1GB;
+    }
+
+    return c->flags & CACHE_HUGE_2MB ? HUGE_PAGE_2MB : 0;
+}
+
+/* Count a read of pinned ENTRY's data in CACHE as local or remote to the NUMA
+   node of the calling thread, if CACHE tracks placement. */
+static inline void
+cache_stat_locality(cache_t *c, hash_entry_t *entry)
+{
+    if (!(c->flags & CACHE_NUMA) || ENTRY_IN_SNAPSHOT(entry)) {
+        return;
+    }
+    int node;
+    if (c->flags & CACHE_ARENA) {
+        node = c->nodes[MIN(ENTRY_OFFSET(entry) / c->shard_size, (size_t) c->n_nodes - 1)];
+    } else {
+        node = CACHE_SHMS(c)[entry - CACHE_ENTRIES(c)].node;
+    }
+    if (node == utils_numa_node()) {
+        STAT_INC(c, n_reads_local);
+    } else {
+        STAT_INC(c, n_reads_remote);
+    }
+}
+
+/* Returns whether process PID is alive. */
+static inline bool
+pid_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/* Returns the hash PATH is indexed by. */
+static inline uint64_t
+cache_hash(char *path)
+{
+    return utils_hash_str(path) & ~HASH_DERIVED;
+}
+
+/* Returns the hash KEY, derived from a path, is indexed by. */
+static inline uint64_t
+cache_derived_hash(char *key)
+{
+    return utils_hash_str(key) | HASH_DERIVED;
+}
+
+/* Returns the filepath ENTRY in CACHE is keyed by. */
+static inline char *
+cache_key(cache_t *c, hash_entry_t *entry)
+{
+    return CACHE_KEYS(c) + (size_t) entry->key * KEY_ALIGN;
+}
+
+/* Write the name of the shm object for entry N of CACHE, stored after FLUSH
+   flushes, into NAME, which must hold SHM_NAME_LEN bytes. Objects are named
+   after the entry rather than its path, so that racing stores of the same path
+   can't clobber each other's objects. */
+static inline void
+cache_shm_name(cache_t *c, size_t n, uint32_t flush, char *name)
+{
+    snprintf(name, SHM_NAME_LEN, "/minio_%llx_%x_%zu", (unsigned long long) c->id, flush, n);
+}
+
+/* Look up PATH (hashed to HASH) in CACHE's index. Returns the entry, storing
+   the generation it was found live in into GEN, or NULL if PATH isn't indexed.
+   Probing stops at the first empty slot. Under an evicting policy an entry may
+   briefly be missed while a neighbour is being removed, which only costs a
+   spurious miss. Callers must pin the result with cache_pin_entry before using
+   it, since it may be recycled concurrently. */
+static hash_entry_t *
+cache_find(cache_t *c, char *path, uint64_t hash, unsigned *gen)
+{
+    _Atomic uint64_t *slots = CACHE_SLOTS(c);
+    size_t mask = c->n_slots - 1;
+    size_t i = 0;
+#ifdef __SSE2__
+    /* Compare SLOT_GROUP slots per step, against a vector holding the tag in
+       each slot's top half and zero in its bottom half, so that one compare
+       finds both tag matches and empty slots (whose IDs are zero). Slots are
+       8-byte aligned, so each is loaded whole even though the group isn't
+       loaded atomically, and candidates are reloaded with acquire ordering
+       before their entries are read. Groups that would wrap around the end of
+       the index are left to the loop below. */
+    __m128i want = _mm_set_epi32((int) SLOT_TAG(hash), 0, (int) SLOT_TAG(hash), 0);
+    for (; i + SLOT_GROUP <= c->n_slots; i += SLOT_GROUP) {
+        size_t start = (hash + i) & mask;
+        if (start + SLOT_GROUP > c->n_slots) {
+            break;
+        }
+        const __m128i *group = (const __m128i *) &slots[start];
+        unsigned bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128(group), want))) |
+                        _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128(group + 1), want))) << 4;
+
+        /* Even bits flag empty slots, and odd bits tag matches. Only slots
+           before the first empty one are in PATH's probe run. */
+        unsigned empty = bits & 0x55;
+        unsigned matches = bits & 0xaa;
+        if (empty != 0) {
+            matches &= (1u << __builtin_ctz(empty)) - 1;
+        }
+        for (; matches != 0; matches &= matches - 1) {
+            size_t j = start + __builtin_ctz(matches) / 2;
+            uint64_t slot = atomic_load_explicit(&slots[j], memory_order_acquire);
+            if (slot == 0 || SLOT_TAG(slot) != SLOT_TAG(hash)) {
+                continue;
+            }
+            hash_entry_t *entry = &CACHE_ENTRIES(c)[SLOT_ID(slot) - 1];
+            unsigned state = atomic_load_explicit(&entry->state, memory_order_acquire);
+            if (ENTRY_LIVE(state) && entry->hash == hash && strcmp(cache_key(c, entry), path) == 0) {
+                *gen = ENTRY_GEN(state);
+                return entry;
+            }
+        }
+        if (empty != 0) {
+            return NULL;
+        }
+    }
+#endif
+    for (; i < c->n_slots; i++) {
+        uint64_t slot = atomic_load_explicit(&slots[(hash + i) & mask], memory_order_acquire);
+        if (slot == 0) {
+            return NULL;
+        }
+
+        /* The tag rules out nearly every collision without touching the
+           entry. */
+        if (SLOT_TAG(slot) != SLOT_TAG(hash)) {
+            continue;
+        }
+        hash_entry_t *entry = &CACHE_ENTRIES(c)[SLOT_ID(slot) - 1];
+        unsigned state = atomic_load_explicit(&entry->state, memory_order_acquire);
+        if (!ENTRY_LIVE(state)) {
+            continue;
+        }
+        if (entry->hash == hash && strcmp(cache_key(c, entry), path) == 0) {
+            *gen = ENTRY_GEN(state);
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Pin ENTRY, which was found live in generation GEN of CACHE during EPOCH.
+   Returns false (leaving ENTRY unpinned) if ENTRY may have been evicted or
+   flushed since. */
+static inline bool
+cache_pin_entry(cache_t *c, hash_entry_t *entry, size_t epoch, unsigned gen)
+{
+    /* Eviction and flushes both move an entry to a new generation before it is
+       reused, and eviction only does so while the entry is unpinned. A flush
+       makes its epoch visible before checking for pins, so if the epoch hasn't
+       moved once our pin is visible, either the flush will see our pin and
+       back off, or it hasn't started. */
+    unsigned state = atomic_fetch_add(&entry->state, 1);
+    if (ENTRY_GEN(state) != gen || atomic_load(&c->epoch) != epoch) {
+        atomic_fetch_sub(&entry->state, 1);
+        return false;
+    }
+
+    /* Only write the shared line if the reference bit isn't already set. */
+    if (c->policy == POLICY_CLOCK && !(state & ENTRY_REF)) {
+        atomic_fetch_or(&entry->state, ENTRY_REF);
+    }
+
+    return true;
+}
+
+/* Find and pin the entry for PATH, with hash HASH, in CACHE, so that it can't
+   be recycled while in use. The pin must be dropped with cache_unpin. Returns
+   NULL on a miss, which includes lookups racing with a flush. */
+static hash_entry_t *
+cache_pin(cache_t *c, char *path, uint64_t hash)
+{
+    size_t epoch = atomic_load(&c->epoch);
+    if (epoch & 1) {
+        return NULL;
+    }
+
+    unsigned gen;
+    hash_entry_t *entry = cache_find(c, path, hash, &gen);
+    if (entry == NULL || !cache_pin_entry(c, entry, epoch, gen)) {
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* Drop a pin taken with cache_pin. */
+static inline void
+cache_unpin(hash_entry_t *entry)
+{
+    atomic_fetch_sub(&entry->state, 1);
+}
+
+/* Publish ENTRY, which must be fully initialized, into CACHE's index. Returns
+   0 on success, -EEXIST if an entry with the same path was published first,
+   or -ENOMEM if the index is full. */
+static int
+cache_publish(cache_t *c, hash_entry_t *entry)
+{
+    uint64_t id = (uint64_t) (entry - CACHE_ENTRIES(c)) + 1;
+    size_t mask = c->n_slots - 1;
+    for (size_t i = 0; i < c->n_slots; i++) {
+        _Atomic uint64_t *slot = &CACHE_SLOTS(c)[(entry->hash + i) & mask];
+        uint64_t other = 0;
+        if (atomic_compare_exchange_strong(slot, &other, SLOT_MAKE(entry->hash, id))) {
+            return 0;
+        }
+
+        /* On failure OTHER holds the occupant, which is already published. */
+        hash_entry_t *occupant = &CACHE_ENTRIES(c)[SLOT_ID(other) - 1];
+        if (occupant->hash == entry->hash &&
+            strcmp(cache_key(c, occupant), cache_key(c, entry)) == 0) {
+            return -EEXIST;
+        }
+    }
+
+    return -ENOMEM;
+}
+
+/* Remove ENTRY from CACHE's index, shifting later members of its probe run
+   back so that no tombstone is needed. The caller must hold the eviction lock,
+   which excludes every other writer. */
+static void
+cache_unpublish(cache_t *c, hash_entry_t *entry)
+{
+    uint64_t id = (uint64_t) (entry - CACHE_ENTRIES(c)) + 1;
+    size_t mask = c->n_slots - 1;
+    size_t i = entry->hash & mask;
+    while (SLOT_ID(atomic_load(&CACHE_SLOTS(c)[i])) != id) {
+        i = (i + 1) & mask;
+    }
+
+    /* Move back any later slot whose home position doesn't lie between the
+       hole and itself. */
+    for (size_t j = (i + 1) & mask; ; j = (j + 1) & mask) {
+        uint64_t slot = atomic_load(&CACHE_SLOTS(c)[j]);
+        if (slot == 0) {
+            break;
+        }
+        size_t home = CACHE_ENTRIES(c)[SLOT_ID(slot) - 1].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            atomic_store(&CACHE_SLOTS(c)[i], slot);
+            i = j;
+        }
+    }
+    atomic_store(&CACHE_SLOTS(c)[i], 0);
+}
+
+/* Stop counting entry N of CACHE's data as pinned (or unpinned), if it was. */
+static void
+cache_uncount_entry(cache_t *c, size_t n)
+{
+    hash_shm_t *shm = &CACHE_SHMS(c)[n];
+    if (shm->pin != PIN_NONE) {
+        atomic_fetch_sub(shm->pin == PIN_LOCKED ? &c->pinned : &c->unpinned, CACHE_ENTRIES(c)[n].size);
+        shm->pin = PIN_NONE;
+    }
+}
+
+/* Free the shm object backing entry N of CACHE. Its mapping belongs to the
+   process that stored it, and is only meaningful there. Snapshot entries have
+   no shm object. */
+static void
+cache_free_entry(cache_t *c, size_t n)
+{
+    if (ENTRY_IN_SNAPSHOT(&CACHE_ENTRIES(c)[n])) {
+        return;
+    }
+
+    hash_shm_t *shm = &CACHE_SHMS(c)[n];
+    char name[SHM_NAME_LEN];
+    cache_shm_name(c, n, shm->flush, name);
+    shm_unlink(name);
+    cache_uncount_entry(c, n);
+    if (shm->pid == getpid()) {
+        munmap(shm->ptr, CACHE_ENTRIES(c)[n].size);
+    }
+}
+
+/* Returns the size class of a key of LEN characters, or N_KEY_CLASSES if it's
+   too long to be recycled. */
+static inline int
+cache_key_class(size_t len)
+{
+    int class = 0;
+    while (class < N_KEY_CLASSES && ((size_t) MIN_KEY_CLASS << class) < len + 1) {
+        class++;
+    }
+
+    return class;
+}
+
+/* Allocate space for PATH in CACHE's key arena and copy it in. Under an
+   evicting policy keys are rounded to a size class so that their space can be
+   recycled, and the caller must hold the eviction lock. Returns the key's
+   offset in units of KEY_ALIGN bytes, or a negative errno value. */
+static int64_t
+cache_alloc_key(cache_t *c, char *path)
+{
+    size_t len = strlen(path);
+    size_t key_size = (len + KEY_ALIGN) & ~((size_t) KEY_ALIGN - 1);
+
+    int class = cache_key_class(len);
+    if (c->policy != POLICY_MINIO && class < N_KEY_CLASSES) {
+        key_size = MIN_KEY_CLASS << class;
+
+        /* Recycled blocks hold the next free block in their first bytes. */
+        uint32_t head = c->key_free[class];
+        if (head != 0) {
+            char *block = CACHE_KEYS(c) + (size_t) (head - 1) * KEY_ALIGN;
+            memcpy(&c->key_free[class], block, sizeof(uint32_t));
+            strcpy(block, path);
+            return head - 1;
+        }
+    }
+
+    size_t key = atomic_fetch_add(&c->keys_used, key_size);
+    if (key + key_size > c->keys_size) {
+        atomic_fetch_sub(&c->keys_used, key_size);
+        return -ENOMEM;
+    }
+    strcpy(CACHE_KEYS(c) + key, path);
+
+    return key / KEY_ALIGN;
+}
+
+/* Return ENTRY's key to CACHE's key arena. The caller must hold the eviction
+   lock. Overlong keys are simply leaked. */
+static void
+cache_free_key(cache_t *c, hash_entry_t *entry)
+{
+    int class = cache_key_class(strlen(cache_key(c, entry)));
+    if (class < N_KEY_CLASSES) {
+        memcpy(cache_key(c, entry), &c->key_free[class], sizeof(uint32_t));
+        c->key_free[class] = entry->key + 1;
+    }
+}
+
+/* Reclaim what the last flush of CACHE detached: free each entry it left live,
+   in order, moving it to a new generation so that it can be reused, and then
+   clear the index it swapped out. Only one process reclaims at a time, the
+   one recorded in CACHE->reclaim_pid. */
+static void
+cache_reclaim(cache_t *c)
+{
+    size_t end = atomic_load(&c->reclaim_end);
+    for (size_t i = atomic_load(&c->reclaim_next); i < end; i++) {
+        hash_entry_t *entry = &CACHE_ENTRIES(c)[i];
+        if (ENTRY_LIVE(atomic_load(&entry->state))) {
+            if (!(c->flags & CACHE_ARENA)) {
+                cache_free_entry(c, i);
+            }
+            atomic_fetch_add(&entry->state, ENTRY_GEN_INC);
+        }
+        atomic_store(&c->reclaim_next, i + 1);
+    }
+
+    /* Lookups that began before the flush may still be probing the old index,
+       but they'll find their epoch has moved before they use anything. */
+    _Atomic uint64_t *slots = CACHE_HALF(c, atomic_load(&c->slot_half) ^ 1);
+    for (size_t i = 0; i < c->n_slots; i++) {
+        atomic_store_explicit(&slots[i], 0, memory_order_relaxed);
+    }
+    atomic_store(&c->reclaim_pid, 0);
+}
+
+static void *
+cache_reclaim_thread(void *arg)
+{
+    cache_reclaim(arg);
+
+    return NULL;
+}
+
+/* Wait until entry N of CACHE has been reclaimed after the last flush (or, if
+   N is SIZE_MAX, until the reclaim is over). If the process reclaiming died,
+   the first waiter to notice takes over. */
+static void
+cache_await_reclaim(cache_t *c, size_t n)
+{
+    pid_t pid;
+    while ((pid = atomic_load(&c->reclaim_pid)) != 0 && atomic_load(&c->reclaim_next) <= n) {
+        if (pid != getpid() && !pid_alive(pid) &&
+            atomic_compare_exchange_strong(&c->reclaim_pid, &pid, getpid())) {
+            cache_reclaim(c);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+/* Acquire an unused entry from CACHE. Under an evicting policy the caller must
+   hold the eviction lock. Returns the entry's offset, or a negative errno
+   value. */
+static int64_t
+cache_alloc_entry(cache_t *c)
+{
+    if (c->policy != POLICY_MINIO && c->n_free_entries > 0) {
+        return CACHE_FREE_ENTRIES(c)[--c->n_free_entries];
+    }
+
+    size_t n = atomic_fetch_add(&c->n_ht_entries, 1);
+    if (n >= c->max_ht_entries) {
+        return -ENOMEM;
+    }
+
+    /* An entry the last flush detached can only be reused once it's been
+       reclaimed. */
+    if (n < atomic_load(&c->reclaim_end)) {
+        cache_await_reclaim(c, n);
+    }
+
+    return n;
+}
+
+/* Slab states besides a size class. */
+#define SLAB_FREE (UINT32_MAX)
+#define SLAB_RUN (UINT32_MAX - 1)
+#define SLAB_RUN_TAIL (UINT32_MAX - 2)
+
+/* Returns the size of objects of slab class K: 64, 128, 192 and 256 bytes, and
+   from then on four classes per doubling (320, 384, 448, 512, 640 and so on),
+   so that rounding wastes at most a fifth of an object. Every class is a
+   multiple of ARENA_ALIGN. */
+static inline size_t
+slab_class_size(int k)
+{
+    if (k < 4) {
+        return (size_t) ARENA_ALIGN * (k + 1);
+    }
+    size_t base = (size_t) 256 << ((k - 4) / 4);
+
+    return base / 4 * (5 + (k - 4) % 4);
+}
+
+/* Returns the smallest slab class of CACHE whose objects hold SIZE bytes and
+   are aligned to ALIGN, or -1 if SIZE needs a run of slabs. Slabs are aligned
+   to their size, so an object is aligned to ALIGN if its class is a multiple
+   of it. */
+static int
+cache_slab_class(cache_t *c, size_t size, size_t align)
+{
+    for (int k = 0; k < N_SLAB_CLASSES && slab_class_size(k) <= c->slab_size; k++) {
+        size_t class_size = slab_class_size(k);
+        if (class_size >= size && class_size % align == 0) {
+            return k;
+        }
+    }
+
+    return -1;
+}
+
+/* Add slab S of CACHE to the front of its class's list of slabs with free
+   objects. */
+static void
+cache_slab_link(cache_t *c, size_t s)
+{
+    cache_slab_t *slab = &CACHE_SLABS(c)[s];
+    uint32_t *head = &c->slab_partial[slab->class];
+    slab->prev = 0;
+    slab->next = *head;
+    if (*head != 0) {
+        CACHE_SLABS(c)[*head - 1].prev = s + 1;
+    }
+    *head = s + 1;
+}
+
+/* Remove slab S of CACHE from its class's list of slabs with free objects. */
+static void
+cache_slab_unlink(cache_t *c, size_t s)
+{
+    cache_slab_t *slab = &CACHE_SLABS(c)[s];
+    if (slab->prev != 0) {
+        CACHE_SLABS(c)[slab->prev - 1].next = slab->next;
+    } else {
+        c->slab_partial[slab->class] = slab->next;
+    }
+    if (slab->next != 0) {
+        CACHE_SLABS(c)[slab->next - 1].prev = slab->prev;
+    }
+}
+
+/* Take N consecutive free slabs of CACHE for CLASS. Single slabs are looked
+   for from where the last one was found, and runs first-fit. Returns the
+   index of the first, or -ENOMEM. */
+static int64_t
+cache_slab_take(cache_t *c, size_t n, uint32_t class)
+{
+    /* The cache may have been shrunk to fewer slabs than it has. */
+    if ((c->slabs_held + n) * c->slab_size > c->size) {
+        return -ENOMEM;
+    }
+    cache_slab_t *slabs = CACHE_SLABS(c);
+    size_t first = n == 1 ? c->slab_hint : 0, run = 0;
+    for (size_t i = 0; i < c->n_slabs; i++) {
+        size_t s = (first + i) % c->n_slabs;
+        if (s == 0) {
+            run = 0;
+        }
+        if (slabs[s].class != SLAB_FREE) {
+            run = 0;
+        } else if (++run == n) {
+            s = s + 1 - n;
+            for (size_t j = 0; j < n; j++) {
+                slabs[s + j] = (cache_slab_t) {.class = j == 0 ? class : SLAB_RUN_TAIL};
+            }
+            slabs[s].n_run = n;
+            c->slabs_held += n;
+            c->slab_hint = s;
+            return s;
+        }
+    }
+
+    return -ENOMEM;
+}
+
+/* Allocate SIZE bytes aligned to ALIGN from CACHE's arena, with a slab object
+   of the smallest class that fits, or a run of slabs if none does. The caller
+   must hold the eviction lock. Returns the allocation's offset, or
+   -ENOMEM. */
+static int64_t
+cache_slab_alloc(cache_t *c, size_t size, size_t align)
+{
+    int k = cache_slab_class(c, size, align);
+    if (k < 0) {
+        int64_t s = cache_slab_take(c, (size + c->slab_size - 1) / c->slab_size, SLAB_RUN);
+        return s < 0 ? s : s * (int64_t) c->slab_size;
+    }
+
+    /* Carve a fresh slab if every slab of the class is full. */
+    if (c->slab_partial[k] == 0) {
+        int64_t s = cache_slab_take(c, 1, k);
+        if (s < 0) {
+            return s;
+        }
+        cache_slab_link(c, s);
+    }
+    size_t s = c->slab_partial[k] - 1;
+    cache_slab_t *slab = &CACHE_SLABS(c)[s];
+    size_t class_size = slab_class_size(k);
+    uint8_t *base = CACHE_DATA(c) + s * c->slab_size;
+    uint32_t object;
+    if (slab->free != 0) {
+        object = slab->free - 1;
+        memcpy(&slab->free, base + object * class_size, sizeof(uint32_t));
+    } else {
+        object = slab->n_carved++;
+    }
+    if (++slab->n_used == c->slab_size / class_size) {
+        cache_slab_unlink(c, s);
+    }
+
+    return s * c->slab_size + object * class_size;
+}
+
+/* Free the allocation at OFFSET in CACHE's arena, made by cache_slab_alloc.
+   The caller must hold the eviction lock. */
+static void
+cache_slab_free(cache_t *c, size_t offset)
+{
+    size_t s = offset / c->slab_size;
+    cache_slab_t *slab = &CACHE_SLABS(c)[s];
+    if (slab->class == SLAB_RUN) {
+        size_t n = slab->n_run;
+        for (size_t j = 0; j < n; j++) {
+            slab[j].class = SLAB_FREE;
+        }
+        c->slabs_held -= n;
+        return;
+    }
+
+    /* A full slab has room again, and an empty one goes back to the pool. */
+    size_t class_size = slab_class_size(slab->class);
+    uint32_t object = (offset - s * c->slab_size) / class_size;
+    if (slab->n_used-- == c->slab_size / class_size) {
+        cache_slab_link(c, s);
+    }
+    if (slab->n_used == 0) {
+        cache_slab_unlink(c, s);
+        slab->class = SLAB_FREE;
+        c->slabs_held--;
+        return;
+    }
+    memcpy(CACHE_DATA(c) + offset, &slab->free, sizeof(uint32_t));
+    slab->free = object + 1;
+}
+
+/* Return every slab of CACHE to the pool. */
+static void
+cache_slab_reset(cache_t *c)
+{
+    for (size_t s = 0; s < c->n_slabs; s++) {
+        CACHE_SLABS(c)[s].class = SLAB_FREE;
+    }
+    memset(c->slab_partial, 0, sizeof(c->slab_partial));
+    c->slab_hint = 0;
+    c->slabs_held = 0;
+}
+
+/* Evict one entry from CACHE according to its policy, returning its space to
+   the allocator. Pinned entries are passed over, as are (once) entries
+   referenced since the hand last passed under POLICY_CLOCK. The caller must
+   hold the eviction lock. On success returns 0. Returns -ENOMEM if nothing can
+   be evicted. */
+static int
+cache_evict(cache_t *c)
+{
+    for (size_t tries = 2 * c->n_order; tries > 0 && c->n_order > 0; tries--) {
+        uint32_t n = CACHE_ORDER(c)[c->order_head];
+        c->order_head = (c->order_head + 1) % c->max_ht_entries;
+        c->n_order--;
+
+        hash_entry_t *entry = &CACHE_ENTRIES(c)[n];
+        unsigned state = atomic_load(&entry->state);
+        bool keep = (state & ENTRY_PIN_MASK) != 0;
+        if (!keep && (state & ENTRY_REF)) {
+            atomic_fetch_and(&entry->state, ~ENTRY_REF);
+            keep = true;
+        }
+
+        /* Retiring the generation fails if the entry was pinned (or referenced)
+           in the meantime, and stops new pins from succeeding. */
+        if (keep || !atomic_compare_exchange_strong(&entry->state, &state,
+                                                    state + ENTRY_GEN_INC)) {
+            CACHE_ORDER(c)[(c->order_head + c->n_order) % c->max_ht_entries] = n;
+            c->n_order++;
+            continue;
+        }
+
+        cache_unpublish(c, entry);
+        if (!ENTRY_IN_SNAPSHOT(entry)) {
+            cache_slab_free(c, ENTRY_OFFSET(entry));
+        }
+        cache_free_key(c, entry);
+        atomic_fetch_sub(&c->used, entry->size);
+        CACHE_FREE_ENTRIES(c)[c->n_free_entries++] = n;
+        STAT_INC(c, n_evictions);
+
+        return 0;
+    }
+
+    return -ENOMEM;
+}
+
+/* Order entries N and M of CACHE (passed as ARG) by their offset. */
+static int
+cache_cmp_offsets(const void *n, const void *m, void *arg)
+{
+    hash_entry_t *entries = CACHE_ENTRIES((cache_t *) arg);
+    uint64_t a = ENTRY_OFFSET(&entries[*(const uint32_t *) n]);
+    uint64_t b = ENTRY_OFFSET(&entries[*(const uint32_t *) m]);
+
+    return (a > b) - (a < b);
+}
+
+/* Rebuild CACHE's eviction state (under an evicting policy) from the entries
+   its index holds, after a process died holding the eviction lock, and may
+   have left it half updated. The caller must hold the lock. Entries that are
+   published and live are kept, in order of their offset, and everything else
+   is free; a store that didn't get as far as publishing is given back whole.
+   Key blocks that were waiting to be recycled are leaked. */
+static void
+cache_evict_recover(cache_t *c)
+{
+    hash_entry_t *entries = CACHE_ENTRIES(c);
+    uint32_t *order = CACHE_ORDER(c);
+    uint32_t *free_entries = CACHE_FREE_ENTRIES(c);
+    size_t n = MIN(atomic_load(&c->n_ht_entries), c->max_ht_entries);
+
+    /* Collect the live entries, using the free list to mark them. An entry
+       that was retired but not yet unpublished is finished off once the scan
+       is over, since unpublishing moves slots around. */
+    size_t n_live = 0, n_stale = 0;
+    memset(free_entries, 0, n * sizeof(uint32_t));
+    for (size_t i = 0; i < c->n_slots; i++) {
+        uint64_t slot = atomic_load(&CACHE_SLOTS(c)[i]);
+        if (slot == 0) {
+            continue;
+        }
+        uint32_t id = SLOT_ID(slot) - 1;
+        if (ENTRY_LIVE(atomic_load(&entries[id].state))) {
+            order[n_live++] = id;
+            free_entries[id] = 1;
+        } else {
+            order[c->max_ht_entries - ++n_stale] = id;
+        }
+    }
+    for (size_t i = 0; i < n_stale; i++) {
+        cache_unpublish(c, &entries[order[c->max_ht_entries - 1 - i]]);
+    }
+
+    /* Every other entry is free. Ones a store made live without publishing
+       are retired, so that they come back live when they're next committed.
+       The list is compacted in place, behind the marks still to be read. */
+    size_t n_free = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (free_entries[i] == 0) {
+            if (ENTRY_LIVE(atomic_load(&entries[i].state))) {
+                atomic_fetch_add(&entries[i].state, ENTRY_GEN_INC);
+            }
+            free_entries[n_free++] = i;
+        }
+    }
+    c->n_free_entries = n_free;
+    c->order_head = 0;
+    c->n_order = n_live;
+    memset(c->key_free, 0, sizeof(c->key_free));
+
+    /* Slabs keep their class, but their objects are reallocated to the live
+       entries, walking them in order of offset. */
+    qsort_r(order, n_live, sizeof(uint32_t), cache_cmp_offsets, c);
+    cache_slab_t *slabs = CACHE_SLABS(c);
+    for (size_t i = 0; i < c->n_slabs; i++) {
+        slabs[i].n_used = 0;
+        slabs[i].n_carved = 0;
+        slabs[i].free = 0;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < n_live; i++) {
+        hash_entry_t *entry = &entries[order[i]];
+        used += entry->size;
+        if (ENTRY_IN_SNAPSHOT(entry)) {
+            continue;
+        }
+        size_t s = ENTRY_OFFSET(entry) / c->slab_size;
+        cache_slab_t *slab = &slabs[s];
+        if (slab->class >= N_SLAB_CLASSES) {
+            slab->n_used = slab->class == SLAB_RUN;
+            continue;
+        }
+
+        /* Objects skipped over are free. */
+        size_t class_size = slab_class_size(slab->class);
+        uint8_t *base = CACHE_DATA(c) + s * c->slab_size;
+        uint32_t object = (ENTRY_OFFSET(entry) - s * c->slab_size) / class_size;
+        for (; slab->n_carved < object; slab->n_carved++) {
+            memcpy(base + (size_t) slab->n_carved * class_size, &slab->free, sizeof(uint32_t));
+            slab->free = slab->n_carved + 1;
+        }
+        slab->n_carved = object + 1;
+        slab->n_used++;
+    }
+    atomic_store(&c->used, used);
+
+    /* Slabs (and runs) with nothing live in them go back to the pool, as do
+       the tails of runs that were being taken or given back. */
+    memset(c->slab_partial, 0, sizeof(c->slab_partial));
+    c->slab_hint = 0;
+    c->slabs_held = 0;
+    for (size_t s = 0; s < c->n_slabs; s++) {
+        cache_slab_t *slab = &slabs[s];
+        if (slab->class == SLAB_RUN && slab->n_used > 0 && s + slab->n_run <= c->n_slabs) {
+            c->slabs_held += slab->n_run;
+            s += slab->n_run - 1;
+        } else if (slab->class >= N_SLAB_CLASSES || slab->n_used == 0) {
+            slab->class = SLAB_FREE;
+        } else {
+            c->slabs_held++;
+            if (slab->n_used < c->slab_size / slab_class_size(slab->class)) {
+                cache_slab_link(c, s);
+            }
+        }
+    }
+}
+
+/* Undo the allocation of entry N (and its key, if HAS_KEY) by a failed
+   cache_insert. Without eviction entries and keys are bump allocated, and are
+   simply leaked. */
+static void
+cache_discard_entry(cache_t *c, int64_t n, bool has_key)
+{
+    if (c->policy == POLICY_MINIO) {
+        return;
+    }
+    if (has_key) {
+        cache_free_key(c, &CACHE_ENTRIES(c)[n]);
+    }
+    CACHE_FREE_ENTRIES(c)[c->n_free_entries++] = n;
+}
+
+/* Undo the reservation of SIZE bytes for ENTRY by a failed cache_insert, and
+   then the entry itself. Outside of arena mode the reservation is only a
+   count, so it can always be returned, as can slab space under an evicting
+   policy. MinIO's bump-allocated arena space can't be. */
+static void
+cache_discard_space(cache_t *c, hash_entry_t *entry, size_t size)
+{
+    if (c->flags & CACHE_ARENA) {
+        if (c->policy == POLICY_MINIO) {
+            return;
+        }
+        cache_slab_free(c, ENTRY_OFFSET(entry));
+    }
+    atomic_fetch_sub(&c->used, size);
+    cache_discard_entry(c, entry - CACHE_ENTRIES(c), true);
+}
+
+/* Make ENTRY, which must be fully initialized, live in CACHE. Returns 0 on
+   success, or negative errno as cache_publish does. */
+static int
+cache_commit_entry(cache_t *c, hash_entry_t *entry)
+{
+    atomic_fetch_add(&entry->state, ENTRY_GEN_INC);
+    int status = cache_publish(c, entry);
+    if (status < 0) {
+        atomic_fetch_add(&entry->state, ENTRY_GEN_INC);
+        return status;
+    }
+
+    /* New entries join the back of the eviction order. */
+    if (c->policy != POLICY_MINIO) {
+        CACHE_ORDER(c)[(c->order_head + c->n_order) % c->max_ht_entries] = entry - CACHE_ENTRIES(c);
+        c->n_order++;
+    }
+
+    return 0;
+}
+
+/* Check if CACHE contains PATH, with hash HASH. */
+static bool
+cache_contains_hashed(cache_t *c, char *path, uint64_t hash)
+{
+    size_t epoch = atomic_load(&c->epoch);
+    if (epoch & 1) {
+        return false;
+    }
+
+    unsigned gen;
+    bool found = cache_find(c, path, hash, &gen) != NULL;
+
+    return found && atomic_load(&c->epoch) == epoch;
+}
+
+/* Check if CACHE contains PATH. Returns true if cached, else false. */
+bool
+cache_contains(cache_t *c, char *path)
+{
+    return cache_contains_hashed(c, path, cache_hash(path));
+}
+
+/* Bump *USED, the bytes in use of a region of CAPACITY bytes, past SIZE bytes
+   starting at the next multiple of ALIGN, if they fit. The padding counts as
+   used. Stores the bytes *USED grew by into *GROWN. Returns the offset of the
+   reservation, or -ENOMEM, in which case *USED is left alone. */
+static int64_t
+cache_bump(atomic_size_t *used, size_t size, size_t align, size_t capacity, size_t *grown)
+{
+    size_t old = atomic_load(used), start;
+    do {
+        start = (old + align - 1) & ~(align - 1);
+        if (start + size > capacity || start + size < old) {
+            return -ENOMEM;
+        }
+    } while (!atomic_compare_exchange_weak(used, &old, start + size));
+    *grown = start + size - old;
+
+    return start;
+}
+
+/* Reserve SIZE bytes of CACHE's sharded arena, aligned to ALIGN, from the
+   shard on the calling thread's NUMA node if it has room, and otherwise from
+   the first other shard that does. Shards are page aligned. Returns the offset
+   of the reservation, or -ENOMEM. */
+static int64_t
+cache_reserve_shard(cache_t *c, size_t size, size_t align)
+{
+    int local = 0;
+    int node = utils_numa_node();
+    for (int i = 0; i < c->n_nodes; i++) {
+        if (c->nodes[i] == node) {
+            local = i;
+            break;
+        }
+    }
+
+    for (int k = 0; k < c->n_nodes; k++) {
+        int i = (local + k) % c->n_nodes;
+        size_t capacity = i == c->n_nodes - 1 ? c->capacity - i * c->shard_size : c->shard_size;
+        size_t grown;
+        int64_t offset = cache_bump(&c->shard_used[i], size, align, capacity, &grown);
+        if (offset >= 0) {
+            atomic_fetch_add(&c->used, grown);
+            return i * c->shard_size + offset;
+        }
+    }
+
+    return -ENOMEM;
+}
+
+/* Reserve SIZE bytes of CACHE's capacity for a new entry, evicting as needed
+   under an evicting policy (for which the caller must hold the eviction lock).
+   Arena space is aligned to ALIGN, which must be a multiple of ARENA_ALIGN;
+   the bump allocator rounds both the start and SIZE up to it, and counts the
+   rounding as used. Returns the offset of the reservation, or a negative errno
+   value. */
+static int64_t
+cache_reserve_space(cache_t *c, size_t size, size_t align)
+{
+    /* Evicting frees slab space, but not necessarily of the size wanted, so
+       keep going until there's room. */
+    if (c->policy != POLICY_MINIO) {
+        if (size > c->size) {
+            return -ENOMEM;
+        }
+        int64_t offset;
+        while ((offset = cache_slab_alloc(c, size, align)) < 0) {
+            if (cache_evict(c) < 0) {
+                return -ENOMEM;
+            }
+        }
+        atomic_fetch_add(&c->used, size);
+        return offset;
+    }
+    if (!(c->flags & CACHE_ARENA)) {
+        align = 1;
+    }
+    size = (size + align - 1) & ~(align - 1);
+    if ((c->flags & CACHE_ARENA) && (c->flags & CACHE_NUMA)) {
+        return cache_reserve_shard(c, size, align);
+    }
+
+    /* Only place data in range. Outside an arena USED is just a count. */
+    size_t grown;
+    return cache_bump(&c->used, size, align, c->size, &grown);
+}
+
+/* Acquire an entry of CACHE keyed by PATH, with hash HASH, for the caller to
+   fill in and commit. The caller must be registered as a writer, and under an
+   evicting policy must hold the eviction lock. Returns the entry's index, or a
+   negative errno value (-EEXIST if PATH is already cached). */
+static int64_t
+cache_new_entry(cache_t *c, char *path, uint64_t hash)
+{
+    /* Don't waste space on a duplicate. Racing duplicates are caught when
+       publishing. */
+    unsigned gen;
+    if (cache_find(c, path, hash, &gen) != NULL) {
+        return -EEXIST;
+    }
+
+    /* Acquire an entry, and copy the path into the key arena. */
+    int64_t n = cache_alloc_entry(c);
+    if (n < 0) {
+        return n;
+    }
+    hash_entry_t *entry = &CACHE_ENTRIES(c)[n];
+    int64_t key = cache_alloc_key(c, path);
+    if (key < 0) {
+        cache_discard_entry(c, n, false);
+        return key;
+    }
+    entry->hash = hash;
+    entry->key = key;
+
+    return n;
+}
+
+/* Allocate an entry of CACHE keyed by PATH, with hash HASH, with room for SIZE
+   bytes of data, and map that room writable into *PTR, for the caller to fill
+   before passing the entry to cache_fill_slot (or cache_drop_slot). Arena space
+   starts at, and is rounded up to, a multiple of ALIGN, which must itself be a
+   multiple of ARENA_ALIGN. The caller must be registered as a writer, and under
+   an evicting policy must hold the eviction lock. Returns the entry's index, or
+   a negative errno value. */
+static int64_t
+cache_alloc_slot(cache_t *c, char *path, uint64_t hash, size_t size, size_t align, uint8_t **ptr)
+{
+    /* Without eviction, entries and keys can't be given back, so don't take
+       them for data that can't fit. (Racing stores may still beat us to the
+       last of the space, in which case the entry is lost until a flush.) */
+    if (c->policy == POLICY_MINIO && atomic_load(&c->used) + size > c->size) {
+        unsigned gen;
+        return cache_find(c, path, hash, &gen) != NULL ? -EEXIST : -ENOMEM;
+    }
+    int64_t n = cache_new_entry(c, path, hash);
+    if (n < 0) {
+        return n;
+    }
+    hash_entry_t *entry = &CACHE_ENTRIES(c)[n];
+
+    /* Figure out where the data goes. Arena allocations are aligned so every
+       entry starts (at least) cache-line aligned. */
+    int64_t offset = cache_reserve_space(c, size, align);
+    if (offset < 0) {
+        cache_discard_entry(c, n, true);
+        return offset;
+    }
+    entry->size = size;
+    entry->offset = offset;
+
+    /* In arena mode the data region is already shared and page-locked. */
+    if (c->flags & CACHE_ARENA) {
+        *ptr = CACHE_DATA(c) + offset;
+        return n;
+    }
+
+    /* Allocate an shm object for this entry's data. Writers keep flushes out,
+       so the count can't move under us. */
+    hash_shm_t *shm = &CACHE_SHMS(c)[n];
+    shm->flush = atomic_load(&c->epoch) / 2;
+    shm->pin = PIN_NONE;
+    char name[SHM_NAME_LEN];
+    cache_shm_name(c, n, shm->flush, name);
+    int fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        int status = -errno;
+        DEBUG_LOG("failed to shm_open %s\n", path);
+        cache_discard_space(c, entry, size);
+        return status;
+    }
+
+    /* Appropriately size the shm object. */
+    if (ftruncate(fd, entry->size) < 0) {
+        int status = -errno;
+        shm_unlink(name);
+        close(fd);
+        cache_discard_space(c, entry, size);
+        return status;
+    }
+
+    /* Create the mmap for the shm object. The mapping keeps the object alive,
+       so the descriptor isn't needed past this point. */
+    shm->ptr = mmap(NULL, entry->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->ptr == MAP_FAILED) {
+        shm_unlink(name);
+        cache_discard_space(c, entry, size);
+        return -ENOMEM;
+    }
+    if (cache_huge_page_size(c) != 0 && entry->size >= HUGE_PAGE_2MB) {
+        madvise(shm->ptr, entry->size, MADV_HUGEPAGE);
+    }
+    if (c->flags & CACHE_NUMA) {
+        shm->node = utils_numa_node();
+        mmap_bind(shm->ptr, entry->size, shm->node);
+    }
+    *ptr = shm->ptr;
+
+    return n;
+}
+
+/* Publish entry N of CACHE, allocated by cache_alloc_slot, once its data has
+   been written. On failure the entry is given back. Returns 0 on success, or
+   negative errno as cache_publish does. */
+static int
+cache_fill_slot(cache_t *c, int64_t n)
+{
+    hash_entry_t *entry = &CACHE_ENTRIES(c)[n];
+    if (c->flags & CACHE_ARENA) {
+        int status = cache_commit_entry(c, entry);
+        if (status < 0) {
+            cache_discard_space(c, entry, entry->size);
+        }
+        return status;
+    }
+
+    /* Keep the mapping to page-lock the data, or, past the memlock limit, at
+       least to keep advising it as needed. */
+    hash_shm_t *shm = &CACHE_SHMS(c)[n];
+    shm->pid = getpid();
+    if (mlock(shm->ptr, entry->size) == 0) {
+        shm->pin = PIN_LOCKED;
+        atomic_fetch_add(&c->pinned, entry->size);
+    } else {
+        shm->pin = PIN_ADVISED;
+        atomic_fetch_add(&c->unpinned, entry->size);
+        madvise(shm->ptr, entry->size, MADV_WILLNEED);
+    }
+
+    /* Insert into hash table. */
+    int status = cache_commit_entry(c, entry);
+    if (status < 0) {
+        cache_free_entry(c, n);
+        cache_discard_space(c, entry, entry->size);
+    }
+
+    return status;
+}
+
+/* Give back entry N of CACHE, allocated by cache_alloc_slot, unpublished. */
+static void
+cache_drop_slot(cache_t *c, int64_t n)
+{
+    hash_entry_t *entry = &CACHE_ENTRIES(c)[n];
+    if (c->flags & CACHE_ARENA) {
+        cache_discard_space(c, entry, entry->size);
+        return;
+    }
+    CACHE_SHMS(c)[n].pid = getpid();
+    cache_free_entry(c, n);
+    cache_discard_space(c, entry, entry->size);
+}
+
+/* Store DATA into CACHE indexed by PATH, with hash HASH, with the OFFSET_*
+   flags FLAGS describing its encoding. The caller must be registered as a
+   writer, and under an evicting policy must hold the eviction lock. On success,
+   returns 0. On failure, returns negative errno value. */
+static int
+cache_insert(cache_t *c, char *path, uint64_t hash, uint8_t *data, size_t size, uint64_t flags)
+{
+    uint8_t *ptr;
+    int64_t n = cache_alloc_slot(c, path, hash, size, ARENA_ALIGN, &ptr);
+    if (n < 0) {
+        return (int) n;
+    }
+    CACHE_ENTRIES(c)[n].offset |= flags;
+    memcpy(ptr, data, size);
+
+    return cache_fill_slot(c, n);
+}
+
+/* Take CACHE's eviction lock, under an evicting policy. Writers and flushes
+   hold it throughout, so one that died holding it was the only one, and may
+   have left what it protects half updated; that's rebuilt from the index, and
+   a flush cut short is finished as far as it got. On success returns 0. On
+   failure returns negative errno. */
+static int
+cache_lock_evict(cache_t *c)
+{
+    int status = pthread_mutex_lock(&c->evict_lock);
+    if (status == EOWNERDEAD) {
+        atomic_store(&c->n_writers, 0);
+        cache_evict_recover(c);
+        size_t epoch = atomic_load(&c->epoch);
+        if (epoch & 1) {
+            atomic_store(&c->epoch, epoch + 1);
+        }
+        status = pthread_mutex_consistent(&c->evict_lock);
+    }
+
+    return -status;
+}
+
+/* Stop being a writer of CACHE, as registered by cache_begin_write. */
+static void
+cache_end_write(cache_t *c)
+{
+    atomic_fetch_sub(&c->n_writers, 1);
+    if (c->policy != POLICY_MINIO) {
+        pthread_mutex_unlock(&c->evict_lock);
+    }
+}
+
+/* Register as a writer of CACHE, so that a flush waits for us, unless one is
+   already in progress (-EBUSY). Under an evicting policy this also takes the
+   eviction lock; stores under MinIO's policy never evict, so they need none.
+   Must be paired with cache_end_write on success. */
+static int
+cache_begin_write(cache_t *c)
+{
+    if (c->policy != POLICY_MINIO) {
+        int status = cache_lock_evict(c);
+        if (status < 0) {
+            return status;
+        }
+    }
+    atomic_fetch_add(&c->n_writers, 1);
+    if (atomic_load(&c->epoch) & 1) {
+        cache_end_write(c);
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+/* Compress the SIZE bytes at DATA for storage. Returns a malloc'd buffer
+   holding SIZE followed by the LZ4 block, and stores its length into STORED.
+   Returns NULL if the data wouldn't shrink. */
+static uint8_t *
+cache_compress(uint8_t *data, size_t size, size_t *stored)
+{
+    if (size <= LZ4_HEADER_SIZE + 1 || size > LZ4_MAX_INPUT_SIZE) {
+        return NULL;
+    }
+    uint8_t *packed = malloc(size);
+    if (packed == NULL) {
+        return NULL;
+    }
+
+    /* Giving the codec less room than the original fails fast on data that
+       doesn't compress. */
+    ssize_t n = lz4_compress(data, size, packed + LZ4_HEADER_SIZE, size - LZ4_HEADER_SIZE - 1);
+    if (n < 0) {
+        free(packed);
+        return NULL;
+    }
+    uint64_t raw = size;
+    memcpy(packed, &raw, LZ4_HEADER_SIZE);
+    *stored = LZ4_HEADER_SIZE + n;
+
+    return packed;
+}
+
+/* Store DATA into CACHE indexed by PATH, with hash HASH, as cache_store
+   does. */
+static int
+cache_store_hashed(cache_t *c, char *path, uint64_t hash, uint8_t *data, size_t size)
+{
+    /* Check size constraint. */
+    if (size > c->max_item_size) {
+        return -E2BIG;
+    }
+
+    /* Compress before registering as a writer, so that stores (and flushes)
+       don't wait on one another's compression. */
+    uint8_t *packed = NULL;
+    size_t stored = size;
+    if ((c->flags & CACHE_COMPRESS) && size >= c->compress_min_size) {
+        packed = cache_compress(data, size, &stored);
+    }
+
+    int status = cache_begin_write(c);
+    if (status == 0) {
+        status = cache_insert(c, path, hash,
+                              packed != NULL ? packed : data,
+                              stored,
+                              packed != NULL ? OFFSET_LZ4 : 0);
+        cache_end_write(c);
+    }
+    free(packed);
+    if (status == 0) {
+        STAT_ADD(c, n_bytes_raw, size);
+        STAT_ADD(c, n_bytes_stored, stored);
+    }
+
+    return status;
+}
+
+/* Store DATA into CACHE indexed by PATH. With CACHE_COMPRESS, large enough
+   data is compressed if that saves space. On success, returns 0. On failure,
+   returns negative errno value. */
+int
+cache_store(cache_t *c, char *path, uint8_t *data, size_t size)
+{
+    return cache_store_hashed(c, path, cache_hash(path), data, size);
+}
+
+/* Map pinned ENTRY's stored data into *PTR, read-only, until it's passed to
+   cache_unmap_entry. On success returns 0. On failure returns negative
+   errno. */
+static int
+cache_map_entry(cache_t *c, hash_entry_t *entry, uint8_t **ptr)
+{
+    /* Arena and snapshot data are mapped identically in every process. */
+    if (ENTRY_IN_SNAPSHOT(entry)) {
+        *ptr = ENTRY_SNAPSHOT_DATA(c, entry);
+        return 0;
+    }
+    if (c->flags & CACHE_ARENA) {
+        *ptr = CACHE_DATA(c) + ENTRY_OFFSET(entry);
+        return 0;
+    }
+
+    /* The mapping outlives the shm object if the entry is flushed, so it's safe
+       to use until it's unmapped. */
+    size_t n = entry - CACHE_ENTRIES(c);
+    char name[SHM_NAME_LEN];
+    cache_shm_name(c, n, CACHE_SHMS(c)[n].flush, name);
+    int fd = shm_open(name, O_RDONLY, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return -errno;
+    }
+    *ptr = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (*ptr == MAP_FAILED) {
+        *ptr = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* Undo cache_map_entry's mapping PTR of ENTRY. */
+static void
+cache_unmap_entry(cache_t *c, hash_entry_t *entry, uint8_t *ptr)
+{
+    if (!(c->flags & CACHE_ARENA) && !ENTRY_IN_SNAPSHOT(entry)) {
+        munmap(ptr, entry->size);
+    }
+}
+
+/* Copy pinned ENTRY's file data out of CACHE into DATA, which has room for MAX
+   bytes, decompressing it straight into DATA if need be. The file's size is
+   stored into SIZE, even if it doesn't fit (-EINVAL). On success returns 0. On
+   failure returns negative errno. */
+static int
+cache_copy_entry(cache_t *c,
+                 hash_entry_t *entry,
+                 uint8_t *data,
+                 size_t max,
+                 size_t *size)
+{
+    /* Uncompressed entries can be checked without mapping anything. */
+    if (!ENTRY_COMPRESSED(entry)) {
+        *size = entry->size;
+        if (entry->size > max) {
+            return -EINVAL;
+        }
+    }
+
+    uint8_t *ptr = NULL;
+    int status = cache_map_entry(c, entry, &ptr);
+    if (status < 0) {
+        return status;
+    }
+    cache_stat_locality(c, entry);
+    if (!ENTRY_COMPRESSED(entry)) {
+        memcpy(data, ptr, entry->size);
+    } else {
+        uint64_t raw;
+        memcpy(&raw, ptr, LZ4_HEADER_SIZE);
+        *size = raw;
+        if (raw > max) {
+            status = -EINVAL;
+        } else if (lz4_decompress(ptr + LZ4_HEADER_SIZE, entry->size - LZ4_HEADER_SIZE,
+                                  data, raw) != (ssize_t) raw) {
+            status = -EIO;
+        }
+    }
+    cache_unmap_entry(c, entry, ptr);
+
+    return status;
+}
+
+/* Copy pinned ENTRY's data out of CACHE as cache_load does, then unpin it. */
+static int
+cache_load_entry(cache_t *c,
+                 hash_entry_t *entry,
+                 uint8_t *data,
+                 size_t *size,
+                 size_t max)
+{
+    int status = cache_copy_entry(c, entry, data, max, size);
+    cache_unpin(entry);
+
+    return status;
+}
+
+/* Load the data at PATH, with hash HASH, in CACHE into DATA, as cache_load
+   does. */
+static int
+cache_load_hashed(cache_t *c, char *path, uint64_t hash, uint8_t *data, size_t *size, size_t max)
+{
+    hash_entry_t *entry = cache_pin(c, path, hash);
+    if (entry == NULL) {
+        return -ENODATA;
+    }
+
+    return cache_load_entry(c, entry, data, size, max);
+}
+
+/* Load the data at PATH in CACHE into DATA (a maximum of MAX bytes), storing
+   the size of the file into SIZE. A cache miss is considered a failure
+   (-ENODATA is returned without any IO being issued). On success returns 0.
+   On failure returns negative errno. */
+int
+cache_load(cache_t *c, char *path, uint8_t *data, size_t *size, size_t max)
+{
+    return cache_load_hashed(c, path, cache_hash(path), data, size, max);
+}
+
+/* Map pinned ENTRY's data into VIEW, as cache_acquire does. The pin passes to
+   VIEW on success, and is dropped on failure. */
+static int
+cache_view_entry(cache_t *c, hash_entry_t *entry, cache_view_t *view)
+{
+    /* Compressed data has to be decompressed somewhere, so there's nothing to
+       view in place. */
+    if (ENTRY_COMPRESSED(entry)) {
+        cache_unpin(entry);
+        return -ENOTSUP;
+    }
+
+    view->entry = entry;
+    view->size = entry->size;
+    int status = cache_map_entry(c, entry, &view->ptr);
+    if (status < 0) {
+        cache_unpin(entry);
+        return status;
+    }
+    cache_stat_locality(c, entry);
+
+    return 0;
+}
+
+/* Pin the entry for PATH, with hash HASH, in CACHE and map its data into VIEW,
+   as cache_acquire does. */
+static int
+cache_acquire_hashed(cache_t *c, char *path, uint64_t hash, cache_view_t *view)
+{
+    hash_entry_t *entry = cache_pin(c, path, hash);
+    if (entry == NULL) {
+        return -ENODATA;
+    }
+
+    return cache_view_entry(c, entry, view);
+}
+
+/* Pin the entry for PATH in CACHE and map its data read-only into VIEW,
+   without copying it. The entry stays pinned (and the mapping valid) until
+   VIEW is passed to cache_release. A cache miss returns -ENODATA without any
+   IO being issued, and compressed entries can't be viewed (-ENOTSUP). On
+   success returns 0. On failure returns negative errno. */
+int
+cache_acquire(cache_t *c, char *path, cache_view_t *view)
+{
+    return cache_acquire_hashed(c, path, cache_hash(path), view);
+}
+
+/* Release a VIEW obtained with cache_acquire, unpinning its entry. */
+void
+cache_release(cache_t *c, cache_view_t *view)
+{
+    if (view->entry == NULL) {
+        return;
+    }
+
+    cache_unmap_entry(c, view->entry, view->ptr);
+    cache_unpin(view->entry);
+    view->entry = NULL;
+    view->ptr = NULL;
+    view->size = 0;
+}
+
+/* Returns whether a file of SIZE bytes is better read straight into a slot from
+   cache_reserve than stored: data that CACHE would compress can't be, and
+   evicting policies hold their lock for as long as a slot is held, which
+   would serialize reads. */
+bool
+cache_should_reserve(cache_t *c, size_t size)
+{
+    return c->policy == POLICY_MINIO &&
+           !((c->flags & CACHE_COMPRESS) && size >= c->compress_min_size);
+}
+
+/* Reserve room in CACHE for SIZE bytes of data keyed by PATH, with hash HASH,
+   as cache_reserve does. */
+static int
+cache_reserve_hashed(cache_t *c, char *path, uint64_t hash, size_t size, cache_slot_t *slot)
+{
+    if (size > c->max_item_size) {
+        return -E2BIG;
+    }
+    int status = cache_begin_write(c);
+    if (status < 0) {
+        return status;
+    }
+    int64_t n = cache_alloc_slot(c, path, hash, size, DIRECT_IO_ALIGN, &slot->ptr);
+    if (n < 0) {
+        cache_end_write(c);
+        return (int) n;
+    }
+    slot->entry = &CACHE_ENTRIES(c)[n];
+    slot->size = size;
+
+    return 0;
+}
+
+/* Reserve room in CACHE for SIZE bytes of data keyed by PATH, so that the data
+   can be written (e.g. read from the filesystem with direct IO) straight into
+   SLOT->ptr, rather than stored from a copy. SLOT->ptr is page aligned, with
+   room for SIZE rounded up to a whole page, except in arena mode when files
+   have also been stored with cache_store. The slot must be passed to
+   cache_commit or cache_abort, and a flush waits for it until then, so it
+   should only be held as long as it takes to fill. Reserved data is never
+   compressed. Returns -EEXIST if PATH is already cached, and -E2BIG if SIZE is
+   over the maximum item size. On success returns 0. On failure returns
+   negative errno. */
+int
+cache_reserve(cache_t *c, char *path, size_t size, cache_slot_t *slot)
+{
+    return cache_reserve_hashed(c, path, cache_hash(path), size, slot);
+}
+
+/* Publish the data written into SLOT, reserved by cache_reserve. If VIEW isn't
+   NULL, it's pinned to the newly cached data as cache_acquire would pin it,
+   without a lookup. The slot is used up either way. Returns -EEXIST if the
+   path was cached by someone else in the meantime. On success returns 0. On
+   failure returns negative errno. */
+int
+cache_commit(cache_t *c, cache_slot_t *slot, cache_view_t *view)
+{
+    hash_entry_t *entry = slot->entry;
+    int status = cache_fill_slot(c, entry - CACHE_ENTRIES(c));
+    if (status == 0) {
+        STAT_ADD(c, n_bytes_raw, slot->size);
+        STAT_ADD(c, n_bytes_stored, slot->size);
+
+        /* A flush waits for writers before it checks for pins, so pinning the
+           entry before leaving can't race with one. */
+        if (view != NULL) {
+            atomic_fetch_add(&entry->state, 1);
+            status = cache_view_entry(c, entry, view);
+        }
+    }
+    cache_end_write(c);
+
+    return status;
+}
+
+/* Give back SLOT, reserved by cache_reserve, without caching anything. */
+void
+cache_abort(cache_t *c, cache_slot_t *slot)
+{
+    cache_drop_slot(c, slot->entry - CACHE_ENTRIES(c));
+    cache_end_write(c);
+}
+
+/* Write the key the VARIANT of PATH is cached under into KEY, which must hold
+   PATH_MAX bytes, and return its hash into *HASH. The hash keeps variant keys
+   apart from paths, and the leading 'v' from range blocks' keys; the length
+   of VARIANT marks where it ends and PATH begins. Returns 0 on success, or
+   -ENAMETOOLONG. */
+static int
+cache_variant_key(char *path, char *variant, char *key, uint64_t *hash)
+{
+    if (snprintf(key, PATH_MAX, "v%zu:%s%s", strlen(variant), variant, path) >= PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    *hash = cache_derived_hash(key);
+
+    return 0;
+}
+
+/* Returns whether the SIZE bytes at DATA hold a well-formed variant. */
+static bool
+cache_variant_valid(uint8_t *data, size_t size)
+{
+    cache_variant_t *meta = (cache_variant_t *) data;
+
+    return size >= sizeof(cache_variant_t) &&
+           meta->size == size - sizeof(cache_variant_t) &&
+           meta->ndim <= VARIANT_MAX_DIMS &&
+           memchr(meta->format, '\0', VARIANT_FORMAT_LEN) != NULL;
+}
+
+/* Returns whether the VARIANT of PATH is cached in CACHE. */
+bool
+cache_contains_variant(cache_t *c, char *path, char *variant)
+{
+    char key[PATH_MAX];
+    uint64_t hash;
+
+    return cache_variant_key(path, variant, key, &hash) == 0 && cache_contains_hashed(c, key, hash);
+}
+
+/* Store META->size bytes of DATA in CACHE as the VARIANT of PATH, described by
+   META, alongside (and independently of) PATH's own data. Where the variant
+   wouldn't be compressed, it's written straight into the cache, so that it's
+   copied once. Returns -EINVAL if META is malformed, and otherwise what
+   cache_store returns. */
+int
+cache_store_variant(cache_t *c, char *path, char *variant, cache_variant_t *meta, void *data)
+{
+    char key[PATH_MAX];
+    uint64_t hash;
+    int status = cache_variant_key(path, variant, key, &hash);
+    if (status < 0) {
+        return status;
+    }
+    if (meta->ndim > VARIANT_MAX_DIMS || memchr(meta->format, '\0', VARIANT_FORMAT_LEN) == NULL) {
+        return -EINVAL;
+    }
+
+    size_t size = sizeof(cache_variant_t) + meta->size;
+    if (cache_should_reserve(c, size)) {
+        cache_slot_t slot;
+        status = cache_reserve_hashed(c, key, hash, size, &slot);
+        if (status < 0) {
+            return status;
+        }
+        memcpy(slot.ptr, meta, sizeof(cache_variant_t));
+        memcpy(slot.ptr + sizeof(cache_variant_t), data, meta->size);
+
+        return cache_commit(c, &slot, NULL);
+    }
+
+    uint8_t *packed = malloc(size);
+    if (packed == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(packed, meta, sizeof(cache_variant_t));
+    memcpy(packed + sizeof(cache_variant_t), data, meta->size);
+    status = cache_store_hashed(c, key, hash, packed, size);
+    free(packed);
+
+    return status;
+}
+
+/* Load the VARIANT of PATH from CACHE into DATA, as cache_load does, header
+   and all. Returns -EBADMSG if what's cached isn't a well-formed variant, and
+   otherwise what cache_load returns. */
+int
+cache_load_variant(cache_t *c, char *path, char *variant, uint8_t *data, size_t *size, size_t max)
+{
+    char key[PATH_MAX];
+    uint64_t hash;
+    int status = cache_variant_key(path, variant, key, &hash);
+    if (status == 0) {
+        status = cache_load_hashed(c, key, hash, data, size, max);
+    }
+    if (status == 0 && !cache_variant_valid(data, *size)) {
+        status = -EBADMSG;
+    }
+
+    return status;
+}
+
+/* Pin the VARIANT of PATH in CACHE and map it into VIEW, as cache_acquire
+   does. VIEW covers the variant's cache_variant_t header as well as its data,
+   which follows it. Returns -EBADMSG if what's cached isn't a well-formed
+   variant, and otherwise what cache_acquire returns. */
+int
+cache_acquire_variant(cache_t *c, char *path, char *variant, cache_view_t *view)
+{
+    char key[PATH_MAX];
+    uint64_t hash;
+    int status = cache_variant_key(path, variant, key, &hash);
+    if (status == 0) {
+        status = cache_acquire_hashed(c, key, hash, view);
+    }
+    if (status == 0 && !cache_variant_valid(view->ptr, view->size)) {
+        cache_release(c, view);
+        status = -EBADMSG;
+    }
+
+    return status;
+}
+
+/* Read PATH, with hash HASH, from CACHE's spill tier into DATA, as
+   cache_read_miss reads it from the filesystem, for a miss that began at START.
+   On a spill miss (or if CACHE has no spill tier) returns -ENODATA. On failure
+   returns errno code with negative value, otherwise returns bytes read. */
+static ssize_t
+cache_spill_read(cache_t *c, char *path, uint64_t hash, void *data, uint64_t max_size, uint64_t start)
+{
+    if (c->spill == 0) {
+        return -ENODATA;
+    }
+    hash_entry_t *entry = cache_pin(CACHE_SPILL(c), path, hash);
+    if (entry == NULL) {
+        return -ENODATA;
+    }
+
+    /* Entries are written a whole number of blocks at a time, so that they
+       can be read back with direct IO. */
+    size_t size = entry->size;
+    ssize_t n = -EINVAL;
+    if (size <= max_size) {
+        n = pread(c->spill_fd, data, (size + SPILL_ALIGN - 1) & ~((size_t) SPILL_ALIGN - 1),
+                  ENTRY_OFFSET(entry));
+        n = n < 0 ? -errno : n < (ssize_t) size ? -EIO : (ssize_t) size;
+    }
+    cache_unpin(entry);
+    if (n < 0) {
+        STAT_INC(c, n_fail);
+        return n;
+    }
+    STAT_INC(c, n_spill_hits);
+    cache_stat_hist(c, HIST_SPILL_NS, cache_now_ns() - start);
+
+    return n;
+}
+
+/* Peer wire protocol. Each request is a peer_request_t followed by LEN bytes
+   of path, and each reply a peer_reply_t followed by SIZE bytes of data, if
+   SIZE isn't negative errno. Every node must share a byte order. Connections
+   whose requests don't carry the tier's token are closed. */
+#define PEER_MAGIC (0x4d494e50)  /* "MINP" */
+typedef struct {
+    uint32_t magic;                 /* PEER_MAGIC. */
+    uint32_t len;                   /* Length of the path, without a NUL. */
+    uint64_t max_size;              /* Most bytes the requester can take. */
+    char     token[PEER_TOKEN_LEN]; /* The tier's token, zero-padded. */
+} peer_request_t;
+
+typedef struct {
+    int64_t size;       /* Bytes of data following, or negative errno. */
+} peer_reply_t;
+
+/* Set in threads serving peers, whose reads must never be forwarded on to
+   another peer, even if the nodes disagree on who owns a path. */
+static _Thread_local bool peer_serving = false;
+
+/* This thread's connections to each node of a peer tier. */
+typedef struct {
+    cache_peers_t *peers;           /* Tier FDS connect to the nodes of. */
+    pid_t          pid;             /* Process FDS belong to. */
+    int            fds[MAX_PEERS];  /* Connection to each node, or -1. */
+} peer_conns_t;
+
+static pthread_key_t peer_conns_key;
+static pthread_once_t peer_conns_once = PTHREAD_ONCE_INIT;
+
+/* Close CONNS' connections. */
+static void
+peer_conns_close(peer_conns_t *conns)
+{
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (conns->fds[i] >= 0) {
+            close(conns->fds[i]);
+            conns->fds[i] = -1;
+        }
+    }
+}
+
+/* Thread exit destructor for a thread's peer_conns_t. */
+static void
+peer_conns_free(void *conns)
+{
+    peer_conns_close(conns);
+    free(conns);
+}
+
+static void
+peer_conns_init(void)
+{
+    pthread_key_create(&peer_conns_key, peer_conns_free);
+}
+
+/* Returns the calling thread's connection to node PEER of PEERS, connecting
+   if need be, or negative errno. Connections inherited across a fork are
+   shared with the parent, so they're dropped rather than used. */
+static int
+cache_peer_conn(cache_peers_t *peers, int peer)
+{
+    pthread_once(&peer_conns_once, peer_conns_init);
+    peer_conns_t *conns = pthread_getspecific(peer_conns_key);
+    if (conns == NULL) {
+        if ((conns = malloc(sizeof(peer_conns_t))) == NULL) {
+            return -ENOMEM;
+        }
+        conns->peers = NULL;
+        for (int i = 0; i < MAX_PEERS; i++) {
+            conns->fds[i] = -1;
+        }
+        pthread_setspecific(peer_conns_key, conns);
+    }
+    pid_t pid = getpid();
+    if (conns->peers != peers || conns->pid != pid) {
+        peer_conns_close(conns);
+        conns->peers = peers;
+        conns->pid = pid;
+    }
+    if (conns->fds[peer] < 0) {
+        conns->fds[peer] = socket_connect((struct sockaddr *) &peers->addrs[peer], peers->addr_lens[peer],
+                                          PEER_TIMEOUT_MS);
+    }
+
+    return conns->fds[peer];
+}
+
+/* Give up on the calling thread's connection to node PEER of PEERS after it
+   failed, and skip the node for a while. */
+static void
+cache_peer_fail(cache_peers_t *peers, int peer)
+{
+    peer_conns_t *conns = pthread_getspecific(peer_conns_key);
+    if (conns != NULL && conns->peers == peers && conns->fds[peer] >= 0) {
+        close(conns->fds[peer]);
+        conns->fds[peer] = -1;
+    }
+    atomic_store(&peers->down_until[peer], cache_now_ns() + PEER_BACKOFF_NS);
+}
+
+/* Returns the node of PEERS that owns the path hashed to HASH: the one whose
+   ID it hashes highest with (rendezvous hashing), so that adding or removing
+   a node only moves the paths it owns. */
+static int
+cache_peer_owner(cache_peers_t *peers, uint64_t hash)
+{
+    int owner = 0;
+    uint64_t best = 0;
+    for (int i = 0; i < peers->n_peers; i++) {
+        uint64_t weight = utils_hash(hash ^ peers->ids[i]);
+        if (i == 0 || weight > best) {
+            owner = i;
+            best = weight;
+        }
+    }
+
+    return owner;
+}
+
+/* Check if the path hashed to HASH is owned by another of CACHE's peers which
+   isn't known to be down as of START, so a miss on it goes over the network.
+   Returns true if so, else false. */
+static bool
+cache_peer_remote(cache_t *c, uint64_t hash, uint64_t start)
+{
+    cache_peers_t *peers = c->peers;
+    if (peers == NULL || peer_serving) {
+        return false;
+    }
+    int owner = cache_peer_owner(peers, hash);
+
+    return owner != peers->self && atomic_load(&peers->down_until[owner]) <= start;
+}
+
+/* Read PATH into DATA from the peer that owns it, for a miss that began at
+   START. The owner serves it from its cache, or reads and caches it, so the
+   file isn't cached here as well. If CACHE has no peer tier, PATH is this
+   node's own, or the owner doesn't answer (or can't read it either), returns
+   -ENODATA, and the miss is served here. Otherwise returns bytes read. */
+static ssize_t
+cache_peer_read(cache_t *c, char *path, void *data, uint64_t max_size, uint64_t start)
+{
+    cache_peers_t *peers = c->peers;
+    uint64_t hash = cache_hash(path);
+    if (!cache_peer_remote(c, hash, start)) {
+        return -ENODATA;
+    }
+    int owner = cache_peer_owner(peers, hash);
+
+    peer_request_t req = {.magic = PEER_MAGIC, .len = strlen(path), .max_size = max_size};
+    memcpy(req.token, peers->token, PEER_TOKEN_LEN);
+    peer_reply_t reply;
+    int fd = cache_peer_conn(peers, owner);
+    int status = fd;
+    if (fd >= 0 && (status = send_full(fd, &req, sizeof(req))) == 0 &&
+        (status = send_full(fd, path, req.len)) == 0 &&
+        (status = recv_full(fd, &reply, sizeof(reply))) == 0 && reply.size >= 0) {
+        status = reply.size <= (int64_t) max_size ? recv_full(fd, data, reply.size) : -EPROTO;
+    }
+    if (status < 0) {
+        cache_peer_fail(peers, owner);
+        STAT_INC(c, n_peer_fails);
+        return -ENODATA;
+    }
+    if (reply.size < 0) {
+        return -ENODATA;
+    }
+    STAT_INC(c, n_peer_hits);
+    cache_stat_hist(c, HIST_PEER_NS, cache_now_ns() - start);
+
+    return reply.size;
+}
+
+/* Append the SIZE bytes at DATA, which must be block-aligned and hold SIZE
+   rounded up to a whole block, to CACHE's spill tier, indexed by PATH (with
+   hash HASH). Called for capacity misses, so failing (because the tier is full
+   too) is silent. */
+static void
+cache_spill_store(cache_t *c, char *path, uint64_t hash, uint8_t *data, size_t size)
+{
+    cache_t *spill = CACHE_SPILL(c);
+    size_t len = (size + SPILL_ALIGN - 1) & ~((size_t) SPILL_ALIGN - 1);
+    if (c->spill == 0 || atomic_load(&spill->used) + len > spill->size || cache_begin_write(spill) < 0) {
+        return;
+    }
+    int64_t n = cache_new_entry(spill, path, hash);
+    if (n >= 0) {
+        hash_entry_t *entry = &CACHE_ENTRIES(spill)[n];
+        int64_t offset = cache_reserve_space(spill, len, SPILL_ALIGN);
+        if (offset < 0 || write_full(c->spill_fd, data, len, offset) < 0) {
+            /* The space reserved (if any) is lost until the next flush, as
+               arena space always is. */
+            cache_discard_entry(spill, n, true);
+        } else {
+            entry->size = size;
+            entry->offset = offset;
+            if (cache_commit_entry(spill, entry) == 0) {
+                STAT_INC(c, n_spill_stores);
+            }
+        }
+    }
+    cache_end_write(spill);
+}
+
+/* Account for a miss that read SIZE bytes of PATH (with hash HASH) into DATA
+   and began at START, where STATUS is the result of trying to cache it. Data
+   that didn't fit spills, if it can; -EEXIST means another process beat us to
+   caching it, which isn't a capacity miss, and -ECANCELED that admission turned
+   it away. */
+static void
+cache_finish_miss(cache_t *c, char *path, uint64_t hash, uint8_t *data, size_t size, int status, uint64_t start)
+{
+    if (status == -ECANCELED) {
+        STAT_INC(c, n_rejected);
+        STAT_INC(c, n_miss_cold);
+    } else if (status < 0 && status != -EEXIST) {
+        STAT_INC(c, n_miss_capacity);
+        cache_spill_store(c, path, hash, data, size);
+    } else {
+        STAT_INC(c, n_miss_cold);
+    }
+    cache_stat_miss(c, start, size);
+}
+
+/* Read PATH (with hash HASH), a member of a shard added with cache_add_shard,
+   out of its shard into DATA and attempt to cache it if it's predicted to be
+   read REUSE times, for a miss that began at START. If PATH isn't a shard
+   member, returns -ENODATA. On failure returns errno code with negative value,
+   otherwise returns bytes read. */
+static ssize_t
+cache_member_read(cache_t *c, char *path, uint64_t hash, void *data, uint64_t max_size, uint64_t start, float reuse)
+{
+    if (c->members == 0) {
+        return -ENODATA;
+    }
+    cache_t *members = CACHE_MEMBERS(c);
+    hash_entry_t *entry = cache_pin(members, path, hash);
+    if (entry == NULL) {
+        return -ENODATA;
+    }
+    size_t size = entry->size;
+    off_t offset = MEMBER_OFFSET(entry);
+    char *shard = cache_id_path(members, MEMBER_SHARD(entry));
+    cache_unpin(entry);
+
+    /* Members aren't block-aligned within their shard, so they're read through
+       the page cache, which also reads ahead into their neighbours. */
+    ssize_t n = -EINVAL;
+    if (size <= max_size) {
+        bool buffered = true;
+        int fd = open(shard, O_RDONLY);
+        n = fd < 0 ? -ENOENT : read_full(fd, data, size, offset, READ_CHUNK_MAX, &buffered);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (n >= 0 && n < (ssize_t) size) {
+            n = -EIO;
+        }
+    }
+    if (n < 0) {
+        STAT_INC(c, n_fail);
+        return n;
+    }
+    int status = cache_admits(c, size, reuse) ? cache_store_hashed(c, path, hash, data, size) : -ECANCELED;
+    cache_finish_miss(c, path, hash, data, size, status, start);
+
+    return size;
+}
+
+/* Open PATH for direct IO, or for buffered IO (setting *BUFFERED) if the
+   filesystem doesn't support direct IO, storing its status into ST. Returns
+   the descriptor, or -ENOENT if PATH can't be opened, or -EINVAL if it's empty
+   or larger than MAX_SIZE bytes. */
+static int
+cache_open_file(char *path, uint64_t max_size, struct stat *st, bool *buffered)
+{
+    int fd = open(path, O_RDONLY | __O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        fd = open(path, O_RDONLY);
+        *buffered = true;
+    }
+    if (fd < 0) {
+        return -ENOENT;
+    }
+    if (fstat(fd, st) < 0 || st->st_size == 0 || (size_t) st->st_size > max_size) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    return fd;
+}
+
+/* How long a miss waiting on a read in flight sleeps between checks that the
+   reading process is still alive. */
+#define FLIGHT_WAIT_NS (10 * 1000 * 1000)
+
+/* How many checks a waiting miss makes while the slot has no process recorded
+   (which should only last an instant) before giving up on it. */
+#define FLIGHT_MAX_ANON_WAITS 100
+
+/* Claim CACHE's in-flight slot for the path with hash HASH, so that concurrent
+   misses on the path wait for this read rather than repeating it. Returns the
+   slot, to be released with cache_flight_end once the file is cached (or
+   failed to be), or NULL if the slot is taken. If the path itself is in flight
+   and WAIT is set, first waits for that read to end, setting *WAITED, before
+   returning NULL. */
+static cache_flight_t *
+cache_flight_begin(cache_t *c, uint64_t hash, bool wait, bool *waited)
+{
+    if (c->flights == 0) {
+        return NULL;
+    }
+    uint64_t key = hash == 0 ? 1 : hash;
+    cache_flight_t *flight = &CACHE_FLIGHTS(c)[key % N_FLIGHTS];
+    for (;;) {
+        uint64_t expected = 0;
+        if (atomic_compare_exchange_strong(&flight->hash, &expected, key)) {
+            atomic_store(&flight->pid, getpid());
+            return flight;
+        } else if (expected != key || !wait) {
+            /* Another path, or the caller can't afford to block. */
+            return NULL;
+        }
+
+        /* The reader may die (in another process) without ending its flight,
+           in which case the first waiter to notice frees the slot, and the
+           waiters race to claim it again. */
+        *waited = true;
+        bool dead = false;
+        for (int anon = 0; anon < FLIGHT_MAX_ANON_WAITS && !dead;) {
+            uint32_t seq = atomic_load(&flight->seq);
+            if (atomic_load(&flight->hash) != key) {
+                return NULL;
+            }
+            pid_t pid = atomic_load(&flight->pid);
+            if (pid == 0) {
+                anon++;
+            } else if (!pid_alive(pid)) {
+                expected = key;
+                if (atomic_compare_exchange_strong(&flight->hash, &expected, 0)) {
+                    atomic_fetch_add(&flight->seq, 1);
+                    futex_wake((uint32_t *) &flight->seq);
+                }
+                dead = true;
+                continue;
+            }
+            futex_wait((uint32_t *) &flight->seq, seq, FLIGHT_WAIT_NS);
+        }
+        if (!dead) {
+            return NULL;
+        }
+    }
+}
+
+/* Release FLIGHT, claimed by cache_flight_begin, waking every miss waiting on
+   it. FLIGHT may be NULL. */
+static void
+cache_flight_end(cache_flight_t *flight)
+{
+    if (flight == NULL) {
+        return;
+    }
+    atomic_store(&flight->pid, 0);
+    atomic_store(&flight->hash, 0);
+    atomic_fetch_add(&flight->seq, 1);
+    futex_wake((uint32_t *) &flight->seq);
+}
+
+/* Read the file at PATH, with hash HASH, from the filesystem into DATA, and
+   attempt to cache it if admission allows for its predicted REUSE. Used to
+   service misses for cache_read, cache_read_view and cache_read_id, which began
+   at START. If VIEW isn't NULL and the file is cached as it's read, VIEW is
+   pinned to the cached copy instead of DATA being filled; otherwise VIEW is
+   left alone. On failure returns errno code with negative value, otherwise
+   returns bytes read. */
+static ssize_t
+cache_read_file(cache_t *c,
+                char *path,
+                uint64_t hash,
+                void *data,
+                uint64_t max_size,
+                uint64_t start,
+                cache_view_t *view,
+                float reuse)
+{
+    bool buffered = false;
+    struct stat st;
+    int fd = cache_open_file(path, max_size, &st, &buffered);
+    if (fd < 0) {
+        STAT_INC(c, n_fail);
+        return fd;
+    }
+
+    /* Two threads/processes may still both miss on the same path (if their
+       in-flight slots collide); whichever stores second gets -EEXIST, and the
+       data is identical either way. */
+
+    /* Read straight into the space the file will be cached in where that
+       suits, so that it's only written once. If there's no room, read into
+       DATA, which the spill tier needs too. */
+    size_t size = st.st_size;
+    size_t chunk = read_chunk_size(st.st_blksize);
+    bool admitted = cache_admits(c, size, reuse);
+    cache_slot_t slot;
+    bool reserved = admitted && cache_should_reserve(c, size) && cache_reserve_hashed(c, path, hash, size, &slot) == 0;
+    ssize_t n = read_full(fd, reserved ? slot.ptr : data, size, 0, chunk, &buffered);
+    int status = 0;
+    if (reserved && n == (ssize_t) size) {
+        if (view == NULL) {
+            memcpy(data, slot.ptr, size);
+        }
+        status = cache_commit(c, &slot, view);
+        if (status < 0 && view != NULL) {
+            /* The data went with the slot, so read it again. */
+            n = read_full(fd, data, size, 0, chunk, &buffered);
+        }
+    } else if (reserved) {
+        /* The file changed under us. Return what we have, uncached. */
+        if (n > 0) {
+            memcpy(data, slot.ptr, n);
+        }
+        cache_abort(c, &slot);
+        reserved = false;
+    }
+    close(fd);
+    if (buffered) {
+        STAT_INC(c, n_buffered);
+    }
+    if (n <= 0) {
+        STAT_INC(c, n_fail);
+        return n < 0 ? n : -EIO;
+    }
+    size = n;
+
+    /* Cache the data, unless it was read into the cache. */
+    if (!reserved) {
+        status = admitted ? cache_store_hashed(c, path, hash, data, size) : -ECANCELED;
+    }
+    cache_finish_miss(c, path, hash, data, size, status, start);
+
+    return size;
+}
+
+/* Service a miss on PATH as cache_read_file does, but coalescing it with any
+   concurrent read of PATH, in this process or another: only one reads the
+   file, and the rest wait for it and then read the cached copy. */
+static ssize_t
+cache_read_miss(cache_t *c,
+                char *path,
+                void *data,
+                uint64_t max_size,
+                uint64_t start,
+                cache_view_t *view,
+                float reuse)
+{
+    /* Whether this read waited for another or claimed the slot itself, the
+       file may have been cached since it was looked up. If the read waited on
+       didn't manage to cache it, it has to be read again, uncoordinated. */
+    uint64_t hash = cache_hash(path);
+    bool waited = false;
+    cache_flight_t *flight = cache_flight_begin(c, hash, true, &waited);
+    if (waited || flight != NULL) {
+        size_t bytes = 0;
+        int status = view == NULL ? -ENOTSUP : cache_acquire_hashed(c, path, hash, view);
+        if (status == 0) {
+            bytes = view->size;
+        } else {
+            if (view != NULL) {
+                view->entry = NULL;
+                view->ptr = NULL;
+            }
+            status = cache_load_hashed(c, path, hash, data, &bytes, max_size);
+        }
+        if (status == 0) {
+            cache_flight_end(flight);
+            STAT_INC(c, n_coalesced);
+            cache_stat_hit(c, start, bytes);
+            return (ssize_t) bytes;
+        }
+    }
+
+    /* Files that didn't fit in memory may have spilled, files other nodes
+       own are read from them, and shard members are read out of their
+       shard. */
+    ssize_t n = cache_spill_read(c, path, hash, data, max_size, start);
+    if (n == -ENODATA) {
+        n = cache_peer_read(c, path, data, max_size, start);
+    }
+    if (n == -ENODATA) {
+        n = cache_member_read(c, path, hash, data, max_size, start, reuse);
+    }
+    if (n == -ENODATA) {
+        n = cache_read_file(c, path, hash, data, max_size, start, view, reuse);
+    }
+    cache_flight_end(flight);
+
+    return n;
+}
+
+/* Read an item from CACHE into DATA, indexed by PATH, and located on the
+   filesystem at PATH. On failure returns errno code with negative value,
+   otherwise returns bytes read on success.
+   
+   DATA must be block-aligned, in order for direct IO to work properly, and
+   must hold MAX_SIZE rounded up to a multiple of DIRECT_IO_ALIGN: direct IO
+   and the spill tier read whole blocks, so may fill DATA past the end of a
+   file of up to MAX_SIZE bytes.
+   
+   Note we use atomics to implement thread safe options because pthreads and
+   traditional synchronization primitives are not safe to use with the Python
+   interpreter, and may cause deadlock to occur, regardless of the correctness
+   of primitives' usage.
+   
+   It should be noted that the cache is only thread/process safe so long as the
+   cache entries are only written once (as is the case with MinIO). */
+ssize_t
+cache_read(cache_t *c, char *path, void *data, uint64_t max_size)
+{
+    uint64_t start = cache_now_ns();
+    STAT_INC(c, n_accs);
+
+    /* Check if the file is cached. */
+    size_t bytes = 0;
+    int status = cache_load(c, path, data, &bytes, max_size);
+    if (status < 0) {
+        /* Don't fail if the error was the file not being cached. */
+        if (status != -ENODATA) {
+            return (ssize_t) status;
+        }
+    } else {
+        cache_stat_hit(c, start, bytes);
+        return (ssize_t) bytes;
+    }
+
+    return cache_read_miss(c, path, data, max_size, start, NULL, REUSE_UNKNOWN);
+}
+
+/* Read an item from CACHE like cache_read, but without copying on hits. If the
+   item is cached (or becomes cached by this read) uncompressed, VIEW is pinned
+   to the cached data as with cache_acquire. Otherwise VIEW->ptr is NULL, and
+   the data has been read (or decompressed) into DATA, which must be aligned
+   and sized as for cache_read. On failure returns errno code with negative
+   value, otherwise returns bytes read on success. */
+ssize_t
+cache_read_view(cache_t *c,
+                char *path,
+                void *data,
+                uint64_t max_size,
+                cache_view_t *view)
+{
+    uint64_t start = cache_now_ns();
+    STAT_INC(c, n_accs);
+    view->entry = NULL;
+    view->ptr = NULL;
+    view->size = 0;
+
+    /* Check if the file is cached. Compressed files are decompressed into
+       DATA instead. */
+    int status = cache_acquire(c, path, view);
+    if (status == -ENOTSUP) {
+        size_t bytes = 0;
+        status = cache_load(c, path, data, &bytes, max_size);
+        if (status == 0) {
+            cache_stat_hit(c, start, bytes);
+            return (ssize_t) bytes;
+        }
+    }
+    if (status == 0) {
+        cache_stat_hit(c, start, view->size);
+        return (ssize_t) view->size;
+    } else if (status != -ENODATA) {
+        return (ssize_t) status;
+    }
+
+    /* Read it from the filesystem. If it was cached as a result, hand back the
+       cached copy; the data in DATA is identical either way, if it was filled
+       at all. */
+    ssize_t size = cache_read_miss(c, path, data, max_size, start, view, REUSE_UNKNOWN);
+    if (size > 0 && view->ptr == NULL && cache_acquire(c, path, view) < 0) {
+        view->entry = NULL;
+        view->ptr = NULL;
+    }
+
+    return size;
+}
+
+/* Read block BLOCK of the file at PATH into CACHE under KEY, with hash HASH,
+   for a miss that began at START, opening the file (as *FD, with its size in
+   *FILE_SIZE) if it isn't open yet. BUF is a block-aligned buffer of
+   RANGE_BLOCK_SIZE bytes for blocks that can't be read straight into the cache.
+   On success pins VIEW to the cached block, or leaves VIEW->ptr NULL and the
+   block in BUF. Returns the block's size (zero past the end of the file), or
+   negative errno. */
+static ssize_t
+cache_read_block(cache_t *c,
+                 char *path,
+                 char *key,
+                 uint64_t hash,
+                 size_t block,
+                 uint8_t *buf,
+                 int *fd,
+                 size_t *file_size,
+                 uint64_t start,
+                 cache_view_t *view)
+{
+    bool buffered = false;
+    if (*fd < 0) {
+        struct stat st;
+        /* There's nothing to read of an empty file. */
+        if ((*fd = cache_open_file(path, SIZE_MAX, &st, &buffered)) < 0) {
+            return *fd == -EINVAL ? 0 : *fd;
+        }
+        *file_size = st.st_size;
+    }
+    size_t offset = block * RANGE_BLOCK_SIZE;
+    if (offset >= *file_size) {
+        return 0;
+    }
+    size_t size = MIN(*file_size - offset, RANGE_BLOCK_SIZE);
+
+    /* As with whole files, read straight into the cache where that suits. */
+    size_t chunk = read_chunk_size(RANGE_BLOCK_SIZE);
+    cache_slot_t slot;
+    bool reserved = cache_should_reserve(c, size) && cache_reserve_hashed(c, key, hash, size, &slot) == 0;
+    ssize_t n = read_full(*fd, reserved ? slot.ptr : buf, size, offset, chunk, &buffered);
+    if (buffered) {
+        STAT_INC(c, n_buffered);
+    }
+    if (n != (ssize_t) size) {
+        if (reserved) {
+            cache_abort(c, &slot);
+        }
+        return n < 0 ? n : -EIO;
+    }
+    int status;
+    if (reserved) {
+        if ((status = cache_commit(c, &slot, view)) < 0) {
+            n = read_full(*fd, buf, size, offset, chunk, &buffered);
+            if (n != (ssize_t) size) {
+                return n < 0 ? n : -EIO;
+            }
+        }
+    } else {
+        status = cache_store_hashed(c, key, hash, buf, size);
+    }
+    cache_finish_miss(c, key, hash, buf, size, status, start);
+
+    return size;
+}
+
+/* Look up the block cached under KEY, with hash HASH, in CACHE, pinning VIEW to
+   it, or if it's
+   compressed, decompressing it into BUF and leaving VIEW->ptr NULL. Stores the
+   block's size into SIZE. Returns 0, or negative errno (-ENODATA on a miss). */
+static int
+cache_lookup_block(cache_t *c, char *key, uint64_t hash, uint8_t *buf, cache_view_t *view, size_t *size)
+{
+    int status = cache_acquire_hashed(c, key, hash, view);
+    if (status == 0) {
+        *size = view->size;
+        return 0;
+    }
+    view->entry = NULL;
+    view->ptr = NULL;
+    if (status == -ENOTSUP) {
+        status = cache_load_hashed(c, key, hash, buf, size, RANGE_BLOCK_SIZE);
+    }
+
+    return status;
+}
+
+/* Read LENGTH bytes of the file at PATH, starting from byte OFFSET, into DATA
+   (which needn't be aligned) through CACHE. Rather than caching the whole
+   file, which may be too large to cache (or read) whole, CACHE caches the
+   aligned RANGE_BLOCK_SIZE blocks of it that the range overlaps, so only the
+   parts of the file that are read take up space. Each block counts as an
+   access. On success returns the number of bytes read, which is only less
+   than LENGTH if the file ends first. On failure returns negative errno. */
+ssize_t
+cache_read_range(cache_t *c, char *path, void *data, size_t offset, size_t length)
+{
+    char key[PATH_MAX];
+    uint8_t *buf = NULL;
+    int fd = -1;
+    size_t file_size = 0, done = 0;
+    ssize_t status = 0;
+    while (done < length) {
+        uint64_t start = cache_now_ns();
+        size_t block = (offset + done) / RANGE_BLOCK_SIZE;
+        size_t skip = (offset + done) % RANGE_BLOCK_SIZE;
+        size_t want = MIN(length - done, RANGE_BLOCK_SIZE - skip);
+        /* Blocks are keyed by their index ahead of the path, in the derived
+           keys' half of the hash space, so they can't be mistaken for whole
+           files (or variants). */
+        if (snprintf(key, sizeof(key), "b%zu:%s", block, path) >= (int) sizeof(key)) {
+            status = -ENAMETOOLONG;
+            break;
+        }
+        uint64_t hash = cache_derived_hash(key);
+        if (buf == NULL && posix_memalign((void **) &buf, DIRECT_IO_ALIGN, RANGE_BLOCK_SIZE) != 0) {
+            buf = NULL;
+            status = -ENOMEM;
+            break;
+        }
+        STAT_INC(c, n_accs);
+
+        /* Hits are copied straight out of the cache, and so are misses read
+           straight into it. Otherwise the block ends up in BUF. Misses are
+           coalesced as cache_read_miss does. */
+        cache_view_t view;
+        size_t size = 0;
+        status = cache_lookup_block(c, key, hash, buf, &view, &size);
+        if (status == 0) {
+            cache_stat_hit(c, start, size);
+        } else if (status == -ENODATA) {
+            bool waited = false;
+            cache_flight_t *flight = cache_flight_begin(c, hash, true, &waited);
+            if ((waited || flight != NULL) && cache_lookup_block(c, key, hash, buf, &view, &size) == 0) {
+                STAT_INC(c, n_coalesced);
+                cache_stat_hit(c, start, size);
+            } else {
+                status = cache_spill_read(c, key, hash, buf, RANGE_BLOCK_SIZE, start);
+                if (status == -ENODATA) {
+                    status = cache_read_block(c, path, key, hash, block, buf, &fd, &file_size, start, &view);
+                }
+                size = status;
+            }
+            cache_flight_end(flight);
+        }
+        if (status < 0) {
+            STAT_INC(c, n_fail);
+            break;
+        }
+
+        /* A block shorter than the range wants is the file's last. */
+        size_t n = size > skip ? MIN(want, size - skip) : 0;
+        memcpy((uint8_t *) data + done, (view.ptr != NULL ? view.ptr : buf) + skip, n);
+        cache_release(c, &view);
+        done += n;
+        if (n < want) {
+            break;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+
+    return status < 0 ? status : (ssize_t) done;
+}
+
+/* Register the N paths in PATHS with CACHE, assigning them consecutive integer
+   IDs starting from FIRST. IDs are shared by every process using CACHE, and
+   remain valid for CACHE's lifetime. A path registered twice gets two IDs. On
+   success returns 0. On failure returns negative errno: -ENOMEM if CACHE was
+   configured with room for fewer paths. */
+int
+cache_register(cache_t *c, char **paths, size_t n, size_t *first)
+{
+    if (n > c->max_paths) {
+        return -ENOMEM;
+    }
+
+    /* Reserve the IDs and the space for every key up front, so that both are
+       contiguous, and only if both fit. */
+    size_t key_units = 0;
+    for (size_t i = 0; i < n; i++) {
+        key_units += (strlen(paths[i]) + KEY_ALIGN) / KEY_ALIGN;
+    }
+    uint64_t reserved = atomic_load(&c->path_reserved), next;
+    size_t id, key;
+    do {
+        id = reserved & UINT32_MAX;
+        key = reserved >> 32;
+        if (id + n > c->max_paths || (key + key_units) * KEY_ALIGN > c->path_keys_size) {
+            return -ENOMEM;
+        }
+        next = ((uint64_t) (key + key_units) << 32) | (id + n);
+    } while (!atomic_compare_exchange_weak(&c->path_reserved, &reserved, next));
+
+    *first = id;
+    for (size_t i = 0; i < n; i++) {
+        cache_path_t *entry = &CACHE_PATHS(c)[id + i];
+        strcpy(CACHE_PATH_KEYS(c) + key * KEY_ALIGN, paths[i]);
+        entry->hash = cache_hash(paths[i]);
+        entry->key = key;
+        atomic_store(&entry->reuse, REUSE_UNKNOWN);
+        atomic_store(&entry->hint, 0);
+        key += (strlen(paths[i]) + KEY_ALIGN) / KEY_ALIGN;
+    }
+
+    /* Publish the IDs once every registration before this one has published
+       its own, which only takes as long as writing them. */
+    while (atomic_load_explicit(&c->n_paths, memory_order_acquire) != id) {
+        sched_yield();
+    }
+    atomic_store_explicit(&c->n_paths, id + n, memory_order_release);
+
+    return 0;
+}
+
+/* Returns the path registered with CACHE as ID, or NULL if there's no such
+   ID. */
+char *
+cache_id_path(cache_t *c, size_t id)
+{
+    if (id >= atomic_load_explicit(&c->n_paths, memory_order_acquire)) {
+        return NULL;
+    }
+
+    return CACHE_PATH_KEYS(c) + (size_t) CACHE_PATHS(c)[id].key * KEY_ALIGN;
+}
+
+/* Find and pin the entry for registered path ID in CACHE, as cache_pin does.
+   Entries are immutable within a generation, so an entry found before is
+   reused without consulting the index if neither its generation nor the
+   cache's flush count has moved. */
+static hash_entry_t *
+cache_pin_id(cache_t *c, size_t id)
+{
+    size_t epoch = atomic_load(&c->epoch);
+    if (epoch & 1) {
+        return NULL;
+    }
+
+    /* Generations are narrow enough to wrap, so check the hash as well. */
+    cache_path_t *path = &CACHE_PATHS(c)[id];
+    uint64_t hint = atomic_load_explicit(&path->hint, memory_order_relaxed);
+    if (hint != 0 && HINT_CURRENT(hint, epoch)) {
+        hash_entry_t *entry = &CACHE_ENTRIES(c)[SLOT_ID(hint) - 1];
+        if (cache_pin_entry(c, entry, epoch, HINT_GEN(hint))) {
+            if (entry->hash == path->hash) {
+                return entry;
+            }
+            cache_unpin(entry);
+        }
+    }
+
+    unsigned gen;
+    hash_entry_t *entry = cache_find(c, cache_id_path(c, id), path->hash, &gen);
+    if (entry == NULL || !cache_pin_entry(c, entry, epoch, gen)) {
+        return NULL;
+    }
+    hint = HINT_MAKE(epoch, gen, (uint64_t) (entry - CACHE_ENTRIES(c) + 1));
+    atomic_store_explicit(&path->hint, hint, memory_order_relaxed);
+
+    return entry;
+}
+
+/* Check if CACHE contains the path registered as ID. */
+bool
+cache_contains_id(cache_t *c, size_t id)
+{
+    if (cache_id_path(c, id) == NULL) {
+        return false;
+    }
+
+    hash_entry_t *entry = cache_pin_id(c, id);
+    if (entry != NULL) {
+        cache_unpin(entry);
+    }
+
+    return entry != NULL;
+}
+
+/* Read the path registered as ID through CACHE, as cache_read does (so DATA
+   must be aligned and sized as it says). Hits involve no hashing or key
+   comparisons once the path has been found. Returns -EINVAL if there's no such
+   ID. */
+ssize_t
+cache_read_id(cache_t *c, size_t id, void *data, uint64_t max_size)
+{
+    char *path = cache_id_path(c, id);
+    if (path == NULL) {
+        return -EINVAL;
+    }
+
+    uint64_t start = cache_now_ns();
+    STAT_INC(c, n_accs);
+    hash_entry_t *entry = cache_pin_id(c, id);
+    if (entry != NULL) {
+        size_t bytes = 0;
+        int status = cache_load_entry(c, entry, data, &bytes, max_size);
+        if (status < 0) {
+            return (ssize_t) status;
+        }
+        cache_stat_hit(c, start, bytes);
+        return (ssize_t) bytes;
+    }
+
+    float reuse = atomic_load_explicit(&CACHE_PATHS(c)[id].reuse, memory_order_relaxed);
+    return cache_read_miss(c, path, data, max_size, start, NULL, reuse);
+}
+
+/* Set the predicted number of reads of the path registered as ID with CACHE
+   (e.g. over the next epoch, from the sampler's order) to REUSE, for
+   admission by cache_read_id, or to REUSE_UNKNOWN. Returns -EINVAL if there's
+   no such ID. On success returns 0. */
+int
+cache_set_reuse(cache_t *c, size_t id, float reuse)
+{
+    if (cache_id_path(c, id) == NULL) {
+        return -EINVAL;
+    }
+    atomic_store_explicit(&CACHE_PATHS(c)[id].reuse, reuse, memory_order_relaxed);
+
+    return 0;
+}
+
+/* Only admit files into CACHE that are predicted to be read more than
+   THRESHOLD times per MB they'd take up, favouring small and often read
+   files once memory is short. Files with unknown reuse are always admitted.
+   Applies to every process sharing CACHE. */
+void
+cache_set_admission(cache_t *c, double threshold)
+{
+    atomic_store(&c->admission, threshold);
+}
+
+/* Returns whether CACHE admits a file of SIZE bytes predicted to be read REUSE
+   times, as set by cache_set_admission. Callers of cache_store that know
+   their data's reuse can check this first. */
+bool
+cache_admits(cache_t *c, size_t size, float reuse)
+{
+    if (reuse < 0) {
+        return true;
+    }
+
+    return (double) reuse * (1024 * 1024) > atomic_load_explicit(&c->admission, memory_order_relaxed) * (double) size;
+}
+
+/* Per-miss state for cache_read_batch. */
+typedef struct {
+    cache_req_t *req;       /* Request being serviced. */
+    int          fd;        /* File descriptor, opened for direct IO. */
+    size_t       size;      /* Size of the file in bytes. */
+    size_t       done;      /* Bytes read so far. */
+    int          status;    /* Negative errno if the read failed. */
+    bool         buffered;  /* Direct IO was rejected; finish with buffered. */
+    cache_flight_t *flight; /* In-flight slot claimed for the read, or NULL. */
+} batch_miss_t;
+
+/* Shared work queue for the thread pool fallback of cache_read_batch. */
+typedef struct {
+    batch_miss_t  *misses;
+    size_t         n_misses;
+    atomic_size_t  next;
+} batch_pool_t;
+
+/* Length of the next read for MISS. With direct IO, reads must be a multiple of
+   the block size, so the last one is rounded up (the caller's buffer is block
+   aligned and sized to fit). */
+static size_t
+batch_read_len(batch_miss_t *miss)
+{
+    size_t remaining = miss->size - miss->done;
+    if (miss->buffered) {
+        return remaining;
+    }
+
+    return (remaining + BATCH_BLOCK_SIZE - 1) & ~((size_t) BATCH_BLOCK_SIZE - 1);
+}
+
+/* Finish reading MISS synchronously, as read_full does. */
+static void
+batch_read_sync(batch_miss_t *miss)
+{
+    if (miss->done >= miss->size || miss->status < 0) {
+        return;
+    }
+    ssize_t n = read_full(miss->fd,
+                          (uint8_t *) miss->req->data + miss->done,
+                          miss->size - miss->done,
+                          miss->done,
+                          READ_CHUNK_MAX,
+                          &miss->buffered);
+    if (n < 0) {
+        miss->status = n;
+    } else {
+        /* A file that shrank under us returns what we have. */
+        miss->done += n;
+        miss->size = miss->done;
+    }
+}
+
+/* Thread pool worker for cache_read_batch. */
+static void *
+batch_worker(void *arg)
+{
+    batch_pool_t *pool = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->n_misses) {
+        batch_read_sync(&pool->misses[i]);
+    }
+
+    return NULL;
+}
+
+/* Read every miss in MISSES using a pool of threads issuing synchronous reads.
+   Used when io_uring is unavailable. */
+static void
+batch_read_threads(batch_miss_t *misses, size_t n_misses)
+{
+    batch_pool_t pool = {.misses = misses, .n_misses = n_misses, .next = 0};
+    size_t n_threads = MIN(n_misses, BATCH_THREADS);
+    pthread_t threads[BATCH_THREADS];
+
+    /* The calling thread works too, so a failure to spawn only costs
+       parallelism. */
+    size_t spawned = 0;
+    while (spawned + 1 < n_threads &&
+           pthread_create(&threads[spawned], NULL, batch_worker, &pool) == 0) {
+        spawned++;
+    }
+    batch_worker(&pool);
+    for (size_t i = 0; i < spawned; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Read every miss in MISSES through an io_uring instance, keeping up to
+   BATCH_QUEUE_DEPTH reads in flight. Short reads are resubmitted for the
+   remainder. Returns 0 on success, or negative errno if io_uring couldn't be
+   used, in which case no IO has been issued. */
+static int
+batch_read_uring(batch_miss_t *misses, size_t n_misses)
+{
+    uring_t ring;
+    int status = uring_init(&ring, MIN(n_misses, BATCH_QUEUE_DEPTH));
+    if (status < 0) {
+        return status;
+    }
+
+    /* Misses waiting to be (re)submitted, as a stack of indices. */
+    size_t *pending = malloc(n_misses * sizeof(size_t));
+    if (pending == NULL) {
+        uring_destroy(&ring);
+        return -ENOMEM;
+    }
+    size_t n_pending = n_misses;
+    for (size_t i = 0; i < n_misses; i++) {
+        pending[i] = n_misses - i - 1;
+    }
+
+    size_t in_flight = 0;
+    while (n_pending > 0 || in_flight > 0) {
+        /* Fill the submission queue. */
+        while (n_pending > 0) {
+            batch_miss_t *miss = &misses[pending[n_pending - 1]];
+            uint8_t *data = miss->req->data;
+            if (!uring_prep_read(&ring,
+                                 miss->fd,
+                                 data + miss->done,
+                                 batch_read_len(miss),
+                                 miss->done,
+                                 pending[n_pending - 1])) {
+                break;
+            }
+            n_pending--;
+            in_flight++;
+        }
+
+        /* Submit, and wait for at least one completion. If the kernel won't
+           take any more right now, just wait for completions. */
+        status = uring_submit(&ring, 1);
+        if (status < 0 && status != -EAGAIN && status != -EBUSY) {
+            break;
+        }
+
+        /* Reap completions, queueing the remainder of short reads. Errors from
+           direct IO that buffered IO might not have are finished later. */
+        uint64_t i;
+        int32_t res;
+        while (uring_reap(&ring, &i, &res)) {
+            batch_miss_t *miss = &misses[i];
+            in_flight--;
+            if (res > 0) {
+                miss->done += res;
+                if (miss->done < miss->size) {
+                    if (miss->done % BATCH_BLOCK_SIZE != 0) {
+                        miss->buffered = true;
+                    }
+                    pending[n_pending++] = i;
+                }
+            } else if (res == 0) {
+                miss->size = miss->done;
+            } else if (res == -EINTR || res == -EAGAIN) {
+                pending[n_pending++] = i;
+            } else if (res == -EINVAL && !miss->buffered) {
+                miss->buffered = true;
+            } else {
+                miss->status = res;
+            }
+        }
+    }
+
+    /* If submission failed outright, drain whatever is still in flight and
+       fail the reads that never made it. */
+    while (in_flight > 0) {
+        uint64_t i;
+        int32_t res;
+        if (uring_submit(&ring, 1) < 0) {
+            break;
+        }
+        while (uring_reap(&ring, &i, &res)) {
+            in_flight--;
+            misses[i].status = res < 0 ? res : -EIO;
+        }
+    }
+    for (size_t p = 0; p < n_pending; p++) {
+        misses[pending[p]].status = status;
+    }
+
+    free(pending);
+    uring_destroy(&ring);
+
+    /* Direct IO was rejected for some files; finish them with buffered IO. */
+    for (size_t i = 0; i < n_misses; i++) {
+        if (misses[i].buffered && misses[i].status == 0) {
+            fcntl(misses[i].fd, F_SETFL, fcntl(misses[i].fd, F_GETFL) & ~__O_DIRECT);
+            batch_read_sync(&misses[i]);
+        }
+    }
+
+    return 0;
+}
+
+/* Read each of the N requests in REQS through CACHE, as cache_read would, but
+   as a batch. All hits are resolved (and unpinned) with a single pass over the
+   hash table, then every miss on the filesystem is read concurrently (through
+   io_uring where available, else a thread pool) to keep the device queue
+   full, and is then cached. Misses in the spill tier or owned by a peer are
+   only read once those are done, so that they don't hold up the rest. Each
+   request's RESULT is set to the bytes read, or a negative errno value
+   describing its failure. Each request's DATA must be block-aligned and hold
+   its MAX_SIZE rounded up to a multiple of DIRECT_IO_ALIGN, as for cache_read.
+
+   A request whose DATA is NULL is only served if it hits an uncompressed
+   entry, which is pinned into its VIEW (for the caller to cache_release)
+   rather than copied. Any other such request is left alone, uncounted, with
+   RESULT -ENODATA and VIEW's entry NULL, for the caller to read into a buffer
+   once it knows how many need one.
+
+   Returns 0 on success (even if individual requests fail), or negative errno
+   if the batch couldn't be processed at all. */
+int
+cache_read_batch(cache_t *c, cache_req_t *reqs, size_t n)
+{
+    if (n == 0) {
+        return 0;
+    }
+    batch_miss_t *misses = malloc(n * sizeof(batch_miss_t));
+    cache_req_t **deferred = malloc(n * sizeof(cache_req_t *));
+    if (misses == NULL || deferred == NULL) {
+        free(misses);
+        free(deferred);
+        return -ENOMEM;
+    }
+
+    /* Serve the hits, unpinning each as soon as it's copied, so that a flush
+       never waits on the rest of the batch. Misses' latency is that of the
+       whole batch, since they're read together. */
+    uint64_t start = cache_now_ns();
+    size_t n_missed = 0;
+    for (size_t i = 0; i < n; i++) {
+        cache_req_t *req = &reqs[i];
+        uint64_t hit_start = cache_now_ns();
+        hash_entry_t *entry = cache_pin(c, req->path, cache_hash(req->path));
+        if (req->data == NULL) {
+            req->view.entry = NULL;
+            req->result = -ENODATA;
+            if (entry != NULL && cache_view_entry(c, entry, &req->view) == 0) {
+                STAT_INC(c, n_accs);
+                cache_stat_hit(c, hit_start, req->view.size);
+                req->result = (ssize_t) req->view.size;
+            }
+            continue;
+        }
+        STAT_INC(c, n_accs);
+        if (entry == NULL) {
+            deferred[n_missed++] = req;
+            continue;
+        }
+        size_t size = 0;
+        int status = cache_copy_entry(c, entry, req->data, req->max_size, &size);
+        req->result = status < 0 ? (ssize_t) status : (ssize_t) size;
+        if (status == 0) {
+            cache_stat_hit(c, hit_start, size);
+        }
+        cache_unpin(entry);
+    }
+
+    /* Open each miss on the filesystem to figure out how much to read, and
+       set aside the rest (compacting DEFERRED in place). */
+    size_t n_misses = 0;
+    size_t n_deferred = 0;
+    for (size_t i = 0; i < n_missed; i++) {
+        cache_req_t *req = deferred[i];
+        uint64_t hash = cache_hash(req->path);
+        if ((c->spill != 0 && cache_contains_hashed(CACHE_SPILL(c), req->path, hash)) ||
+            cache_peer_remote(c, hash, cache_now_ns())) {
+            deferred[n_deferred++] = req;
+            continue;
+        }
+
+        /* Concurrent misses on the same files wait for this batch, but the
+           batch never waits on them: holding slots while waiting could
+           deadlock. */
+        bool waited = false;
+        cache_flight_t *flight = cache_flight_begin(c, hash, false, &waited);
+        ssize_t member = cache_member_read(c, req->path, hash, req->data, req->max_size, start, REUSE_UNKNOWN);
+        if (member != -ENODATA) {
+            cache_flight_end(flight);
+            req->result = member;
+            continue;
+        }
+        bool buffered = false;
+        struct stat st;
+        int fd = cache_open_file(req->path, req->max_size, &st, &buffered);
+        if (fd < 0) {
+            cache_flight_end(flight);
+            STAT_INC(c, n_fail);
+            req->result = fd;
+            continue;
+        }
+        misses[n_misses++] = (batch_miss_t) {
+            .req = req,
+            .fd = fd,
+            .size = st.st_size,
+            .done = 0,
+            .status = 0,
+            .buffered = buffered,
+            .flight = flight,
+        };
+    }
+
+    /* Read all the misses at once. */
+    if (n_misses > 0 && batch_read_uring(misses, n_misses) < 0) {
+        batch_read_threads(misses, n_misses);
+    }
+
+    /* Cache everything that was read successfully. */
+    for (size_t i = 0; i < n_misses; i++) {
+        batch_miss_t *miss = &misses[i];
+        close(miss->fd);
+        if (miss->buffered) {
+            STAT_INC(c, n_buffered);
+        }
+        if (miss->status < 0 || miss->size == 0) {
+            cache_flight_end(miss->flight);
+            STAT_INC(c, n_fail);
+            miss->req->result = miss->status < 0 ? miss->status : -EIO;
+            continue;
+        }
+        miss->req->result = (ssize_t) miss->size;
+        uint64_t hash = cache_hash(miss->req->path);
+        int status = cache_store_hashed(c, miss->req->path, hash, miss->req->data, miss->size);
+        cache_finish_miss(c, miss->req->path, hash, miss->req->data, miss->size, status, start);
+        cache_flight_end(miss->flight);
+    }
+
+    /* Now that the batch holds no slots, read what was set aside as any
+       other miss is, falling back to the filesystem. */
+    for (size_t i = 0; i < n_deferred; i++) {
+        cache_req_t *req = deferred[i];
+        req->result = cache_read_miss(c, req->path, req->data, req->max_size, start, NULL, REUSE_UNKNOWN);
+    }
+
+    free(misses);
+    free(deferred);
+
+    return 0;
+}
+
+/* Write every entry of CACHE to a snapshot file at PATH (replacing it
+   atomically), for cache_open to index later. Entries are pinned while being
+   written, so stores and reads may continue, but a flush will fail until the
+   save returns. On success returns the number of entries saved. On failure
+   returns negative errno. */
+int
+cache_save(cache_t *c, char *path)
+{
+    size_t epoch = atomic_load(&c->epoch);
+    if (epoch & 1) {
+        return -EBUSY;
+    }
+
+    /* Pin every live entry, so that the layout can't change while it's being
+       written. Entries the last flush detached are live until reclaimed. */
+    size_t n = MIN(atomic_load(&c->n_ht_entries), c->max_ht_entries);
+    if (n > 0) {
+        cache_await_reclaim(c, n - 1);
+    }
+    hash_entry_t **entries = malloc(MAX(n, 1) * sizeof(hash_entry_t *));
+    if (entries == NULL) {
+        return -ENOMEM;
+    }
+    size_t n_entries = 0;
+    for (size_t i = 0; i < n; i++) {
+        hash_entry_t *entry = &CACHE_ENTRIES(c)[i];
+        unsigned state = atomic_load(&entry->state);
+        if (ENTRY_LIVE(state) && cache_pin_entry(c, entry, epoch, ENTRY_GEN(state))) {
+            entries[n_entries++] = entry;
+        }
+    }
+
+    /* Lay out the file. Data is placed as the arena would place it. */
+    size_t keys_offset = sizeof(snapshot_header_t) + n_entries * sizeof(snapshot_record_t);
+    size_t keys_size = 0;
+    for (size_t i = 0; i < n_entries; i++) {
+        keys_size += strlen(cache_key(c, entries[i])) + 1;
+    }
+    size_t data_offset = (keys_offset + keys_size + SNAPSHOT_ALIGN - 1) & ~((size_t) SNAPSHOT_ALIGN - 1);
+    uint8_t *meta = calloc(1, data_offset);
+    if (meta == NULL) {
+        for (size_t i = 0; i < n_entries; i++) {
+            cache_unpin(entries[i]);
+        }
+        free(entries);
+        return -ENOMEM;
+    }
+    snapshot_record_t *records = (snapshot_record_t *) (meta + sizeof(snapshot_header_t));
+    size_t key = keys_offset, data_size = 0;
+    for (size_t i = 0; i < n_entries; i++) {
+        records[i].key = key;
+        records[i].offset = data_offset + data_size;
+        records[i].size = entries[i]->size;
+        records[i].flags = (ENTRY_COMPRESSED(entries[i]) ? SNAPSHOT_LZ4 : 0) |
+                           (entries[i]->hash & HASH_DERIVED ? SNAPSHOT_DERIVED : 0);
+        strcpy((char *) meta + key, cache_key(c, entries[i]));
+        key += strlen(cache_key(c, entries[i])) + 1;
+        data_size += (entries[i]->size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    }
+    *(snapshot_header_t *) meta = (snapshot_header_t) {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .n_entries = n_entries,
+        .keys_offset = keys_offset,
+        .keys_size = keys_size,
+        .data_offset = data_offset,
+        .data_size = data_size,
+    };
+
+    /* Write everything to a temporary file, so that a failed or concurrent save
+       never leaves a partial snapshot at PATH. Entries are unpinned as soon as
+       they're written. */
+    int status = 0;
+    char *tmp = malloc(strlen(path) + 16);
+    int fd = -1;
+    if (tmp == NULL) {
+        status = -ENOMEM;
+    } else {
+        sprintf(tmp, "%s.%d.tmp", path, getpid());
+        if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            status = -errno;
+        }
+    }
+    if (status == 0) {
+        status = write_full(fd, meta, data_offset, 0);
+    }
+    for (size_t i = 0; i < n_entries; i++) {
+        if (status < 0) {
+            cache_unpin(entries[i]);
+            continue;
+        }
+        uint8_t *ptr;
+        if ((status = cache_map_entry(c, entries[i], &ptr)) == 0) {
+            status = write_full(fd, ptr, entries[i]->size, records[i].offset);
+            cache_unmap_entry(c, entries[i], ptr);
+        }
+        cache_unpin(entries[i]);
+    }
+    if (status == 0 && (ftruncate(fd, data_offset + data_size) < 0 || fsync(fd) < 0)) {
+        status = -errno;
+    }
+    if (fd >= 0) {
+        close(fd);
+        if (status == 0 && rename(tmp, path) < 0) {
+            status = -errno;
+        }
+        if (status < 0) {
+            unlink(tmp);
+        }
+    }
+
+    free(tmp);
+    free(meta);
+    free(entries);
+
+    return status < 0 ? status : (int) n_entries;
+}
+
+/* Index SIZE bytes at OFFSET in CACHE's snapshot as the data for PATH, with
+   hash HASH and the OFFSET_* flags FLAGS. The caller must be registered as a
+   writer. Snapshot entries count towards the cache's size like any other, but
+   never evict to make room. */
+static int
+cache_insert_snapshot(cache_t *c, char *path, uint64_t hash, size_t offset, size_t size, uint64_t flags)
+{
+    int64_t n = cache_new_entry(c, path, hash);
+    if (n < 0) {
+        return (int) n;
+    }
+    size_t used = atomic_fetch_add(&c->used, size);
+    if (used + size > c->size) {
+        atomic_fetch_sub(&c->used, size);
+        cache_discard_entry(c, n, true);
+        return -ENOMEM;
+    }
+
+    hash_entry_t *entry = &CACHE_ENTRIES(c)[n];
+    entry->size = size;
+    entry->offset = OFFSET_SNAPSHOT | flags | offset;
+    int status = cache_commit_entry(c, entry);
+    if (status < 0) {
+        cache_discard_space(c, entry, size);
+    }
+
+    return status;
+}
+
+/* Map the snapshot at PATH, written by cache_save, into CACHE and index its
+   entries. Their data isn't read; it's paged in from the file as it's hit.
+   Entries that are already cached, or too large, are skipped, and indexing
+   stops once the cache is full. Processes must be forked after the snapshot is
+   opened to share it, so named caches can't open snapshots (-ENOTSUP). A
+   cache has at most one snapshot open. On success returns the number of
+   entries indexed. On failure returns negative errno. */
+int
+cache_open(cache_t *c, char *path)
+{
+    if (c->name[0] != '\0') {
+        return -ENOTSUP;
+    }
+    if (c->snap != NULL) {
+        return -EBUSY;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int status = -errno;
+        close(fd);
+        return status;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(snapshot_header_t)) {
+        close(fd);
+        return -EINVAL;
+    }
+    uint8_t *snap = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snap == MAP_FAILED) {
+        return -ENOMEM;
+    }
+
+    /* Make sure the layout is self-consistent, so that records can be checked
+       against it. */
+    snapshot_header_t *hdr = (snapshot_header_t *) snap;
+    if (hdr->magic != SNAPSHOT_MAGIC ||
+        hdr->version != SNAPSHOT_VERSION ||
+        hdr->n_entries > (size - sizeof(snapshot_header_t)) / sizeof(snapshot_record_t) ||
+        hdr->keys_offset != sizeof(snapshot_header_t) + hdr->n_entries * sizeof(snapshot_record_t) ||
+        hdr->keys_size > size - hdr->keys_offset ||
+        hdr->data_offset < hdr->keys_offset + hdr->keys_size ||
+        hdr->data_offset > size ||
+        hdr->data_size > size - hdr->data_offset) {
+        munmap(snap, size);
+        return -EINVAL;
+    }
+
+    int status = cache_begin_write(c);
+    if (status < 0) {
+        munmap(snap, size);
+        return status;
+    }
+    c->snap = snap;
+    c->snap_size = size;
+
+    snapshot_record_t *records = (snapshot_record_t *) (snap + sizeof(snapshot_header_t));
+    uint64_t keys_end = hdr->keys_offset + hdr->keys_size;
+    uint64_t data_end = hdr->data_offset + hdr->data_size;
+    int n_indexed = 0;
+    for (size_t i = 0; i < hdr->n_entries; i++) {
+        snapshot_record_t *rec = &records[i];
+        if (rec->key < hdr->keys_offset || rec->key >= keys_end ||
+            memchr(snap + rec->key, '\0', keys_end - rec->key) == NULL ||
+            rec->offset < hdr->data_offset || rec->offset > data_end ||
+            rec->size == 0 || rec->size > data_end - rec->offset ||
+            rec->size > c->max_item_size || (rec->flags & ~(SNAPSHOT_LZ4 | SNAPSHOT_DERIVED))) {
+            continue;
+        }
+
+        /* Compressed files must fit once decompressed, too. */
+        uint64_t flags = 0;
+        if (rec->flags & SNAPSHOT_LZ4) {
+            uint64_t raw;
+            if (rec->size <= LZ4_HEADER_SIZE) {
+                continue;
+            }
+            memcpy(&raw, snap + rec->offset, LZ4_HEADER_SIZE);
+            if (raw > c->max_item_size) {
+                continue;
+            }
+            flags = OFFSET_LZ4;
+        }
+
+        char *key = (char *) snap + rec->key;
+        uint64_t hash = rec->flags & SNAPSHOT_DERIVED ? cache_derived_hash(key) : cache_hash(key);
+        status = cache_insert_snapshot(c, key, hash, rec->offset, rec->size, flags);
+        if (status == 0) {
+            n_indexed++;
+        } else if (status != -EEXIST) {
+            break;
+        }
+    }
+    cache_end_write(c);
+
+    return n_indexed;
+}
+
+/* Add a spill tier of SIZE bytes to CACHE, in a file in directory DIR (ideally
+   on local NVMe). Files that miss but don't fit in memory are appended to it
+   a whole number of blocks at a time, and later misses on them are read back
+   with direct IO, rather than from the (likely remote) filesystem they came
+   from. The tier has its own index and space, sized for files of the same
+   average size as CACHE's. The file is unlinked as soon as it's created, so it
+   is only reachable by this process and processes forked afterwards, and goes
+   away with them. Named caches can't spill (-ENOTSUP). Not thread safe. On
+   success returns 0. On failure returns negative errno. */
+int
+cache_spill(cache_t *c, char *dir, size_t size)
+{
+    if (c->name[0] != '\0') {
+        return -ENOTSUP;
+    }
+    if (c->spill != 0) {
+        return -EEXIST;
+    }
+    size &= ~((size_t) SPILL_ALIGN - 1);
+    if (size == 0) {
+        return -EINVAL;
+    }
+
+    /* Some filesystems (e.g. tmpfs) don't do direct IO, in which case the
+       spill file is read through the page cache instead. */
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/minio-%016lx.spill", dir, c->id) >= (int) sizeof(path)) {
+        return -ENAMETOOLONG;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return -errno;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | __O_DIRECT);
+
+    /* Reserve the space up front where the filesystem can, so that the tier
+       doesn't run out of disk halfway. */
+    int status = 0;
+    if (fallocate(fd, 0, 0, size) < 0 && errno != EOPNOTSUPP) {
+        status = -errno;
+        close(fd);
+        return status;
+    }
+
+    /* The tier is indexed by a cache_t of its own, with no data in memory. */
+    cache_t *spill = mmap_alloc(sizeof(cache_t));
+    if (spill == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    status = cache_init(spill, size, c->max_item_size, 2 * c->size / c->max_ht_entries, 0,
+                        POLICY_MINIO, CACHE_ARENA | CACHE_SPILL_TIER);
+    if (status < 0) {
+        cache_destroy(spill);
+        mmap_free(spill, sizeof(cache_t));
+        close(fd);
+        return status;
+    }
+    c->spill = (uint8_t *) spill - (uint8_t *) c;
+    c->spill_fd = fd;
+
+    return 0;
+}
+
+/* A connection accepted by a peer tier's server, in slot SLOT of its CONNS. */
+typedef struct {
+    cache_peers_t *peers;
+    int            slot;
+} peer_serve_args_t;
+
+/* Insert registered path ID, with hash HASH, into PEERS' path index, which
+   must have room for it. */
+static void
+cache_peer_index_insert(cache_peers_t *peers, size_t id, uint64_t hash)
+{
+    size_t mask = peers->path_index_size - 1;
+    size_t i = hash & mask;
+    while (peers->path_index[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    peers->path_index[i] = (uint32_t) id + 1;
+}
+
+/* Bring PEERS' path index up to date with the paths registered with its
+   cache, growing it to stay at most half full. The caller must hold
+   PEERS->path_lock. Returns false if it ran out of memory. */
+static bool
+cache_peer_index_update(cache_peers_t *peers)
+{
+    cache_t *c = peers->cache;
+    size_t n = atomic_load(&c->n_paths);
+    if (2 * n > peers->path_index_size) {
+        size_t size = MAX(peers->path_index_size, 1024);
+        while (2 * n > size) {
+            size <<= 1;
+        }
+        uint32_t *index = calloc(size, sizeof(uint32_t));
+        if (index == NULL) {
+            return false;
+        }
+        free(peers->path_index);
+        peers->path_index = index;
+        peers->path_index_size = size;
+        peers->n_indexed = 0;
+    }
+    for (; peers->n_indexed < n; peers->n_indexed++) {
+        cache_peer_index_insert(peers, peers->n_indexed, CACHE_PATHS(c)[peers->n_indexed].hash);
+    }
+
+    return true;
+}
+
+/* Check if PATH, with hash HASH, is registered with the cache PEERS serves.
+   Paths registered since the last check are indexed as they're needed. */
+static bool
+cache_peer_registered(cache_peers_t *peers, char *path, uint64_t hash)
+{
+    cache_t *c = peers->cache;
+    bool found = false;
+    pthread_mutex_lock(&peers->path_lock);
+    for (int pass = 0; pass < 2 && !found; pass++) {
+        if (pass == 1 && (atomic_load(&c->n_paths) == peers->n_indexed ||
+                          !cache_peer_index_update(peers))) {
+            break;
+        }
+        size_t mask = peers->path_index_size - 1;
+        for (size_t i = hash & mask; peers->path_index_size > 0 && peers->path_index[i] != 0; i = (i + 1) & mask) {
+            size_t id = peers->path_index[i] - 1;
+            if (CACHE_PATHS(c)[id].hash == hash && strcmp(cache_id_path(c, id), path) == 0) {
+                found = true;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&peers->path_lock);
+
+    return found;
+}
+
+/* Check if a peer may have PATH read through the cache PEERS serves: only
+   paths this node owns are served, and of those only ones that are cached, or
+   registered or indexed in a shard here, so that a peer can't have the node
+   read any file it likes. */
+static bool
+cache_peer_serves(cache_peers_t *peers, char *path)
+{
+    cache_t *c = peers->cache;
+    uint64_t hash = cache_hash(path);
+    if (cache_peer_owner(peers, hash) != peers->self) {
+        return false;
+    }
+
+    return cache_contains_hashed(c, path, hash) ||
+           (c->members != 0 && cache_contains_hashed(CACHE_MEMBERS(c), path, hash)) ||
+           cache_peer_registered(peers, path, hash);
+}
+
+/* Check the token of request REQ against PEERS', in constant time. */
+static bool
+cache_peer_token_ok(cache_peers_t *peers, peer_request_t *req)
+{
+    uint8_t diff = 0;
+    for (int i = 0; i < PEER_TOKEN_LEN; i++) {
+        diff |= (uint8_t) (req->token[i] ^ peers->token[i]);
+    }
+
+    return diff == 0;
+}
+
+/* Serve requests from one peer connection (ARG, a peer_serve_args_t) until it
+   closes or the tier stops, or sends a request without the tier's token. Each
+   request for a path this node serves is read through the cache as any other
+   read is, so hits are sent straight out of the cache, and misses are read
+   from the filesystem and cached here, at their owner. Others get
+   -ENODATA. */
+static void *
+cache_peer_serve(void *arg)
+{
+    peer_serve_args_t args = *(peer_serve_args_t *) arg;
+    free(arg);
+    cache_peers_t *peers = args.peers;
+    cache_t *c = peers->cache;
+    int fd = peers->conns[args.slot];
+    peer_serving = true;
+
+    char key[PATH_MAX];
+    uint8_t *buf = NULL;
+    size_t buf_size = (c->max_item_size + DIRECT_IO_ALIGN - 1) & ~((size_t) DIRECT_IO_ALIGN - 1);
+    if (posix_memalign((void **) &buf, DIRECT_IO_ALIGN, buf_size) != 0) {
+        buf = NULL;
+    }
+    while (buf != NULL && !atomic_load(&peers->stopping)) {
+        peer_request_t req;
+        if (recv_full(fd, &req, sizeof(req)) < 0 || req.magic != PEER_MAGIC || !cache_peer_token_ok(peers, &req) ||
+            req.len >= PATH_MAX || recv_full(fd, key, req.len) < 0) {
+            break;
+        }
+        key[req.len] = '\0';
+
+        cache_view_t view = {.entry = NULL};
+        ssize_t n = -ENODATA;
+        if (cache_peer_serves(peers, key)) {
+            n = cache_read_view(c, key, buf, MIN(req.max_size, c->max_item_size), &view);
+        }
+        peer_reply_t reply = {.size = n};
+        int status = send_full(fd, &reply, sizeof(reply));
+        if (status == 0 && n > 0) {
+            status = send_full(fd, view.ptr != NULL ? view.ptr : buf, n);
+        }
+        cache_release(c, &view);
+        if (status < 0) {
+            break;
+        }
+    }
+    free(buf);
+
+    pthread_mutex_lock(&peers->lock);
+    close(fd);
+    peers->conns[args.slot] = -1;
+    pthread_mutex_unlock(&peers->lock);
+    atomic_fetch_sub(&peers->n_serving, 1);
+
+    return NULL;
+}
+
+/* Accept connections from peers (ARG, a cache_peers_t), serving each on a
+   thread of its own, until the tier stops. */
+static void *
+cache_peer_accept(void *arg)
+{
+    cache_peers_t *peers = arg;
+    for (;;) {
+        int fd = accept4(peers->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (atomic_load(&peers->stopping)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        if (fd < 0) {
+            /* Out of descriptors (say) may pass, so back off and retry. */
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(1000);
+            }
+            continue;
+        }
+        socket_configure(fd, 0);
+
+        pthread_mutex_lock(&peers->lock);
+        int slot = -1;
+        for (int i = 0; i < MAX_PEER_CONNS && slot < 0; i++) {
+            if (peers->conns[i] < 0) {
+                slot = i;
+                peers->conns[i] = fd;
+            }
+        }
+        pthread_mutex_unlock(&peers->lock);
+        if (slot < 0) {
+            close(fd);
+            continue;
+        }
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        peer_serve_args_t *args = malloc(sizeof(peer_serve_args_t));
+        atomic_fetch_add(&peers->n_serving, 1);
+        if (args != NULL) {
+            *args = (peer_serve_args_t) {.peers = peers, .slot = slot};
+        }
+        if (args == NULL || pthread_create(&thread, &attr, cache_peer_serve, args) != 0) {
+            atomic_fetch_sub(&peers->n_serving, 1);
+            pthread_mutex_lock(&peers->lock);
+            peers->conns[slot] = -1;
+            pthread_mutex_unlock(&peers->lock);
+            close(fd);
+            free(args);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    return NULL;
+}
+
+/* Resolve SPEC, a "host:port" address (with IPv6 hosts in brackets), into
+   ADDR and *LEN. Returns 0 on success, -EINVAL if SPEC is malformed, or
+   -EHOSTUNREACH if the host can't be resolved. */
+static int
+cache_peer_resolve(char *spec, struct sockaddr_storage *addr, socklen_t *len)
+{
+    char host[256];
+    char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || colon[1] == '\0' || (size_t) (colon - spec) >= sizeof(host)) {
+        return -EINVAL;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    char *name = host;
+    if (host[0] == '[' && host[colon - spec - 1] == ']') {
+        host[colon - spec - 1] = '\0';
+        name = host + 1;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    if (getaddrinfo(name, colon + 1, &hints, &res) != 0) {
+        return -EHOSTUNREACH;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/* Stop serving CACHE's peer tier, if it has one and this process serves it,
+   waiting for requests in progress, and free it. */
+static void
+cache_peers_stop(cache_t *c)
+{
+    cache_peers_t *peers = c->peers;
+    if (peers == NULL || peers->pid != getpid()) {
+        return;
+    }
+
+    /* Shutting the sockets down wakes threads blocked on them. */
+    atomic_store(&peers->stopping, true);
+    shutdown(peers->listen_fd, SHUT_RDWR);
+    pthread_join(peers->acceptor, NULL);
+    close(peers->listen_fd);
+    pthread_mutex_lock(&peers->lock);
+    for (int i = 0; i < MAX_PEER_CONNS; i++) {
+        if (peers->conns[i] >= 0) {
+            shutdown(peers->conns[i], SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&peers->lock);
+    while (atomic_load(&peers->n_serving) > 0) {
+        usleep(1000);
+    }
+    pthread_mutex_destroy(&peers->lock);
+    pthread_mutex_destroy(&peers->path_lock);
+    free(peers->path_index);
+    free(peers);
+    c->peers = NULL;
+}
+
+/* Add a peer tier to CACHE: the caches of the N nodes at PEERS ("host:port"
+   addresses, listed identically and in the same order on every node), of
+   which this node is PEERS[SELF]. Each path is owned by one node, chosen by
+   rendezvous hashing its path over the nodes' addresses. Misses on paths
+   another node owns are read from that node's cache over TCP, which reads and
+   caches them itself if need be, rather than from the filesystem, so that
+   every node's cache holds a different part of the dataset. Misses fall back
+   to being read (and cached) here while the owner doesn't answer. CACHE is
+   served to the other nodes at PEERS[SELF], by threads of this process, until
+   it's destroyed, but only to requests carrying TOKEN (a secret shared by
+   every node, of fewer than PEER_TOKEN_LEN characters), and only for paths
+   this node owns that are cached, or registered or indexed in a shard here.
+   Named caches can't have peers (-ENOTSUP). Not thread safe. On success
+   returns 0. On failure returns negative errno. */
+int
+cache_add_peers(cache_t *c, char **peers, int n, int self, char *token)
+{
+    if (c->name[0] != '\0') {
+        return -ENOTSUP;
+    }
+    if (c->peers != NULL) {
+        return -EEXIST;
+    }
+    if (n < 1 || n > MAX_PEERS || self < 0 || self >= n || token == NULL || token[0] == '\0' ||
+        strlen(token) >= PEER_TOKEN_LEN) {
+        return -EINVAL;
+    }
+
+    cache_peers_t *p = calloc(1, sizeof(cache_peers_t));
+    if (p == NULL) {
+        return -ENOMEM;
+    }
+    p->cache = c;
+    p->n_peers = n;
+    p->self = self;
+    p->pid = getpid();
+    strcpy(p->token, token);
+    for (int i = 0; i < MAX_PEER_CONNS; i++) {
+        p->conns[i] = -1;
+    }
+    int status = 0;
+    for (int i = 0; i < n && status == 0; i++) {
+        status = cache_peer_resolve(peers[i], &p->addrs[i], &p->addr_lens[i]);
+        p->ids[i] = utils_hash_str(peers[i]);
+    }
+    if (status < 0) {
+        free(p);
+        return status;
+    }
+
+    /* Listen on this node's address alone, not on every interface. */
+    int one = 1;
+    p->listen_fd = socket(p->addrs[self].ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (p->listen_fd < 0 ||
+        setsockopt(p->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(p->listen_fd, (struct sockaddr *) &p->addrs[self], p->addr_lens[self]) < 0 ||
+        listen(p->listen_fd, MAX_PEER_CONNS) < 0) {
+        status = -errno;
+        if (p->listen_fd >= 0) {
+            close(p->listen_fd);
+        }
+        free(p);
+        return status;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_mutex_init(&p->path_lock, NULL);
+    if ((status = pthread_create(&p->acceptor, NULL, cache_peer_accept, p)) != 0) {
+        pthread_mutex_destroy(&p->lock);
+        pthread_mutex_destroy(&p->path_lock);
+        close(p->listen_fd);
+        free(p);
+        return -status;
+    }
+    c->peers = p;
+
+    return 0;
+}
+
+/* Parse the LEN-byte numeric tar header field at FIELD into *VALUE. Fields
+   hold octal digits, or (for values too large for them) big-endian base-256
+   with the top bit of the first byte set. Returns whether it's well-formed. */
+static bool
+tar_number(const uint8_t *field, size_t len, uint64_t *value)
+{
+    *value = 0;
+    if (field[0] & 0x80) {
+        if (field[0] != 0x80) {
+            return false;
+        }
+        for (size_t i = 1; i < len; i++) {
+            if (*value >> 56) {
+                return false;
+            }
+            *value = (*value << 8) | field[i];
+        }
+        return true;
+    }
+
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        *value = (*value << 3) | (field[i] - '0');
+    }
+
+    return i == len || field[i] == ' ' || field[i] == '\0';
+}
+
+/* Returns whether tar header H is intact: its checksum is the sum of its
+   bytes, counting the checksum field itself as spaces. */
+static bool
+tar_header_ok(const uint8_t *h)
+{
+    uint64_t sum = 0, expected;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    }
+
+    return tar_number(h + 148, 8, &expected) && sum == expected;
+}
+
+/* Find the path in the SIZE bytes of pax extended header records at RECORDS
+   (each "<length> <key>=<value>\n"), and copy it into NAME, which holds MAX
+   bytes. Returns whether there was one that fit. */
+static bool
+tar_pax_path(const uint8_t *records, size_t size, char *name, size_t max)
+{
+    while (size > 0) {
+        size_t len = 0, i = 0;
+        while (i < size && records[i] >= '0' && records[i] <= '9') {
+            len = len * 10 + (records[i++] - '0');
+        }
+        if (len == 0 || len > size || i >= len || records[i] != ' ' || records[len - 1] != '\n') {
+            return false;
+        }
+        const char *record = (const char *) records + i + 1;
+        size_t record_len = len - i - 2;
+        if (record_len > 5 && memcmp(record, "path=", 5) == 0) {
+            if (record_len - 5 >= max) {
+                return false;
+            }
+            memcpy(name, record + 5, record_len - 5);
+            name[record_len - 5] = '\0';
+            return true;
+        }
+        records += len;
+        size -= len;
+    }
+
+    return false;
+}
+
+/* Index a member of shard ID in CACHE's member index by KEY, as SIZE bytes at
+   OFFSET in the shard. Returns 0 on success (or if it's already indexed), or
+   negative errno. */
+static int
+cache_index_member(cache_t *c, char *key, size_t id, size_t offset, size_t size)
+{
+    cache_t *members = CACHE_MEMBERS(c);
+    int status = cache_begin_write(members);
+    if (status < 0) {
+        return status;
+    }
+    int64_t n = cache_new_entry(members, key, cache_hash(key));
+    if (n >= 0) {
+        hash_entry_t *entry = &CACHE_ENTRIES(members)[n];
+        entry->size = size;
+        entry->offset = ((uint64_t) id << MEMBER_SHARD_SHIFT) | offset;
+        n = cache_commit_entry(members, entry);
+    }
+    cache_end_write(members);
+
+    return n == -EEXIST ? 0 : n < 0 ? (int) n : 0;
+}
+
+/* Add the tar shard (e.g. a WebDataset shard) at PATH to CACHE: index each of
+   its members by the shard's path and the member's name, joined by a slash
+   (e.g. "/data/shard-0.tar/0001.jpg"), so that it can be read through the
+   cache like any other file. The shard is read sequentially in large extents
+   as it's indexed, and each member is cached as it goes by, for as long as they
+   fit; members that aren't cached are read back out of the shard on a miss.
+   The index outlives flushes. Named caches can't index shards (-ENOTSUP). Not
+   thread safe. On success returns the number of members indexed. On failure
+   returns negative errno: -EINVAL if PATH isn't a valid tar file, or -ENOSPC
+   if the index is full, in which case the members indexed so far remain. */
+int
+cache_add_shard(cache_t *c, char *path)
+{
+    if (c->name[0] != '\0') {
+        return -ENOTSUP;
+    }
+
+    /* Members are indexed by a cache_t of their own, with no data in memory,
+       created with the first shard. */
+    int status;
+    if (c->members == 0) {
+        cache_t *members = mmap_alloc(sizeof(cache_t));
+        if (members == NULL) {
+            return -ENOMEM;
+        }
+        size_t avg = MAX(2 * c->size / (SHARD_MEMBERS_PER_ENTRY * c->max_ht_entries), 1);
+        status = cache_init(members, c->size, c->max_item_size, avg, MAX_SHARDS, POLICY_MINIO,
+                            CACHE_ARENA | CACHE_SPILL_TIER);
+        if (status < 0) {
+            cache_destroy(members);
+            mmap_free(members, sizeof(cache_t));
+            return status;
+        }
+        c->members = (uint8_t *) members - (uint8_t *) c;
+    }
+
+    bool buffered = false;
+    struct stat st;
+    int fd = cache_open_file(path, SIZE_MAX, &st, &buffered);
+    if (fd < 0) {
+        return fd;
+    }
+
+    /* The buffer holds an extent, and at least any cacheable member along with
+       its header. */
+    size_t cap = MAX(SHARD_EXTENT, c->max_item_size + TAR_BLOCK + DIRECT_IO_ALIGN);
+    cap = (cap + DIRECT_IO_ALIGN - 1) & ~((size_t) DIRECT_IO_ALIGN - 1);
+    uint8_t *buf;
+    if (posix_memalign((void **) &buf, DIRECT_IO_ALIGN, cap) != 0) {
+        close(fd);
+        return -ENOMEM;
+    }
+    size_t id;
+    status = cache_register(CACHE_MEMBERS(c), &path, 1, &id);
+    if (status == 0 && id >= MAX_SHARDS) {
+        status = -ENOSPC;
+    }
+
+    size_t chunk = read_chunk_size(st.st_blksize);
+    size_t file_size = st.st_size, base = 0, len = 0, pos = 0;
+    char name[PATH_MAX], key[PATH_MAX];
+    bool long_name = false;
+    int n_members = 0;
+    while (status == 0 && pos + TAR_BLOCK <= file_size) {
+        /* Read the next extent once the buffer runs out, starting from the
+           block holding the next header. */
+        if (pos + TAR_BLOCK > base + len) {
+            base = pos & ~((size_t) DIRECT_IO_ALIGN - 1);
+            ssize_t n = read_full(fd, buf, MIN(cap, file_size - base), base, chunk, &buffered);
+            if (n < 0) {
+                status = (int) n;
+                break;
+            }
+            len = n;
+            if (pos + TAR_BLOCK > base + len) {
+                status = -EIO;
+                break;
+            }
+        }
+
+        /* The archive ends with zero blocks. */
+        uint8_t *h = buf + (pos - base);
+        uint64_t size;
+        if (h[0] == '\0') {
+            break;
+        }
+        if (!tar_header_ok(h) || !tar_number(h + 124, 12, &size) || size > file_size - pos - TAR_BLOCK) {
+            status = -EINVAL;
+            break;
+        }
+
+        /* Pull the rest of the member in too, if it can fit. */
+        size_t data = pos + TAR_BLOCK;
+        if (data + size > base + len && data + size - (pos & ~((size_t) DIRECT_IO_ALIGN - 1)) <= cap) {
+            base = pos & ~((size_t) DIRECT_IO_ALIGN - 1);
+            ssize_t n = read_full(fd, buf, MIN(cap, file_size - base), base, chunk, &buffered);
+            if (n < 0) {
+                status = (int) n;
+                break;
+            }
+            len = n;
+            h = buf + (pos - base);
+        }
+        bool resident = data + size <= base + len;
+
+        /* GNU and pax archives give long names in a header of their own,
+           applying to the next member. */
+        char type = h[156];
+        if (type == 'L' || type == 'x') {
+            if (type == 'L' && resident && size < sizeof(name)) {
+                memcpy(name, buf + (data - base), size);
+                name[size] = '\0';
+                long_name = true;
+            } else if (type == 'x' && resident) {
+                long_name = tar_pax_path(buf + (data - base), size, name, sizeof(name));
+            }
+        } else if (type == '0' || type == '\0' || type == '7') {
+            int key_len;
+            if (long_name) {
+                key_len = snprintf(key, sizeof(key), "%s/%s", path, name);
+            } else if (memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0') {
+                key_len = snprintf(key, sizeof(key), "%s/%.155s/%.100s", path, h + 345, h);
+            } else {
+                key_len = snprintf(key, sizeof(key), "%s/%.100s", path, h);
+            }
+
+            /* Empty members can't be cached, as empty files can't be. */
+            if (size > 0 && key_len < (int) sizeof(key)) {
+                if ((status = cache_index_member(c, key, id, data, size)) < 0) {
+                    break;
+                }
+                n_members++;
+                if (resident && size <= c->max_item_size) {
+                    cache_store(c, key, buf + (data - base), size);
+                }
+            }
+            long_name = false;
+        } else if (type != 'g') {
+            long_name = false;
+        }
+        pos = data + ((size + TAR_BLOCK - 1) & ~((size_t) TAR_BLOCK - 1));
+    }
+    close(fd);
+    free(buf);
+    if (buffered) {
+        STAT_INC(c, n_buffered);
+    }
+
+    return status < 0 ? status : n_members;
+}
+
+/* Sum CACHE's statistics across every shard into STATS. Concurrent updates may
+   or may not be included. */
+void
+cache_get_stats(cache_t *c, cache_stats_t *stats)
+{
+    memset(stats, 0, sizeof(cache_stats_t));
+    for (int i = 0; i < N_STAT_SHARDS; i++) {
+        cache_stat_shard_t *shard = &CACHE_STATS(c)[i];
+        stats->n_accs += atomic_load_explicit(&shard->n_accs, memory_order_relaxed);
+        stats->n_hits += atomic_load_explicit(&shard->n_hits, memory_order_relaxed);
+        stats->n_miss_cold += atomic_load_explicit(&shard->n_miss_cold, memory_order_relaxed);
+        stats->n_miss_capacity += atomic_load_explicit(&shard->n_miss_capacity, memory_order_relaxed);
+        stats->n_fail += atomic_load_explicit(&shard->n_fail, memory_order_relaxed);
+        stats->n_evictions += atomic_load_explicit(&shard->n_evictions, memory_order_relaxed);
+        stats->n_bytes_raw += atomic_load_explicit(&shard->n_bytes_raw, memory_order_relaxed);
+        stats->n_bytes_stored += atomic_load_explicit(&shard->n_bytes_stored, memory_order_relaxed);
+        stats->n_reads_local += atomic_load_explicit(&shard->n_reads_local, memory_order_relaxed);
+        stats->n_reads_remote += atomic_load_explicit(&shard->n_reads_remote, memory_order_relaxed);
+        stats->n_spill_hits += atomic_load_explicit(&shard->n_spill_hits, memory_order_relaxed);
+        stats->n_spill_stores += atomic_load_explicit(&shard->n_spill_stores, memory_order_relaxed);
+        stats->n_peer_hits += atomic_load_explicit(&shard->n_peer_hits, memory_order_relaxed);
+        stats->n_peer_fails += atomic_load_explicit(&shard->n_peer_fails, memory_order_relaxed);
+        stats->n_buffered += atomic_load_explicit(&shard->n_buffered, memory_order_relaxed);
+        stats->n_coalesced += atomic_load_explicit(&shard->n_coalesced, memory_order_relaxed);
+        stats->n_rejected += atomic_load_explicit(&shard->n_rejected, memory_order_relaxed);
+        for (int h = 0; h < N_HISTS; h++) {
+            for (int b = 0; b < N_HIST_BUCKETS; b++) {
+                stats->hists[h].buckets[b] += atomic_load_explicit(&shard->hists[h].buckets[b], memory_order_relaxed);
+            }
+            stats->hists[h].sum += atomic_load_explicit(&shard->hists[h].sum, memory_order_relaxed);
+        }
+    }
+
+    /* Arena space held by slabs (or, for the bump allocator, handed out) versus
+       used by entries gives the arena's fragmentation. */
+    if (c->slabs != 0) {
+        stats->arena_held = *(volatile size_t *) &c->slabs_held * c->slab_size;
+    } else if (c->flags & CACHE_ARENA) {
+        stats->arena_held = atomic_load(&c->used);
+    }
+}
+
+/* Zero CACHE's statistics. Updates racing with the reset may survive it. */
+void
+cache_reset_stats(cache_t *c)
+{
+    for (int i = 0; i < N_STAT_SHARDS; i++) {
+        cache_stat_shard_t *shard = &CACHE_STATS(c)[i];
+        atomic_store_explicit(&shard->n_accs, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_hits, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_miss_cold, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_miss_capacity, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_fail, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_evictions, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_bytes_raw, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_bytes_stored, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_reads_local, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_reads_remote, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_spill_hits, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_spill_stores, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_peer_hits, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_peer_fails, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_buffered, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_coalesced, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->n_rejected, 0, memory_order_relaxed);
+        for (int h = 0; h < N_HISTS; h++) {
+            for (int b = 0; b < N_HIST_BUCKETS; b++) {
+                atomic_store_explicit(&shard->hists[h].buckets[b], 0, memory_order_relaxed);
+            }
+            atomic_store_explicit(&shard->hists[h].sum, 0, memory_order_relaxed);
+        }
+    }
+}
+
+/* How long a flush waits for pins taken before it began to be dropped. Reads
+   only pin an entry for as long as they copy it, so pins that outlast this
+   belong to views (or a save). */
+#define FLUSH_DRAIN_NS (50 * 1000 * 1000)
+
+/* Clear the cache's hash table and reset used bytes to zero, and then do the
+   same for its spill tier, if any. Lookups miss and stores are turned away
+   only while a fresh index is swapped in; the entries flushed (and their shm
+   objects) are reclaimed afterwards, in the background, and stores reusing
+   them wait their turn. Fails with -EBUSY (leaving the cache untouched) if
+   any entry is still pinned once reads in progress have finished, as it is
+   by a view. On success returns 0. */
+int
+cache_flush(cache_t *c)
+{
+    /* Under an evicting policy the flush holds the eviction lock, like any
+       writer, so that it can be recovered from in the same way. */
+    if (c->policy != POLICY_MINIO) {
+        int status = cache_lock_evict(c);
+        if (status < 0) {
+            return status;
+        }
+    }
+
+    /* Enter the flushing state by making the epoch odd, which turns away new
+       lookups and stores. Only one flush can be in progress at a time, and the
+       last one's reclaim has to be over, since its index is the one swapped
+       in. */
+    size_t epoch;
+    for (;;) {
+        cache_await_reclaim(c, SIZE_MAX);
+        epoch = atomic_load(&c->epoch);
+        if ((epoch & 1) || !atomic_compare_exchange_weak(&c->epoch, &epoch, epoch + 1)) {
+            sched_yield();
+        } else if (atomic_load(&c->reclaim_pid) != 0) {
+            /* Another flush got in first. */
+            atomic_store(&c->epoch, epoch);
+        } else {
+            break;
+        }
+    }
+
+    /* Wait out stores that got in before us. */
+    while (atomic_load(&c->n_writers) > 0) {
+        sched_yield();
+    }
+
+    /* Entries can't be recycled while they're pinned. Lookups are turned away
+       now, so pins only drop, and reads' pins drop as soon as they've copied.
+       Nothing has changed yet, so restoring the epoch lets readers holding
+       views continue. */
+    size_t n = MIN(atomic_load(&c->n_ht_entries), c->max_ht_entries);
+    uint64_t deadline = cache_now_ns() + FLUSH_DRAIN_NS;
+    for (size_t i = 0; i < n;) {
+        if (!(atomic_load(&CACHE_ENTRIES(c)[i].state) & ENTRY_PIN_MASK)) {
+            i++;
+        } else if (cache_now_ns() < deadline) {
+            sched_yield();
+        } else {
+            atomic_store(&c->epoch, epoch);
+            if (c->policy != POLICY_MINIO) {
+                pthread_mutex_unlock(&c->evict_lock);
+            }
+            return -EBUSY;
+        }
+    }
+
+    /* Detach the entries and the index, swapping in the other (empty) half of
+       the index, and clear the cache metadata. */
+    atomic_store(&c->reclaim_next, 0);
+    atomic_store(&c->reclaim_end, n);
+    atomic_store(&c->reclaim_pid, getpid());
+    atomic_store(&c->slot_half, atomic_load(&c->slot_half) ^ 1);
+    atomic_store(&c->used, 0);
+    for (int i = 0; i < c->n_nodes; i++) {
+        atomic_store(&c->shard_used[i], 0);
+    }
+    atomic_store(&c->keys_used, 0);
+    atomic_store(&c->n_ht_entries, 0);
+    c->order_head = 0;
+    c->n_order = 0;
+    c->n_free_entries = 0;
+    memset(c->key_free, 0, sizeof(c->key_free));
+    if (c->slabs != 0) {
+        cache_slab_reset(c);
+    }
+
+    /* Let lookups and stores back in, and reclaim what was detached. */
+    atomic_store(&c->epoch, epoch + 2);
+    if (c->policy != POLICY_MINIO) {
+        pthread_mutex_unlock(&c->evict_lock);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, cache_reclaim_thread, c) == 0) {
+        pthread_detach(thread);
+    } else {
+        cache_reclaim(c);
+    }
+
+    return c->spill != 0 ? cache_flush(CACHE_SPILL(c)) : 0;
+}
+
+/* Resize CACHE to SIZE bytes while it's in use, for every process sharing it.
+   Growing takes effect immediately. Shrinking below what's cached evicts down
+   to SIZE under an evicting policy; MinIO's policy never evicts, so it just
+   stops admitting files until a flush makes room. An arena can't grow past
+   the capacity it was created with (-EINVAL). Returns -EBUSY if a flush is in
+   progress. On success returns 0. */
+int
+cache_resize(cache_t *c, size_t size)
+{
+    if (size == 0 || ((c->flags & CACHE_ARENA) && size > c->capacity)) {
+        return -EINVAL;
+    }
+    int status = cache_begin_write(c);
+    if (status < 0) {
+        return status;
+    }
+
+    /* Slabs hold more than their entries use, and it's slabs that have to fit
+       in an arena. Pinned entries may keep the cache over SIZE for now. */
+    c->size = size;
+    if (c->policy != POLICY_MINIO) {
+        while ((c->slabs != 0 ? c->slabs_held * c->slab_size : atomic_load(&c->used)) > size) {
+            if (cache_evict(c) < 0) {
+                break;
+            }
+        }
+    }
+    cache_end_write(c);
+
+    return 0;
+}
+
+/* A region of shared memory used by a cache, stored at offset FIELD of the
+   cache_t. Locked regions are populated and page-locked up front; the rest are
+   committed as they're touched. Huge regions are the ones accessed at random
+   on every read, and are backed by huge pages if the cache asks for them. */
+typedef struct {
+    size_t field;
+    size_t size;
+    bool   locked;
+    bool   huge;
+} cache_region_t;
+
+#define MAX_REGIONS (12)
+
+/* Fill REGIONS with the regions CACHE's configuration calls for. Returns the
+   number of regions. */
+static int
+cache_regions(cache_t *c, cache_region_t *regions)
+{
+    int n = 0;
+    regions[n++] = (cache_region_t) {offsetof(cache_t, ht_entries), c->max_ht_entries * sizeof(hash_entry_t), true, true};
+    regions[n++] = (cache_region_t) {offsetof(cache_t, slots), 2 * c->n_slots * sizeof(uint64_t), true, true};
+    regions[n++] = (cache_region_t) {offsetof(cache_t, keys), c->keys_size, false};
+    regions[n++] = (cache_region_t) {offsetof(cache_t, stats), N_STAT_SHARDS * sizeof(cache_stat_shard_t), true};
+
+    /* The path registry is only as large as it's configured to be, and spill
+       tiers don't have one. */
+    if (c->max_paths > 0) {
+        regions[n++] = (cache_region_t) {offsetof(cache_t, paths), c->max_paths * sizeof(cache_path_t), false};
+        regions[n++] = (cache_region_t) {offsetof(cache_t, path_keys), c->path_keys_size, false};
+    }
+
+    /* Evicting policies track entries in insertion order, and recycle evicted
+       entries through a free list. */
+    if (c->policy != POLICY_MINIO) {
+        regions[n++] = (cache_region_t) {offsetof(cache_t, order), c->max_ht_entries * sizeof(uint32_t), true};
+        regions[n++] = (cache_region_t) {offsetof(cache_t, free_entries), c->max_ht_entries * sizeof(uint32_t), true};
+    }
+
+    /* So that evicted entries' space can be reused, an evicting policy's arena
+       is carved up into slabs. */
+    if (c->policy != POLICY_MINIO && (c->flags & CACHE_ARENA) && c->n_slabs > 0) {
+        regions[n++] = (cache_region_t) {offsetof(cache_t, slabs), c->n_slabs * sizeof(cache_slab_t), true};
+    }
+
+    /* The mappings behind shm entries aren't needed in arena mode. Otherwise
+       the memory used to cache actual data isn't allocated yet; it's allocated
+       on demand as shm objects named after each entry. In arena mode all of it
+       is allocated (and page-locked) up front. */
+    if (c->flags & CACHE_SPILL_TIER) {
+        /* A spill tier's data is on disk. */
+    } else if (c->flags & CACHE_ARENA) {
+        regions[n++] = (cache_region_t) {offsetof(cache_t, data), c->capacity, true, true};
+    } else {
+        regions[n++] = (cache_region_t) {offsetof(cache_t, ht_shms), c->max_ht_entries * sizeof(hash_shm_t), true};
+    }
+
+    /* Only named caches track the processes attached to them. */
+    if (c->name[0] != '\0') {
+        regions[n++] = (cache_region_t) {offsetof(cache_t, attached), MAX_ATTACHED * sizeof(pid_t), true};
+    }
+
+    /* A spill tier is only read through its parent, which coalesces misses. */
+    if (!(c->flags & CACHE_SPILL_TIER)) {
+        regions[n++] = (cache_region_t) {offsetof(cache_t, flights), N_FLIGHTS * sizeof(cache_flight_t), true};
+    }
+    assert(n <= MAX_REGIONS);
+
+    /* Huge regions are rounded up to a whole number of huge pages. */
+    size_t page = cache_huge_page_size(c);
+    for (int i = 0; i < n && page != 0; i++) {
+        if (regions[i].huge) {
+            regions[i].size = (regions[i].size + page - 1) & ~(page - 1);
+        }
+    }
+
+    return n;
+}
+
+/* Bind each shard of CACHE's arena, whose SIZE bytes are mapped at DATA, to
+   its NUMA node. The last shard also takes any rounding past the end of the
+   arena. Binding is best effort: where the kernel refuses it (as containers
+   without CAP_SYS_NICE do), pages are placed as they would have been. */
+static void
+cache_bind_shards(cache_t *c, uint8_t *data, size_t size)
+{
+    for (int i = 0; i < c->n_nodes; i++) {
+        size_t start = i * c->shard_size;
+        size_t end = i == c->n_nodes - 1 ? size : start + c->shard_size;
+        mmap_bind(data + start, end - start, c->nodes[i]);
+    }
+}
+
+/* Set the offset of CACHE's region REGION to point at PTR. */
+static inline void
+cache_set_region(cache_t *c, cache_region_t *region, void *ptr)
+{
+    *(ptrdiff_t *) ((uint8_t *) c + region->field) = (uint8_t *) ptr - (uint8_t *) c;
+}
+
+/* Count LOCKED of the SIZE bytes of a region CACHE page-locks as pinned, and
+   the rest as unpinned. */
+static inline void
+cache_count_pinned(cache_t *c, size_t size, size_t locked)
+{
+    atomic_fetch_add(&c->pinned, locked);
+    atomic_fetch_add(&c->unpinned, size - locked);
+}
+
+/* Configure CACHE with SIZE bytes and POLICY replacement policy, without
+   allocating anything. On success, 0 is returned. On failure, negative errno
+   value is returned. */
+static int
+cache_configure(cache_t *c,
+                size_t size,
+                size_t max_item_size,
+                size_t avg_item_size,
+                size_t max_paths,
+                policy_t policy,
+                int flags)
+{
+    memset(c, 0, sizeof(cache_t));
+
+    /* Cache configuration. */
+    c->size = size;
+    c->capacity = size;
+    c->policy = policy;
+    c->flags = flags;
+    c->max_item_size = max_item_size;
+    c->compress_min_size = COMPRESS_MIN_SIZE;
+    c->max_paths = max_paths;
+    atomic_store(&c->admission, 0.0);
+
+    if (policy >= N_POLICIES || max_paths > MAX_REGISTERED_PATHS) {
+        return -EINVAL;
+    }
+
+    /* Outside arena mode each entry's data is page-locked by the mapping of
+       the process that stored it, which no other process can release, so
+       entries can only be evicted from an arena. */
+    if (policy != POLICY_MINIO && !(flags & CACHE_ARENA)) {
+        return -EINVAL;
+    }
+    if ((flags & CACHE_HUGE_2MB) && (flags & CACHE_HUGE_1GB)) {
+        return -EINVAL;
+    }
+
+    /* The arena is split evenly across the online NUMA nodes, along page
+       boundaries so that each shard can be bound to its own node. */
+    if (flags & CACHE_NUMA) {
+        c->n_nodes = utils_numa_nodes(c->nodes, MAX_CACHE_NODES);
+        size_t page = cache_huge_page_size(c);
+        if (page == 0) {
+            page = sysconf(_SC_PAGESIZE);
+        }
+        c->shard_size = (size / c->n_nodes) & ~(page - 1);
+        if (c->shard_size == 0) {
+            c->n_nodes = 1;
+            c->shard_size = size;
+        }
+    }
+
+    /* An evicting policy's arena is split into slabs, of SLAB_SIZE bytes or
+       (for small caches) less, so that every cache has a few of them. */
+    if (policy != POLICY_MINIO && (flags & CACHE_ARENA)) {
+        c->slab_size = SLAB_SIZE;
+        while (c->slab_size > 4096 && 16 * c->slab_size > size) {
+            c->slab_size >>= 1;
+        }
+        c->n_slabs = size / c->slab_size;
+        if (c->n_slabs == 0) {
+            return -EINVAL;
+        }
+    }
+
+    /* Allocate more entries than we'll likely need, since file size may vary,
+       and entries are relatively small. */
+    if (avg_item_size != 0) {
+        c->max_ht_entries = (2 * size) / avg_item_size;
+    } else {
+        c->max_ht_entries = (2 * size) / AVERAGE_FILE_SIZE;
+    }
+    if (c->max_ht_entries == 0 || c->max_ht_entries >= UINT32_MAX) {
+        return -EINVAL;
+    }
+
+    /* The index is sized to a power of two with plenty of headroom, so probe
+       sequences stay short even when every entry is in use. */
+    c->n_slots = 1;
+    while (c->n_slots < SLOTS_PER_ENTRY * c->max_ht_entries) {
+        c->n_slots <<= 1;
+    }
+
+    /* Paths vary far more in length than entries do in number, so the key
+       arena is sized generously but only committed as it fills. The path
+       registry's key arena is sized for the paths it holds in the same way. */
+    c->keys_size = MIN(c->max_ht_entries * KEY_BYTES_PER_ENTRY,
+                       (size_t) UINT32_MAX * KEY_ALIGN);
+    c->path_keys_size = max_paths * KEY_BYTES_PER_PATH;
+
+    return 0;
+}
+
+/* Initialize CACHE's synchronization once its regions are allocated. */
+static void
+cache_init_sync(cache_t *c)
+{
+    /* Under an evicting policy, stores are serialized by a lock that works
+       across processes, and survives one of them dying while holding it. */
+    if (c->policy != POLICY_MINIO) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&c->evict_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    if (c->slabs != 0) {
+        cache_slab_reset(c);
+    }
+
+    /* Statistics are sharded so that readers don't contend on counters. */
+    pthread_once(&stat_once, stat_shard_init);
+
+    c->epoch = 0;
+    c->n_writers = 0;
+    c->id = ((uint64_t) getpid() << 32) | atomic_fetch_add(&n_caches, 1);
+}
+
+/* Initialize a cache CACHE with SIZE bytes and POLICY replacement policy, and
+   room to register MAX_PATHS paths with cache_register. The cache is shared
+   with processes forked afterwards, provided CACHE itself is in shared
+   memory. On success, 0 is returned. On failure, negative errno value is
+   returned, and CACHE must still be destroyed. */
+int
+cache_init(cache_t *c,
+           size_t size,
+           size_t max_item_size,
+           size_t avg_item_size,
+           size_t max_paths,
+           policy_t policy,
+           int flags)
+{
+    int status = cache_configure(c, size, max_item_size, avg_item_size, max_paths, policy, flags);
+    if (status < 0) {
+        return status;
+    }
+
+    /* Every region is its own shared mapping, so forked processes see the same
+       cache. */
+    cache_region_t regions[MAX_REGIONS];
+    int n = cache_regions(c, regions);
+    size_t page = cache_huge_page_size(c);
+    for (int i = 0; i < n; i++) {
+        void *ptr;
+        bool data = regions[i].field == offsetof(cache_t, data);
+        if (regions[i].locked && (c->flags & CACHE_PIN_FALLBACK)) {
+            /* Lock what the memlock limit allows of the region, and commit the
+               rest unlocked. */
+            if ((ptr = mmap_map(regions[i].size, regions[i].huge ? page : 0)) != NULL) {
+                if (data && (c->flags & CACHE_NUMA)) {
+                    cache_bind_shards(c, ptr, regions[i].size);
+                }
+                cache_count_pinned(c, regions[i].size, mmap_lock(ptr, regions[i].size));
+            }
+            if (ptr == NULL) {
+                return -ENOMEM;
+            }
+            cache_set_region(c, &regions[i], ptr);
+            continue;
+        }
+        if (data && (c->flags & CACHE_NUMA)) {
+            /* Shards have to be bound before they're populated. */
+            if ((ptr = mmap_map(regions[i].size, page)) != NULL) {
+                cache_bind_shards(c, ptr, regions[i].size);
+                if (mmap_populate(ptr, regions[i].size) < 0) {
+                    munmap(ptr, regions[i].size);
+                    ptr = NULL;
+                }
+            }
+        } else if (page != 0 && regions[i].huge) {
+            ptr = mmap_alloc_huge(regions[i].size, page);
+        } else if (regions[i].locked) {
+            ptr = mmap_alloc(regions[i].size);
+        } else {
+            ptr = mmap_reserve(regions[i].size);
+        }
+        if (ptr == NULL) {
+            return -ENOMEM;
+        }
+        if (regions[i].locked) {
+            cache_count_pinned(c, regions[i].size, regions[i].size);
+        }
+        cache_set_region(c, &regions[i], ptr);
+    }
+    cache_init_sync(c);
+
+    return 0;
+}
+
+/* Returns whether a cache configured with SIZE bytes and the rest of the
+   parameters cache_init takes fits in BUDGET bytes of memory, of which
+   LOCKABLE may be page-locked. Only memory committed up front, or page-locked
+   as files are cached, counts. */
+static bool
+cache_fits(size_t size,
+           size_t max_item_size,
+           size_t avg_item_size,
+           policy_t policy,
+           int flags,
+           size_t budget,
+           size_t lockable)
+{
+    cache_t *c = malloc(sizeof(cache_t));
+    if (c == NULL) {
+        return false;
+    }
+    bool fits = false;
+    if (cache_configure(c, size, max_item_size, avg_item_size, 0, policy, flags) == 0) {
+        cache_region_t regions[MAX_REGIONS];
+        int n = cache_regions(c, regions);
+        size_t locked = 0;
+        for (int i = 0; i < n; i++) {
+            locked += regions[i].locked ? regions[i].size : 0;
+        }
+
+        /* Files cached outside the arena are page-locked as they're stored. */
+        size_t total = locked;
+        if (!(flags & CACHE_ARENA)) {
+            total += size;
+            locked += size;
+        }
+        fits = total <= budget && ((flags & CACHE_PIN_FALLBACK) || locked <= lockable);
+    }
+    free(c);
+
+    return fits;
+}
+
+/* Returns the largest size of at most SIZE bytes that a cache created with
+   the rest of the parameters cache_init takes could have without exceeding
+   physical memory, the memory cgroup limits of this process or, unless FLAGS
+   has CACHE_PIN_FALLBACK, its memlock limit. Returns zero if no size fits. */
+size_t
+cache_fit_size(size_t size, size_t max_item_size, size_t avg_item_size, policy_t policy, int flags)
+{
+    size_t budget = MIN(utils_cgroup_budget(), (size_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE));
+    size_t lockable = utils_memlock_budget();
+    if (cache_fits(size, max_item_size, avg_item_size, policy, flags, budget, lockable)) {
+        return size;
+    }
+
+    /* Footprints grow with size, so binary search for the largest that fits,
+       to within a page. */
+    size_t lo = 0, hi = size;
+    while (hi - lo > 4096) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cache_fits(mid, max_item_size, avg_item_size, policy, flags, budget, lockable)) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Store CACHE's memory use into MEMORY, including that of its spill tier's
+   and shard members' indexes. Residency is measured with mincore, so takes
+   time in proportion to the memory mapped; it isn't meant for every read. */
+void
+cache_get_memory(cache_t *c, cache_memory_t *memory)
+{
+    memset(memory, 0, sizeof(cache_memory_t));
+    memory->pinned = atomic_load(&c->pinned);
+    memory->unpinned = atomic_load(&c->unpinned);
+
+    cache_region_t regions[MAX_REGIONS];
+    int n = cache_regions(c, regions);
+    for (int i = 0; i < n; i++) {
+        ptrdiff_t offset = *(ptrdiff_t *) ((uint8_t *) c + regions[i].field);
+        memory->resident += mmap_resident((uint8_t *) c + offset, regions[i].size);
+    }
+
+    /* Only the process that stored a file outside the arena keeps it mapped. */
+    if (!(c->flags & CACHE_ARENA)) {
+        pid_t pid = getpid();
+        size_t n_entries = MIN(atomic_load(&c->n_ht_entries), c->max_ht_entries);
+        for (size_t i = 0; i < n_entries; i++) {
+            hash_shm_t *shm = &CACHE_SHMS(c)[i];
+            if (shm->pid == pid && shm->pin != PIN_NONE) {
+                memory->resident += mmap_resident(shm->ptr, CACHE_ENTRIES(c)[i].size);
+            }
+        }
+    }
+
+    /* Tiers' indexes are caches of their own. */
+    cache_t *tiers[] = {
+        c->spill != 0 ? CACHE_SPILL(c) : NULL,
+        c->members != 0 ? CACHE_MEMBERS(c) : NULL,
+    };
+    for (size_t i = 0; i < sizeof(tiers) / sizeof(tiers[0]); i++) {
+        if (tiers[i] != NULL) {
+            cache_memory_t tier;
+            cache_get_memory(tiers[i], &tier);
+            memory->pinned += tier.pinned;
+            memory->unpinned += tier.unpinned;
+            memory->resident += tier.resident;
+        }
+    }
+}
+
+/* Write the name of the shm object holding the cache named NAME into SHM_NAME,
+   which must hold CACHE_NAME_LEN + 8 bytes. Returns -EINVAL if NAME isn't a
+   valid name. */
+static int
+cache_named_shm(char *name, char *shm_name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len >= CACHE_NAME_LEN || strchr(name, '/') != NULL) {
+        return -EINVAL;
+    }
+    sprintf(shm_name, "/minio.%s", name);
+
+    return 0;
+}
+
+/* Drop the references of processes attached to named CACHE that died without
+   detaching. The caller must hold a reference of its own, so this never drops
+   the last one. */
+static void
+cache_reap(cache_t *c)
+{
+    _Atomic pid_t *attached = CACHE_ATTACHED(c);
+    for (size_t i = 0; i < MAX_ATTACHED; i++) {
+        pid_t pid = atomic_load(&attached[i]);
+        if (pid != 0 && !pid_alive(pid) &&
+            atomic_compare_exchange_strong(&attached[i], &pid, 0)) {
+            atomic_fetch_sub(&c->n_refs, 1);
+        }
+    }
+}
+
+/* Record this process as holding a reference to named CACHE. Returns -EUSERS if
+   too many processes are attached. */
+static int
+cache_add_ref(cache_t *c)
+{
+    _Atomic pid_t *attached = CACHE_ATTACHED(c);
+    for (size_t i = 0; i < MAX_ATTACHED; i++) {
+        pid_t empty = 0;
+        if (atomic_compare_exchange_strong(&attached[i], &empty, getpid())) {
+            return 0;
+        }
+    }
+
+    return -EUSERS;
+}
+
+/* Create a cache named NAME, configured as cache_init does, in a single shm
+   object that unrelated processes can attach to with cache_attach. The cache
+   is stored into CACHE, and holds one reference, which cache_destroy drops.
+   Returns -EEXIST if a cache named NAME already exists. On success, 0 is
+   returned. On failure, negative errno value is returned. */
+int
+cache_create(cache_t **cache,
+             char *name,
+             size_t size,
+             size_t max_item_size,
+             size_t avg_item_size,
+             size_t max_paths,
+             policy_t policy,
+             int flags)
+{
+    char shm_name[CACHE_NAME_LEN + 8];
+    int status = cache_named_shm(name, shm_name);
+    if (status < 0) {
+        return status;
+    }
+
+    /* Work out the layout: the cache_t, then each region, page aligned. */
+    cache_t config;
+    if ((status = cache_configure(&config, size, max_item_size, avg_item_size, max_paths, policy, flags)) < 0) {
+        return status;
+    }
+    strcpy(config.name, name);
+    cache_region_t regions[MAX_REGIONS];
+    int n = cache_regions(&config, regions);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t offsets[MAX_REGIONS];
+    size_t map_size = (sizeof(cache_t) + page - 1) & ~(page - 1);
+    for (int i = 0; i < n; i++) {
+        offsets[i] = map_size;
+        map_size += (regions[i].size + page - 1) & ~(page - 1);
+    }
+
+    /* Creating the object exclusively decides which process initializes it. */
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (ftruncate(fd, map_size) < 0) {
+        status = -errno;
+        close(fd);
+        shm_unlink(shm_name);
+        return status;
+    }
+    uint8_t *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(shm_name);
+        return -ENOMEM;
+    }
+
+    cache_t *c = (cache_t *) base;
+    memcpy(c, &config, sizeof(cache_t));
+    for (int i = 0; i < n; i++) {
+        /* The shm object can't come from the hugetlb pool, but its huge
+           regions may still be backed by transparent huge pages. */
+        cache_set_region(c, &regions[i], base + offsets[i]);
+        if (regions[i].huge && cache_huge_page_size(c) != 0) {
+            madvise(base + offsets[i], regions[i].size, MADV_HUGEPAGE);
+        }
+        if (regions[i].field == offsetof(cache_t, data) && (c->flags & CACHE_NUMA)) {
+            cache_bind_shards(c, base + offsets[i], regions[i].size);
+        }
+        if (regions[i].locked && (c->flags & CACHE_PIN_FALLBACK)) {
+            cache_count_pinned(c, regions[i].size, mmap_lock(base + offsets[i], regions[i].size));
+        } else if (regions[i].locked && mlock(base + offsets[i], regions[i].size) < 0) {
+            status = -errno;
+            munmap(base, map_size);
+            shm_unlink(shm_name);
+            return status;
+        } else if (regions[i].locked) {
+            cache_count_pinned(c, regions[i].size, regions[i].size);
+        }
+    }
+    cache_init_sync(c);
+    c->layout = ((uint64_t) CACHE_LAYOUT_VERSION << 32) | sizeof(cache_t);
+    c->map_size = map_size;
+    c->n_refs = 1;
+    CACHE_ATTACHED(c)[0] = getpid();
+    atomic_store(&c->ready, 1);
+
+    *cache = c;
+
+    return 0;
+}
+
+/* Attach to the cache named NAME, created by cache_create in any process, and
+   store it into CACHE. The reference taken is dropped by cache_destroy. Waits
+   briefly for a cache that's still being created. Returns -ENOENT if there's no
+   such cache. On success, 0 is returned. On failure, negative errno value is
+   returned. */
+int
+cache_attach(cache_t **cache, char *name)
+{
+    char shm_name[CACHE_NAME_LEN + 8];
+    int status = cache_named_shm(name, shm_name);
+    if (status < 0) {
+        return status;
+    }
+    int fd = shm_open(shm_name, O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    /* The creator sizes the object, then initializes it. */
+    cache_t *c = NULL;
+    size_t map_size = 0;
+    for (int tries = 0; c == NULL || !atomic_load(&c->ready); tries++) {
+        if (tries == ATTACH_TRIES) {
+            status = -ETIMEDOUT;
+            break;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            status = -errno;
+            break;
+        }
+        if (c == NULL && (size_t) st.st_size >= sizeof(cache_t)) {
+            map_size = st.st_size;
+            c = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+            if (c == MAP_FAILED) {
+                c = NULL;
+                status = -ENOMEM;
+                break;
+            }
+            continue;
+        }
+        usleep(ATTACH_WAIT_US);
+    }
+    close(fd);
+    if (status < 0) {
+        if (c != NULL) {
+            munmap(c, map_size);
+        }
+        return status;
+    }
+    if (c->layout != (((uint64_t) CACHE_LAYOUT_VERSION << 32) | sizeof(cache_t)) ||
+        c->map_size != map_size) {
+        munmap(c, map_size);
+        return -EINVAL;
+    }
+
+    /* Take a reference, unless the last one has already been dropped and the
+       cache is being torn down. */
+    unsigned refs = atomic_load(&c->n_refs);
+    do {
+        if (refs == 0) {
+            munmap(c, map_size);
+            return -ENOENT;
+        }
+    } while (!atomic_compare_exchange_weak(&c->n_refs, &refs, refs + 1));
+    cache_reap(c);
+    if ((status = cache_add_ref(c)) < 0) {
+        atomic_fetch_sub(&c->n_refs, 1);
+        munmap(c, map_size);
+        return status;
+    }
+
+    *cache = c;
+
+    return 0;
+}
+
+/* Free every entry's shm object. Only published entries own one, and those a
+   flush detached are freed by its reclaim, which has to be over first. */
+static void
+cache_free_entries(cache_t *c)
+{
+    if (c->slots != 0) {
+        cache_await_reclaim(c, SIZE_MAX);
+    }
+    if ((c->flags & CACHE_ARENA) || c->slots == 0) {
+        return;
+    }
+    for (size_t i = 0; i < c->n_slots; i++) {
+        uint64_t slot = atomic_load(&CACHE_SLOTS(c)[i]);
+        if (slot != 0) {
+            cache_free_entry(c, SLOT_ID(slot) - 1);
+        }
+    }
+}
+
+/* Drop this process' reference to named CACHE, tearing it down if it was the
+   last. References belong to the process that took them, so a forked child
+   merely unmaps the cache. */
+static void
+cache_detach(cache_t *c)
+{
+    size_t map_size = c->map_size;
+    _Atomic pid_t *attached = CACHE_ATTACHED(c);
+    pid_t pid = getpid();
+
+    /* A reclaim this process is running needs the mapping. */
+    if (atomic_load(&c->reclaim_pid) == pid) {
+        cache_await_reclaim(c, SIZE_MAX);
+    }
+    for (size_t i = 0; i < MAX_ATTACHED; i++) {
+        pid_t self = pid;
+        if (atomic_load(&attached[i]) != pid) {
+            continue;
+        }
+
+        /* Peers that died without detaching mustn't keep the cache alive. */
+        cache_reap(c);
+        if (!atomic_compare_exchange_strong(&attached[i], &self, 0)) {
+            continue;
+        }
+        if (atomic_fetch_sub(&c->n_refs, 1) == 1) {
+            /* Unlink the name first, so no new process can attach. */
+            char shm_name[CACHE_NAME_LEN + 8];
+            cache_named_shm(c->name, shm_name);
+            shm_unlink(shm_name);
+            cache_free_entries(c);
+            if (c->policy != POLICY_MINIO) {
+                pthread_mutex_destroy(&c->evict_lock);
+            }
+        }
+        break;
+    }
+
+    munmap(c, map_size);
+}
+
+/* Destroy a cache. Deallocates all allocated memory. Not thread safe. Named
+   caches are only torn down once every process has destroyed its handle, and
+   CACHE itself is unmapped. */
+void
+cache_destroy(cache_t *c)
+{
+    if (c == NULL) {
+        return;
+    }
+    if (c->snap != NULL) {
+        munmap(c->snap, c->snap_size);
+    }
+    if (c->name[0] != '\0') {
+        cache_detach(c);
+        return;
+    }
+
+    cache_peers_stop(c);
+    cache_free_entries(c);
+    if (c->spill != 0) {
+        cache_destroy(CACHE_SPILL(c));
+        mmap_free(CACHE_SPILL(c), sizeof(cache_t));
+        close(c->spill_fd);
+    }
+    if (c->members != 0) {
+        cache_destroy(CACHE_MEMBERS(c));
+        mmap_free(CACHE_MEMBERS(c), sizeof(cache_t));
+    }
+    if (c->policy != POLICY_MINIO && c->policy < N_POLICIES) {
+        pthread_mutex_destroy(&c->evict_lock);
+    }
+
+    /* Free every region that was allocated. */
+    cache_region_t regions[MAX_REGIONS];
+    int n = cache_regions(c, regions);
+    for (int i = 0; i < n; i++) {
+        ptrdiff_t offset = *(ptrdiff_t *) ((uint8_t *) c + regions[i].field);
+        if (offset != 0) {
+            mmap_free((uint8_t *) c + offset, regions[i].size);
+        }
+    }
+}
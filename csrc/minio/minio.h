@@ -26,76 +26,551 @@
 
 #include <stdlib.h>
 
-#include "../include/uthash.h"
+#include <stddef.h>
+#include <stdint.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
-#define MAX_PATH_LEN 128
-
-/* Cache replacement policy. */
+/* Cache replacement policy. The evicting policies (all but POLICY_MINIO)
+   require CACHE_ARENA. */
 typedef enum {
-    POLICY_FIFO,
-    POLICY_MINIO,
+    POLICY_FIFO,    /* Evict in insertion order. */
+    POLICY_MINIO,   /* Never evict; once full, further files aren't cached. */
+    POLICY_CLOCK,   /* Evict in insertion order, but give entries that were hit
+                       since the hand last passed a second chance. */
     N_POLICIES
 } policy_t;
 
+/* Cache configuration flags, passed to cache_init. */
+#define CACHE_ARENA (1 << 0)    /* Store data in one shared, page-locked arena,
+                                   rather than one shm object per file. */
+#define CACHE_COMPRESS (1 << 1) /* LZ4 compress files of at least
+                                   COMPRESS_MIN_SIZE bytes (by default) where
+                                   it saves space. */
+
+#define CACHE_HUGE_2MB (1 << 2) /* Back the data and hash table with 2 MB huge
+                                   pages. */
+#define CACHE_HUGE_1GB (1 << 3) /* Back the data and hash table with 1 GB huge
+                                   pages. */
+#define CACHE_NUMA (1 << 4)     /* Place data on the NUMA node of the thread
+                                   storing it, and count local and remote
+                                   reads. */
+#define CACHE_PIN_FALLBACK (1 << 5) /* Where the cache's memory can't all be
+                                       page-locked (past RLIMIT_MEMLOCK), lock
+                                       what can be and keep the rest resident
+                                       but unlocked, rather than failing. */
+
+/* Default smallest file CACHE_COMPRESS compresses. Smaller files seldom save
+   enough to be worth decompressing on every hit. */
+#define COMPRESS_MIN_SIZE (4096)
+
+/* Files are cached by cache_read_range in aligned blocks of this many bytes,
+   each keyed by the file's path and the block's index. */
+#define RANGE_BLOCK_SIZE (2 * 1024 * 1024)
+
 /* Hash table entry. Maps filepath to cached data. An entry must be in the hash
-   table IFF the corresponding file is cached. */
+   table IFF the corresponding file is cached. Entries are written once, before
+   being published to the index, and are immutable until the next flush. Keys
+   are stored out of line, so that entries pack two to a cache line. */
 typedef struct {
-    char      path[MAX_PATH_LEN + 1];       /* Key. Filepath of file. */
-    char      shm_path[MAX_PATH_LEN + 2];   /* PATH but with '/' replaced with
-                                               '_' to name the shm object. */
-    void     *ptr;                          /* Pointer to this file's data. */
-    size_t    size;                         /* Size of file data in bytes. */
-    int       shm_fd;                       /* SHM object file descriptor. */
-    uint64_t  lock_id;                      /* ID of lock in ENTRY_LOCKS array
-                                               for this entry's protection. */
-
-    UT_hash_handle hh;
+    uint64_t    hash;       /* Hash of the key. */
+    size_t      offset;     /* Offset of this file's data in the arena
+                               (CACHE_ARENA only), or in the snapshot for
+                               entries indexed by cache_open. The top bits
+                               flag where the data is, and how it's encoded. */
+    size_t      size;       /* Size of the stored data in bytes. Compressed
+                               data is prefixed by the file's size. */
+    uint32_t    key;        /* Offset of the NUL-terminated filepath in the key
+                               arena, in units of KEY_ALIGN bytes. */
+    atomic_uint state;      /* Pin count (the number of readers currently
+                               using this entry's data), CLOCK reference bit
+                               and generation. */
 } hash_entry_t;
 
-/* Cache. Atomics types are used to ensure thread safety. */
+/* Alignment of keys in the key arena. */
+#define KEY_ALIGN 8
+
+/* Registered path, addressed by its integer ID. HINT caches the entry the path
+   was last found at, tagged with that entry's generation at the time, so that
+   repeat lookups skip the index. */
+typedef struct {
+    uint64_t         hash;  /* Hash of the path. */
+    uint32_t         key;   /* Offset of the path in the registry's key arena,
+                               in units of KEY_ALIGN bytes. */
+    _Atomic float    reuse; /* Predicted number of reads of the path, for
+                               admission, or REUSE_UNKNOWN. */
+    _Atomic uint64_t hint;  /* Flush count and generation over entry offset
+                               plus one, or zero. */
+} cache_path_t;
+
+/* Predicted reuse of a path nothing is known about. Always admitted. */
+#define REUSE_UNKNOWN (-1.0f)
+
+/* Maximum number of paths a cache can be configured to register. */
+#define MAX_REGISTERED_PATHS (1 << 26)
+
+/* Key arena blocks are recycled in power-of-two size classes, starting from
+   MIN_KEY_CLASS bytes, under evicting policies. */
+#define MIN_KEY_CLASS 16
+#define N_KEY_CLASSES 9
+
+/* Per-entry state of the shm object behind an entry, outside of arena mode.
+   Only meaningful in the process that stored the entry. */
+typedef struct {
+    void    *ptr;   /* Page-locked mapping of the entry's data. */
+    pid_t    pid;   /* Process that created PTR. */
+    int      node;  /* NUMA node PTR is bound to (CACHE_NUMA only). */
+    uint32_t flush; /* Number of flushes before the entry was stored. Part of
+                       its shm object's name, so that an object a flush has
+                       yet to unlink never collides with a newer one. */
+    uint32_t pin;   /* Which of the cache's PINNED and UNPINNED counts the
+                       entry's data is in, if either (PIN_*). */
+} hash_shm_t;
+
+/* States of an entry's shm object for hash_shm_t.PIN. */
+#define PIN_NONE (0)
+#define PIN_LOCKED (1)
+#define PIN_ADVISED (2)
+
+/* Largest slab of an arena under an evicting policy, and the number of object
+   size classes slabs can be carved into. */
+#define SLAB_SIZE (2 * 1024 * 1024)
+#define N_SLAB_CLASSES (56)
+
+/* A slab of the arena, under an evicting policy. A slab assigned a size class
+   is carved into objects of that size, handed out in order and then through a
+   free list threaded through the free objects themselves. Allocations larger
+   than a slab take a run of whole slabs instead. Slabs left empty go back to
+   the pool, for any class (or run) to take. */
+typedef struct {
+    uint32_t class;     /* Size class, or one of the SLAB_* states. */
+    uint32_t n_run;     /* Number of slabs in the run it starts. */
+    uint32_t n_used;    /* Number of objects allocated. */
+    uint32_t n_carved;  /* Number of objects handed out at least once. */
+    uint32_t free;      /* First free object, plus one, or zero. */
+    uint32_t prev;      /* Neighbours in its class's list of slabs with free */
+    uint32_t next;      /* objects, as slab index plus one, or zero. */
+} cache_slab_t;
+
+/* A read of a missing file in progress, which concurrent misses on the same
+   file (in any process) wait on rather than repeat. Indexed by path hash;
+   misses on paths colliding with one already in flight read independently. */
+typedef struct {
+    _Atomic uint64_t hash;  /* Hash of the path being read (never zero), or
+                               zero if the slot is free. */
+    _Atomic pid_t    pid;   /* Process doing the read. */
+    _Atomic uint32_t seq;   /* Bumped (and woken) whenever the slot frees. */
+} cache_flight_t;
+
+/* Number of cache_flight_t slots each cache has. */
+#define N_FLIGHTS 4096
+
+/* Peer tier limits. Requests to a peer that take longer than PEER_TIMEOUT_MS
+   fail, and a peer that fails isn't asked again for PEER_BACKOFF_NS. */
+#define MAX_PEERS (64)
+#define MAX_PEER_CONNS (256)
+#define PEER_TIMEOUT_MS (2000)
+#define PEER_BACKOFF_NS (1000000000ULL)
+
+/* Room for the token every request to a peer carries, NUL included. */
+#define PEER_TOKEN_LEN (64)
+
+/* Peer tier, added with cache_add_peers: the other nodes' caches, each of
+   which owns the paths that rendezvous hash to it. Allocated by the process
+   that added it, and only valid in it and its forks. */
+typedef struct {
+    struct cache   *cache;                  /* Cache served to the peers. */
+    int             n_peers;                /* Number of nodes, this one
+                                               included. */
+    int             self;                   /* This node's index. */
+    uint64_t        ids[MAX_PEERS];         /* Hash of each node's address,
+                                               as given. */
+    struct sockaddr_storage addrs[MAX_PEERS];   /* Each node's address. */
+    socklen_t       addr_lens[MAX_PEERS];       /* Length of each. */
+    _Atomic uint64_t down_until[MAX_PEERS]; /* Monotonic time before which a
+                                               node that failed is skipped. */
+    char            token[PEER_TOKEN_LEN];  /* Shared by every node, and
+                                               zero-padded. */
+
+    /* Server. */
+    pid_t           pid;                    /* Process serving. */
+    int             listen_fd;              /* Listening socket. */
+    pthread_t       acceptor;               /* Thread accepting connections. */
+    atomic_bool     stopping;               /* Threads should exit. */
+    pthread_mutex_t lock;                   /* Protects CONNS. */
+    int             conns[MAX_PEER_CONNS];  /* Connected sockets, or -1. */
+    atomic_int      n_serving;              /* Connection threads running. */
+    pthread_mutex_t path_lock;              /* Protects the path index. */
+    uint32_t       *path_index;             /* Open addressing over the IDs
+                                               of registered paths, plus one,
+                                               by hash. */
+    size_t          path_index_size;        /* Slots in PATH_INDEX, a power of
+                                               two. */
+    size_t          n_indexed;              /* IDs indexed so far. */
+} cache_peers_t;
+
+/* Histograms kept by every cache. */
+typedef enum {
+    HIST_HIT_NS,        /* Latency of reads served from the cache. */
+    HIST_MISS_NS,       /* Latency of reads that went to the filesystem. */
+    HIST_DISK_BYTES,    /* Size of each file read from the filesystem. */
+    HIST_CACHE_BYTES,   /* Size of each file served from the cache. */
+    HIST_SPILL_NS,      /* Latency of reads served from the spill tier. */
+    HIST_PEER_NS,       /* Latency of reads served by a peer. */
+    N_HISTS
+} hist_t;
+
+/* Histograms are log-bucketed: bucket 0 counts zeros, and bucket I > 0 counts
+   values in [2^(I - 1), 2^I). The last bucket also counts anything larger. */
+#define N_HIST_BUCKETS 48
+
+typedef struct {
+    size_t buckets[N_HIST_BUCKETS];
+    size_t sum;                     /* Sum of every value counted. */
+} cache_hist_t;
+
+/* Snapshot of a cache's statistics, summed across every process and thread
+   using it. */
+typedef struct {
+    size_t       n_accs;            /* Reads. */
+    size_t       n_hits;            /* Reads served from the cache. */
+    size_t       n_miss_cold;       /* Misses whose file was then cached. */
+    size_t       n_miss_capacity;   /* Misses whose file didn't fit. */
+    size_t       n_fail;            /* Reads that failed. */
+    size_t       n_evictions;       /* Entries evicted to make space. */
+    size_t       n_bytes_raw;       /* Bytes of files stored. */
+    size_t       n_bytes_stored;    /* Bytes those files take up once stored,
+                                       after any compression. */
+    size_t       n_reads_local;     /* Cached data read from the reader's own
+                                       NUMA node (CACHE_NUMA only). */
+    size_t       n_reads_remote;    /* Cached data read from another node. */
+    size_t       n_spill_hits;      /* Reads served from the spill tier. */
+    size_t       n_spill_stores;    /* Misses that didn't fit in memory, and
+                                       were written to the spill tier. */
+    size_t       n_peer_hits;       /* Misses served by the peer owning
+                                       the file. */
+    size_t       n_peer_fails;      /* Misses a peer should have served, but
+                                       didn't answer, and so were read here
+                                       instead. */
+    size_t       n_buffered;        /* Reads from the filesystem that fell
+                                       back to buffered IO. */
+    size_t       n_coalesced;       /* Misses served from the cache once a
+                                       concurrent read of the same file had
+                                       cached it. Also counted as hits. */
+    size_t       n_rejected;        /* Misses that weren't cached, because
+                                       their predicted reuse per byte was
+                                       under the admission threshold. Also
+                                       counted as cold misses. */
+    size_t       arena_held;        /* Bytes of the arena held by cached data,
+                                       including what's lost to rounding and
+                                       to partly used slabs. Unlike USED, this
+                                       counts arena space itself. */
+    cache_hist_t hists[N_HISTS];
+} cache_stats_t;
+
+/* One shard of a cache's statistics. Each thread updates a single shard, so
+   threads and processes reading concurrently rarely share a cache line. */
+#define N_STAT_SHARDS 64
+
 typedef struct {
+    atomic_size_t n_accs;
+    atomic_size_t n_hits;
+    atomic_size_t n_miss_cold;
+    atomic_size_t n_miss_capacity;
+    atomic_size_t n_fail;
+    atomic_size_t n_evictions;
+    atomic_size_t n_bytes_raw;
+    atomic_size_t n_bytes_stored;
+    atomic_size_t n_reads_local;
+    atomic_size_t n_reads_remote;
+    atomic_size_t n_spill_hits;
+    atomic_size_t n_spill_stores;
+    atomic_size_t n_peer_hits;
+    atomic_size_t n_peer_fails;
+    atomic_size_t n_buffered;
+    atomic_size_t n_coalesced;
+    atomic_size_t n_rejected;
+    struct {
+        atomic_size_t buckets[N_HIST_BUCKETS];
+        atomic_size_t sum;
+    } hists[N_HISTS];
+} __attribute__((aligned(64))) cache_stat_shard_t;
+
+/* Maximum length of a named cache's name, including the NUL. */
+#define CACHE_NAME_LEN 64
+
+/* Maximum number of processes attached to a named cache at once. */
+#define MAX_ATTACHED 1024
+
+/* Maximum number of NUMA nodes a CACHE_NUMA cache shards its data across. */
+#define MAX_CACHE_NODES 16
+
+/* Cache. Atomics types are used to ensure thread safety.
+
+   Every region of shared memory a cache uses is addressed by its offset from
+   the cache_t itself, rather than by pointer, so that a named cache (which
+   lives in a single shm object, headed by its cache_t) is valid wherever each
+   process maps it. Use the CACHE_* accessors below to address them. An offset
+   of zero means the region isn't allocated. */
+typedef struct cache {
     /* Configuration. */
-    policy_t policy;            /* Replacement policy. Only MinIO supported. */
+    policy_t policy;            /* Replacement policy. Evicting policies
+                                   require CACHE_ARENA, and allocate from its
+                                   slabs. */
+    int      flags;             /* CACHE_* configuration flags. */
     size_t   size;              /* Size of cache in bytes. */
-    size_t   ht_size;           /* Number of bytes allocated for HT entries. */
+    size_t   capacity;          /* SIZE when the cache was created, which is
+                                   how much arena CACHE_ARENA allocates, and so
+                                   as far as cache_resize can grow it. */
     size_t   max_ht_entries;    /* Maximum number of HT entries. */
+    size_t   n_slots;           /* Number of index slots. A power of two. */
+    uint64_t id;                /* Unique across caches and processes. Names
+                                   this cache's shm objects. */
     size_t   max_item_size;     /* Maximum size of an element in the cache. All
                                    reads for larger items bypass the cache. A
                                    size of zero indicates there is no limit. */
+    size_t   compress_min_size; /* Smallest item CACHE_COMPRESS compresses. */
+    size_t   max_paths;         /* Number of paths that can be registered. */
+    _Atomic double admission;   /* Files with predicted reuse are only cached
+                                   if they'd be read more than this many times
+                                   per MB cached. Zero by default. */
 
     /* State. */
     atomic_size_t  used;            /* Number of bytes cached. */
-    uint8_t       *data;            /* First byte of SIZE bytes of memory. */
-    hash_entry_t  *ht_entries;      /* Memory used for HT entries. */
+    atomic_size_t  pinned;          /* Bytes of memory page-locked. */
+    atomic_size_t  unpinned;        /* Bytes of memory that should have been
+                                       page-locked, but couldn't be, and were
+                                       advised as needed instead. */
+    ptrdiff_t      data;            /* uint8_t[SIZE] of cached data. Only
+                                       allocated with CACHE_ARENA. */
+    ptrdiff_t      ht_entries;      /* hash_entry_t[MAX_HT_ENTRIES]. */
+    ptrdiff_t      ht_shms;         /* hash_shm_t[MAX_HT_ENTRIES], parallel to
+                                       HT_ENTRIES. Not allocated with
+                                       CACHE_ARENA. */
     atomic_size_t  n_ht_entries;    /* Current number of HT entries. */
-    hash_entry_t  *ht;              /* Hash table, maps filename to data. */
+    ptrdiff_t      slots;           /* _Atomic uint64_t[2 * N_SLOTS], two
+                                       open-addressing indexes over HT_ENTRIES,
+                                       of which SLOT_HALF is in use. Each slot
+                                       holds the top half of an entry's hash
+                                       over its offset plus one, or zero if
+                                       empty. */
+    atomic_uint    slot_half;       /* Which half of SLOTS is the index. A
+                                       flush swaps in the other, empty, half
+                                       and clears the old one afterwards. */
+    ptrdiff_t      keys;            /* char[KEYS_SIZE] key arena, holding every
+                                       entry's path. Committed on demand. */
+    size_t         keys_size;       /* Size of KEYS in bytes. */
+    atomic_size_t  keys_used;       /* Number of bytes of KEYS in use. */
+    ptrdiff_t      paths;           /* cache_path_t[MAX_PATHS], indexed by ID.
+                                       Kept across flushes. Committed on
+                                       demand. Not allocated if MAX_PATHS is
+                                       zero. */
+    atomic_size_t  n_paths;         /* Number of registered paths, which are
+                                       published in ID order once written. */
+    _Atomic uint64_t path_reserved; /* IDs (low 32 bits) and KEY_ALIGN-byte
+                                       units of PATH_KEYS (high 32 bits)
+                                       reserved by registrations, together so
+                                       that both are reserved or neither. */
+    ptrdiff_t      path_keys;       /* char[PATH_KEYS_SIZE] key arena for
+                                       registered paths. Committed on demand. */
+    size_t         path_keys_size;  /* Size of PATH_KEYS in bytes. */
+    uint8_t       *snap;            /* Read-only mapping of the snapshot opened
+                                       with cache_open, or NULL. Mapped by the
+                                       process that opened it, and so only
+                                       valid in it and its forks. */
+    size_t         snap_size;       /* Size of SNAP in bytes. */
+    ptrdiff_t      spill;           /* cache_t indexing the spill tier added
+                                       with cache_spill, or zero. Its entries'
+                                       offsets are into SPILL_FD. */
+    int            spill_fd;        /* Spill file, opened by the process that
+                                       added the tier, and so only valid in it
+                                       and its forks. */
+    cache_peers_t *peers;           /* Peer tier added with cache_add_peers,
+                                       or NULL. */
+    ptrdiff_t      members;         /* cache_t indexing the members of shards
+                                       added with cache_add_shard, or zero. Its
+                                       registered paths are the shards, and its
+                                       entries' offsets are into them. */
+    ptrdiff_t      flights;         /* cache_flight_t[N_FLIGHTS] of misses
+                                       being read. Not allocated for a spill
+                                       tier. */
 
-    /* Statistics. */
-    atomic_size_t n_accs;
-    atomic_size_t n_hits;
-    atomic_size_t n_miss_cold;
-    atomic_size_t n_miss_capacity;
-    atomic_size_t n_fail;
+    /* NUMA placement, with CACHE_NUMA. The arena is split into one shard per
+       node, each bound to its node, and stores fill the shard local to the
+       storing thread first. */
+    int           n_nodes;                      /* Number of shards. */
+    int           nodes[MAX_CACHE_NODES];       /* Node of each shard. */
+    size_t        shard_size;                   /* Bytes of DATA per shard,
+                                                   but for the last, which
+                                                   has the remainder. */
+    atomic_size_t shard_used[MAX_CACHE_NODES];  /* Bytes used of each. */
 
-    /* Synchronization. */
-    pthread_spinlock_t  ht_lock;        /* Protects hash table. */
-    pthread_spinlock_t *entry_locks;    /* Protects hash table entries. Indexed
-                                           using a hash function to provide fair
-                                           coverage. Size of the array decides
-                                           maximum parallelism. */
-    size_t              n_entry_locks;  /* Number of locks in ENTRY_LOCKS. */
+    /* Statistics, read with cache_get_stats. */
+    ptrdiff_t stats;            /* cache_stat_shard_t[N_STAT_SHARDS]. */
+
+    /* Synchronization. Lookups and inserts are lock-free; only a flush needs
+       to exclude them, which it does through EPOCH and N_WRITERS. */
+    atomic_size_t epoch;        /* Odd while a flush is in progress. Bumped by
+                                   two by every successful flush. */
+    atomic_size_t n_writers;    /* Number of stores in progress. */
+
+    /* Reclaim of what the last flush detached, done in the background by
+       the flushing process. Stores wait for the entries they reuse. */
+    atomic_size_t reclaim_next; /* Entries below this have been reclaimed. */
+    atomic_size_t reclaim_end;  /* Number of entries the flush detached. */
+    _Atomic pid_t reclaim_pid;  /* Process reclaiming them, or zero once the
+                                   old index is cleared too. */
+
+    /* Eviction state, for policies other than POLICY_MINIO. Protected by
+       EVICT_LOCK, which serializes stores. */
+    pthread_mutex_t  evict_lock;
+    ptrdiff_t        order;             /* uint32_t[MAX_HT_ENTRIES] ring of live
+                                           entries, in insertion order. */
+    size_t           order_head;        /* Oldest entry in ORDER. */
+    size_t           n_order;           /* Number of entries in ORDER. */
+    ptrdiff_t        free_entries;      /* uint32_t[MAX_HT_ENTRIES] stack of
+                                           evicted entries. */
+    size_t           n_free_entries;    /* Number of entries in FREE_ENTRIES. */
+    uint32_t         key_free[N_KEY_CLASSES];   /* Free key blocks by class, as
+                                                   key offset plus one. */
+    ptrdiff_t        slabs;             /* cache_slab_t[N_SLABS] carving up
+                                           DATA, with CACHE_ARENA. */
+    size_t           n_slabs;           /* Number of slabs in DATA. */
+    size_t           slab_size;         /* Size of each slab in bytes. */
+    size_t           slab_hint;         /* Where to look for a free slab. */
+    size_t           slabs_held;        /* Number of slabs in use. */
+    uint32_t         slab_partial[N_SLAB_CLASSES];  /* Slabs of each class
+                                                       with free objects, as
+                                                       slab index plus one. */
+
+    /* Named caches only, created with cache_create and attached to with
+       cache_attach. */
+    char         name[CACHE_NAME_LEN];  /* Name, or empty if anonymous. */
+    uint64_t     layout;        /* Identifies the layout of this struct. */
+    size_t       map_size;      /* Size of the shm object in bytes. */
+    atomic_uint  ready;         /* Set once the creator has initialized the
+                                   cache. */
+    atomic_uint  n_refs;        /* Number of attached handles. */
+    ptrdiff_t    attached;      /* _Atomic pid_t[MAX_ATTACHED], the processes
+                                   holding references, or zero. */
 } cache_t;
 
+/* Address the region at offset FIELD of CACHE. */
+#define CACHE_REGION(cache, field) ((void *) ((uint8_t *) (cache) + (cache)->field))
+
+#define CACHE_DATA(cache)           ((uint8_t *) CACHE_REGION(cache, data))
+#define CACHE_ENTRIES(cache)        ((hash_entry_t *) CACHE_REGION(cache, ht_entries))
+#define CACHE_SHMS(cache)           ((hash_shm_t *) CACHE_REGION(cache, ht_shms))
+#define CACHE_HALF(cache, half)     ((_Atomic uint64_t *) CACHE_REGION(cache, slots) + (size_t) (half) * (cache)->n_slots)
+#define CACHE_SLOTS(cache)          CACHE_HALF(cache, atomic_load(&(cache)->slot_half))
+#define CACHE_KEYS(cache)           ((char *) CACHE_REGION(cache, keys))
+#define CACHE_PATHS(cache)          ((cache_path_t *) CACHE_REGION(cache, paths))
+#define CACHE_PATH_KEYS(cache)      ((char *) CACHE_REGION(cache, path_keys))
+#define CACHE_STATS(cache)          ((cache_stat_shard_t *) CACHE_REGION(cache, stats))
+#define CACHE_ORDER(cache)          ((uint32_t *) CACHE_REGION(cache, order))
+#define CACHE_FREE_ENTRIES(cache)   ((uint32_t *) CACHE_REGION(cache, free_entries))
+#define CACHE_ATTACHED(cache)       ((_Atomic pid_t *) CACHE_REGION(cache, attached))
+#define CACHE_SPILL(cache)          ((cache_t *) CACHE_REGION(cache, spill))
+#define CACHE_MEMBERS(cache)        ((cache_t *) CACHE_REGION(cache, members))
+#define CACHE_FLIGHTS(cache)        ((cache_flight_t *) CACHE_REGION(cache, flights))
+#define CACHE_SLABS(cache)          ((cache_slab_t *) CACHE_REGION(cache, slabs))
+
+/* Pinned, zero-copy reference to a cached file's data. Obtained with
+   cache_acquire, and must be returned with cache_release. */
+typedef struct {
+    hash_entry_t *entry;    /* Pinned entry. */
+    uint8_t      *ptr;      /* Read-only mapping of the entry's data. */
+    size_t        size;     /* Size of the data in bytes. */
+} cache_view_t;
+
+/* Room reserved in a cache for a file's data, to be written in place. Obtained
+   with cache_reserve, and must be passed to cache_commit or cache_abort. */
+typedef struct {
+    hash_entry_t *entry;    /* Entry being filled. */
+    uint8_t      *ptr;      /* Writable mapping of the entry's data. */
+    size_t        size;     /* Size of the data in bytes. */
+} cache_slot_t;
+
+/* Derived representation of a file (e.g. a decoded image), stored under the
+   file's path and a variant name as this header followed by its data, which is
+   a C-contiguous array. Its size keeps the data as aligned as the entry. */
+#define VARIANT_MAX_DIMS (8)
+#define VARIANT_FORMAT_LEN (16)
+typedef struct {
+    char     format[VARIANT_FORMAT_LEN];    /* Element format in the buffer
+                                               protocol's struct syntax (e.g.
+                                               "B"), NUL-terminated. */
+    uint32_t itemsize;                      /* Bytes per element. */
+    uint32_t ndim;                          /* Number of dimensions. */
+    uint64_t shape[VARIANT_MAX_DIMS];       /* Elements per dimension. */
+    uint64_t size;                          /* Bytes of data. */
+    uint64_t reserved[4];
+} cache_variant_t;
+
+/* Memory use of a cache, from cache_get_memory. */
+typedef struct {
+    size_t pinned;      /* Bytes page-locked. */
+    size_t unpinned;    /* Bytes that couldn't be page-locked (e.g. past
+                           RLIMIT_MEMLOCK), so may be paged out. */
+    size_t resident;    /* Bytes resident in memory, of the cache's own regions
+                           and of the data mapped by the calling process. */
+} cache_memory_t;
+
+/* A single request for cache_read_batch. */
+typedef struct {
+    char        *path;      /* Path of the file to read. */
+    void        *data;      /* Block-aligned buffer to read into, or NULL to
+                               only look for a hit to view. Must hold MAX_SIZE
+                               rounded up to a multiple of DIRECT_IO_ALIGN,
+                               since direct IO reads whole blocks. */
+    size_t       max_size;  /* Largest file to read, in bytes. */
+    ssize_t      result;    /* Bytes read, or negative errno on failure. */
+    cache_view_t view;      /* Hit pinned in place of a copy, if DATA is
+                               NULL. */
+} cache_req_t;
+
 bool cache_contains(cache_t *cache, char *path);
 int cache_store(cache_t *cache, char *path, uint8_t *data, size_t size);
 int cache_load(cache_t *cache, char *path, uint8_t *data, size_t *size, size_t max);
+int cache_acquire(cache_t *cache, char *path, cache_view_t *view);
+void cache_release(cache_t *cache, cache_view_t *view);
+bool cache_should_reserve(cache_t *cache, size_t size);
+int cache_reserve(cache_t *cache, char *path, size_t size, cache_slot_t *slot);
+int cache_commit(cache_t *cache, cache_slot_t *slot, cache_view_t *view);
+void cache_abort(cache_t *cache, cache_slot_t *slot);
 ssize_t cache_read(cache_t *cache, char *filepath, void *data, uint64_t max_size);
-void cache_flush(cache_t *cache);
-int cache_init(cache_t *cache, size_t size, size_t max_item_size, size_t avg_item_size, policy_t policy);
+ssize_t cache_read_view(cache_t *cache, char *filepath, void *data, uint64_t max_size, cache_view_t *view);
+ssize_t cache_read_range(cache_t *cache, char *filepath, void *data, size_t offset, size_t length);
+bool cache_contains_variant(cache_t *cache, char *path, char *variant);
+int cache_store_variant(cache_t *cache, char *path, char *variant, cache_variant_t *meta, void *data);
+int cache_load_variant(cache_t *cache, char *path, char *variant, uint8_t *data, size_t *size, size_t max);
+int cache_acquire_variant(cache_t *cache, char *path, char *variant, cache_view_t *view);
+int cache_read_batch(cache_t *cache, cache_req_t *reqs, size_t n);
+int cache_register(cache_t *cache, char **paths, size_t n, size_t *first);
+char *cache_id_path(cache_t *cache, size_t id);
+bool cache_contains_id(cache_t *cache, size_t id);
+ssize_t cache_read_id(cache_t *cache, size_t id, void *data, uint64_t max_size);
+int cache_set_reuse(cache_t *cache, size_t id, float reuse);
+void cache_set_admission(cache_t *cache, double threshold);
+bool cache_admits(cache_t *cache, size_t size, float reuse);
+int cache_save(cache_t *cache, char *path);
+int cache_open(cache_t *cache, char *path);
+int cache_spill(cache_t *cache, char *dir, size_t size);
+int cache_add_shard(cache_t *cache, char *path);
+int cache_add_peers(cache_t *cache, char **peers, int n, int self, char *token);
+void cache_get_stats(cache_t *cache, cache_stats_t *stats);
+void cache_reset_stats(cache_t *cache);
+void cache_get_memory(cache_t *cache, cache_memory_t *memory);
+size_t cache_fit_size(size_t size, size_t max_item_size, size_t avg_item_size, policy_t policy, int flags);
+int cache_flush(cache_t *cache);
+int cache_resize(cache_t *cache, size_t size);
+int cache_init(cache_t *cache, size_t size, size_t max_item_size, size_t avg_item_size, size_t max_paths, policy_t policy, int flags);
+int cache_create(cache_t **cache, char *name, size_t size, size_t max_item_size, size_t avg_item_size, size_t max_paths, policy_t policy, int flags);
+int cache_attach(cache_t **cache, char *name);
 void cache_destroy(cache_t *c);
 
 #endif
\ No newline at end of file
@@ -25,12 +25,24 @@
 #include <Python.h>
 
 #include "../minio/minio.h"
+#include "../prefetch/prefetch.h"
+#include "../utils/utils.h"
 #include <stdlib.h>
 #include <pthread.h>
 
 #define BLOCK_SIZE (4096)
+#define MAX_POOLED_BUFFERS (16)
+#define DEFAULT_MAX_PATHS (1 << 22)
 
 
+/* Reference-counted prefetcher. Replacing or stopping a prefetch only frees it
+   once reads that were consulting it have finished. */
+typedef struct {
+    prefetch_t prefetch;    /* The prefetcher itself. */
+    size_t     refs;        /* References held by the owning PyCache and by
+                               in-flight reads. Protected by the GIL. */
+} PyPrefetch;
+
 /* Python wrapper for cache_t type. */
 typedef struct {
     PyObject_HEAD
@@ -38,10 +50,280 @@ typedef struct {
     size_t   max_usable_file_size;      /* Max file size we can read. */
     size_t   max_cacheable_file_size;   /* Max file size we can cache. Defaults
                                            to MAX_USABLE_FILE_SIZE if zero. */
-    uint8_t *temp;                      /* MAX_USABLE_FILE_SIZE bytes used for
-                                           copying. */
+    uint8_t *buffers[MAX_POOLED_BUFFERS];   /* Free staging buffers, each
+                                               MAX_USABLE_FILE_SIZE bytes used
+                                               for copying. Protected by the
+                                               GIL. */
+    size_t   n_buffers;                     /* Number of free buffers. */
+    PyPrefetch *prefetch;                   /* Active prefetch, or NULL. */
 } PyCache;
 
+/* Read-only buffer exporter over a pinned cache entry. Wrapped in a memoryview
+   before being handed to Python; the entry is unpinned when the last reference
+   to the underlying buffer is dropped. Variants are exported as the array
+   their header describes, rather than as bytes. */
+typedef struct {
+    PyObject_HEAD
+    PyCache         *owner;     /* Keeps the cache alive while the view is. */
+    cache_view_t     view;      /* Pinned cache data. */
+    cache_variant_t *meta;      /* Header of the variant in VIEW, or NULL. */
+    uint8_t         *copy;      /* Private copy VIEW references instead of the
+                                   cache (for compressed variants), or NULL. */
+    Py_ssize_t       shape[VARIANT_MAX_DIMS];   /* META's shape and... */
+    Py_ssize_t       strides[VARIANT_MAX_DIMS]; /* ...C-contiguous strides. */
+} PyCacheView;
+
+/* PyCacheView deallocate method. Unpins the cached data. */
+static void
+PyCacheView_dealloc(PyObject *self)
+{
+    PyCacheView *view = (PyCacheView *) self;
+
+    if (view->owner != NULL) {
+        cache_release(view->owner->cache, &view->view);
+        Py_DECREF(view->owner);
+    }
+    free(view->copy);
+
+    Py_TYPE(view)->tp_free((PyObject *) view);
+}
+
+/* PyCacheView buffer protocol method. Exposes the cached data read-only. */
+static int
+PyCacheView_getbuffer(PyObject *self, Py_buffer *buf, int flags)
+{
+    PyCacheView *view = (PyCacheView *) self;
+    cache_variant_t *meta = view->meta;
+    if (meta == NULL) {
+        return PyBuffer_FillInfo(buf,
+                                 self,
+                                 view->view.ptr,
+                                 (Py_ssize_t) view->view.size,
+                                 1,
+                                 flags);
+    }
+
+    /* Arrays of anything but bytes can't be described without a format. */
+    if (meta->itemsize != 1 && !(flags & PyBUF_FORMAT)) {
+        PyErr_SetString(PyExc_BufferError, "variant's elements need a format to be read");
+        return -1;
+    }
+    if (PyBuffer_FillInfo(buf,
+                          self,
+                          view->view.ptr + sizeof(cache_variant_t),
+                          (Py_ssize_t) meta->size,
+                          1,
+                          flags) < 0) {
+        return -1;
+    }
+    buf->itemsize = meta->itemsize;
+    if (flags & PyBUF_FORMAT) {
+        buf->format = meta->format;
+    }
+    if ((flags & PyBUF_ND) == PyBUF_ND) {
+        buf->ndim = (int) meta->ndim;
+        buf->shape = view->shape;
+    }
+    if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) {
+        buf->strides = view->strides;
+    }
+
+    return 0;
+}
+
+static PyBufferProcs PyCacheView_as_buffer = {
+    .bf_getbuffer = PyCacheView_getbuffer,
+    .bf_releasebuffer = NULL,
+};
+
+static PyTypeObject PythonCacheViewType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "minio.CacheView",
+    .tp_doc = PyDoc_STR("Zero-copy view of a cached file"),
+    .tp_basicsize = sizeof(PyCacheView),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+
+    /* Methods. */
+    .tp_dealloc = PyCacheView_dealloc,
+    .tp_as_buffer = &PyCacheView_as_buffer,
+};
+
+/* Wrap the pinned VIEW of OWNER's cache in a memoryview. Ownership of the pin
+   is transferred to the returned object (or released on failure). */
+static PyObject *
+PyCacheView_wrap(PyCache *owner, cache_view_t *view)
+{
+    PyCacheView *exporter = PyObject_New(PyCacheView, &PythonCacheViewType);
+    if (exporter == NULL) {
+        cache_release(owner->cache, view);
+        return NULL;
+    }
+    Py_INCREF(owner);
+    exporter->owner = owner;
+    exporter->view = *view;
+    exporter->meta = NULL;
+    exporter->copy = NULL;
+
+    /* The memoryview holds the only reference to the exporter. */
+    PyObject *memview = PyMemoryView_FromObject((PyObject *) exporter);
+    Py_DECREF(exporter);
+
+    return memview;
+}
+
+/* Wrap the variant in VIEW of OWNER's cache in a memoryview shaped as its
+   header describes, as PyCacheView_wrap does. If COPY isn't NULL, VIEW isn't
+   pinned, and instead references COPY, which the returned object frees. */
+static PyObject *
+PyCacheView_wrap_variant(PyCache *owner, cache_view_t *view, uint8_t *copy)
+{
+    PyCacheView *exporter = PyObject_New(PyCacheView, &PythonCacheViewType);
+    if (exporter == NULL) {
+        cache_release(owner->cache, view);
+        free(copy);
+        return NULL;
+    }
+    Py_INCREF(owner);
+    exporter->owner = owner;
+    exporter->view = *view;
+    exporter->meta = (cache_variant_t *) view->ptr;
+    exporter->copy = copy;
+    Py_ssize_t stride = exporter->meta->itemsize;
+    for (int i = (int) exporter->meta->ndim - 1; i >= 0; i--) {
+        exporter->shape[i] = (Py_ssize_t) exporter->meta->shape[i];
+        exporter->strides[i] = stride;
+        stride *= exporter->shape[i];
+    }
+
+    PyObject *memview = PyMemoryView_FromObject((PyObject *) exporter);
+    Py_DECREF(exporter);
+
+    return memview;
+}
+
+/* Pack DATA and SIZE into a (data, size) tuple, stealing the reference to
+   DATA. */
+static PyObject *
+PyCache_pack(PyObject *data, size_t size)
+{
+    if (data == NULL) {
+        return NULL;
+    }
+
+    PyObject *size_ = PyLong_FromLong(size);
+    PyObject *out = PyTuple_Pack(2, data, size_);
+
+    /* Because PyTuple_Pack increments the reference counter for all inputs,
+       we must decrement the refcounts to prevent a leak where the count is >1
+       when we return. */
+    Py_DECREF(data);
+    Py_DECREF(size_);
+
+    return out;
+}
+
+/* Take a block-aligned staging buffer of MAX_USABLE_FILE_SIZE bytes from
+   SELF's pool, allocating a new one if the pool is empty. Each thread with a
+   read in flight holds its own buffer. Must be called with the GIL held.
+   Returns NULL (with an exception set) on failure. */
+static uint8_t *
+PyCache_get_buffer(PyCache *self)
+{
+    if (self->n_buffers > 0) {
+        return self->buffers[--self->n_buffers];
+    }
+
+    /* Direct IO reads whole blocks, so the last one can run past the end of a
+       file that exactly fits. */
+    uint8_t *buffer;
+    size_t size = (self->max_usable_file_size + BLOCK_SIZE - 1) & ~((size_t) BLOCK_SIZE - 1);
+    if (posix_memalign((void **) &buffer, BLOCK_SIZE, size) != 0) {
+        PyErr_SetString(PyExc_MemoryError, "couldn't allocate staging buffer");
+        return NULL;
+    }
+
+    return buffer;
+}
+
+/* Return BUFFER to SELF's pool, freeing it if the pool is full. Must be called
+   with the GIL held. */
+static void
+PyCache_put_buffer(PyCache *self, uint8_t *buffer)
+{
+    if (self->n_buffers < MAX_POOLED_BUFFERS) {
+        self->buffers[self->n_buffers++] = buffer;
+    } else {
+        free(buffer);
+    }
+}
+
+/* Take a reference to SELF's active prefetch, if any. Must be called with the
+   GIL held. */
+static PyPrefetch *
+PyCache_get_prefetch(PyCache *self)
+{
+    PyPrefetch *prefetch = self->prefetch;
+    if (prefetch != NULL) {
+        prefetch->refs++;
+    }
+
+    return prefetch;
+}
+
+/* Drop a reference to PREFETCH, stopping and freeing it if it was the last.
+   Must be called with the GIL held (prefetch threads never need it). */
+static void
+PyCache_put_prefetch(PyPrefetch *prefetch)
+{
+    if (prefetch != NULL && --prefetch->refs == 0) {
+        prefetch_stop(&prefetch->prefetch);
+        PyMem_Free(prefetch);
+    }
+}
+
+/* Serve FILEPATH from PREFETCH's staging ring into BUFFER if it was staged
+   there, otherwise read it through SELF's cache. Called without the GIL. */
+static ssize_t
+PyCache_read_prefetched(PyCache *self,
+                        PyPrefetch *prefetch,
+                        char *filepath,
+                        uint8_t *buffer)
+{
+    if (prefetch != NULL) {
+        ssize_t size = prefetch_take(&prefetch->prefetch,
+                                     filepath,
+                                     buffer,
+                                     self->max_usable_file_size);
+        if (size != -ENODATA) {
+            return size;
+        }
+    }
+
+    return cache_read(self->cache, filepath, buffer, self->max_usable_file_size);
+}
+
+/* Set the Python exception corresponding to a failed cache_read of FILEPATH,
+   which returned STATUS. */
+static void
+PyCache_read_error(ssize_t status, char *filepath)
+{
+    switch (status) {
+        case -EINVAL:
+            PyErr_SetString(PyExc_MemoryError, "insufficient buffer size");
+            break;
+        case -ENOMEM:
+            PyErr_SetString(PyExc_MemoryError, "unable to allocate hash table entry");
+            break;
+        case -ENOENT:
+            PyErr_SetString(PyExc_FileNotFoundError, filepath);
+            break;
+        default:
+            PyErr_SetString(PyExc_Exception, "unknown exception");
+            break;
+    }
+}
+
 /* PyCache deallocate method. */
 static void
 PyCache_dealloc(PyObject *self)
@@ -51,43 +333,151 @@ PyCache_dealloc(PyObject *self)
         return;
     }
 
-    /* Destroy the MinIO cache. */
+    /* Stop prefetching before the cache goes away. */
+    PyCache_put_prefetch(cache->prefetch);
+    cache->prefetch = NULL;
+
+    /* Destroy the MinIO cache. Named caches unmap themselves. */
     if (cache->cache != NULL) {
+        int named = cache->cache->name[0] != '\0';
         cache_destroy(cache->cache);
-        munmap(cache->cache, sizeof(cache_t));
+        if (!named) {
+            munmap(cache->cache, sizeof(cache_t));
+        }
     }
 
-    /* Free the memory allocated for the copy region. */
-    if (cache->temp != NULL) {
-        free(cache->temp);
+    /* Free the memory allocated for the copy regions. */
+    for (size_t i = 0; i < cache->n_buffers; i++) {
+        free(cache->buffers[i]);
     }
 
     /* Free the cache wrapper struct itself. */
     Py_TYPE(cache)->tp_free((PyObject *) cache);
 }
 
+/* Raise the exception matching a cache_init, cache_create or cache_attach
+   STATUS. */
+static void
+PyCache_init_error(int status, char *name)
+{
+    switch (status) {
+        case -ENOMEM:
+            PyErr_SetString(PyExc_MemoryError, "couldn't allocate cache");
+            break;
+        case -EPERM:
+            PyErr_SetString(PyExc_PermissionError, "couldn't pin cache memory");
+            break;
+        case -ENOENT:
+            PyErr_Format(PyExc_FileNotFoundError, "no cache named \"%s\"", name);
+            break;
+        case -EINVAL:
+            if (name != NULL) {
+                PyErr_Format(PyExc_ValueError, "invalid cache name \"%s\" or incompatible cache", name);
+                break;
+            }
+            /* Fall through. */
+        default:
+            PyErr_Format(PyExc_Exception, "couldn't initialize cache; %s", strerror(-status));
+            break;
+    }
+}
+
 /* PyCache initialization method. */
 static int
 PyCache_init(PyObject *self, PyObject *args, PyObject *kwds)
 {
     PyCache *cache = (PyCache *) self;
 
-    /* Parse arguments. */
-    size_t size, max_usable_file_size;
+    /* Parse arguments. SIZE and MAX_USABLE_FILE_SIZE may only be omitted when
+       attaching to an existing named cache. */
+    size_t size = 0, max_usable_file_size = 0;
     size_t max_cacheable_file_size = 0; /* If zero, defaults to MAX_USABLE_FILE_SIZE. */
     size_t average_file_size = 0;
+    int arena = 0;
+    char *policy_name = "minio";
+    char *name = NULL;
+    int create = 1;
+    int compress = 0;
+    size_t compress_min_size = 0;   /* If zero, defaults to COMPRESS_MIN_SIZE. */
+    PyObject *hugepages = Py_False;
+    int numa = 0;
+    char *spill_dir = NULL;
+    size_t spill_size = 0;
+    int auto_size = 0;
+    int pin_fallback = 0;
+    size_t max_paths = DEFAULT_MAX_PATHS;
     static char *kwlist[] = {
         "size", "max_usable_file_size", "max_cacheable_file_size",
-        "average_file_size", NULL
+        "average_file_size", "arena", "policy", "name", "create", "compress",
+        "compress_min_size", "hugepages", "numa", "spill_dir", "spill_size",
+        "auto_size", "pin_fallback", "max_paths", NULL
     };
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kk|kk", kwlist,
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|kkkkpszppkOpzkppk", kwlist,
                                      &size,
                                      &max_usable_file_size,
                                      &max_cacheable_file_size,
-                                     &average_file_size)) {
+                                     &average_file_size,
+                                     &arena,
+                                     &policy_name,
+                                     &name,
+                                     &create,
+                                     &compress,
+                                     &compress_min_size,
+                                     &hugepages,
+                                     &numa,
+                                     &spill_dir,
+                                     &spill_size,
+                                     &auto_size,
+                                     &pin_fallback,
+                                     &max_paths)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return -1;
+    }
+    if ((name == NULL || create) && (size == 0 || max_usable_file_size == 0)) {
         PyErr_SetString(PyExc_Exception, "missing/invalid argument");
         return -1;
     }
+    if ((spill_dir == NULL) != (spill_size == 0)) {
+        PyErr_SetString(PyExc_ValueError, "spill_dir and spill_size must be given together");
+        return -1;
+    }
+
+    /* Map the policy name onto its policy_t. */
+    policy_t policy;
+    if (strcmp(policy_name, "minio") == 0) {
+        policy = POLICY_MINIO;
+    } else if (strcmp(policy_name, "fifo") == 0) {
+        policy = POLICY_FIFO;
+    } else if (strcmp(policy_name, "clock") == 0) {
+        policy = POLICY_CLOCK;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "policy must be one of \"minio\", \"fifo\" or \"clock\"");
+        return -1;
+    }
+    if (policy != POLICY_MINIO && !arena && (name == NULL || create)) {
+        PyErr_SetString(PyExc_ValueError, "evicting policies require arena=True");
+        return -1;
+    }
+
+    /* Huge pages are 2 MB unless 1 GB pages are asked for by name. */
+    int huge_flags = 0;
+    if (PyUnicode_Check(hugepages)) {
+        const char *page = PyUnicode_AsUTF8(hugepages);
+        if (strcmp(page, "2MB") == 0) {
+            huge_flags = CACHE_HUGE_2MB;
+        } else if (strcmp(page, "1GB") == 0) {
+            huge_flags = CACHE_HUGE_1GB;
+        } else {
+            PyErr_SetString(PyExc_ValueError, "hugepages must be a bool, \"2MB\" or \"1GB\"");
+            return -1;
+        }
+    } else {
+        int truth = PyObject_IsTrue(hugepages);
+        if (truth < 0) {
+            return -1;
+        }
+        huge_flags = truth ? CACHE_HUGE_2MB : 0;
+    }
 
     /* Default to max usable file size (i.e., no-op). */
     if (max_cacheable_file_size == 0) {
@@ -100,40 +490,88 @@ PyCache_init(PyObject *self, PyObject *args, PyObject *kwds)
         return -1;
     }
 
-    /* Set up the cache struct as shared memory. */
-    cache->cache = mmap_alloc(sizeof(cache_t));
-    if (cache == NULL) {
-        PyErr_SetString(PyExc_MemoryError, "unable to allocate cache_t struct");
-        return -1;
-    }
+    /* Initialize the cache. A named cache is created if it doesn't exist yet,
+       and attached to otherwise. */
+    int status;
+    int flags = (arena ? CACHE_ARENA : 0) | (compress ? CACHE_COMPRESS : 0) | huge_flags |
+                (numa ? CACHE_NUMA : 0) | (pin_fallback ? CACHE_PIN_FALLBACK : 0);
 
-    /* Set up the copy area. */
-    cache->max_usable_file_size = max_usable_file_size;
-    cache->max_cacheable_file_size = max_cacheable_file_size;
-    if (posix_memalign((void **) &cache->temp, BLOCK_SIZE, max_usable_file_size) != 0) {
-        PyErr_SetString(PyExc_MemoryError, "couldn't allocate temp area");
-        PyErr_NoMemory();
-        return -1;
+    /* SIZE is the most an auto-sized cache may take, within the memory limits
+       this process is under. */
+    if (auto_size && size != 0) {
+        size = cache_fit_size(size, max_cacheable_file_size, average_file_size, policy, flags);
+        if (size == 0) {
+            PyErr_SetString(PyExc_MemoryError, "no room for a cache within the memlock and cgroup memory limits");
+            return -1;
+        }
     }
-
-    /* Initialize the cache. */
-    int status = cache_init(cache->cache,
+    if (name != NULL) {
+        status = -EEXIST;
+        if (create) {
+            status = cache_create(&cache->cache, name, size,
+                                  max_cacheable_file_size, average_file_size,
+                                  max_paths,
+                                  policy, flags);
+        }
+        if (status == -EEXIST) {
+            /* An attached cache keeps its creator's configuration. */
+            compress_min_size = 0;
+            status = cache_attach(&cache->cache, name);
+        }
+    } else {
+        /* Set up the cache struct as shared memory. */
+        cache->cache = mmap_alloc(sizeof(cache_t));
+        if (cache->cache == NULL) {
+            PyErr_SetString(PyExc_MemoryError, "unable to allocate cache_t struct");
+            return -1;
+        }
+        status = cache_init(cache->cache,
                             size,
                             max_cacheable_file_size,
                             average_file_size,
-                            POLICY_MINIO);
+                            max_paths,
+                            policy,
+                            flags);
+    }
     if (status < 0) {
-        switch (status) {
-            case -ENOMEM:
-                PyErr_SetString(PyExc_MemoryError, "couldn't allocate cache");
-                break;
-            case -EPERM:
-                PyErr_SetString(PyExc_PermissionError, "couldn't pin cache memory");
-                break;
+        if (name != NULL) {
+            cache->cache = NULL;
+        }
+        PyCache_init_error(status, name);
+        return -1;
+    }
+
+    if (compress_min_size != 0) {
+        cache->cache->compress_min_size = compress_min_size;
+    }
+    if (spill_dir != NULL && (status = cache_spill(cache->cache, spill_dir, spill_size)) < 0) {
+        if (status == -ENOTSUP) {
+            PyErr_SetString(PyExc_ValueError, "named caches can't spill");
+        } else {
+            errno = -status;
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, spill_dir);
         }
+        return -1;
+    }
+
+    /* An attached cache decides how large an item may be. */
+    if (max_usable_file_size == 0) {
+        max_usable_file_size = cache->cache->max_item_size;
+    }
+    if (max_cacheable_file_size == 0 || max_cacheable_file_size > cache->cache->max_item_size) {
+        max_cacheable_file_size = MIN(max_usable_file_size, cache->cache->max_item_size);
+    }
 
+    /* Set up the first copy area. More are allocated on demand when multiple
+       threads read concurrently. */
+    cache->max_usable_file_size = max_usable_file_size;
+    cache->max_cacheable_file_size = max_cacheable_file_size;
+    cache->n_buffers = 0;
+    uint8_t *buffer = PyCache_get_buffer(cache);
+    if (buffer == NULL) {
         return -1;
     }
+    PyCache_put_buffer(cache, buffer);
 
     return 0;
 }
@@ -183,17 +621,18 @@ PyCache_store(PyCache *self, PyObject *args, PyObject *kwds)
     }
 
     /* Don't cache things that are bigger than we allow. */
-    if (bytes > self->max_cacheable_file_size) {
+    if (bytes > self->max_cacheable_file_size || bytes > (size_t) buf.len) {
+        PyBuffer_Release(&buf);
         return PyBool_FromLong(0);
     }
 
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_store(self->cache, filepath, buf.buf, bytes);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&buf);
 
-    int status = cache_store(self->cache, filepath, buf.buf, bytes);
-    if (status < 0) {
-        return PyBool_FromLong(0);
-    }
-
-    return PyBool_FromLong(1);
+    return PyBool_FromLong(status == 0);
 }
 
 /* PyCache method to load from cache without issuing IO on miss. Returns a tuple
@@ -210,28 +649,30 @@ PyCache_load(PyCache *self, PyObject *args, PyObject *kwds)
         return NULL;
     }
 
+    uint8_t *buffer = PyCache_get_buffer(self);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
     size_t size = 0;
-    int status = cache_load(self->cache,
-                            filepath,
-                            self->temp,
-                            &size,
-                            self->max_cacheable_file_size);
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_load(self->cache,
+                        filepath,
+                        buffer,
+                        &size,
+                        self->max_cacheable_file_size);
+    Py_END_ALLOW_THREADS
     if (status < 0) {
+        PyCache_put_buffer(self, buffer);
         PyErr_Format(PyExc_Exception, "load failed; %s", strerror(-status));
         return NULL;
     }
 
-    PyObject *bytes = PyBytes_FromStringAndSize((char *) self->temp, size);
-    PyObject *size_ = PyLong_FromLong(size);
-    PyObject *out = PyTuple_Pack(2, bytes, size_);
-
-    /* Because PyTuple_Pack increments the reference counter for all inputs,
-       we must decrement the refcounts to prevent a leak where the count is >1
-       when we return. */
-    Py_DECREF(bytes);
-    Py_DECREF(size_);
+    PyObject *bytes = PyBytes_FromStringAndSize((char *) buffer, size);
+    PyCache_put_buffer(self, buffer);
 
-    return out;
+    return PyCache_pack(bytes, size);
 }
 
 /* PyCache read/get method. Returns (data, size) as a tuple. */
@@ -246,75 +687,1045 @@ PyCache_read(PyCache *self, PyObject *args, PyObject *kwds)
         return NULL;
     }
 
-    /* Get the file contents. */
-    ssize_t size = cache_read(self->cache,
-                              filepath,
-                              self->temp,
-                              self->max_usable_file_size);
-    if (size < 0) {
-        switch (size) {
-            case -EINVAL:
-                PyErr_SetString(PyExc_MemoryError, "insufficient buffer size");
-                break;
-            case -ENOMEM:
-                PyErr_SetString(PyExc_MemoryError, "unable to allocate hash table entry");
-                break;
-            case -ENOENT:
-                PyErr_SetString(PyExc_FileNotFoundError, filepath);
-                break;
-            default:
-                PyErr_SetString(PyExc_Exception, "unknown exception");
-                break;
-        }
-
+    uint8_t *buffer = PyCache_get_buffer(self);
+    if (buffer == NULL) {
         return NULL;
     }
 
-    PyObject *bytes = PyBytes_FromStringAndSize((char *) self->temp, size);
-    PyObject *size_ = PyLong_FromLong(size);
-    PyObject *out = PyTuple_Pack(2, bytes, size_);
+    /* Get the file contents. Other threads may run (and issue their own reads)
+       while this one is blocked on IO. */
+    PyPrefetch *prefetch = PyCache_get_prefetch(self);
+    ssize_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = PyCache_read_prefetched(self, prefetch, filepath, buffer);
+    Py_END_ALLOW_THREADS
+    PyCache_put_prefetch(prefetch);
+    if (size < 0) {
+        PyCache_put_buffer(self, buffer);
+        PyCache_read_error(size, filepath);
+        return NULL;
+    }
 
-    /* Because PyTuple_Pack increments the reference counter for all inputs,
-       we must decrement the refcounts to prevent a leak where the count is >1
-       when we return. */
-    Py_DECREF(bytes);
-    Py_DECREF(size_);
+    PyObject *bytes = PyBytes_FromStringAndSize((char *) buffer, size);
+    PyCache_put_buffer(self, buffer);
 
-    return out;
+    return PyCache_pack(bytes, size);
 }
 
-/* PyCache method to flush the cache. */
+/* PyCache range read method. Reads LENGTH bytes of FILEPATH from OFFSET
+   through the cache, which caches the file in blocks rather than whole, so
+   the file may be any size. Returns a (data, size) tuple, as read does. */
 static PyObject *
-PyCache_flush(PyCache *self, PyObject *args, PyObject *kwds)
+PyCache_read_range(PyCache *self, PyObject *args, PyObject *kwds)
 {
-    cache_flush(self->cache);
+    /* Parse arguments. */
+    char *filepath;
+    Py_ssize_t offset, length;
+    static char *kwlist[] = {"filepath", "offset", "length", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "snn", kwlist, &filepath, &offset, &length) ||
+        offset < 0 || length < 0) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
 
-    return PyLong_FromLong(0L);
+    /* The range is read straight into the bytes object, which nothing else
+       can see yet, so no staging buffer is needed. */
+    PyObject *bytes = PyBytes_FromStringAndSize(NULL, length);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    char *data = PyBytes_AS_STRING(bytes);
+    ssize_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = cache_read_range(self->cache, filepath, data, offset, length);
+    Py_END_ALLOW_THREADS
+    if (size < 0) {
+        Py_DECREF(bytes);
+        PyCache_read_error(size, filepath);
+        return NULL;
+    }
+    if (size < length && _PyBytes_Resize(&bytes, size) < 0) {
+        return NULL;
+    }
+
+    return PyCache_pack(bytes, size);
 }
 
-/* PyCache method to get the cache's "size" field. */
+/* PyCache batched read method. Reads every filepath in the list FILEPATHS
+   through the cache, issuing all misses concurrently. Returns a list of
+   (data, size) tuples, in the same order as FILEPATHS. */
 static PyObject *
-PyCache_get_size(PyCache *self, PyObject *args, PyObject *kwds)
+PyCache_read_many(PyCache *self, PyObject *args, PyObject *kwds)
 {
-    return PyLong_FromUnsignedLong(self->cache->size);
+    /* Parse arguments. */
+    PyObject *filepaths;
+    static char *kwlist[] = {"filepaths", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &filepaths)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(filepaths, "filepaths must be a sequence");
+    if (seq == NULL) {
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+
+    /* The path strings are kept alive by SEQ while the GIL is released. */
+    cache_req_t *reqs = PyMem_Calloc(n > 0 ? n : 1, sizeof(cache_req_t));
+    if (reqs == NULL) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    PyObject *out = NULL;
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        if ((reqs[i].path = (char *) PyUnicode_AsUTF8(item)) == NULL) {
+            goto done;
+        }
+    }
+
+    /* View every hit first, so hits are copied once, straight into bytes of
+       their own size, and never take a staging buffer. */
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_read_batch(self->cache, reqs, n);
+    Py_END_ALLOW_THREADS
+    if (status < 0) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if ((out = PyList_New(n)) == NULL) {
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if (reqs[i].view.entry == NULL) {
+            continue;
+        }
+        PyObject *bytes = PyBytes_FromStringAndSize((char *) reqs[i].view.ptr, reqs[i].view.size);
+        PyObject *tuple = PyCache_pack(bytes, reqs[i].view.size);
+        cache_release(self->cache, &reqs[i].view);
+        if (tuple == NULL) {
+            Py_CLEAR(out);
+            goto done;
+        }
+        PyList_SET_ITEM(out, i, tuple);
+    }
+
+    /* Stage the rest (misses and compressed hits) in batches of at most a
+       pool's worth of buffers, failing on the first failed read. */
+    cache_req_t staged[MAX_POOLED_BUFFERS];
+    Py_ssize_t index[MAX_POOLED_BUFFERS];
+    Py_ssize_t next = 0;
+    while (next < n) {
+        size_t n_staged = 0;
+        for (; next < n && n_staged < MAX_POOLED_BUFFERS; next++) {
+            if (PyList_GET_ITEM(out, next) != NULL) {
+                continue;
+            }
+            uint8_t *buffer = PyCache_get_buffer(self);
+            if (buffer == NULL) {
+                break;
+            }
+            staged[n_staged] = (cache_req_t) {
+                .path = reqs[next].path,
+                .data = buffer,
+                .max_size = self->max_usable_file_size,
+            };
+            index[n_staged++] = next;
+        }
+        if (!PyErr_Occurred() && n_staged > 0) {
+            Py_BEGIN_ALLOW_THREADS
+            status = cache_read_batch(self->cache, staged, n_staged);
+            Py_END_ALLOW_THREADS
+            if (status < 0) {
+                PyErr_NoMemory();
+            }
+        }
+
+        /* Once a read fails the rest are skipped, but their buffers still go
+           back to the pool. */
+        for (size_t i = 0; i < n_staged; i++) {
+            cache_req_t *req = &staged[i];
+            if (!PyErr_Occurred() && req->result < 0) {
+                PyCache_read_error(req->result, req->path);
+            } else if (!PyErr_Occurred()) {
+                PyObject *bytes = PyBytes_FromStringAndSize((char *) req->data, req->result);
+                PyObject *tuple = PyCache_pack(bytes, req->result);
+                if (tuple != NULL) {
+                    PyList_SET_ITEM(out, index[i], tuple);
+                }
+            }
+            PyCache_put_buffer(self, req->data);
+        }
+        if (PyErr_Occurred()) {
+            Py_CLEAR(out);
+            goto done;
+        }
+    }
+
+done:
+    for (Py_ssize_t i = 0; i < n; i++) {
+        cache_release(self->cache, &reqs[i].view);
+    }
+    PyMem_Free(reqs);
+    Py_DECREF(seq);
+
+    return out;
 }
 
-/* PyCache method to get the cache's "used" field. */
+/* PyCache method to load from cache without issuing IO on miss, and without
+   copying. Returns a tuple (view, size) on success, where VIEW is a read-only
+   memoryview of the cached data. The data stays pinned in the cache until VIEW
+   is released. */
 static PyObject *
-PyCache_get_used(PyCache *self, PyObject *args, PyObject *kwds)
+PyCache_load_view(PyCache *self, PyObject *args, PyObject *kwds)
 {
-    size_t used = self->cache->used;
+    /* Parse arguments. */
+    char *filepath;
+    static char *kwlist[] = {"filepath", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &filepath)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
 
-    return PyLong_FromUnsignedLong(used);
+    cache_view_t view;
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_acquire(self->cache, filepath, &view);
+    Py_END_ALLOW_THREADS
+
+    /* Compressed files can't be viewed in place, so view a copy instead. */
+    if (status == -ENOTSUP) {
+        PyObject *loaded = PyCache_load(self, args, kwds);
+        if (loaded == NULL) {
+            return NULL;
+        }
+        size_t size = PyLong_AsSize_t(PyTuple_GET_ITEM(loaded, 1));
+        PyObject *memview = PyMemoryView_FromObject(PyTuple_GET_ITEM(loaded, 0));
+        Py_DECREF(loaded);
+
+        return PyCache_pack(memview, size);
+    }
+    if (status < 0) {
+        PyErr_Format(PyExc_Exception, "load failed; %s", strerror(-status));
+        return NULL;
+    }
+
+    return PyCache_pack(PyCacheView_wrap(self, &view), view.size);
 }
 
-/* PyCache methods. */
-static PyMethodDef PyCache_methods[] = {
-    {
-        "contains",
-        (PyCFunction) PyCache_contains,
-        METH_VARARGS | METH_KEYWORDS,
-        "Check if the filepath is cached."
+/* PyCache read/get method, without copying on hits. Returns (view, size) as a
+   tuple, where VIEW is a read-only memoryview. If the file is cached, VIEW
+   references the cached data directly and keeps it pinned until released. */
+static PyObject *
+PyCache_read_view(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    /* Parse arguments. */
+    char *filepath;
+    static char *kwlist[] = {"filepath", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &filepath)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+
+    uint8_t *buffer = PyCache_get_buffer(self);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    /* Get the file contents. Staged prefetches are served from the staging
+       ring, and so can't be viewed in place. */
+    PyPrefetch *prefetch = PyCache_get_prefetch(self);
+    cache_view_t view = {.entry = NULL, .ptr = NULL, .size = 0};
+    ssize_t size = -ENODATA;
+    Py_BEGIN_ALLOW_THREADS
+    if (prefetch != NULL) {
+        size = prefetch_take(&prefetch->prefetch,
+                             filepath,
+                             buffer,
+                             self->max_usable_file_size);
+    }
+    if (size == -ENODATA) {
+        size = cache_read_view(self->cache,
+                               filepath,
+                               buffer,
+                               self->max_usable_file_size,
+                               &view);
+    }
+    Py_END_ALLOW_THREADS
+    PyCache_put_prefetch(prefetch);
+    if (size < 0) {
+        PyCache_put_buffer(self, buffer);
+        PyCache_read_error(size, filepath);
+        return NULL;
+    }
+
+    /* Uncached data lives in the staging buffer, which will be reused by the
+       next read, so it has to be copied out. */
+    if (view.ptr == NULL) {
+        PyObject *bytes = PyBytes_FromStringAndSize((char *) buffer, size);
+        PyCache_put_buffer(self, buffer);
+        if (bytes == NULL) {
+            return NULL;
+        }
+        PyObject *memview = PyMemoryView_FromObject(bytes);
+        Py_DECREF(bytes);
+
+        return PyCache_pack(memview, size);
+    }
+
+    PyCache_put_buffer(self, buffer);
+
+    return PyCache_pack(PyCacheView_wrap(self, &view), size);
+}
+
+/* PyCache method to check whether VARIANT of FILEPATH is cached. */
+static PyObject *
+PyCache_contains_variant(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    /* Parse arguments. */
+    char *filepath, *variant;
+    static char *kwlist[] = {"filepath", "variant", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss", kwlist, &filepath, &variant)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+
+    return PyBool_FromLong(cache_contains_variant(self->cache, filepath, variant));
+}
+
+/* PyCache method to store DATA, any C-contiguous buffer (e.g. a numpy array),
+   as VARIANT of FILEPATH, keeping its shape and element format. Returns True
+   if it was stored. */
+static PyObject *
+PyCache_store_variant(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    /* Parse arguments. */
+    char *filepath, *variant;
+    PyObject *data;
+    static char *kwlist[] = {"filepath", "variant", "data", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ssO", kwlist, &filepath, &variant, &data)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+    Py_buffer buf;
+    if (PyObject_GetBuffer(data, &buf, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        return NULL;
+    }
+
+    cache_variant_t meta = {
+        .itemsize = (uint32_t) buf.itemsize,
+        .ndim = (uint32_t) buf.ndim,
+        .size = (uint64_t) buf.len
+    };
+    char *format = buf.format != NULL ? buf.format : "B";
+    if (buf.ndim > VARIANT_MAX_DIMS || strlen(format) >= VARIANT_FORMAT_LEN) {
+        PyBuffer_Release(&buf);
+        PyErr_Format(PyExc_ValueError,
+                     "variants can have at most %d dimensions, and formats of at most %d characters",
+                     VARIANT_MAX_DIMS, VARIANT_FORMAT_LEN - 1);
+        return NULL;
+    }
+    strcpy(meta.format, format);
+    for (int i = 0; i < buf.ndim; i++) {
+        meta.shape[i] = (uint64_t) buf.shape[i];
+    }
+
+    /* Don't cache things that are bigger than we allow. */
+    if (sizeof(cache_variant_t) + meta.size > self->max_cacheable_file_size) {
+        PyBuffer_Release(&buf);
+        return PyBool_FromLong(0);
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_store_variant(self->cache, filepath, variant, &meta, buf.buf);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&buf);
+
+    return PyBool_FromLong(status == 0);
+}
+
+/* PyCache method to load VARIANT of FILEPATH from the cache, without issuing
+   IO. Returns a read-only memoryview with the shape and format it was stored
+   with, referencing the cached data directly (unless it was compressed) and
+   keeping it pinned until released. Returns None on a miss. */
+static PyObject *
+PyCache_load_variant(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    /* Parse arguments. */
+    char *filepath, *variant;
+    static char *kwlist[] = {"filepath", "variant", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss", kwlist, &filepath, &variant)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+
+    cache_view_t view;
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_acquire_variant(self->cache, filepath, variant, &view);
+    Py_END_ALLOW_THREADS
+    if (status == 0) {
+        return PyCacheView_wrap_variant(self, &view, NULL);
+    }
+
+    /* Compressed variants can't be viewed in place, so view a copy instead. */
+    uint8_t *copy = NULL;
+    if (status == -ENOTSUP) {
+        uint8_t *buffer = PyCache_get_buffer(self);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        size_t size = 0;
+        Py_BEGIN_ALLOW_THREADS
+        status = cache_load_variant(self->cache, filepath, variant, buffer, &size,
+                                    self->max_cacheable_file_size);
+        if (status == 0 && (copy = malloc(size)) == NULL) {
+            status = -ENOMEM;
+        }
+        if (status == 0) {
+            memcpy(copy, buffer, size);
+        }
+        Py_END_ALLOW_THREADS
+        PyCache_put_buffer(self, buffer);
+        view = (cache_view_t) {.entry = NULL, .ptr = copy, .size = size};
+    }
+    if (status == -ENODATA) {
+        Py_RETURN_NONE;
+    }
+    if (status < 0) {
+        PyErr_Format(PyExc_Exception, "load failed; %s", strerror(-status));
+        return NULL;
+    }
+
+    return PyCacheView_wrap_variant(self, &view, copy);
+}
+
+/* PyCache method to register FILEPATHS, returning a list of integer IDs that
+   can be passed to read_id and contains_id in place of each path. IDs are
+   stable for the cache's lifetime, and shared with forked processes. */
+static PyObject *
+PyCache_register_paths(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    /* Parse arguments. */
+    PyObject *filepaths;
+    static char *kwlist[] = {"filepaths", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &filepaths)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(filepaths, "filepaths must be a sequence");
+    if (seq == NULL) {
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+
+    char **paths = PyMem_Calloc(n > 0 ? n : 1, sizeof(char *));
+    if (paths == NULL) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    PyObject *out = NULL;
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        if ((paths[i] = (char *) PyUnicode_AsUTF8(item)) == NULL) {
+            goto done;
+        }
+    }
+
+    size_t first;
+    if (cache_register(self->cache, paths, n, &first) < 0) {
+        PyErr_SetString(PyExc_MemoryError, "unable to register paths");
+        goto done;
+    }
+    if ((out = PyList_New(n)) == NULL) {
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *id = PyLong_FromSize_t(first + i);
+        if (id == NULL) {
+            Py_CLEAR(out);
+            goto done;
+        }
+        PyList_SET_ITEM(out, i, id);
+    }
+
+done:
+    PyMem_Free(paths);
+    Py_DECREF(seq);
+
+    return out;
+}
+
+/* Returns the path registered as ID, or NULL with an exception set. */
+static char *
+PyCache_id_path(PyCache *self, PyObject *id)
+{
+    size_t value = PyLong_AsSize_t(id);
+    if (value == (size_t) -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    char *path = cache_id_path(self->cache, value);
+    if (path == NULL) {
+        PyErr_SetString(PyExc_IndexError, "unregistered path ID");
+    }
+
+    return path;
+}
+
+/* PyCache method to check if the path registered as ID is cached. */
+static PyObject *
+PyCache_contains_id(PyCache *self, PyObject *id)
+{
+    if (PyCache_id_path(self, id) == NULL) {
+        return NULL;
+    }
+
+    return PyBool_FromLong((long) cache_contains_id(self->cache, PyLong_AsSize_t(id)));
+}
+
+/* PyCache method to read the path registered as ID, as read does. Returns
+   (data, size) as a tuple. */
+static PyObject *
+PyCache_read_id(PyCache *self, PyObject *id)
+{
+    char *filepath = PyCache_id_path(self, id);
+    if (filepath == NULL) {
+        return NULL;
+    }
+    size_t value = PyLong_AsSize_t(id);
+
+    uint8_t *buffer = PyCache_get_buffer(self);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    /* Staged files are looked up by path; everything else goes by ID. */
+    PyPrefetch *prefetch = PyCache_get_prefetch(self);
+    ssize_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = -ENODATA;
+    if (prefetch != NULL) {
+        size = prefetch_take(&prefetch->prefetch,
+                             filepath,
+                             buffer,
+                             self->max_usable_file_size);
+    }
+    if (size == -ENODATA) {
+        size = cache_read_id(self->cache, value, buffer, self->max_usable_file_size);
+    }
+    Py_END_ALLOW_THREADS
+    PyCache_put_prefetch(prefetch);
+    if (size < 0) {
+        PyCache_put_buffer(self, buffer);
+        PyCache_read_error(size, filepath);
+        return NULL;
+    }
+
+    PyObject *bytes = PyBytes_FromStringAndSize((char *) buffer, size);
+    PyCache_put_buffer(self, buffer);
+
+    return PyCache_pack(bytes, size);
+}
+
+/* PyCache method to set the predicted number of reads of each path registered
+   in IDS to the matching entry of REUSE (or to unknown, if it's None), for
+   admission by read_id. */
+static PyObject *
+PyCache_set_reuse(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    /* Parse arguments. */
+    PyObject *ids, *reuse;
+    static char *kwlist[] = {"ids", "reuse", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO", kwlist, &ids, &reuse)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+    PyObject *id_seq = PySequence_Fast(ids, "ids must be a sequence");
+    if (id_seq == NULL) {
+        return NULL;
+    }
+    PyObject *reuse_seq = PySequence_Fast(reuse, "reuse must be a sequence");
+    if (reuse_seq == NULL) {
+        Py_DECREF(id_seq);
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(id_seq);
+    PyObject *out = NULL;
+    if (PySequence_Fast_GET_SIZE(reuse_seq) != n) {
+        PyErr_SetString(PyExc_ValueError, "ids and reuse must be the same length");
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *id = PySequence_Fast_GET_ITEM(id_seq, i);
+        PyObject *item = PySequence_Fast_GET_ITEM(reuse_seq, i);
+        if (PyCache_id_path(self, id) == NULL) {
+            goto done;
+        }
+        double value = item == Py_None ? REUSE_UNKNOWN : PyFloat_AsDouble(item);
+        if (value == -1.0 && PyErr_Occurred()) {
+            goto done;
+        }
+        if (value < 0 && item != Py_None) {
+            PyErr_SetString(PyExc_ValueError, "reuse must be non-negative");
+            goto done;
+        }
+        cache_set_reuse(self->cache, PyLong_AsSize_t(id), (float) value);
+    }
+    out = Py_None;
+    Py_INCREF(out);
+
+done:
+    Py_DECREF(id_seq);
+    Py_DECREF(reuse_seq);
+
+    return out;
+}
+
+/* PyCache method to only admit files predicted to be read more than THRESHOLD
+   times per MB they'd take up. */
+static PyObject *
+PyCache_set_admission(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    /* Parse arguments. */
+    double threshold;
+    static char *kwlist[] = {"threshold", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "d", kwlist, &threshold)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be non-negative");
+        return NULL;
+    }
+    cache_set_admission(self->cache, threshold);
+
+    Py_RETURN_NONE;
+}
+
+/* PyCache method to start asynchronously prefetching FILEPATHS, in the order
+   they will be read. Background threads read up to DEPTH files ahead of the
+   reads issued through this PyCache, caching what fits, and staging what
+   doesn't so that it can still be served without waiting on IO. Replaces any
+   previous prefetch; an empty list just stops prefetching. */
+static PyObject *
+PyCache_prefetch(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    /* Parse arguments. */
+    PyObject *filepaths;
+    Py_ssize_t depth = 64;
+    Py_ssize_t threads = 8;
+    static char *kwlist[] = {"filepaths", "depth", "threads", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|nn", kwlist,
+                                     &filepaths, &depth, &threads)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+    if (depth <= 0 || threads <= 0) {
+        PyErr_SetString(PyExc_ValueError, "depth and threads must be positive");
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(filepaths, "filepaths must be a sequence");
+    if (seq == NULL) {
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+
+    /* Stop the previous prefetch (once reads using it finish). */
+    PyCache_put_prefetch(self->prefetch);
+    self->prefetch = NULL;
+    if (n == 0) {
+        Py_DECREF(seq);
+        Py_RETURN_NONE;
+    }
+
+    char **paths = PyMem_Calloc(n, sizeof(char *));
+    PyPrefetch *prefetch = PyMem_Calloc(1, sizeof(PyPrefetch));
+    if (paths == NULL || prefetch == NULL) {
+        PyMem_Free(paths);
+        PyMem_Free(prefetch);
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if ((paths[i] = (char *) PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i))) == NULL) {
+            PyMem_Free(paths);
+            PyMem_Free(prefetch);
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+
+    /* The prefetcher copies the paths. */
+    int status = prefetch_start(&prefetch->prefetch,
+                                self->cache,
+                                paths,
+                                n,
+                                depth,
+                                threads,
+                                self->max_usable_file_size);
+    PyMem_Free(paths);
+    Py_DECREF(seq);
+    if (status < 0) {
+        PyMem_Free(prefetch);
+        PyErr_Format(PyExc_Exception, "prefetch failed; %s", strerror(-status));
+        return NULL;
+    }
+    prefetch->refs = 1;
+    self->prefetch = prefetch;
+
+    Py_RETURN_NONE;
+}
+
+/* PyCache method to flush the cache. Fails if any cached data is still in
+   use, by a view or a save, once reads in progress are done with it. The GIL
+   is released meanwhile, so that other threads can release their views. */
+static PyObject *
+PyCache_flush(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_flush(self->cache);
+    Py_END_ALLOW_THREADS
+    if (status == -EBUSY) {
+        PyErr_SetString(PyExc_BufferError, "cached data is still in use by a view or a save");
+        return NULL;
+    } else if (status < 0) {
+        errno = -status;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    return PyLong_FromLong(0L);
+}
+
+/* PyCache method to resize the cache to SIZE bytes while it's in use. */
+static PyObject *
+PyCache_resize(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t size;
+    static char *kwlist[] = {"size", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &size)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+    if (size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        return NULL;
+    }
+
+    int status = cache_resize(self->cache, size);
+    switch (status) {
+        case 0:
+            Py_RETURN_NONE;
+        case -EINVAL:
+            PyErr_SetString(PyExc_ValueError, "an arena can't grow past the size it was created with");
+            return NULL;
+        case -EBUSY:
+            PyErr_SetString(PyExc_RuntimeError, "cache is being flushed");
+            return NULL;
+        default:
+            PyErr_Format(PyExc_RuntimeError, "couldn't resize cache; %s", strerror(-status));
+            return NULL;
+    }
+}
+
+/* PyCache method to save the cache to a snapshot file at PATH, which open can
+   index later. Returns the number of files saved. */
+static PyObject *
+PyCache_save(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    char *path;
+    static char *kwlist[] = {"path", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &path)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_save(self->cache, path);
+    Py_END_ALLOW_THREADS
+    if (status < 0) {
+        errno = -status;
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+
+    return PyLong_FromLong(status);
+}
+
+/* PyCache method to index the snapshot file at PATH, without reading its data.
+   Returns the number of files indexed. */
+static PyObject *
+PyCache_open(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    char *path;
+    static char *kwlist[] = {"path", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &path)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_open(self->cache, path);
+    Py_END_ALLOW_THREADS
+    switch (status) {
+        case -EINVAL:
+            PyErr_Format(PyExc_ValueError, "%s isn't a valid snapshot", path);
+            return NULL;
+        case -EBUSY:
+            PyErr_SetString(PyExc_RuntimeError, "a snapshot is already open");
+            return NULL;
+        case -ENOTSUP:
+            PyErr_SetString(PyExc_RuntimeError, "named caches don't support snapshots");
+            return NULL;
+        default:
+            if (status < 0) {
+                errno = -status;
+                return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            }
+    }
+
+    return PyLong_FromLong(status);
+}
+
+/* PyCache method to add a tar shard, whose members can then be read through
+   the cache as "<shard path>/<member name>". Returns the number of members. */
+static PyObject *
+PyCache_add_shard(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    char *path;
+    static char *kwlist[] = {"path", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &path)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_add_shard(self->cache, path);
+    Py_END_ALLOW_THREADS
+    switch (status) {
+        case -EINVAL:
+            PyErr_Format(PyExc_ValueError, "%s isn't a valid tar file", path);
+            return NULL;
+        case -ENOSPC:
+            PyErr_SetString(PyExc_RuntimeError, "the shard index is full");
+            return NULL;
+        case -ENOTSUP:
+            PyErr_SetString(PyExc_RuntimeError, "named caches don't support shards");
+            return NULL;
+        default:
+            if (status < 0) {
+                errno = -status;
+                return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            }
+    }
+
+    return PyLong_FromLong(status);
+}
+
+/* PyCache method to add a peer tier over the caches of every node listed in
+   PEERS ("host:port" addresses), of which this is PEERS[RANK], serving this
+   one to them. Every node must list the same peers in the same order, and
+   pass the same secret TOKEN. */
+static PyObject *
+PyCache_add_peers(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *peers;
+    int rank;
+    char *token;
+    static char *kwlist[] = {"peers", "rank", "token", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Ois", kwlist, &peers, &rank, &token)) {
+        PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(peers, "peers must be a sequence");
+    if (seq == NULL) {
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    if (n < 1 || n > MAX_PEERS) {
+        Py_DECREF(seq);
+        PyErr_Format(PyExc_ValueError, "there must be between 1 and %d peers", MAX_PEERS);
+        return NULL;
+    }
+
+    char *addrs[MAX_PEERS];
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if ((addrs[i] = (char *) PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i))) == NULL) {
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = cache_add_peers(self->cache, addrs, (int) n, rank, token);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(seq);
+    switch (status) {
+        case 0:
+            Py_RETURN_NONE;
+        case -EINVAL:
+            PyErr_Format(PyExc_ValueError,
+                         "peers must be \"host:port\" addresses, rank one of them, and token %d characters at most",
+                         PEER_TOKEN_LEN - 1);
+            return NULL;
+        case -EHOSTUNREACH:
+            PyErr_SetString(PyExc_ValueError, "couldn't resolve every peer's host");
+            return NULL;
+        case -EEXIST:
+            PyErr_SetString(PyExc_RuntimeError, "the cache already has peers");
+            return NULL;
+        case -ENOTSUP:
+            PyErr_SetString(PyExc_RuntimeError, "named caches don't support peers");
+            return NULL;
+        default:
+            errno = -status;
+            return PyErr_SetFromErrno(PyExc_OSError);
+    }
+}
+
+/* PyCache method to get the cache's "size" field. */
+static PyObject *
+PyCache_get_size(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    return PyLong_FromUnsignedLong(self->cache->size);
+}
+
+/* PyCache method to get the cache's "used" field. */
+static PyObject *
+PyCache_get_used(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    size_t used = self->cache->used;
+
+    return PyLong_FromUnsignedLong(used);
+}
+
+/* Convert HIST to a dict of its count, sum and buckets, omitting trailing empty
+   buckets. */
+static PyObject *
+PyCache_hist_dict(cache_hist_t *hist)
+{
+    int n_buckets = N_HIST_BUCKETS;
+    while (n_buckets > 0 && hist->buckets[n_buckets - 1] == 0) {
+        n_buckets--;
+    }
+
+    size_t count = 0;
+    PyObject *buckets = PyList_New(n_buckets);
+    if (buckets == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < n_buckets; i++) {
+        count += hist->buckets[i];
+        PyList_SET_ITEM(buckets, i, PyLong_FromSize_t(hist->buckets[i]));
+    }
+    for (int i = n_buckets; i < N_HIST_BUCKETS; i++) {
+        count += hist->buckets[i];
+    }
+
+    return Py_BuildValue("{s:n,s:n,s:N}",
+                         "count", (Py_ssize_t) count,
+                         "sum", (Py_ssize_t) hist->sum,
+                         "buckets", buckets);
+}
+
+/* PyCache method to get the cache's statistics, across every process using
+   it. */
+static PyObject *
+PyCache_stats(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    cache_stats_t stats;
+    cache_get_stats(self->cache, &stats);
+
+    static const char *hist_names[N_HISTS] = {
+        [HIST_HIT_NS] = "hit_latency_ns",
+        [HIST_MISS_NS] = "miss_latency_ns",
+        [HIST_DISK_BYTES] = "disk_bytes",
+        [HIST_CACHE_BYTES] = "cache_bytes",
+        [HIST_SPILL_NS] = "spill_latency_ns",
+        [HIST_PEER_NS] = "peer_latency_ns",
+    };
+
+    double ratio = stats.n_bytes_stored > 0 ? (double) stats.n_bytes_raw / stats.n_bytes_stored : 1.0;
+    double fragmentation = stats.arena_held > 0 ? 1.0 - (double) self->cache->used / stats.arena_held : 0.0;
+    PyObject *dict = Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:d,s:n,s:n,s:n,s:n,s:n,s:n,s:d,s:n,s:n,s:n}",
+                                   "accesses", (Py_ssize_t) stats.n_accs,
+                                   "hits", (Py_ssize_t) stats.n_hits,
+                                   "cold_misses", (Py_ssize_t) stats.n_miss_cold,
+                                   "capacity_misses", (Py_ssize_t) stats.n_miss_capacity,
+                                   "fails", (Py_ssize_t) stats.n_fail,
+                                   "buffered_reads", (Py_ssize_t) stats.n_buffered,
+                                   "coalesced_reads", (Py_ssize_t) stats.n_coalesced,
+                                   "evictions", (Py_ssize_t) stats.n_evictions,
+                                   "used", (Py_ssize_t) self->cache->used,
+                                   "size", (Py_ssize_t) self->cache->size,
+                                   "stored_raw_bytes", (Py_ssize_t) stats.n_bytes_raw,
+                                   "stored_bytes", (Py_ssize_t) stats.n_bytes_stored,
+                                   "compression_ratio", ratio,
+                                   "local_reads", (Py_ssize_t) stats.n_reads_local,
+                                   "remote_reads", (Py_ssize_t) stats.n_reads_remote,
+                                   "spill_hits", (Py_ssize_t) stats.n_spill_hits,
+                                   "spill_stores", (Py_ssize_t) stats.n_spill_stores,
+                                   "spill_used", (Py_ssize_t) (self->cache->spill != 0 ? CACHE_SPILL(self->cache)->used : 0),
+                                   "arena_held", (Py_ssize_t) stats.arena_held,
+                                   "fragmentation", fragmentation,
+                                   "rejected", (Py_ssize_t) stats.n_rejected,
+                                   "peer_hits", (Py_ssize_t) stats.n_peer_hits,
+                                   "peer_fails", (Py_ssize_t) stats.n_peer_fails);
+    if (dict == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < N_HISTS; i++) {
+        PyObject *hist = PyCache_hist_dict(&stats.hists[i]);
+        if (hist == NULL || PyDict_SetItemString(dict, hist_names[i], hist) < 0) {
+            Py_XDECREF(hist);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(hist);
+    }
+
+    return dict;
+}
+
+/* PyCache method to get the cache's memory use, as a dict of the bytes of it
+   that are page-locked, couldn't be, and are resident. */
+static PyObject *
+PyCache_memory(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    cache_memory_t memory;
+    Py_BEGIN_ALLOW_THREADS
+    cache_get_memory(self->cache, &memory);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("{s:n,s:n,s:n}",
+                         "pinned", (Py_ssize_t) memory.pinned,
+                         "unpinned", (Py_ssize_t) memory.unpinned,
+                         "resident", (Py_ssize_t) memory.resident);
+}
+
+/* PyCache method to zero the cache's statistics. */
+static PyObject *
+PyCache_reset_stats(PyCache *self, PyObject *args, PyObject *kwds)
+{
+    cache_reset_stats(self->cache);
+
+    Py_RETURN_NONE;
+}
+
+/* PyCache methods. */
+static PyMethodDef PyCache_methods[] = {
+    {
+        "contains",
+        (PyCFunction) PyCache_contains,
+        METH_VARARGS | METH_KEYWORDS,
+        "Check if the filepath is cached."
     },
     {
         "load",
@@ -334,12 +1745,120 @@ static PyMethodDef PyCache_methods[] = {
         METH_VARARGS | METH_KEYWORDS,
         "Read a file through the cache."
     },
+    {
+        "read_many",
+        (PyCFunction) PyCache_read_many,
+        METH_VARARGS | METH_KEYWORDS,
+        "Read a list of files through the cache, as a batch."
+    },
+    {
+        "read_range",
+        (PyCFunction) PyCache_read_range,
+        METH_VARARGS | METH_KEYWORDS,
+        "Read a byte range of a file through the cache, caching it in blocks."
+    },
+    {
+        "load_view",
+        (PyCFunction) PyCache_load_view,
+        METH_VARARGS | METH_KEYWORDS,
+        "Load the filepath if it's cached, as a zero-copy memoryview."
+    },
+    {
+        "contains_variant",
+        (PyCFunction) PyCache_contains_variant,
+        METH_VARARGS | METH_KEYWORDS,
+        "Check whether a variant of the filepath is cached."
+    },
+    {
+        "store_variant",
+        (PyCFunction) PyCache_store_variant,
+        METH_VARARGS | METH_KEYWORDS,
+        "Store an array (e.g. a decoded sample) as a variant of the filepath."
+    },
+    {
+        "load_variant",
+        (PyCFunction) PyCache_load_variant,
+        METH_VARARGS | METH_KEYWORDS,
+        "Load a variant of the filepath if it's cached, as a shaped memoryview."
+    },
+    {
+        "read_view",
+        (PyCFunction) PyCache_read_view,
+        METH_VARARGS | METH_KEYWORDS,
+        "Read a file through the cache, as a zero-copy memoryview on hits."
+    },
+    {
+        "register_paths",
+        (PyCFunction) PyCache_register_paths,
+        METH_VARARGS | METH_KEYWORDS,
+        "Register a list of filepaths, returning an integer ID for each."
+    },
+    {
+        "contains_id",
+        (PyCFunction) PyCache_contains_id,
+        METH_O,
+        "Check if the filepath registered as an ID is cached."
+    },
+    {
+        "read_id",
+        (PyCFunction) PyCache_read_id,
+        METH_O,
+        "Read the filepath registered as an ID through the cache."
+    },
+    {
+        "set_reuse",
+        (PyCFunction) PyCache_set_reuse,
+        METH_VARARGS | METH_KEYWORDS,
+        "Set the predicted number of reads of registered paths, for admission."
+    },
+    {
+        "set_admission",
+        (PyCFunction) PyCache_set_admission,
+        METH_VARARGS | METH_KEYWORDS,
+        "Only admit files predicted to be read more than threshold times per MB."
+    },
+    {
+        "prefetch",
+        (PyCFunction) PyCache_prefetch,
+        METH_VARARGS | METH_KEYWORDS,
+        "Prefetch files in the order they will be read."
+    },
     {
         "flush",
         (PyCFunction) PyCache_flush,
         METH_NOARGS,
         "Flush the cache."
     },
+    {
+        "resize",
+        (PyCFunction) PyCache_resize,
+        METH_VARARGS | METH_KEYWORDS,
+        "Resize the cache while it's in use."
+    },
+    {
+        "save",
+        (PyCFunction) PyCache_save,
+        METH_VARARGS | METH_KEYWORDS,
+        "Save the cache to a snapshot file."
+    },
+    {
+        "open",
+        (PyCFunction) PyCache_open,
+        METH_VARARGS | METH_KEYWORDS,
+        "Index a snapshot file saved by save, paging its data in lazily."
+    },
+    {
+        "add_shard",
+        (PyCFunction) PyCache_add_shard,
+        METH_VARARGS | METH_KEYWORDS,
+        "Index (and cache) the members of a tar shard, read by shard/member path."
+    },
+    {
+        "add_peers",
+        (PyCFunction) PyCache_add_peers,
+        METH_VARARGS | METH_KEYWORDS,
+        "Read misses on files other nodes own from their caches, and serve this one to them."
+    },
     {
         "get_size",
         (PyCFunction) PyCache_get_size,
@@ -352,6 +1871,24 @@ static PyMethodDef PyCache_methods[] = {
         METH_NOARGS,
         "Get number of bytes used in cache."
     },
+    {
+        "stats",
+        (PyCFunction) PyCache_stats,
+        METH_NOARGS,
+        "Get the cache's counters and histograms."
+    },
+    {
+        "reset_stats",
+        (PyCFunction) PyCache_reset_stats,
+        METH_NOARGS,
+        "Zero the cache's counters and histograms."
+    },
+    {
+        "memory",
+        (PyCFunction) PyCache_memory,
+        METH_NOARGS,
+        "Get how much of the cache's memory is pinned, unpinned and resident."
+    },
     {NULL} /* Sentinel. */
 };
 
@@ -392,6 +1929,9 @@ PyInit_minio(void)
     if (PyType_Ready(&PythonCacheType) < 0) {
         return NULL;
     }
+    if (PyType_Ready(&PythonCacheViewType) < 0) {
+        return NULL;
+    }
 
     /* Create Python module. */
     if ((module = PyModule_Create(&miniomodule)) == NULL) {
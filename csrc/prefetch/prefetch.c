@@ -0,0 +1,314 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#define _GNU_SOURCE
+
+#include "prefetch.h"
+#include "../utils/utils.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define PREFETCH_BLOCK_SIZE (4096)
+
+
+/* Bring item I into the cache, or failing that, into its staging buffer.
+   Called without the lock held; item I is ITEM_LOADING, which reserves its
+   staging buffer. Files are read with direct IO (where the filesystem allows
+   it) straight into the space reserved for them in the cache, if there's room.
+   Returns the item's new state. */
+static item_state_t
+prefetch_load(prefetch_t *p, size_t i)
+{
+    prefetch_item_t *item = &p->items[i];
+    if (cache_contains(p->cache, item->path)) {
+        return ITEM_CACHED;
+    }
+
+    /* Let the consumer's own read report any failure. */
+    bool buffered = false;
+    int fd = open(item->path, O_RDONLY | __O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        fd = open(item->path, O_RDONLY);
+        buffered = true;
+    }
+    if (fd < 0) {
+        return ITEM_DONE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || (size_t) st.st_size > p->max_size) {
+        close(fd);
+        return ITEM_DONE;
+    }
+
+    size_t size = st.st_size;
+    size_t chunk = read_chunk_size(st.st_blksize);
+    cache_slot_t slot;
+    if (cache_should_reserve(p->cache, size) &&
+        cache_reserve(p->cache, item->path, size, &slot) == 0) {
+        ssize_t n = read_full(fd, slot.ptr, size, 0, chunk, &buffered);
+        if (n == (ssize_t) size) {
+            close(fd);
+            cache_commit(p->cache, &slot, NULL);
+            return ITEM_CACHED;
+        }
+        cache_abort(p->cache, &slot);
+    }
+
+    /* Otherwise stage it, and store it the usual way if it fits. */
+    uint8_t *buffer = p->staging[i % p->depth];
+    ssize_t n = read_full(fd, buffer, size, 0, chunk, &buffered);
+    close(fd);
+    if (n <= 0) {
+        return ITEM_DONE;
+    }
+    if (cache_store(p->cache, item->path, buffer, n) == 0) {
+        return ITEM_CACHED;
+    }
+    item->size = n;
+
+    return ITEM_STAGED;
+}
+
+/* Prefetch thread. Issues items in sequence order, staying within DEPTH items
+   of the consumer. */
+static void *
+prefetch_worker(void *arg)
+{
+    prefetch_t *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stopping) {
+        /* Skip anything the consumer already got to. */
+        while (p->next < p->n_items && p->items[p->next].state != ITEM_PENDING) {
+            p->next++;
+        }
+        if (p->next >= p->n_items) {
+            break;
+        }
+        if (p->next >= p->head + p->depth) {
+            pthread_cond_wait(&p->issue_cv, &p->lock);
+            continue;
+        }
+
+        size_t i = p->next++;
+        p->items[i].state = ITEM_LOADING;
+        pthread_mutex_unlock(&p->lock);
+
+        item_state_t state = prefetch_load(p, i);
+
+        pthread_mutex_lock(&p->lock);
+        p->items[i].state = state;
+        if (state == ITEM_CACHED) {
+            p->n_cached++;
+        } else if (state == ITEM_STAGED) {
+            p->n_staged++;
+        }
+        pthread_cond_broadcast(&p->done_cv);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+/* Start prefetching the N files in PATHS into CACHE, in order, using N_THREADS
+   threads reading at most DEPTH items ahead of the consumer. Files that don't
+   fit in the cache are staged in DEPTH buffers of MAX_SIZE bytes each. P must
+   be zeroed or stopped. On success returns 0. On failure returns negative
+   errno, and P is left stopped. */
+int
+prefetch_start(prefetch_t *p,
+               cache_t *cache,
+               char **paths,
+               size_t n,
+               size_t depth,
+               size_t n_threads,
+               size_t max_size)
+{
+    if (n == 0 || depth == 0 || n_threads == 0) {
+        return -EINVAL;
+    }
+    n_threads = MIN(n_threads, PREFETCH_MAX_THREADS);
+
+    memset(p, 0, sizeof(prefetch_t));
+    p->cache = cache;
+    p->depth = depth;
+    p->max_size = max_size;
+    p->pid = getpid();
+
+    /* Copy the sequence. */
+    if ((p->items = calloc(n, sizeof(prefetch_item_t))) == NULL) {
+        return -ENOMEM;
+    }
+    p->n_items = n;
+    for (size_t i = 0; i < n; i++) {
+        if ((p->items[i].path = strdup(paths[i])) == NULL) {
+            prefetch_stop(p);
+            return -ENOMEM;
+        }
+        p->items[i].hash = utils_hash_str(paths[i]);
+        p->items[i].state = ITEM_PENDING;
+    }
+
+    /* Staging buffers are only touched as far as the files read into them, so
+       most of this is never made resident. */
+    if ((p->staging = calloc(depth, sizeof(uint8_t *))) == NULL) {
+        prefetch_stop(p);
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < depth; i++) {
+        if (posix_memalign((void **) &p->staging[i], PREFETCH_BLOCK_SIZE,
+                           (max_size + PREFETCH_BLOCK_SIZE - 1) & ~((size_t) PREFETCH_BLOCK_SIZE - 1)) != 0) {
+            prefetch_stop(p);
+            return -ENOMEM;
+        }
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->issue_cv, NULL);
+    pthread_cond_init(&p->done_cv, NULL);
+    for (; p->n_threads < n_threads; p->n_threads++) {
+        if (pthread_create(&p->threads[p->n_threads], NULL, prefetch_worker, p) != 0) {
+            break;
+        }
+    }
+    if (p->n_threads == 0) {
+        prefetch_stop(p);
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+/* Consume PATH from P's sequence. If PATH was staged, its data is copied into
+   DATA (MAX_SIZE bytes), and the number of bytes is returned. Otherwise returns
+   -ENODATA, and the caller should read PATH through the cache as usual, where
+   it will have been cached if it fit. If PATH is still being prefetched, waits
+   for it to finish rather than issuing a second read. */
+ssize_t
+prefetch_take(prefetch_t *p, char *path, void *data, uint64_t max_size)
+{
+    /* Prefetch threads don't survive a fork. */
+    if (p->items == NULL || p->pid != getpid()) {
+        return -ENODATA;
+    }
+
+    uint64_t hash = utils_hash_str(path);
+    pthread_mutex_lock(&p->lock);
+    size_t end = MIN(p->n_items, p->head + p->depth);
+    size_t i = p->head;
+    for (; i < end; i++) {
+        prefetch_item_t *item = &p->items[i];
+        if (item->hash == hash && strcmp(item->path, path) == 0) {
+            break;
+        }
+    }
+    if (i == end) {
+        pthread_mutex_unlock(&p->lock);
+        return -ENODATA;
+    }
+
+    /* Don't race the prefetch thread to the disk. */
+    prefetch_item_t *item = &p->items[i];
+    while (item->state == ITEM_LOADING) {
+        pthread_cond_wait(&p->done_cv, &p->lock);
+    }
+
+    ssize_t status = -ENODATA;
+    if (item->state == ITEM_STAGED) {
+        /* Copy outside the lock; ITEM_TAKING keeps the buffer reserved. */
+        item->state = ITEM_TAKING;
+        pthread_mutex_unlock(&p->lock);
+        if ((uint64_t) item->size <= max_size) {
+            memcpy(data, p->staging[i % p->depth], item->size);
+            status = item->size;
+        } else {
+            status = -EINVAL;
+        }
+        pthread_mutex_lock(&p->lock);
+        p->n_staged_hits++;
+    }
+    if (item->state != ITEM_TAKING || status != -ENODATA) {
+        item->state = ITEM_DONE;
+    }
+
+    /* The sequence is read in order, so anything before this item that hasn't
+       been consumed was skipped. Release it, then advance the window past
+       everything that's finished. */
+    for (size_t j = p->head; j < i; j++) {
+        item_state_t state = p->items[j].state;
+        if (state == ITEM_PENDING || state == ITEM_CACHED || state == ITEM_STAGED) {
+            p->items[j].state = ITEM_DONE;
+        }
+    }
+    while (p->head < p->n_items && p->items[p->head].state == ITEM_DONE) {
+        p->head++;
+    }
+    pthread_cond_broadcast(&p->issue_cv);
+    pthread_mutex_unlock(&p->lock);
+
+    return status;
+}
+
+/* Stop prefetching, waiting for in-flight reads, and free P's resources. P is
+   left zeroed. Safe to call on a zeroed or already-stopped prefetcher, and in
+   a forked child of the process that started it. */
+void
+prefetch_stop(prefetch_t *p)
+{
+    if (p->items == NULL) {
+        return;
+    }
+
+    /* The threads (and the state of the lock) only exist in the owner. */
+    if (p->pid == getpid() && p->n_threads > 0) {
+        pthread_mutex_lock(&p->lock);
+        p->stopping = true;
+        pthread_cond_broadcast(&p->issue_cv);
+        pthread_cond_broadcast(&p->done_cv);
+        pthread_mutex_unlock(&p->lock);
+        for (size_t i = 0; i < p->n_threads; i++) {
+            pthread_join(p->threads[i], NULL);
+        }
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->issue_cv);
+        pthread_cond_destroy(&p->done_cv);
+    }
+
+    for (size_t i = 0; i < p->n_items; i++) {
+        free(p->items[i].path);
+    }
+    free(p->items);
+    if (p->staging != NULL) {
+        for (size_t i = 0; i < p->depth; i++) {
+            free(p->staging[i]);
+        }
+        free(p->staging);
+    }
+    memset(p, 0, sizeof(prefetch_t));
+}
@@ -0,0 +1,91 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef __PREFETCH_H_
+#define __PREFETCH_H_
+
+#include "../minio/minio.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define PREFETCH_MAX_THREADS (64)
+
+/* State of one item in a prefetch sequence. */
+typedef enum {
+    ITEM_PENDING,   /* Not yet issued. */
+    ITEM_LOADING,   /* Being read by a prefetch thread. */
+    ITEM_CACHED,    /* Resident in the cache. */
+    ITEM_STAGED,    /* Didn't fit in the cache; held in the staging ring. */
+    ITEM_TAKING,    /* Staged data being copied out by the consumer. */
+    ITEM_DONE,      /* Consumed, skipped, or failed. Holds no resources. */
+} item_state_t;
+
+/* One item in a prefetch sequence. */
+typedef struct {
+    char         *path;     /* Path of the file. */
+    uint64_t      hash;     /* Hash of PATH, to speed up matching reads. */
+    item_state_t  state;    /* Progress of this item. */
+    ssize_t       size;     /* Bytes staged, when ITEM_STAGED. */
+} prefetch_item_t;
+
+/* Asynchronous prefetcher. Reads a known sequence of files ahead of the
+   consumer using a pool of threads, filling CACHE with everything that fits
+   and staging what doesn't in a ring of DEPTH buffers. The prefetcher belongs
+   to the process that started it; the cache it fills may be shared.
+
+   Synchronization uses a private mutex, only ever held for short, non-blocking
+   critical sections, and never while calling into Python. */
+typedef struct {
+    cache_t         *cache;         /* Cache being filled. */
+    size_t           depth;         /* Maximum items ahead of the consumer. */
+    size_t           max_size;      /* Size of each staging buffer. */
+    uint8_t        **staging;       /* DEPTH buffers. Item I uses I % DEPTH. */
+    pid_t            pid;           /* Process owning the prefetch threads. */
+
+    /* Sequence. */
+    prefetch_item_t *items;         /* Items, in the order they'll be read. */
+    size_t           n_items;       /* Number of items. */
+    size_t           head;          /* First item not yet consumed. */
+    size_t           next;          /* Next item to issue. */
+    bool             stopping;      /* Threads should exit. */
+
+    /* Statistics. */
+    size_t           n_cached;      /* Items brought into the cache. */
+    size_t           n_staged;      /* Items staged outside the cache. */
+    size_t           n_staged_hits; /* Reads served from the staging ring. */
+
+    /* Synchronization. */
+    pthread_mutex_t  lock;          /* Protects everything above. */
+    pthread_cond_t   issue_cv;      /* Signalled when the window advances. */
+    pthread_cond_t   done_cv;       /* Signalled when an item finishes. */
+    pthread_t        threads[PREFETCH_MAX_THREADS];
+    size_t           n_threads;
+} prefetch_t;
+
+int prefetch_start(prefetch_t *p, cache_t *cache, char **paths, size_t n, size_t depth, size_t n_threads, size_t max_size);
+ssize_t prefetch_take(prefetch_t *p, char *path, void *data, uint64_t max_size);
+void prefetch_stop(prefetch_t *p);
+
+#endif
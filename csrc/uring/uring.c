@@ -0,0 +1,211 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* The kernel and userspace share the ring indices, so accesses to the indices
+   the other side writes need acquire/release ordering. */
+#define LOAD_ACQUIRE(p) atomic_load_explicit((_Atomic unsigned *) (p), memory_order_acquire)
+#define STORE_RELEASE(p, v) atomic_store_explicit((_Atomic unsigned *) (p), (v), memory_order_release)
+
+
+/* Set up RING with (at least) ENTRIES submission queue entries. On success
+   returns 0. On failure returns negative errno, e.g. -ENOSYS or -EPERM when
+   io_uring is unavailable or disabled. */
+int
+uring_init(uring_t *ring, unsigned entries)
+{
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -errno;
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+
+    /* Map the submission and completion rings. Older kernels without
+       IORING_FEAT_SINGLE_MMAP need them mapped separately. */
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_destroy(ring);
+        return -ENOMEM;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_destroy(ring);
+            return -ENOMEM;
+        }
+    }
+
+    /* Map the submission queue entries themselves. */
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return -ENOMEM;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    return 0;
+}
+
+/* Queue a read of LEN bytes at OFFSET in FD into BUF, tagged with USER_DATA.
+   The read is not issued until uring_submit is called. Returns false if the
+   submission queue is full. */
+bool
+uring_prep_read(uring_t *ring,
+                int fd,
+                void *buf,
+                unsigned len,
+                uint64_t offset,
+                uint64_t user_data)
+{
+    unsigned head = LOAD_ACQUIRE(ring->sq_head);
+    if (ring->sq_local_tail - head >= ring->entries) {
+        return false;
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+
+    return true;
+}
+
+/* Submit all queued reads, then block until at least WAIT_NR completions are
+   available. Returns the number of SQEs submitted, or negative errno. */
+int
+uring_submit(uring_t *ring, unsigned wait_nr)
+{
+    /* Count from the kernel's head rather than the published tail, so entries
+       left over from a failed submission are retried. */
+    STORE_RELEASE(ring->sq_tail, ring->sq_local_tail);
+    unsigned to_submit = ring->sq_local_tail - LOAD_ACQUIRE(ring->sq_head);
+
+    int status;
+    do {
+        status = syscall(__NR_io_uring_enter,
+                         ring->fd,
+                         to_submit,
+                         wait_nr,
+                         wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0,
+                         NULL,
+                         0);
+    } while (status < 0 && errno == EINTR);
+
+    return status < 0 ? -errno : status;
+}
+
+/* Consume one completion, if any is available, storing its tag and result
+   into USER_DATA and RES. Returns false if the completion queue is empty. */
+bool
+uring_reap(uring_t *ring, uint64_t *user_data, int32_t *res)
+{
+    unsigned head = *ring->cq_head;
+    if (head == LOAD_ACQUIRE(ring->cq_tail)) {
+        return false;
+    }
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    STORE_RELEASE(ring->cq_head, head + 1);
+
+    return true;
+}
+
+/* Tear down RING. All submitted reads must have been reaped first, since the
+   kernel may otherwise still write into their buffers. */
+void
+uring_destroy(uring_t *ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+}
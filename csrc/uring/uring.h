@@ -0,0 +1,67 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef __URING_H_
+#define __URING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Minimal io_uring instance, driven directly through the io_uring syscalls so
+   no liburing dependency is needed. Not thread safe; each thread (or batch)
+   should use its own ring. */
+typedef struct {
+    int       fd;               /* Ring file descriptor. */
+    unsigned  entries;          /* Number of SQEs in the submission queue. */
+
+    /* Submission queue. */
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned             sq_local_tail;  /* SQEs prepared but not submitted. */
+
+    /* Completion queue. */
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Mappings, kept for teardown. */
+    void   *sq_ring;
+    size_t  sq_ring_size;
+    void   *cq_ring;
+    size_t  cq_ring_size;
+    size_t  sqes_size;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+bool uring_prep_read(uring_t *ring, int fd, void *buf, unsigned len, uint64_t offset, uint64_t user_data);
+int uring_submit(uring_t *ring, unsigned wait_nr);
+bool uring_reap(uring_t *ring, uint64_t *user_data, int32_t *res);
+void uring_destroy(uring_t *ring);
+
+#endif
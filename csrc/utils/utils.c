@@ -21,13 +21,29 @@
    SOFTWARE.
    */
 
+#define _GNU_SOURCE
+
 #include "utils.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/capability.h>
 #include <sys/mman.h>
-
-#define _GNU_SOURCE
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mman.h>
+#include <linux/mempolicy.h>
 
 /* Simple uint64->uint64 hash function from Stack Overflow, id 12996028. */
 uint64_t
@@ -38,6 +54,102 @@ utils_hash(uint64_t x) {
     return x;
 }
 
+/* Multiply A and B into 128 bits, storing the low half in A and the high half
+   in B. */
+static inline void
+hash_mum(uint64_t *a, uint64_t *b)
+{
+    __uint128_t r = (__uint128_t) *a * *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+}
+
+/* Multiply A and B into 128 bits, and fold the halves together. */
+static inline uint64_t
+hash_mix(uint64_t a, uint64_t b)
+{
+    hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t
+hash_read8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+hash_read4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Hash the LEN bytes at KEY (wyhash, with its default secret and a zero seed).
+   Consumes 16 bytes per step, in three independent lanes for longer keys, so
+   that a path costs a handful of multiplies rather than one per byte. */
+uint64_t
+utils_hash_bytes(const void *key, size_t len)
+{
+    static const uint64_t secret[4] = {
+        0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+        0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+    };
+    const uint8_t *p = key;
+    uint64_t seed = hash_mix(secret[0], secret[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            /* Two (possibly overlapping) reads from each end cover it all. */
+            size_t mid = (len >> 3) << 2;
+            a = (hash_read4(p) << 32) | hash_read4(p + mid);
+            b = (hash_read4(p + len - 4) << 32) | hash_read4(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = hash_mix(hash_read8(p) ^ secret[1], hash_read8(p + 8) ^ seed);
+                seed1 = hash_mix(hash_read8(p + 16) ^ secret[2], hash_read8(p + 24) ^ seed1);
+                seed2 = hash_mix(hash_read8(p + 32) ^ secret[3], hash_read8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hash_mix(hash_read8(p) ^ secret[1], hash_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        /* The last 16 bytes, overlapping what came before if need be. */
+        a = hash_read8(p + i - 16);
+        b = hash_read8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    hash_mum(&a, &b);
+
+    return hash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+/* Hash a NUL-terminated string STR with utils_hash_bytes. Finding its length
+   first lets both passes work a word or more at a time. */
+uint64_t
+utils_hash_str(const char *str)
+{
+    return utils_hash_bytes(str, strlen(str));
+}
+
 /* Allocate shared, page-locked memory, using an anonymous mmap. If this process
    forks, and all "shared" state was allocated using this function, everything
    will behave properly, as if we're synchronizing threads.
@@ -53,20 +165,544 @@ mmap_alloc(size_t size)
                     PROT_READ | PROT_WRITE,
                     MAP_ANONYMOUS | MAP_SHARED | MAP_POPULATE,
                     -1, 0);
+   if (ptr == MAP_FAILED) {
+      return NULL;
+   }
 
    /* Lock this region. */
    if (mlock(ptr, size) != 0) {
-      /* Don't allow a double failure. */
-      assert(munmap(ptr, size) == 0);
+      munmap(ptr, size);
+      return NULL;
+   }
+
+   return ptr;
+}
+
+/* Map SIZE bytes of shared memory, backed by huge pages of PAGE_SIZE bytes
+   (HUGE_PAGE_2MB or HUGE_PAGE_1GB) unless PAGE_SIZE is zero, without
+   populating or locking it. This leaves room to set its NUMA policy with
+   mmap_bind before mmap_populate commits it. Pages come from the hugetlb pool
+   if it has enough reserved; otherwise regular pages are advised to be
+   collapsed into transparent huge pages. SIZE must be a multiple of PAGE_SIZE.
+
+   Returns a pointer to a SIZE-byte region of memory on success, and returns
+   NULL on failure. */
+void *
+mmap_map(size_t size, size_t page_size)
+{
+   assert(size > 0 && (page_size == 0 || size % page_size == 0));
+   void *ptr;
+   if (page_size != 0) {
+      int shift = page_size == HUGE_PAGE_1GB ? 30 : 21;
+      ptr = mmap(NULL, size,
+                 PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_SHARED | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT),
+                 -1, 0);
+      if (ptr != MAP_FAILED) {
+         return ptr;
+      }
+   }
+
+   /* Advise before populating, so that faults allocate huge pages where the
+      kernel allows them for shared memory. */
+   ptr = mmap(NULL, size,
+              PROT_READ | PROT_WRITE,
+              MAP_ANONYMOUS | MAP_SHARED,
+              -1, 0);
+   if (ptr == MAP_FAILED) {
+      return NULL;
+   }
+   if (page_size != 0) {
+      madvise(ptr, size, MADV_HUGEPAGE);
+   }
+
+   return ptr;
+}
+
+/* Commit and page-lock SIZE bytes at PTR, mapped by mmap_map. Hugetlb pages
+   are never swapped, so locking them is a no-op, and they're committed by
+   touching them instead. On success returns 0. On failure returns negative
+   errno. */
+int
+mmap_populate(void *ptr, size_t size)
+{
+   size_t page = sysconf(_SC_PAGESIZE);
+   for (size_t offset = 0; offset < size; offset += page) {
+      ((volatile uint8_t *) ptr)[offset] = 0;
+   }
+
+   return mlock(ptr, size) == 0 ? 0 : -errno;
+}
+
+/* Page-lock as much of the SIZE bytes of shared memory at PTR (which must be
+   page aligned) as allowed, MMAP_LOCK_CHUNK bytes at a time, and commit the
+   rest without locking it, advised as needed so that it's read back from swap
+   ahead of use should it ever be paged out. Returns the number of bytes
+   locked. */
+size_t
+mmap_lock(void *ptr, size_t size)
+{
+   size_t locked = 0;
+   while (locked < size) {
+      size_t len = MIN(size - locked, MMAP_LOCK_CHUNK);
+      if (mlock((uint8_t *) ptr + locked, len) != 0) {
+         break;
+      }
+      locked += len;
+   }
+   if (locked < size) {
+      size_t page = sysconf(_SC_PAGESIZE);
+      for (size_t offset = locked; offset < size; offset += page) {
+         ((volatile uint8_t *) ptr)[offset] = ((volatile uint8_t *) ptr)[offset];
+      }
+      madvise((uint8_t *) ptr + locked, size - locked, MADV_WILLNEED);
+   }
+
+   return locked;
+}
+
+/* Returns how many of the SIZE bytes of memory at PTR are resident, as far as
+   this process' mapping of them is concerned. */
+size_t
+mmap_resident(void *ptr, size_t size)
+{
+   size_t page = sysconf(_SC_PAGESIZE);
+   uintptr_t start = (uintptr_t) ptr & ~(page - 1);
+   size_t n_pages = ((uintptr_t) ptr + size - start + page - 1) / page;
+
+   /* Pages are checked a batch at a time, to bound the vector. */
+   unsigned char vec[4096];
+   size_t resident = 0;
+   for (size_t first = 0; first < n_pages; first += sizeof(vec)) {
+      size_t n = MIN(n_pages - first, sizeof(vec));
+      if (mincore((void *) (start + first * page), n * page, vec) != 0) {
+         continue;
+      }
+      for (size_t i = 0; i < n; i++) {
+         resident += vec[i] & 1;
+      }
+   }
+
+   return MIN(resident * page, size);
+}
+
+/* Read the single number in the file at PATH into VALUE, with "max" read as
+   SIZE_MAX. Returns whether there was one. */
+static bool
+read_size_file(const char *path, size_t *value)
+{
+   FILE *f = fopen(path, "r");
+   if (f == NULL) {
+      return false;
+   }
+   char buf[32];
+   bool ok = fgets(buf, sizeof(buf), f) != NULL;
+   fclose(f);
+   if (!ok) {
+      return false;
+   }
+   if (strncmp(buf, "max", 3) == 0) {
+      *value = SIZE_MAX;
+      return true;
+   }
+   char *end;
+   unsigned long long n = strtoull(buf, &end, 10);
+   if (end == buf) {
+      return false;
+   }
+   *value = n;
+
+   return true;
+}
+
+/* Returns how many more bytes this process may page-lock: RLIMIT_MEMLOCK, less
+   what it has locked already, or SIZE_MAX if it isn't limited (with
+   CAP_IPC_LOCK, or an unlimited RLIMIT_MEMLOCK). */
+size_t
+utils_memlock_budget(void)
+{
+   struct rlimit limit;
+   if (getrlimit(RLIMIT_MEMLOCK, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+      return SIZE_MAX;
+   }
+
+   /* Both the capability and the locked total are in our status. */
+   size_t locked = 0;
+   FILE *f = fopen("/proc/self/status", "r");
+   if (f != NULL) {
+      char line[256];
+      unsigned long long value;
+      while (fgets(line, sizeof(line), f) != NULL) {
+         if (sscanf(line, "VmLck: %llu kB", &value) == 1) {
+            locked = value * 1024;
+         } else if (sscanf(line, "CapEff: %llx", &value) == 1 && (value >> CAP_IPC_LOCK & 1)) {
+            fclose(f);
+            return SIZE_MAX;
+         }
+      }
+      fclose(f);
+   }
+
+   return limit.rlim_cur > locked ? limit.rlim_cur - locked : 0;
+}
+
+/* Returns how many more bytes the memory cgroups this process is in can be
+   charged before one of them reaches its limit, or SIZE_MAX if none has one.
+   Understands cgroup v2, walking up from this process' cgroup, and cgroup v1's
+   memory controller. Page cache counts towards usage, so this errs low. */
+size_t
+utils_cgroup_budget(void)
+{
+   size_t budget = SIZE_MAX;
+   char cgroup[PATH_MAX] = "";
+   FILE *f = fopen("/proc/self/cgroup", "r");
+   if (f != NULL) {
+      char line[PATH_MAX];
+      while (fgets(line, sizeof(line), f) != NULL) {
+         if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(cgroup, sizeof(cgroup), "%s", strcmp(line + 3, "/") == 0 ? "" : line + 3);
+         }
+      }
+      fclose(f);
+   }
+
+   /* A container usually only sees its own cgroup, at the root. */
+   for (;;) {
+      char path[PATH_MAX + 64];
+      size_t max, current;
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", cgroup);
+      if (read_size_file(path, &max) && max != SIZE_MAX) {
+         snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.current", cgroup);
+         if (read_size_file(path, &current)) {
+            budget = MIN(budget, max > current ? max - current : 0);
+         }
+      }
+      char *slash = strrchr(cgroup, '/');
+      if (slash == NULL) {
+         break;
+      }
+      *slash = '\0';
+   }
+
+   /* Cgroup v1 reports no limit as a huge (page-rounded) number. */
+   size_t limit, usage;
+   if (read_size_file("/sys/fs/cgroup/memory/memory.limit_in_bytes", &limit) && limit < (SIZE_MAX >> 2) &&
+       read_size_file("/sys/fs/cgroup/memory/memory.usage_in_bytes", &usage)) {
+      budget = MIN(budget, limit > usage ? limit - usage : 0);
+   }
+
+   return budget;
+}
+
+/* Allocate shared, page-locked memory as mmap_alloc does, but backed by huge
+   pages of PAGE_SIZE bytes as mmap_map is, so that a large region needs far
+   fewer page table entries, and misses the TLB far less. SIZE must be a
+   multiple of PAGE_SIZE.
+
+   Returns a pointer to a SIZE-byte region of memory on success, and returns
+   NULL on failure. */
+void *
+mmap_alloc_huge(size_t size, size_t page_size)
+{
+   void *ptr = mmap_map(size, page_size);
+   if (ptr != NULL && mmap_populate(ptr, size) < 0) {
+      munmap(ptr, size);
       return NULL;
    }
 
    return ptr;
 }
 
-/* Free memory allocated with mmap_alloc. */
+/* Bind the SIZE bytes of shared memory at PTR (which must be page aligned) to
+   NUMA node NODE, so that its pages are only ever allocated there. Pages that
+   were already allocated elsewhere are moved. On success returns 0. On
+   failure returns negative errno (e.g. -ENOSYS without NUMA support). */
+int
+mmap_bind(void *ptr, size_t size, int node)
+{
+   unsigned long mask[(MAX_NUMA_NODES + 63) / 64] = {0};
+   if (node < 0 || node >= MAX_NUMA_NODES) {
+      return -EINVAL;
+   }
+   mask[node / 64] = 1UL << (node % 64);
+   if (syscall(SYS_mbind, ptr, size, MPOL_BIND, mask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE) < 0) {
+      return -errno;
+   }
+
+   return 0;
+}
+
+/* Store the IDs of (at most MAX of) the online NUMA nodes in NODES, in
+   ascending order. Returns how many were stored. Systems without NUMA report
+   a single node 0. */
+int
+utils_numa_nodes(int *nodes, int max)
+{
+   int n = 0;
+   FILE *f = fopen("/sys/devices/system/node/online", "r");
+   if (f != NULL) {
+      /* The list is ranges ("0-3") and single nodes, separated by commas. */
+      int first, last;
+      while (n < max && fscanf(f, "%d", &first) == 1) {
+         last = first;
+         int c = fgetc(f);
+         if (c == '-' && fscanf(f, "%d", &last) == 1) {
+            c = fgetc(f);
+         }
+         for (int node = first; node <= last && n < max; node++) {
+            if (node < MAX_NUMA_NODES) {
+               nodes[n++] = node;
+            }
+         }
+         if (c != ',') {
+            break;
+         }
+      }
+      fclose(f);
+   }
+   if (n == 0) {
+      nodes[n++] = 0;
+   }
+
+   return n;
+}
+
+/* Returns the NUMA node the calling thread is running on. */
+int
+utils_numa_node(void)
+{
+   unsigned cpu, node;
+   if (getcpu(&cpu, &node) != 0) {
+      return 0;
+   }
+
+   return (int) node;
+}
+
+/* Reserve shared memory, using an anonymous mmap. Unlike mmap_alloc, pages are
+   neither populated nor page-locked, so memory is only committed as it's
+   touched. Suited to regions sized for the worst case.
+
+   Returns a pointer to a SIZE-byte region of memory on success, and returns
+   NULL on failure. */
+void *
+mmap_reserve(size_t size)
+{
+   assert(size > 0);
+   void *ptr = mmap(NULL, size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_SHARED | MAP_NORESERVE,
+                    -1, 0);
+
+   return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/* Free memory allocated with mmap_alloc or mmap_reserve. */
 void
 mmap_free(void *ptr, size_t size)
 {
    munmap(ptr, size);
-}
\ No newline at end of file
+}
+
+/* Returns the size of the reads read_full should issue for a file whose
+   optimal IO size (st_blksize) is BLKSIZE: the largest multiple of it, in
+   whole blocks, of at most READ_CHUNK_MAX bytes. */
+size_t
+read_chunk_size(size_t blksize)
+{
+   blksize = (MAX(blksize, 1) + DIRECT_IO_ALIGN - 1) & ~((size_t) DIRECT_IO_ALIGN - 1);
+   if (blksize >= READ_CHUNK_MAX) {
+      return blksize;
+   }
+
+   return READ_CHUNK_MAX / blksize * blksize;
+}
+
+/* Read SIZE bytes of FD from OFFSET into BUF, CHUNK bytes at a time, retrying
+   short and interrupted reads. Unless *BUFFERED is set, FD is taken to be open
+   for direct IO: BUF and OFFSET must be block-aligned, BUF must have room for
+   SIZE rounded up to a whole block, and CHUNK must be a whole number of blocks.
+   If the filesystem rejects direct IO, FD is switched to buffered IO to finish
+   the read, and *BUFFERED is set.
+
+   Returns the number of bytes read, which is only less than SIZE if the file
+   ends first, or negative errno. */
+ssize_t
+read_full(int fd, void *buf, size_t size, off_t offset, size_t chunk, bool *buffered)
+{
+   size_t done = 0;
+   while (done < size) {
+      size_t len = MIN(size - done, chunk);
+      if (!*buffered) {
+         len = (len + DIRECT_IO_ALIGN - 1) & ~((size_t) DIRECT_IO_ALIGN - 1);
+      }
+      ssize_t n = pread(fd, (uint8_t *) buf + done, len, offset + done);
+      if (n == 0) {
+         break;
+      } else if (n > 0) {
+         /* Direct IO can't resume a short read that ended mid-block. */
+         done += n;
+         if (!*buffered && done < size && done % DIRECT_IO_ALIGN != 0) {
+            n = -1;
+            errno = EINVAL;
+         }
+      }
+      if (n >= 0 || errno == EINTR || errno == EAGAIN) {
+         continue;
+      }
+      if (errno != EINVAL || *buffered) {
+         return -errno;
+      }
+      *buffered = true;
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+   }
+
+   return MIN(done, size);
+}
+
+/* Write SIZE bytes of BUF to FD at OFFSET, retrying short writes. Returns 0,
+   or negative errno. */
+int
+write_full(int fd, const void *buf, size_t size, off_t offset)
+{
+   while (size > 0) {
+      ssize_t n = pwrite(fd, buf, size, offset);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return -errno;
+      }
+      buf = (const uint8_t *) buf + n;
+      size -= n;
+      offset += n;
+   }
+
+   return 0;
+}
+
+/* Bound sends and receives on socket FD to TIMEOUT_MS milliseconds (if it's
+   positive), and disable Nagle's algorithm on it. */
+void
+socket_configure(int fd, int timeout_ms)
+{
+   int one = 1;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   if (timeout_ms > 0) {
+      struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+   }
+}
+
+/* Connect a TCP socket to the LEN-byte address ADDR, giving up after
+   TIMEOUT_MS milliseconds, which also bounds every later send and receive on
+   it, as socket_configure does. Returns the socket, or negative errno. */
+int
+socket_connect(const struct sockaddr *addr, socklen_t len, int timeout_ms)
+{
+   int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (fd < 0) {
+      return -errno;
+   }
+
+   /* Connect without blocking, so that an unreachable host times out. */
+   int status = 0;
+   if (connect(fd, addr, len) < 0) {
+      if (errno != EINPROGRESS) {
+         status = -errno;
+      } else {
+         struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+         int error = 0;
+         socklen_t error_len = sizeof(error);
+         int n = poll(&pfd, 1, timeout_ms);
+         if (n == 0) {
+            status = -ETIMEDOUT;
+         } else if (n < 0) {
+            status = -errno;
+         } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+            status = error != 0 ? -error : -errno;
+         }
+      }
+   }
+   if (status < 0) {
+      close(fd);
+      return status;
+   }
+
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+   socket_configure(fd, timeout_ms);
+
+   return fd;
+}
+
+/* Send SIZE bytes of BUF over socket FD, retrying short and interrupted sends.
+   A closed connection fails with -EPIPE rather than raising SIGPIPE. Returns
+   0, or negative errno. */
+int
+send_full(int fd, const void *buf, size_t size)
+{
+   while (size > 0) {
+      ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return errno == EAGAIN ? -ETIMEDOUT : -errno;
+      }
+      buf = (const uint8_t *) buf + n;
+      size -= n;
+   }
+
+   return 0;
+}
+
+/* Receive exactly SIZE bytes from socket FD into BUF, retrying short and
+   interrupted receives. Returns 0, -ECONNRESET if the connection closes
+   first, or negative errno. */
+int
+recv_full(int fd, void *buf, size_t size)
+{
+   while (size > 0) {
+      ssize_t n = recv(fd, buf, size, 0);
+      if (n == 0) {
+         return -ECONNRESET;
+      }
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return errno == EAGAIN ? -ETIMEDOUT : -errno;
+      }
+      buf = (uint8_t *) buf + n;
+      size -= n;
+   }
+
+   return 0;
+}
+
+/* Wait (for at most TIMEOUT_NS nanoseconds) for the 32-bit word at ADDR, which
+   may be in memory shared between processes, to be woken by futex_wake, unless
+   it no longer holds VAL. Returns 0 once woken (or if the word had changed),
+   or negative errno (-ETIMEDOUT, -EINTR). */
+int
+futex_wait(uint32_t *addr, uint32_t val, uint64_t timeout_ns)
+{
+   struct timespec ts = {
+      .tv_sec = timeout_ns / 1000000000ULL,
+      .tv_nsec = timeout_ns % 1000000000ULL,
+   };
+   if (syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0) < 0 && errno != EAGAIN) {
+      return -errno;
+   }
+
+   return 0;
+}
+
+/* Wake every process and thread waiting on ADDR in futex_wait. */
+void
+futex_wake(uint32_t *addr)
+{
+   syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
@@ -22,11 +22,22 @@
    */
 
 #ifndef __UTILS_H__
+#define __UTILS_H__
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
+/* Debug builds (see setup.py) define MINIO_DEBUG; otherwise logging compiles
+   away entirely. */
+#ifdef MINIO_DEBUG
+#define DEBUG 1
+#else
 #define DEBUG 0
+#endif
 #define DEBUG_LOG(fmt, ...) \
     do { if (DEBUG) fprintf(stderr, "[%8s:%-5d] " fmt, __FILE__, \
                             __LINE__, ## __VA_ARGS__); } while (0)
@@ -36,10 +47,49 @@
     do { if (ALT_DEBUG) fprintf(stderr, "[%8s:%-5d] " fmt, __FILE__, \
                                 __LINE__, ## __VA_ARGS__); } while (0)
 
-#define MAX(a, b) (a) > (b) ? (a) : (b)
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Huge page sizes mmap_alloc_huge can back memory with. */
+#define HUGE_PAGE_2MB (2UL << 20)
+#define HUGE_PAGE_1GB (1UL << 30)
+
+/* mmap_lock locks memory this many bytes at a time, so that it gets as much
+   locked as the memlock limit allows. */
+#define MMAP_LOCK_CHUNK (64UL << 20)
+
+/* Maximum number of NUMA nodes utils_numa_nodes reports. */
+#define MAX_NUMA_NODES (16)
+
+/* Direct IO is done in whole blocks of DIRECT_IO_ALIGN bytes, and read_full
+   issues reads of at most READ_CHUNK_MAX bytes. */
+#define DIRECT_IO_ALIGN (4096)
+#define READ_CHUNK_MAX (64UL << 20)
 
 uint64_t utils_hash(uint64_t x);
+uint64_t utils_hash_bytes(const void *key, size_t len);
+uint64_t utils_hash_str(const char *str);
 void *mmap_alloc(size_t size);
+void *mmap_alloc_huge(size_t size, size_t page_size);
+void *mmap_map(size_t size, size_t page_size);
+int mmap_populate(void *ptr, size_t size);
+size_t mmap_lock(void *ptr, size_t size);
+size_t mmap_resident(void *ptr, size_t size);
+size_t utils_memlock_budget(void);
+size_t utils_cgroup_budget(void);
+int mmap_bind(void *ptr, size_t size, int node);
+int utils_numa_nodes(int *nodes, int max);
+int utils_numa_node(void);
+void *mmap_reserve(size_t size);
 void mmap_free(void *ptr, size_t size);
+size_t read_chunk_size(size_t blksize);
+ssize_t read_full(int fd, void *buf, size_t size, off_t offset, size_t chunk, bool *buffered);
+int write_full(int fd, const void *buf, size_t size, off_t offset);
+int socket_connect(const struct sockaddr *addr, socklen_t len, int timeout_ms);
+void socket_configure(int fd, int timeout_ms);
+int send_full(int fd, const void *buf, size_t size);
+int recv_full(int fd, void *buf, size_t size);
+int futex_wait(uint32_t *addr, uint32_t val, uint64_t timeout_ns);
+void futex_wake(uint32_t *addr);
 
 #endif
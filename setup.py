@@ -1,4 +1,9 @@
+import os
+import shutil
+import subprocess
+import tempfile
 from distutils.core import setup, Extension
+from distutils.command.build_ext import build_ext
 
 MAJOR = 0
 MINOR = 3
@@ -8,6 +13,95 @@ VERSION = '{}.{}.{}'.format(MAJOR, MINOR, MICRO)
 with open('README.md', 'r') as f:
     long_description = f.read()
 
+# Build variant, chosen with environment variables so that it also works
+# through pip:
+#   MINIO_BUILD=debug    (default) asserts and debug logging enabled.
+#   MINIO_BUILD=release  -O3, LTO and -march=$MINIO_MARCH (default native),
+#                        with asserts and debug logging compiled out.
+#   MINIO_PGO=1          a release build, profiled by running the benchmark
+#                        harness in test/c against an instrumented build first.
+PGO = os.environ.get('MINIO_PGO', '0') not in ('', '0')
+BUILD = 'release' if PGO else os.environ.get('MINIO_BUILD', 'debug')
+MARCH = os.environ.get('MINIO_MARCH', 'native')
+if BUILD not in ('debug', 'release'):
+    raise SystemExit("MINIO_BUILD must be 'debug' or 'release', not '{}'".format(BUILD))
+
+SOURCES = [
+    'csrc/miniomodule/miniomodule.c',
+    'csrc/minio/minio.c',
+    'csrc/lz4/lz4.c',
+    'csrc/prefetch/prefetch.c',
+    'csrc/uring/uring.c',
+    'csrc/utils/utils.c'
+]
+LIBS = [
+    '-lpthread',
+    '-lrt',
+]
+
+if BUILD == 'release':
+    compile_args = ['-O3', '-flto=auto', '-g']
+    link_args = ['-O3', '-flto=auto']
+    if MARCH:
+        compile_args.append('-march=' + MARCH)
+    define_macros = [('NDEBUG', None)]
+    undef_macros = []
+else:
+    compile_args = ['-g']
+    link_args = []
+    define_macros = [('MINIO_DEBUG', None)]
+    undef_macros = ['NDEBUG']
+
+# Benchmark runs that train a PGO build: the default MinIO policy with and
+# without an arena, plus CLOCK (which needs one), so that hits, misses and
+# eviction are all covered.
+PGO_RUNS = [
+    ['-n', '1024', '-s', '64', '-c', '48', '-p', '2', '-t', '2', '-r', '3'],
+    ['-n', '1024', '-s', '64', '-c', '48', '-p', '2', '-t', '2', '-r', '3', '-a'],
+    ['-n', '1024', '-s', '64', '-c', '32', '-p', '2', '-t', '2', '-r', '3', '-P', 'clock', '-a'],
+]
+
+
+class BuildExt(build_ext):
+    """Builds the extension, first training it on the benchmark harness if
+    MINIO_PGO is set."""
+
+    def build_extension(self, ext):
+        if not PGO:
+            return super().build_extension(ext)
+
+        # Profiles are keyed by object path, so the instrumented objects are
+        # built exactly where the final ones will be.
+        profile_dir = os.path.abspath(os.path.join(self.build_temp, 'pgo'))
+        shutil.rmtree(profile_dir, ignore_errors=True)
+        generate = ['-fprofile-generate=' + profile_dir, '-fprofile-update=atomic']
+        macros = ext.define_macros + [(m,) for m in ext.undef_macros]
+        objects = self.compiler.compile(ext.sources + ['test/c/bench.c'],
+                                        output_dir=self.build_temp,
+                                        macros=macros,
+                                        include_dirs=ext.include_dirs,
+                                        extra_postargs=ext.extra_compile_args + generate,
+                                        depends=ext.depends)
+        bench = os.path.join(self.build_temp, 'bench')
+        self.compiler.link_executable([o for o in objects if 'miniomodule' not in o],
+                                      bench,
+                                      extra_postargs=ext.extra_link_args + generate + ['-lm'])
+        data = tempfile.mkdtemp(prefix='minio-pgo-', dir=self.build_temp)
+        try:
+            for run in PGO_RUNS:
+                subprocess.run([bench, '-D', data] + run, check=True, stdout=subprocess.DEVNULL)
+        finally:
+            shutil.rmtree(data, ignore_errors=True)
+
+        ext.extra_compile_args = ext.extra_compile_args + [
+            '-fprofile-use=' + profile_dir,
+            '-fprofile-partial-training',
+            '-Wno-missing-profile',
+        ]
+        self.force = True
+        super().build_extension(ext)
+
+
 setup(name = 'MinIO Cache',
       version = VERSION,
       description = 'MinIO file cache module',
@@ -18,21 +112,12 @@ setup(name = 'MinIO Cache',
       author = 'Gus Waldspurger',
       author_email = 'gus@waldspurger.com',
       license = 'MIT',
+      cmdclass = {'build_ext': BuildExt},
       ext_modules = [
           Extension('minio',
-                    sources = [
-                        'csrc/miniomodule/miniomodule.c',
-                        'csrc/minio/minio.c',
-                        'csrc/utils/utils.c'
-                    ],
-                    extra_link_args = [
-                        '-lpthread',
-                        '-lrt',
-                    ],
-                    extra_compile_args = [
-                        '-g',
-                    ],
-                    undef_macros = [
-                        "NDEBUG"
-                    ])
-      ])
\ No newline at end of file
+                    sources = SOURCES,
+                    extra_link_args = LIBS + link_args,
+                    extra_compile_args = compile_args,
+                    define_macros = define_macros,
+                    undef_macros = undef_macros)
+      ])
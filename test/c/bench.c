@@ -0,0 +1,685 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+/* Benchmark harness. Generates a synthetic dataset, then runs three phases
+   against a cache shared by every reader (PROCS forked processes of THREADS
+   threads each):
+
+     store  each reader stores its share of the dataset (read from disk
+            untimed) with cache_store.
+     load   each round, readers split a shuffled pass over the dataset between
+            them and cache_load every file.
+     read   a fresh cache is read through, epoch by epoch, with cache_contains
+            followed by cache_read, as a data loader would.
+
+   Stores the cache rejects for lack of space and loads that miss are counted
+   as failed rather than timed. Per-op latency percentiles, throughput and the
+   read phase's hit ratio are printed to stderr and written as JSON to stdout (or to -o PATH). */
+
+#include "../../csrc/minio/minio.h"
+#include "../../csrc/utils/utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define KB (1024)
+#define MB (KB * KB)
+#define GB (KB * KB * KB)
+
+#define BLOCK_SIZE (4096)
+
+/* Like assert, but evaluated even under NDEBUG, since most of the harness'
+   checks wrap calls it needs made (and setup.py builds it with NDEBUG to
+   train PGO builds). */
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond);                                                 \
+            abort();                                                        \
+        }                                                                   \
+    } while (0)
+#define LOGNORMAL_SIGMA (0.5)
+
+typedef enum {
+    OP_CONTAINS,
+    OP_LOAD,
+    OP_READ,
+    OP_STORE,
+    N_OPS
+} op_t;
+
+static const char *op_names[N_OPS] = {"contains", "load", "read", "store"};
+
+typedef enum {
+    PHASE_STORE,
+    PHASE_LOAD,
+    PHASE_READ,
+    N_PHASES
+} phase_t;
+
+static const char *phase_names[N_PHASES] = {"store", "load", "read"};
+
+typedef enum {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_LOGNORMAL,
+    N_DISTS
+} dist_t;
+
+static const char *dist_names[N_DISTS] = {"fixed", "uniform", "lognormal"};
+static const char *policy_names[N_POLICIES] = {"fifo", "minio", "clock"};
+
+/* Benchmark configuration, set from the command line. */
+typedef struct {
+    size_t   n_files;
+    size_t   file_size;
+    dist_t   dist;
+    size_t   cache_size;
+    int      n_procs;
+    int      n_threads;
+    int      n_rounds;
+    policy_t policy;
+    int      flags;
+    char    *dir;
+    char    *out;
+    uint64_t seed;
+} bench_config_t;
+
+/* What a reader measured in one phase. */
+typedef struct {
+    size_t   n_ops[N_OPS];
+    size_t   n_bytes[N_OPS];
+    uint64_t busy_ns[N_OPS];
+    size_t   n_failed;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} bench_result_t;
+
+/* State shared by every reader. Lives in shared memory so forked readers
+   report back through it. */
+typedef struct {
+    bench_config_t     config;
+    cache_t           *cache;
+    char             **paths;
+    size_t            *sizes;
+    size_t             max_size;
+    size_t             n_readers;
+    size_t             max_samples;
+    pthread_barrier_t  barrier;
+    bench_result_t    *results;  /* [reader] */
+    uint64_t          *samples;  /* [reader][op][max_samples] */
+} bench_t;
+
+typedef struct {
+    bench_t *bench;
+    phase_t  phase;
+    size_t   reader;
+} reader_args_t;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Splitmix64; deterministic given its STATE so every reader agrees on the
+   dataset and the access order. */
+static uint64_t
+rand_next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+/* Uniform double in (0, 1). */
+static double
+rand_unit(uint64_t *state)
+{
+    return ((rand_next(state) >> 11) + 0.5) / (double) (1ULL << 53);
+}
+
+/* Draw a file size with mean SIZE from distribution DIST. */
+static size_t
+rand_size(uint64_t *state, size_t size, dist_t dist)
+{
+    double x;
+    switch (dist) {
+        case DIST_UNIFORM:
+            x = size * (0.5 + rand_unit(state));
+            break;
+        case DIST_LOGNORMAL: {
+            /* Box-Muller, with MU chosen so the mean is SIZE. */
+            double z = sqrt(-2.0 * log(rand_unit(state))) * cos(2.0 * M_PI * rand_unit(state));
+            double mu = log((double) size) - LOGNORMAL_SIGMA * LOGNORMAL_SIGMA / 2.0;
+            x = exp(mu + LOGNORMAL_SIGMA * z);
+            break;
+        }
+        default:
+            x = size;
+            break;
+    }
+
+    return MAX((size_t) x, 1);
+}
+
+/* Fill ORDER with the permutation of the dataset read in round ROUND. */
+static void
+shuffle(bench_t *b, size_t *order, int round)
+{
+    uint64_t state = b->config.seed ^ utils_hash(round + 1);
+    for (size_t i = 0; i < b->config.n_files; i++) {
+        order[i] = i;
+    }
+    for (size_t i = b->config.n_files - 1; i > 0; i--) {
+        size_t j = rand_next(&state) % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/* Record that READER spent NS on an OP over BYTES bytes. */
+static inline void
+record(bench_t *b, size_t reader, op_t op, uint64_t ns, size_t bytes)
+{
+    bench_result_t *r = &b->results[reader];
+    assert(r->n_ops[op] < b->max_samples);
+    b->samples[(reader * N_OPS + op) * b->max_samples + r->n_ops[op]] = ns;
+    r->n_ops[op]++;
+    r->n_bytes[op] += bytes;
+    r->busy_ns[op] += ns;
+}
+
+/* Read the file at PATH into DATA (untimed). Returns its size. */
+static ssize_t
+read_file(char *path, uint8_t *data, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if (n <= 0) {
+            close(fd);
+            return n < 0 ? -errno : -EIO;
+        }
+        done += n;
+    }
+    close(fd);
+
+    return done;
+}
+
+static void
+run_store(bench_t *b, size_t reader, uint8_t *data)
+{
+    bench_result_t *r = &b->results[reader];
+    for (size_t i = reader; i < b->config.n_files; i += b->n_readers) {
+        if (read_file(b->paths[i], data, b->sizes[i]) != (ssize_t) b->sizes[i]) {
+            r->n_failed++;
+            continue;
+        }
+        uint64_t start = now_ns();
+        int status = cache_store(b->cache, b->paths[i], data, b->sizes[i]);
+        uint64_t ns = now_ns() - start;
+        if (status == 0) {
+            record(b, reader, OP_STORE, ns, b->sizes[i]);
+        } else {
+            r->n_failed++;
+        }
+    }
+}
+
+static void
+run_load(bench_t *b, size_t reader, uint8_t *data, size_t *order)
+{
+    bench_result_t *r = &b->results[reader];
+    for (int round = 0; round < b->config.n_rounds; round++) {
+        shuffle(b, order, round);
+        for (size_t i = reader; i < b->config.n_files; i += b->n_readers) {
+            size_t size;
+            uint64_t start = now_ns();
+            int status = cache_load(b->cache, b->paths[order[i]], data, &size, b->max_size);
+            uint64_t ns = now_ns() - start;
+            if (status == 0) {
+                record(b, reader, OP_LOAD, ns, size);
+            } else {
+                r->n_failed++;
+            }
+        }
+    }
+}
+
+static void
+run_read(bench_t *b, size_t reader, uint8_t *data, size_t *order)
+{
+    bench_result_t *r = &b->results[reader];
+    for (int round = 0; round < b->config.n_rounds; round++) {
+        shuffle(b, order, round);
+        for (size_t i = reader; i < b->config.n_files; i += b->n_readers) {
+            char *path = b->paths[order[i]];
+
+            uint64_t start = now_ns();
+            cache_contains(b->cache, path);
+            record(b, reader, OP_CONTAINS, now_ns() - start, 0);
+
+            start = now_ns();
+            ssize_t size = cache_read(b->cache, path, data, b->max_size);
+            uint64_t ns = now_ns() - start;
+            if (size >= 0) {
+                record(b, reader, OP_READ, ns, size);
+            } else {
+                r->n_failed++;
+            }
+        }
+    }
+}
+
+static void *
+reader_main(void *arg)
+{
+    reader_args_t *args = arg;
+    bench_t *b = args->bench;
+    bench_result_t *r = &b->results[args->reader];
+
+    uint8_t *data;
+    CHECK(posix_memalign((void **) &data, BLOCK_SIZE, b->max_size) == 0);
+    size_t *order = malloc(b->config.n_files * sizeof(size_t));
+    CHECK(order != NULL);
+
+    pthread_barrier_wait(&b->barrier);
+    r->start_ns = now_ns();
+    switch (args->phase) {
+        case PHASE_STORE:
+            run_store(b, args->reader, data);
+            break;
+        case PHASE_LOAD:
+            run_load(b, args->reader, data, order);
+            break;
+        default:
+            run_read(b, args->reader, data, order);
+            break;
+    }
+    r->end_ns = now_ns();
+
+    free(order);
+    free(data);
+
+    return NULL;
+}
+
+/* Run PHASE in every reader, forking a process per group of threads. */
+static void
+run_phase(bench_t *b, phase_t phase)
+{
+    memset(b->results, 0, b->n_readers * sizeof(bench_result_t));
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    CHECK(pthread_barrier_init(&b->barrier, &attr, b->n_readers) == 0);
+    pthread_barrierattr_destroy(&attr);
+
+    pid_t pids[b->config.n_procs];
+    for (int p = 0; p < b->config.n_procs; p++) {
+        if ((pids[p] = fork()) == 0) {
+            pthread_t threads[b->config.n_threads];
+            reader_args_t args[b->config.n_threads];
+            for (int t = 0; t < b->config.n_threads; t++) {
+                args[t] = (reader_args_t) {
+                    .bench = b,
+                    .phase = phase,
+                    .reader = p * b->config.n_threads + t
+                };
+                CHECK(pthread_create(&threads[t], NULL, reader_main, &args[t]) == 0);
+            }
+            for (int t = 0; t < b->config.n_threads; t++) {
+                pthread_join(threads[t], NULL);
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        CHECK(pids[p] > 0);
+    }
+    for (int p = 0; p < b->config.n_procs; p++) {
+        int status;
+        CHECK(waitpid(pids[p], &status, 0) == pids[p]);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    pthread_barrier_destroy(&b->barrier);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile P of the N sorted SAMPLES. */
+static uint64_t
+percentile(uint64_t *samples, size_t n, double p)
+{
+    if (n == 0) {
+        return 0;
+    }
+    size_t rank = (size_t) ceil(p * n);
+
+    return samples[MIN(MAX(rank, 1), n) - 1];
+}
+
+/* Summarize OP over every reader of the phase just run, writing it as a JSON
+   object to OUT. */
+static void
+report_op(bench_t *b, op_t op, FILE *out)
+{
+    size_t n = 0, bytes = 0;
+    uint64_t busy = 0;
+    for (size_t i = 0; i < b->n_readers; i++) {
+        n += b->results[i].n_ops[op];
+        bytes += b->results[i].n_bytes[op];
+        busy += b->results[i].busy_ns[op];
+    }
+
+    /* Gather and sort every sample. */
+    uint64_t *all = malloc(MAX(n, 1) * sizeof(uint64_t));
+    CHECK(all != NULL);
+    size_t k = 0;
+    for (size_t i = 0; i < b->n_readers; i++) {
+        uint64_t *samples = &b->samples[(i * N_OPS + op) * b->max_samples];
+        memcpy(all + k, samples, b->results[i].n_ops[op] * sizeof(uint64_t));
+        k += b->results[i].n_ops[op];
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+
+    /* Throughput is over the time readers spent in OP, averaged across
+       readers, so untimed work (e.g. reading files to store) isn't counted. */
+    double seconds = busy * 1e-9 / b->n_readers;
+    double ops_per_sec = seconds > 0 ? n / seconds : 0;
+    double gb_per_sec = seconds > 0 ? bytes / seconds / GB : 0;
+    uint64_t p50 = percentile(all, n, 0.50);
+    uint64_t p99 = percentile(all, n, 0.99);
+    uint64_t p999 = percentile(all, n, 0.999);
+    uint64_t max = n > 0 ? all[n - 1] : 0;
+
+    fprintf(stderr, "  %-8s %10zu ops %12.0f ops/s %8.3f GB/s   p50 %9lu ns   p99 %9lu ns   p999 %9lu ns\n",
+            op_names[op], n, ops_per_sec, gb_per_sec, p50, p99, p999);
+    fprintf(out, "\"%s\": {\"ops\": %zu, \"bytes\": %zu, \"ops_per_sec\": %.1f, "
+                 "\"gb_per_sec\": %.4f, \"p50_ns\": %lu, \"p99_ns\": %lu, "
+                 "\"p999_ns\": %lu, \"max_ns\": %lu}",
+            op_names[op], n, bytes, ops_per_sec, gb_per_sec, p50, p99, p999, max);
+
+    free(all);
+}
+
+/* Report the phase just run as a JSON object to OUT. */
+static void
+report_phase(bench_t *b, phase_t phase, op_t *ops, int n_ops, FILE *out)
+{
+    uint64_t start = UINT64_MAX, end = 0;
+    size_t n_failed = 0;
+    for (size_t i = 0; i < b->n_readers; i++) {
+        start = MIN(start, b->results[i].start_ns);
+        end = MAX(end, b->results[i].end_ns);
+        n_failed += b->results[i].n_failed;
+    }
+    double seconds = (end - start) * 1e-9;
+
+    fprintf(stderr, "%s (%.3f s, %zu failed):\n", phase_names[phase], seconds, n_failed);
+    fprintf(out, "    \"%s\": {\"seconds\": %.6f, \"failed\": %zu, ", phase_names[phase], seconds, n_failed);
+    for (int i = 0; i < n_ops; i++) {
+        report_op(b, ops[i], out);
+        fprintf(out, i + 1 < n_ops ? ", " : "");
+    }
+    fprintf(out, "}");
+}
+
+/* Create the dataset's files in the configured directory. Returns the
+   directory created, which the caller removes. */
+static char *
+make_dataset(bench_t *b)
+{
+    bench_config_t *cfg = &b->config;
+    char *dir = malloc(strlen(cfg->dir) + 32);
+    CHECK(dir != NULL);
+    sprintf(dir, "%s/bench-XXXXXX", cfg->dir);
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    b->paths = malloc(cfg->n_files * sizeof(char *));
+    b->sizes = malloc(cfg->n_files * sizeof(size_t));
+    CHECK(b->paths != NULL && b->sizes != NULL);
+
+    uint64_t state = cfg->seed;
+    b->max_size = 0;
+    for (size_t i = 0; i < cfg->n_files; i++) {
+        b->sizes[i] = rand_size(&state, cfg->file_size, cfg->dist);
+        b->max_size = MAX(b->max_size, b->sizes[i]);
+    }
+
+    /* O_DIRECT reads round up to whole blocks. */
+    b->max_size = (b->max_size + 2 * BLOCK_SIZE - 1) & ~(size_t) (BLOCK_SIZE - 1);
+    uint64_t *buf = malloc(b->max_size);
+    CHECK(buf != NULL);
+    for (size_t i = 0; i < cfg->n_files; i++) {
+        b->paths[i] = malloc(strlen(dir) + 32);
+        CHECK(b->paths[i] != NULL);
+        sprintf(b->paths[i], "%s/%zu.bin", dir, i);
+
+        for (size_t j = 0; j < b->max_size / sizeof(uint64_t); j++) {
+            buf[j] = rand_next(&state);
+        }
+        int fd = open(b->paths[i], O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd < 0 || write(fd, buf, b->sizes[i]) != (ssize_t) b->sizes[i]) {
+            perror(b->paths[i]);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    free(buf);
+
+    return dir;
+}
+
+static void
+remove_dataset(bench_t *b, char *dir)
+{
+    for (size_t i = 0; i < b->config.n_files; i++) {
+        unlink(b->paths[i]);
+        free(b->paths[i]);
+    }
+    rmdir(dir);
+    free(b->paths);
+    free(b->sizes);
+    free(dir);
+}
+
+static int
+parse_name(const char *name, const char **names, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (names[i] != NULL && strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "unknown option value \"%s\"\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static void
+usage(char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n N       number of files (default 512)\n"
+            "  -s KB      mean file size in KB (default 112)\n"
+            "  -d DIST    file size distribution: fixed, uniform, lognormal (default lognormal)\n"
+            "  -c MB      cache size in MB (default 64)\n"
+            "  -p N       reader processes (default 1)\n"
+            "  -t N       reader threads per process (default 1)\n"
+            "  -r N       rounds (epochs) of the load and read phases (default 3)\n"
+            "  -P POLICY  cache policy: minio, fifo, clock (default minio; fifo and clock need -a)\n"
+            "  -a         use arena mode\n"
+            "  -D DIR     directory to create the dataset in (default ../test-images)\n"
+            "  -S SEED    random seed (default 1)\n"
+            "  -o PATH    write JSON to PATH instead of stdout\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    bench_config_t cfg = {
+        .n_files = 512,
+        .file_size = 112 * KB,
+        .dist = DIST_LOGNORMAL,
+        .cache_size = 64 * MB,
+        .n_procs = 1,
+        .n_threads = 1,
+        .n_rounds = 3,
+        .policy = POLICY_MINIO,
+        .flags = 0,
+        .dir = "../test-images",
+        .out = NULL,
+        .seed = 1
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:d:c:p:t:r:P:aD:S:o:h")) != -1) {
+        switch (opt) {
+            case 'n': cfg.n_files = strtoul(optarg, NULL, 0); break;
+            case 's': cfg.file_size = strtoul(optarg, NULL, 0) * KB; break;
+            case 'd': cfg.dist = parse_name(optarg, dist_names, N_DISTS); break;
+            case 'c': cfg.cache_size = strtoul(optarg, NULL, 0) * MB; break;
+            case 'p': cfg.n_procs = atoi(optarg); break;
+            case 't': cfg.n_threads = atoi(optarg); break;
+            case 'r': cfg.n_rounds = atoi(optarg); break;
+            case 'P': cfg.policy = parse_name(optarg, policy_names, N_POLICIES); break;
+            case 'a': cfg.flags |= CACHE_ARENA; break;
+            case 'D': cfg.dir = optarg; break;
+            case 'S': cfg.seed = strtoull(optarg, NULL, 0); break;
+            case 'o': cfg.out = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (cfg.n_files == 0 || cfg.file_size == 0 || cfg.cache_size == 0 ||
+        cfg.n_procs < 1 || cfg.n_threads < 1 || cfg.n_rounds < 1) {
+        usage(argv[0]);
+    }
+
+    /* Everything readers write to is shared, so forked readers can report. */
+    bench_t *b = mmap_alloc(sizeof(bench_t));
+    CHECK(b != NULL);
+    b->config = cfg;
+    b->n_readers = (size_t) cfg.n_procs * cfg.n_threads;
+    b->max_samples = cfg.n_rounds * ((cfg.n_files + b->n_readers - 1) / b->n_readers);
+    b->results = mmap_alloc(b->n_readers * sizeof(bench_result_t));
+    b->samples = mmap_alloc(b->n_readers * N_OPS * b->max_samples * sizeof(uint64_t));
+    b->cache = mmap_alloc(sizeof(cache_t));
+    CHECK(b->results != NULL && b->samples != NULL && b->cache != NULL);
+
+    char *dir = make_dataset(b);
+    size_t total = 0;
+    for (size_t i = 0; i < cfg.n_files; i++) {
+        total += b->sizes[i];
+    }
+    fprintf(stderr, "%zu files (%s, mean %zu KB, total %zu MB), %zu MB %s cache%s, %d x %d readers, %d rounds\n",
+            cfg.n_files, dist_names[cfg.dist], cfg.file_size / KB, total / MB,
+            cfg.cache_size / MB, policy_names[cfg.policy],
+            cfg.flags & CACHE_ARENA ? " (arena)" : "",
+            cfg.n_procs, cfg.n_threads, cfg.n_rounds);
+
+    FILE *out = stdout;
+    if (cfg.out != NULL && (out = fopen(cfg.out, "w")) == NULL) {
+        perror(cfg.out);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "{\n  \"config\": {\"files\": %zu, \"file_size\": %zu, \"dist\": \"%s\", "
+                 "\"dataset_bytes\": %zu, \"cache_size\": %zu, \"policy\": \"%s\", "
+                 "\"arena\": %s, \"procs\": %d, \"threads\": %d, \"rounds\": %d, "
+                 "\"seed\": %lu},\n  \"phases\": {\n",
+            cfg.n_files, cfg.file_size, dist_names[cfg.dist], total, cfg.cache_size,
+            policy_names[cfg.policy], cfg.flags & CACHE_ARENA ? "true" : "false",
+            cfg.n_procs, cfg.n_threads, cfg.n_rounds, cfg.seed);
+
+    int status = cache_init(b->cache, cfg.cache_size, b->max_size, total / cfg.n_files, 0, cfg.policy, cfg.flags);
+    if (status < 0) {
+        fprintf(stderr, "cache_init failed; %s\n", strerror(-status));
+        exit(EXIT_FAILURE);
+    }
+    run_phase(b, PHASE_STORE);
+    report_phase(b, PHASE_STORE, (op_t[]) {OP_STORE}, 1, out);
+    fprintf(out, ",\n");
+    run_phase(b, PHASE_LOAD);
+    report_phase(b, PHASE_LOAD, (op_t[]) {OP_LOAD}, 1, out);
+    fprintf(out, ",\n");
+
+    /* Read through a cold cache, so the hit ratio reflects its capacity. */
+    cache_destroy(b->cache);
+    status = cache_init(b->cache, cfg.cache_size, b->max_size, total / cfg.n_files, 0, cfg.policy, cfg.flags);
+    CHECK(status == 0);
+    run_phase(b, PHASE_READ);
+    report_phase(b, PHASE_READ, (op_t[]) {OP_CONTAINS, OP_READ}, 2, out);
+
+    cache_stats_t stats, *c = &stats;
+    cache_get_stats(b->cache, &stats);
+    double hit_ratio = c->n_accs > 0 ? (double) c->n_hits / c->n_accs : 0;
+    fprintf(stderr, "read hit ratio %.4f (%lu hits, %lu cold misses, %lu capacity misses, %lu evictions)\n",
+            hit_ratio, c->n_hits, c->n_miss_cold, c->n_miss_capacity, c->n_evictions);
+    fprintf(out, "\n  },\n  \"cache\": {\"accesses\": %lu, \"hits\": %lu, \"cold_misses\": %lu, "
+                 "\"capacity_misses\": %lu, \"fails\": %lu, \"evictions\": %lu, "
+                 "\"hit_ratio\": %.6f, \"used\": %zu}\n}\n",
+            c->n_accs, c->n_hits, c->n_miss_cold, c->n_miss_capacity, c->n_fail,
+            c->n_evictions, hit_ratio, b->cache->used);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    cache_destroy(b->cache);
+    remove_dataset(b, dir);
+
+    return EXIT_SUCCESS;
+}
@@ -22,6 +22,8 @@
    */
 
 #include "../../csrc/minio/minio.h"
+#include "../../csrc/prefetch/prefetch.h"
+#include "../../csrc/utils/utils.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,127 +33,1867 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #define KB (1024)
 #define MB (KB * KB)
 #define GB (KB * KB * KB)
 
 #define N_TEST_FILES (3)
-#define SPEEDUP_METRIC (2)
 
 #define BLOCK_SIZE (4096)
+#define N_PROCS (8)
 
-/* Returns access time in nanoseconds. */
-long
-timed_access(cache_t *cache, char *filepath, void *data, size_t max_size)
+/* Verify that DATA contains the same data as the file at FILEPATH. */
+bool
+verify_integrity(char *filepath, uint8_t *data, ssize_t size)
+{
+    /* Read a fresh copy of the data from storage. */
+    uint8_t *baseline = malloc(size);
+    assert(baseline != NULL);
+    int fd = open(filepath, O_RDONLY);
+    read(fd, baseline, size);
+
+    /* Check each byte matches. */
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != baseline[i]) {
+            printf("byte offset %ld is incorrect (data = 0x%hx, truth = 0x%hx)\n",
+                   i,
+                   data[i],
+                   baseline[i]);
+            free(baseline);
+            return false;
+        }
+    }
+
+    free(baseline);
+    return true;
+}
+
+void
+test_integrity(size_t cache_size,
+              size_t max_size,
+              char **filepaths,
+              int n_files,
+              int flags)
+{
+    /* Where we're reading the file into from the cache. */
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    /* Cache being tested. */
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+
+    /* Cold accesses. */
+    for (int i = 0; i < n_files; i++) {
+        ssize_t size = cache_read(&cache, filepaths[i], data, max_size);
+        assert(size > 0);
+        verify_integrity(filepaths[i], data, size);
+    }
+
+    /* Hot accesses. */
+    for (int i = 0; i < n_files; i++) {
+        ssize_t size = cache_read(&cache, filepaths[i], data, max_size);
+        assert(size > 0);
+        verify_integrity(filepaths[i], data, size);
+    }
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that paths of any length are cached. */
+void
+test_long_path(size_t cache_size, size_t max_size, char *filepath, int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+
+    /* Pad the path out with "./" components. */
+    char path[1024] = {0};
+    for (int i = 0; i < 200; i++) {
+        strcat(path, "./");
+    }
+    strcat(path, filepath);
+
+    for (int i = 0; i < 2; i++) {
+        ssize_t size = cache_read(&cache, path, data, max_size);
+        assert(size > 0);
+        assert(verify_integrity(filepath, data, size));
+    }
+    cache_stats_t stats;
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_hits == 1);
+    assert(!cache_contains(&cache, filepath));
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that a NUMA-placed cache accounts every cached read as either local or
+   remote, and that its arena shards add up to the space used. */
+void
+test_numa(size_t cache_size,
+          size_t max_size,
+          char **filepaths,
+          int n_files,
+          int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags | CACHE_NUMA) == 0);
+    assert(cache.n_nodes >= 1);
+
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n_files; i++) {
+            ssize_t size = cache_read(&cache, filepaths[i], data, max_size);
+            assert(size > 0);
+            assert(verify_integrity(filepaths[i], data, size));
+        }
+    }
+    cache_stats_t stats;
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_reads_local + stats.n_reads_remote == stats.n_hits);
+    if (flags & CACHE_ARENA) {
+        size_t used = 0;
+        for (int i = 0; i < cache.n_nodes; i++) {
+            used += cache.shard_used[i];
+        }
+        assert(used == cache.used);
+    }
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that read_full reads whole files with direct IO however many chunks it
+   takes, and finishes with buffered IO once a read can't stay aligned. */
+void
+test_read_full(char *filepath)
+{
+    struct stat st;
+    assert(stat(filepath, &st) == 0);
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, st.st_size + BLOCK_SIZE) == 0);
+
+    /* Chunks of a single block. */
+    bool buffered = false;
+    int fd = open(filepath, O_RDONLY | __O_DIRECT);
+    assert(fd >= 0);
+    assert(read_full(fd, data, st.st_size, 0, BLOCK_SIZE, &buffered) == st.st_size);
+    assert(verify_integrity(filepath, data, st.st_size));
+    assert(!buffered);
+    close(fd);
+
+    /* Starting mid-block can't be done directly. */
+    fd = open(filepath, O_RDONLY | __O_DIRECT);
+    assert(fd >= 0);
+    data[0] = 0;
+    assert(read_full(fd, data + 1, st.st_size - 1, 1, read_chunk_size(st.st_blksize), &buffered) == st.st_size - 1);
+    assert(pread(fd, data, 1, 0) == 1);
+    assert(verify_integrity(filepath, data, st.st_size));
+    assert(buffered);
+    close(fd);
+
+    /* Asking for more than there is stops at the end of the file. */
+    buffered = true;
+    fd = open(filepath, O_RDONLY);
+    assert(read_full(fd, data, st.st_size + 10, 0, BLOCK_SIZE, &buffered) == st.st_size);
+    close(fd);
+
+    free(data);
+}
+
+/* Test that path hashes depend on every byte of the path and on nothing past
+   it, whatever its length, and that the index tells apart N_PATHS paths that
+   differ only near their ends, with or without an arena (FLAGS). */
+#define N_HASH_PATHS (2000)
+void
+test_hash(int flags)
+{
+    char buf[256];
+    memset(buf, 'a', sizeof(buf));
+    uint64_t hashes[129];
+    for (size_t len = 0; len <= 128; len++) {
+        hashes[len] = utils_hash_bytes(buf, len);
+        for (size_t i = 0; i < len; i++) {
+            assert(hashes[len] != utils_hash_bytes(buf, i));
+        }
+        if (len > 0) {
+            buf[len - 1] = 'b';
+            assert(utils_hash_bytes(buf, len) != hashes[len]);
+            buf[len - 1] = 'a';
+        }
+        buf[len] = 'c';
+        assert(utils_hash_bytes(buf, len) == hashes[len]);
+        buf[len] = '\0';
+        assert(utils_hash_str(buf) == hashes[len]);
+        buf[len] = 'a';
+    }
+
+    cache_t cache;
+    uint8_t data[8] = {0};
+    assert(cache_init(&cache, 16 * MB, 4096, 1024, 0, POLICY_MINIO, flags) == 0);
+    char path[128];
+    for (int i = 0; i < N_HASH_PATHS; i++) {
+        snprintf(path, sizeof(path), "/datasets/imagenet/train/n01440764/%08d.JPEG", i);
+        assert(cache_store(&cache, path, data, sizeof(data)) == 0);
+    }
+    for (int i = 0; i < 2 * N_HASH_PATHS; i++) {
+        snprintf(path, sizeof(path), "/datasets/imagenet/train/n01440764/%08d.JPEG", i);
+        assert(cache_contains(&cache, path) == (i < N_HASH_PATHS));
+    }
+    cache_destroy(&cache);
+}
+
+/* Test that reads by registered ID match reads by path, including once the
+   cache has been flushed out from under the IDs. */
+void
+test_ids(size_t cache_size,
+         size_t max_size,
+         char **filepaths,
+         int n_files,
+         int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, n_files, POLICY_MINIO, flags) == 0);
+
+    /* Registrations that don't fit take nothing. */
+    size_t first;
+    char *too_many[n_files + 1];
+    for (int i = 0; i <= n_files; i++) {
+        too_many[i] = filepaths[i % n_files];
+    }
+    for (int i = 0; i < 8; i++) {
+        assert(cache_register(&cache, too_many, n_files + 1, &first) == -ENOMEM);
+    }
+    assert(cache_id_path(&cache, 0) == NULL);
+    assert(cache_register(&cache, filepaths, n_files, &first) == 0 && first == 0);
+    assert(cache_register(&cache, filepaths, 1, &first) == -ENOMEM);
+    assert(cache_id_path(&cache, first + n_files) == NULL);
+    assert(cache_read_id(&cache, first + n_files, data, max_size) == -EINVAL);
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < n_files; i++) {
+            assert(strcmp(cache_id_path(&cache, first + i), filepaths[i]) == 0);
+            ssize_t size = cache_read_id(&cache, first + i, data, max_size);
+            assert(size > 0);
+            assert(verify_integrity(filepaths[i], data, size));
+            assert(cache_contains_id(&cache, first + i) == cache_contains(&cache, filepaths[i]));
+        }
+        if (round == 1) {
+            assert(cache_flush(&cache) == 0);
+            for (int i = 0; i < n_files; i++) {
+                assert(!cache_contains_id(&cache, first + i));
+            }
+        }
+    }
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that processes registering paths at once are given IDs of their own,
+   each naming the path it was registered for. */
+#define N_REGISTERED (256)
+void
+test_register_race(void)
+{
+    cache_t *cache = mmap_alloc(sizeof(cache_t));
+    assert(cache != NULL);
+    assert(cache_init(cache, 4 * MB, 1 * MB, 0, N_PROCS * N_REGISTERED, POLICY_MINIO, 0) == 0);
+
+    pid_t pids[N_PROCS];
+    for (int p = 0; p < N_PROCS; p++) {
+        if ((pids[p] = fork()) == 0) {
+            char names[4][32];
+            char *paths[4] = {names[0], names[1], names[2], names[3]};
+            for (int i = 0; i < N_REGISTERED; i += 4) {
+                for (int j = 0; j < 4; j++) {
+                    snprintf(names[j], sizeof(names[j]), "/proc%d/%0*d", p, 1 + (i + j) % 17, i + j);
+                }
+                size_t first;
+                if (cache_register(cache, paths, 4, &first) < 0) {
+                    _exit(EXIT_FAILURE);
+                }
+                for (int j = 0; j < 4; j++) {
+                    char *path = cache_id_path(cache, first + j);
+                    if (path == NULL || strcmp(path, names[j]) != 0) {
+                        _exit(EXIT_FAILURE);
+                    }
+                }
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        assert(pids[p] > 0);
+    }
+    for (int p = 0; p < N_PROCS; p++) {
+        int status;
+        assert(waitpid(pids[p], &status, 0) == pids[p]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    /* Every path was registered exactly once. */
+    int seen[N_PROCS][N_REGISTERED] = {{0}};
+    for (size_t id = 0; id < N_PROCS * N_REGISTERED; id++) {
+        int p, i;
+        char *path = cache_id_path(cache, id);
+        assert(path != NULL && sscanf(path, "/proc%d/%d", &p, &i) == 2);
+        seen[p][i]++;
+    }
+    for (int p = 0; p < N_PROCS; p++) {
+        for (int i = 0; i < N_REGISTERED; i++) {
+            assert(seen[p][i] == 1);
+        }
+    }
+    assert(cache_id_path(cache, N_PROCS * N_REGISTERED) == NULL);
+
+    cache_destroy(cache);
+    munmap(cache, sizeof(cache_t));
+}
+
+/* Test that reads by registered ID only cache files whose predicted reuse per
+   MB beats the admission threshold, and that files of unknown reuse, and
+   reads by path, are always admitted. */
+void
+test_admission(size_t cache_size,
+               size_t max_size,
+               char **filepaths,
+               int n_files,
+               int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, n_files, POLICY_MINIO, flags) == 0);
+
+    size_t first;
+    assert(cache_register(&cache, filepaths, n_files, &first) == 0);
+    assert(cache_set_reuse(&cache, first + n_files, 1) == -EINVAL);
+
+    /* Files predicted to be read once per MB get in when the threshold is
+       half that, and not when it's double. */
+    struct stat st;
+    for (int round = 0; round < 2; round++) {
+        double threshold = round == 0 ? 0.5 : 2.0;
+        cache_set_admission(&cache, threshold);
+        for (int i = 0; i < n_files; i++) {
+            assert(stat(filepaths[i], &st) == 0);
+            assert(cache_set_reuse(&cache, first + i, (float) st.st_size / MB) == 0);
+            ssize_t size = cache_read_id(&cache, first + i, data, max_size);
+            assert(size == st.st_size && verify_integrity(filepaths[i], data, size));
+            assert(cache_contains_id(&cache, first + i) == (round == 0));
+        }
+        cache_stats_t stats;
+        cache_get_stats(&cache, &stats);
+        assert(stats.n_rejected == (size_t) (round * n_files));
+        assert(cache_flush(&cache) == 0);
+    }
+
+    /* Files that won't be read again are turned away even at the default
+       threshold, but unknown reuse and reads by path aren't. */
+    cache_set_admission(&cache, 0);
+    assert(!cache_admits(&cache, 1, 0) && cache_admits(&cache, SIZE_MAX, REUSE_UNKNOWN));
+    for (int i = 0; i < n_files; i++) {
+        assert(cache_set_reuse(&cache, first + i, i == 0 ? REUSE_UNKNOWN : 0) == 0);
+        ssize_t size = cache_read_id(&cache, first + i, data, max_size);
+        assert(size > 0 && verify_integrity(filepaths[i], data, size));
+        assert(cache_contains_id(&cache, first + i) == (i == 0));
+        assert(cache_read(&cache, filepaths[i], data, max_size) == size);
+        assert(cache_contains(&cache, filepaths[i]));
+    }
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that variants are cached apart from their files and from each other,
+   and come back with their headers intact, in place unless compressed, with
+   or without an arena or compression (FLAGS). */
+#define VARIANT_H (96)
+#define VARIANT_W (128)
+void
+test_variants(char *filepath, int flags)
+{
+    size_t size = VARIANT_H * VARIANT_W * 3;
+    uint8_t *decoded = malloc(size);
+    uint8_t *data = malloc(sizeof(cache_variant_t) + size);
+    assert(decoded != NULL && data != NULL);
+    for (size_t i = 0; i < size; i++) {
+        decoded[i] = (uint8_t) (i / 7);
+    }
+    cache_variant_t meta = {
+        .format = "B",
+        .itemsize = 1,
+        .ndim = 3,
+        .shape = {VARIANT_H, VARIANT_W, 3},
+        .size = size
+    };
+
+    cache_t cache;
+    assert(cache_init(&cache, 32 * MB, 32 * MB, 0, 0, POLICY_MINIO, flags) == 0);
+    assert(!cache_contains_variant(&cache, filepath, "rgb"));
+    assert(cache_store_variant(&cache, filepath, "rgb", &meta, decoded) == 0);
+    assert(cache_store_variant(&cache, filepath, "rgb", &meta, decoded) == -EEXIST);
+    assert(cache_contains_variant(&cache, filepath, "rgb"));
+    assert(!cache_contains_variant(&cache, filepath, "gray"));
+    assert(!cache_contains(&cache, filepath));
+
+    cache_view_t view;
+    int status = cache_acquire_variant(&cache, filepath, "rgb", &view);
+    if (flags & CACHE_COMPRESS) {
+        assert(status == -ENOTSUP);
+    } else {
+        assert(status == 0 && view.size == sizeof(cache_variant_t) + size);
+        assert(memcmp(view.ptr, &meta, sizeof(meta)) == 0);
+        assert(memcmp(view.ptr + sizeof(cache_variant_t), decoded, size) == 0);
+        assert(cache_flush(&cache) == -EBUSY);
+        cache_release(&cache, &view);
+    }
+    size_t loaded = 0;
+    assert(cache_load_variant(&cache, filepath, "rgb", data, &loaded, sizeof(cache_variant_t) + size) == 0);
+    assert(loaded == sizeof(cache_variant_t) + size);
+    assert(memcmp(data, &meta, sizeof(meta)) == 0 && memcmp(data + sizeof(cache_variant_t), decoded, size) == 0);
+
+    /* Neither paths nor other variants spelled like the variant's key see
+       it. */
+    char key[PATH_MAX];
+    char *spellings[] = {"v3:rgb%s", "%s//:rgb"};
+    for (size_t s = 0; s < sizeof(spellings) / sizeof(spellings[0]); s++) {
+        snprintf(key, sizeof(key), spellings[s], filepath);
+        assert(!cache_contains(&cache, key));
+        assert(cache_load(&cache, key, data, &loaded, sizeof(cache_variant_t) + size) == -ENODATA);
+    }
+    assert(cache_store_variant(&cache, filepath, "x//:y", &meta, decoded) == 0);
+    snprintf(key, sizeof(key), "%s//:x", filepath);
+    assert(!cache_contains_variant(&cache, key, "y"));
+    snprintf(key, sizeof(key), "gb%s", filepath);
+    assert(!cache_contains_variant(&cache, key, "r"));
+
+    /* Reading the file itself caches it separately. */
+    ssize_t n = cache_read(&cache, filepath, data, sizeof(cache_variant_t) + size);
+    assert(n < 0 || cache_contains(&cache, filepath));
+
+    /* Malformed headers and overlong keys are turned away. */
+    meta.ndim = VARIANT_MAX_DIMS + 1;
+    assert(cache_store_variant(&cache, filepath, "bad", &meta, decoded) == -EINVAL);
+    char variant[PATH_MAX];
+    memset(variant, 'v', sizeof(variant) - 1);
+    variant[sizeof(variant) - 1] = '\0';
+    assert(cache_store_variant(&cache, filepath, variant, &meta, decoded) == -ENAMETOOLONG);
+
+    assert(cache_flush(&cache) == 0);
+    assert(!cache_contains_variant(&cache, filepath, "rgb"));
+    assert(cache_load_variant(&cache, filepath, "rgb", data, &loaded, sizeof(cache_variant_t) + size) == -ENODATA);
+
+    cache_destroy(&cache);
+    free(data);
+    free(decoded);
+}
+
+/* A view for a thread to release after holding it a while. */
+typedef struct {
+    cache_t      *cache;
+    cache_view_t *view;
+} release_t;
+
+void *
+release_later(void *arg)
+{
+    release_t *release = arg;
+    usleep(10000);
+    cache_release(release->cache, release->view);
+
+    return NULL;
+}
+
+/* Test that zero-copy views reference the same data as a regular read, and
+   that pinned entries block a flush until released. */
+void
+test_views(size_t cache_size,
+           size_t max_size,
+           char **filepaths,
+           int n_files,
+           int flags)
+{
+    /* Where we're reading the file into from the cache. */
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    /* Cache being tested. */
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+
+    /* Cold accesses, then hot accesses. Every cached item must be viewable. */
+    cache_view_t views[n_files];
+    for (int i = 0; i < n_files; i++) {
+        ssize_t size = cache_read_view(&cache, filepaths[i], data, max_size, &views[i]);
+        assert(size > 0);
+        if (views[i].ptr == NULL) {
+            assert(verify_integrity(filepaths[i], data, size));
+        } else {
+            assert(views[i].size == size);
+            assert(verify_integrity(filepaths[i], views[i].ptr, size));
+            cache_release(&cache, &views[i]);
+        }
+    }
+    for (int i = 0; i < n_files; i++) {
+        if (cache_acquire(&cache, filepaths[i], &views[i]) == 0) {
+            assert(verify_integrity(filepaths[i], views[i].ptr, views[i].size));
+        } else {
+            views[i].entry = NULL;
+        }
+    }
+
+    /* Pinned entries can't be flushed. */
+    bool pinned = false;
+    for (int i = 0; i < n_files; i++) {
+        pinned |= views[i].entry != NULL;
+    }
+    assert(!pinned || cache_flush(&cache) == -EBUSY);
+    for (int i = 0; i < n_files; i++) {
+        cache_release(&cache, &views[i]);
+    }
+
+    /* A flush waits for pins that are dropped soon after it begins. */
+    if (pinned) {
+        for (int i = 0; i < n_files; i++) {
+            if (cache_acquire(&cache, filepaths[i], &views[i]) == 0) {
+                release_t release = {&cache, &views[i]};
+                pthread_t thread;
+                assert(pthread_create(&thread, NULL, release_later, &release) == 0);
+                assert(cache_flush(&cache) == 0);
+                assert(pthread_join(thread, NULL) == 0);
+                break;
+            }
+        }
+    }
+    assert(cache_flush(&cache) == 0);
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that data written into a reserved slot is cached once committed, and
+   not if aborted, and that cold misses read into the cache hand back views of
+   the cached copy without touching the caller's buffer. */
+void
+test_reserve(size_t cache_size,
+             size_t max_size,
+             char **filepaths,
+             int n_files,
+             int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+    assert(cache_should_reserve(&cache, BLOCK_SIZE));
+
+    /* Fill the first file by hand. */
+    struct stat st;
+    assert(stat(filepaths[0], &st) == 0);
+    cache_slot_t slot;
+    assert(cache_reserve(&cache, filepaths[0], max_size + 1, &slot) == -E2BIG);
+    if (cache_reserve(&cache, filepaths[0], st.st_size, &slot) == 0) {
+        assert((uintptr_t) slot.ptr % BLOCK_SIZE == 0);
+        int fd = open(filepaths[0], O_RDONLY);
+        assert(read(fd, slot.ptr, st.st_size) == st.st_size);
+        close(fd);
+        assert(!cache_contains(&cache, filepaths[0]));
+        cache_view_t view;
+        assert(cache_commit(&cache, &slot, &view) == 0);
+        assert(view.size == (size_t) st.st_size && verify_integrity(filepaths[0], view.ptr, view.size));
+        assert(cache_flush(&cache) == -EBUSY);
+        cache_release(&cache, &view);
+        assert(cache_reserve(&cache, filepaths[0], st.st_size, &slot) == -EEXIST);
+        assert(cache_flush(&cache) == 0);
+
+        /* Aborted slots leave nothing behind. */
+        assert(cache_reserve(&cache, filepaths[0], st.st_size, &slot) == 0);
+        cache_abort(&cache, &slot);
+        assert(!cache_contains(&cache, filepaths[0]));
+        assert(cache_flush(&cache) == 0);
+    }
+
+    /* Cold misses that fit come back as views, and DATA stays untouched. */
+    for (int i = 0; i < n_files; i++) {
+        memset(data, 0, BLOCK_SIZE);
+        cache_view_t view;
+        ssize_t size = cache_read_view(&cache, filepaths[i], data, max_size, &view);
+        assert(size > 0);
+        bool viewed = view.ptr != NULL;
+        if (viewed) {
+            assert(verify_integrity(filepaths[i], view.ptr, size));
+            assert(data[0] == 0);
+            cache_release(&cache, &view);
+        } else {
+            assert(verify_integrity(filepaths[i], data, size));
+        }
+        assert(cache_contains(&cache, filepaths[i]) == viewed);
+        size = cache_read(&cache, filepaths[i], data, max_size);
+        assert(size > 0 && verify_integrity(filepaths[i], data, size));
+    }
+
+    /* Slots reserved after a store of an odd size are still page aligned, so
+       misses read into them with direct IO. */
+    assert(cache_flush(&cache) == 0);
+    memset(data, 'x', 100);
+    assert(cache_store(&cache, "odd", data, 100) == 0);
+    if (cache_reserve(&cache, filepaths[0], st.st_size, &slot) == 0) {
+        assert((uintptr_t) slot.ptr % BLOCK_SIZE == 0);
+        cache_abort(&cache, &slot);
+    }
+    cache_stats_t stats;
+    cache_get_stats(&cache, &stats);
+    size_t buffered = stats.n_buffered;
+    for (int i = 0; i < n_files; i++) {
+        assert(cache_read(&cache, filepaths[i], data, max_size) > 0);
+    }
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_buffered == buffered);
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that batched reads return the same data as individual reads, in order,
+   and that failures are reported per-request. */
+void
+test_batch(size_t cache_size,
+           size_t max_size,
+           char **filepaths,
+           int n_files,
+           int flags)
+{
+    /* Cache being tested. */
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+
+    /* Each file twice in one batch, plus one that doesn't exist. */
+    int n_reqs = 2 * n_files + 1;
+    cache_req_t reqs[n_reqs];
+    for (int i = 0; i < n_reqs; i++) {
+        reqs[i].path = i < 2 * n_files ? filepaths[i % n_files] : "../test-images/missing.bmp";
+        reqs[i].max_size = max_size;
+        assert(posix_memalign(&reqs[i].data, BLOCK_SIZE, max_size) == 0);
+    }
+
+    /* Cold batch, then hot batch. */
+    for (int round = 0; round < 2; round++) {
+        assert(cache_read_batch(&cache, reqs, n_reqs) == 0);
+        for (int i = 0; i < 2 * n_files; i++) {
+            assert(reqs[i].result > 0);
+            assert(verify_integrity(reqs[i].path, reqs[i].data, reqs[i].result));
+        }
+        assert(reqs[n_reqs - 1].result == -ENOENT);
+    }
+
+    /* Without buffers, only the hits are served, as views, and nothing else
+       is counted. */
+    for (int i = 0; i < n_reqs; i++) {
+        free(reqs[i].data);
+        reqs[i].data = NULL;
+    }
+    cache_stats_t before, after;
+    cache_get_stats(&cache, &before);
+    assert(cache_read_batch(&cache, reqs, n_reqs) == 0);
+    size_t n_viewed = 0;
+    for (int i = 0; i < n_reqs; i++) {
+        if (reqs[i].result == -ENODATA) {
+            assert(reqs[i].view.entry == NULL);
+            continue;
+        }
+        assert(reqs[i].result > 0 && (size_t) reqs[i].result == reqs[i].view.size);
+        assert(verify_integrity(reqs[i].path, reqs[i].view.ptr, reqs[i].view.size));
+        cache_release(&cache, &reqs[i].view);
+        n_viewed++;
+    }
+    assert(reqs[n_reqs - 1].result == -ENODATA);
+    cache_get_stats(&cache, &after);
+    assert(after.n_accs - before.n_accs == n_viewed);
+    assert(after.n_hits - before.n_hits == n_viewed);
+    assert(after.n_fail == before.n_fail);
+    assert(after.n_miss_cold == before.n_miss_cold);
+
+    cache_destroy(&cache);
+}
+
+/* Test that reads following a prefetched sequence see the right data, whether
+   it was cached or staged. */
+void
+test_prefetch(size_t cache_size,
+              size_t max_size,
+              char **filepaths,
+              int n_files,
+              int flags)
+{
+    /* Where we're reading the file into from the cache. */
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    /* Cache being tested. */
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+
+    /* Two passes over the files as one sequence, with a window smaller than
+       the sequence. */
+    int n_paths = 2 * n_files;
+    char *paths[n_paths];
+    for (int i = 0; i < n_paths; i++) {
+        paths[i] = filepaths[i % n_files];
+    }
+    prefetch_t prefetch;
+    assert(prefetch_start(&prefetch, &cache, paths, n_paths, 2, 2, max_size) == 0);
+    size_t n_taken = 0;
+    for (int i = 0; i < n_paths; i++) {
+        ssize_t size = prefetch_take(&prefetch, paths[i], data, max_size);
+        if (size == -ENODATA) {
+            size = cache_read(&cache, paths[i], data, max_size);
+        } else {
+            n_taken++;
+        }
+        assert(size > 0);
+        assert(verify_integrity(paths[i], data, size));
+    }
+
+    /* Nothing fits in a cache smaller than the smallest file, so anything the
+       prefetcher got to first must have come from the staging ring. Items the
+       consumer reached before they were issued are read directly. */
+    assert(prefetch.n_staged_hits == n_taken);
+    if (cache_size <= 1 * MB) {
+        cache_stats_t stats;
+        cache_get_stats(&cache, &stats);
+        assert(stats.n_hits == 0);
+    }
+    prefetch_stop(&prefetch);
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that forked processes missing on the same files at once read each from
+   the filesystem only once, and that a miss waiting on a read whose process
+   died goes ahead by itself. */
+void
+test_coalesce(size_t cache_size,
+              size_t max_size,
+              char **filepaths,
+              int n_files,
+              int flags)
+{
+    cache_t *cache = mmap_alloc(sizeof(cache_t));
+    assert(cache != NULL);
+    assert(cache_init(cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+
+    /* Leave a slot claimed by a process that's gone. */
+    pid_t dead = fork();
+    if (dead == 0) {
+        _exit(EXIT_SUCCESS);
+    }
+    assert(dead > 0 && waitpid(dead, NULL, 0) == dead);
+    uint64_t key = utils_hash_str(filepaths[0]);
+    cache_flight_t *flight = &CACHE_FLIGHTS(cache)[key % N_FLIGHTS];
+    atomic_store(&flight->hash, key);
+    atomic_store(&flight->pid, dead);
+
+    /* Every child starts reading at once. */
+    _Atomic int *ready = mmap_alloc(sizeof(int));
+    assert(ready != NULL);
+    pid_t pids[N_PROCS];
+    for (int i = 0; i < N_PROCS; i++) {
+        if ((pids[i] = fork()) == 0) {
+            uint8_t *data;
+            assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+            atomic_fetch_add(ready, 1);
+            while (atomic_load(ready) < N_PROCS) {
+            }
+            for (int j = 0; j < n_files; j++) {
+                ssize_t size = cache_read(cache, filepaths[j], data, max_size);
+                if (size <= 0 || !verify_integrity(filepaths[j], data, size)) {
+                    _exit(EXIT_FAILURE);
+                }
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        assert(pids[i] > 0);
+    }
+    for (int i = 0; i < N_PROCS; i++) {
+        int status;
+        assert(waitpid(pids[i], &status, 0) == pids[i]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+    assert(atomic_load(&flight->hash) == 0);
+
+    /* When everything fits, each file was read from the filesystem once, by
+       whichever process got there first. */
+    cache_stats_t stats;
+    cache_get_stats(cache, &stats);
+    assert(stats.n_accs == N_PROCS * (size_t) n_files);
+    assert(stats.n_coalesced <= stats.n_hits);
+    if (stats.n_miss_capacity == 0) {
+        assert(stats.n_miss_cold == (size_t) n_files);
+        assert(stats.n_hits == stats.n_accs - n_files);
+    }
+
+    cache_destroy(cache);
+    mmap_free((void *) ready, sizeof(int));
+    mmap_free(cache, sizeof(cache_t));
+}
+
+/* Test that forked processes racing to read the same files share one index,
+   with every file ending up cached exactly once. */
+void
+test_fork(size_t cache_size,
+          size_t max_size,
+          char **filepaths,
+          int n_files,
+          int flags)
+{
+    /* The cache must be shared for its state to be visible after the fork. */
+    cache_t *cache = mmap_alloc(sizeof(cache_t));
+    assert(cache != NULL);
+    assert(cache_init(cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+
+    pid_t pids[N_PROCS];
+    for (int i = 0; i < N_PROCS; i++) {
+        if ((pids[i] = fork()) == 0) {
+            uint8_t *data;
+            assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+            for (int round = 0; round < 4; round++) {
+                for (int j = 0; j < n_files; j++) {
+                    ssize_t size = cache_read(cache, filepaths[j], data, max_size);
+                    if (size <= 0 || !verify_integrity(filepaths[j], data, size)) {
+                        _exit(EXIT_FAILURE);
+                    }
+                }
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        assert(pids[i] > 0);
+    }
+    for (int i = 0; i < N_PROCS; i++) {
+        int status;
+        assert(waitpid(pids[i], &status, 0) == pids[i]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    /* Whatever the children cached is visible here, and indexed once. */
+    size_t n_cached = 0, n_indexed = 0;
+    for (int i = 0; i < n_files; i++) {
+        n_cached += cache_contains(cache, filepaths[i]);
+    }
+    for (size_t i = 0; i < cache->n_slots; i++) {
+        n_indexed += CACHE_SLOTS(cache)[i] != 0;
+    }
+    assert(n_indexed == n_cached);
+
+    /* Every process' reads are counted, and each one lands in exactly one of
+       the hit and miss histograms. */
+    cache_stats_t stats;
+    cache_get_stats(cache, &stats);
+    assert(stats.n_accs == N_PROCS * 4 * n_files);
+    assert(stats.n_hits + stats.n_miss_cold + stats.n_miss_capacity == stats.n_accs);
+    size_t n_hit_ns = 0, n_miss_ns = 0, n_disk = 0;
+    for (int i = 0; i < N_HIST_BUCKETS; i++) {
+        n_hit_ns += stats.hists[HIST_HIT_NS].buckets[i];
+        n_miss_ns += stats.hists[HIST_MISS_NS].buckets[i];
+        n_disk += stats.hists[HIST_DISK_BYTES].buckets[i];
+    }
+    assert(n_hit_ns == stats.n_hits);
+    assert(n_miss_ns == stats.n_miss_cold + stats.n_miss_capacity);
+    assert(n_disk == n_miss_ns);
+    size_t disk_bytes = 0;
+    for (int j = 0; j < n_files; j++) {
+        struct stat st;
+        assert(stat(filepaths[j], &st) == 0);
+        disk_bytes += st.st_size;
+    }
+    assert(stats.hists[HIST_DISK_BYTES].sum + stats.hists[HIST_CACHE_BYTES].sum == N_PROCS * 4 * disk_bytes);
+
+    cache_reset_stats(cache);
+    cache_get_stats(cache, &stats);
+    assert(stats.n_accs == 0 && stats.hists[HIST_HIT_NS].sum == 0);
+
+    cache_destroy(cache);
+    munmap(cache, sizeof(cache_t));
+}
+
+/* Test that files which don't fit in memory spill to disk, and that later reads
+   (by path and in batches) are served from the spill tier intact, until it's
+   flushed along with the rest of the cache. */
+void
+test_spill(size_t cache_size,
+           size_t max_size,
+           char **filepaths,
+           int n_files,
+           int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+    assert(cache_spill(&cache, "../test-images", 32 * MB) == 0);
+    assert(cache_spill(&cache, "../test-images", 32 * MB) == -EEXIST);
+
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n_files; i++) {
+            ssize_t size = cache_read(&cache, filepaths[i], data, max_size);
+            assert(size > 0 && verify_integrity(filepaths[i], data, size));
+        }
+    }
+    cache_stats_t stats;
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_spill_stores == stats.n_miss_capacity);
+    assert(stats.n_hits + stats.n_spill_hits == (size_t) n_files);
+    if (cache_size < 2 * MB) {
+        assert(stats.n_spill_hits == (size_t) n_files);
+    }
+
+    /* Batches find spilled files too. */
+    uint8_t *datas[n_files];
+    cache_req_t reqs[n_files];
+    for (int i = 0; i < n_files; i++) {
+        assert(posix_memalign((void **) &datas[i], BLOCK_SIZE, max_size) == 0);
+        reqs[i] = (cache_req_t) {filepaths[i], datas[i], max_size, 0};
+    }
+    assert(cache_read_batch(&cache, reqs, n_files) == 0);
+    for (int i = 0; i < n_files; i++) {
+        assert(reqs[i].result > 0 && verify_integrity(filepaths[i], datas[i], reqs[i].result));
+        free(datas[i]);
+    }
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_hits + stats.n_spill_hits == 2 * (size_t) n_files);
+
+    /* Flushing empties both tiers. */
+    assert(cache_flush(&cache) == 0);
+    cache_reset_stats(&cache);
+    for (int i = 0; i < n_files; i++) {
+        assert(cache_read(&cache, filepaths[i], data, max_size) > 0);
+    }
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_hits == 0 && stats.n_spill_hits == 0);
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that ranges of files read intact whatever their alignment, through the
+   end of the file, and that the blocks they touch are cached for later
+   ranges. */
+void
+test_range(size_t cache_size,
+           size_t max_size,
+           char **filepaths,
+           int n_files,
+           int flags)
+{
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+    uint8_t *data = malloc(3 * RANGE_BLOCK_SIZE + 1);
+    uint8_t *truth = malloc(3 * RANGE_BLOCK_SIZE + 1);
+    assert(data != NULL && truth != NULL);
+
+    size_t n_blocks = 0;
+    for (int i = 0; i < n_files; i++) {
+        struct stat st;
+        assert(stat(filepaths[i], &st) == 0);
+        int fd = open(filepaths[i], O_RDONLY);
+        assert(fd >= 0);
+        size_t ranges[][2] = {
+            {0, 100},
+            {RANGE_BLOCK_SIZE - 7, 3 * RANGE_BLOCK_SIZE + 1},
+            {st.st_size - 10, 1000},
+            {12345, RANGE_BLOCK_SIZE},
+        };
+        size_t n_file_blocks = (st.st_size + RANGE_BLOCK_SIZE - 1) / RANGE_BLOCK_SIZE;
+        n_blocks += MIN(n_file_blocks, 4) + (n_file_blocks > 4);
+        for (int round = 0; round < 2; round++) {
+            for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+                size_t offset = ranges[r][0], length = ranges[r][1];
+                ssize_t expected = pread(fd, truth, length, offset);
+                assert(cache_read_range(&cache, filepaths[i], data, offset, length) == expected);
+                assert(memcmp(data, truth, expected) == 0);
+            }
+        }
+        assert(cache_read_range(&cache, filepaths[i], data, st.st_size + 1, 10) == 0);
+        close(fd);
+    }
+    assert(cache_read_range(&cache, "../test-images/nonexistent.bmp", data, 0, 10) == -ENOENT);
+
+    /* Each block touched was read from the filesystem once if they all fit:
+       the first four, and the last. */
+    cache_stats_t stats;
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_fail == 1);
+    if (stats.n_miss_capacity == 0) {
+        assert(stats.n_miss_cold == n_blocks);
+    }
+
+    /* Paths spelled like a block's key neither see nor disturb the block. */
+    int fd = open(filepaths[0], O_RDONLY);
+    assert(fd >= 0);
+    ssize_t expected = pread(fd, truth, 100, 0);
+    close(fd);
+    char *spellings[] = {"b0:%s", "%s//0"};
+    for (size_t s = 0; s < sizeof(spellings) / sizeof(spellings[0]); s++) {
+        char key[PATH_MAX];
+        uint8_t junk[64] = {0};
+        size_t size = 0;
+        snprintf(key, sizeof(key), spellings[s], filepaths[0]);
+        assert(!cache_contains(&cache, key));
+        assert(cache_load(&cache, key, data, &size, RANGE_BLOCK_SIZE) == -ENODATA);
+        int status = cache_store(&cache, key, junk, sizeof(junk));
+        assert(status == 0 || status == -ENOMEM);
+        assert(cache_read_range(&cache, filepaths[0], data, 0, 100) == expected);
+        assert(memcmp(data, truth, expected) == 0);
+    }
+
+    cache_destroy(&cache);
+    free(data);
+    free(truth);
+}
+
+/* Append a ustar header for a SIZE-byte member of type TYPE, named NAME under
+   PREFIX (if not NULL), to the tar file FD. */
+void
+write_tar_header(int fd, char *name, char *prefix, size_t size, char type)
+{
+    char h[512] = {0};
+    strncpy(h, name, 100);
+    strcpy(h + 100, "0000644");
+    sprintf(h + 124, "%011lo", size);
+    h[156] = type;
+    memcpy(h + 257, "ustar\0" "00", 8);
+    if (prefix != NULL) {
+        strncpy(h + 345, prefix, 155);
+    }
+    unsigned sum = 0;
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < 512; i++) {
+        sum += (uint8_t) h[i];
+    }
+    sprintf(h + 148, "%06o", sum);
+    assert(write(fd, h, 512) == 512);
+}
+
+/* Test that members of a tar shard are indexed under the shard's path, cached
+   as the shard is added, and read back out of the shard once flushed. */
+void
+test_shard(size_t cache_size,
+           size_t max_size,
+           char **filepaths,
+           int n_files,
+           int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    /* Pack the files, the first under a ustar prefix and the last under a
+       GNU long name. */
+    char *shard = "../test-images/minio-test.tar";
+    char *long_name = "a-member-name-that-is-far-too-long-for-the-one-hundred-bytes-a-ustar-header-has-room-for-in-its-name-field.bmp";
+    char keys[n_files][PATH_MAX];
+    int fd = open(shard, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (int i = 0; i < n_files; i++) {
+        struct stat st;
+        assert(stat(filepaths[i], &st) == 0);
+        char *name = strrchr(filepaths[i], '/') + 1;
+        if (i == 0) {
+            write_tar_header(fd, name, "images", st.st_size, '0');
+            sprintf(keys[i], "%s/images/%s", shard, name);
+        } else if (i == n_files - 1) {
+            write_tar_header(fd, "././@LongLink", NULL, strlen(long_name) + 1, 'L');
+            char block[512] = {0};
+            strcpy(block, long_name);
+            assert(write(fd, block, 512) == 512);
+            write_tar_header(fd, long_name, NULL, st.st_size, '0');
+            sprintf(keys[i], "%s/%s", shard, long_name);
+        } else {
+            write_tar_header(fd, name, NULL, st.st_size, '0');
+            sprintf(keys[i], "%s/%s", shard, name);
+        }
+        int in = open(filepaths[i], O_RDONLY);
+        assert(in >= 0 && read(in, data, st.st_size) == st.st_size);
+        close(in);
+        size_t padded = (st.st_size + 511) & ~511;
+        memset(data + st.st_size, 0, padded - st.st_size);
+        assert(write(fd, data, padded) == (ssize_t) padded);
+    }
+    memset(data, 0, 1024);
+    assert(write(fd, data, 1024) == 1024);
+    close(fd);
+
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+    assert(cache_add_shard(&cache, filepaths[0]) == -EINVAL);
+    assert(cache_add_shard(&cache, "../test-images/nonexistent.tar") == -ENOENT);
+    assert(cache_add_shard(&cache, shard) == n_files);
+
+    /* Members that fit were cached as the shard was read. */
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n_files; i++) {
+            struct stat st;
+            assert(stat(filepaths[i], &st) == 0);
+            ssize_t size = cache_read(&cache, keys[i], data, max_size);
+            assert(size == st.st_size && verify_integrity(filepaths[i], data, size));
+        }
+        cache_stats_t stats;
+        cache_get_stats(&cache, &stats);
+        assert(stats.n_fail == 0);
+        if (round == 0 && cache_size >= 32 * MB) {
+            assert(stats.n_hits == stats.n_accs);
+        }
+
+        /* Misses after a flush go back to the shard. */
+        assert(cache_flush(&cache) == 0);
+    }
+
+    cache_destroy(&cache);
+    unlink(shard);
+    free(data);
+}
+
+/* Test that CACHE_COMPRESS caches compress files that shrink, serve them intact
+   through every read path (and snapshots), and account for the space saved. */
+void
+test_compress(size_t cache_size,
+              size_t max_size,
+              char **filepaths,
+              int n_files,
+              int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    /* A file that compresses well, cached ahead of the test images. */
+    char text[] = "../test-images/text-XXXXXX";
+    int fd = mkstemp(text);
+    assert(fd >= 0);
+    for (int i = 0; i < 512 * KB / 64; i++) {
+        char line[65];
+        snprintf(line, sizeof(line), "%063d\n", i % 1000);
+        assert(write(fd, line, 64) == 64);
+    }
+    close(fd);
+    char *paths[n_files + 1];
+    paths[0] = text;
+    memcpy(&paths[1], filepaths, n_files * sizeof(char *));
+
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, POLICY_MINIO, flags | CACHE_COMPRESS) == 0);
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i <= n_files; i++) {
+            ssize_t size = cache_read(&cache, paths[i], data, max_size);
+            assert(size > 0 && verify_integrity(paths[i], data, size));
+        }
+    }
+    cache_stats_t stats;
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_hits >= 1);
+    assert(stats.n_bytes_stored > 0 && stats.n_bytes_raw - stats.n_bytes_stored > 256 * KB);
+    assert(cache_load(&cache, text, data, &(size_t) {0}, 512 * KB - 1) == -EINVAL);
+
+    /* Compressed entries can't be viewed in place, but are still hits. */
+    cache_view_t view;
+    assert(cache_acquire(&cache, text, &view) == -ENOTSUP);
+    assert(cache_read_view(&cache, text, data, max_size, &view) == 512 * KB);
+    assert(view.ptr == NULL && verify_integrity(text, data, 512 * KB));
+    cache_req_t req = {.path = text, .data = data, .max_size = max_size};
+    assert(cache_read_batch(&cache, &req, 1) == 0 && req.result == 512 * KB);
+    assert(verify_integrity(text, data, req.result));
+
+    /* Snapshots keep the data compressed, and range blocks apart from
+       paths. */
+    assert(cache_read_range(&cache, text, data, 0, 100) == 100);
+    char snap[] = "../test-images/snapshot-XXXXXX";
+    fd = mkstemp(snap);
+    assert(fd >= 0);
+    close(fd);
+    int n_saved = cache_save(&cache, snap), n_blocks = n_saved;
+    for (int i = 0; i <= n_files; i++) {
+        n_blocks -= cache_contains(&cache, paths[i]);
+    }
+    assert(n_saved > 0 && (n_blocks == 0 || n_blocks == 1));
+    cache_t opened;
+    assert(cache_init(&opened, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+    assert(cache_open(&opened, snap) == n_saved);
+    assert(cache_read(&opened, text, data, max_size) == 512 * KB);
+    assert(verify_integrity(text, data, 512 * KB));
+    assert(cache_read_range(&opened, text, data, 0, 100) == 100);
+    assert(verify_integrity(text, data, 100));
+    char key[PATH_MAX];
+    snprintf(key, sizeof(key), "b0:%s", text);
+    assert(!cache_contains(&opened, key));
+    cache_get_stats(&opened, &stats);
+    assert(stats.n_hits == 1 + (size_t) n_blocks);
+
+    cache_destroy(&opened);
+    cache_destroy(&cache);
+    unlink(snap);
+    unlink(text);
+    free(data);
+}
+
+/* Test that a snapshot saved by a cache with flags SAVE_FLAGS is indexed by a
+   cache with flags OPEN_FLAGS, serves the same data, and can itself be saved
+   again. */
+void
+test_snapshot(size_t cache_size,
+              size_t max_size,
+              char **filepaths,
+              int n_files,
+              int save_flags,
+              int open_flags)
 {
-    struct timespec start, end;
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+    char path[] = "../test-images/snapshot-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    cache_t saved;
+    assert(cache_init(&saved, cache_size, max_size, 0, 0, POLICY_MINIO, save_flags) == 0);
+    int n_cached = 0;
+    for (int i = 0; i < n_files; i++) {
+        assert(cache_read(&saved, filepaths[i], data, max_size) > 0);
+        n_cached += cache_contains(&saved, filepaths[i]);
+    }
+    assert(cache_save(&saved, path) == n_cached);
+
+    /* Everything saved is hit in the new cache, and nothing else is. */
+    for (int round = 0; round < 2; round++) {
+        cache_t opened;
+        assert(cache_init(&opened, cache_size, max_size, 0, 0, POLICY_MINIO, open_flags) == 0);
+        assert(cache_open(&opened, path) == n_cached);
+        assert(cache_open(&opened, path) == -EBUSY);
+        for (int i = 0; i < n_files; i++) {
+            assert(cache_contains(&opened, filepaths[i]) == cache_contains(&saved, filepaths[i]));
+            ssize_t size = cache_read(&opened, filepaths[i], data, max_size);
+            assert(size > 0 && verify_integrity(filepaths[i], data, size));
+
+            cache_view_t view;
+            if (cache_acquire(&opened, filepaths[i], &view) == 0) {
+                assert(verify_integrity(filepaths[i], view.ptr, view.size));
+                cache_release(&opened, &view);
+            }
+        }
+        cache_stats_t stats;
+        cache_get_stats(&opened, &stats);
+        assert(stats.n_hits == (size_t) n_cached);
+
+        /* A save of snapshot entries (and anything cached since) round-trips. */
+        n_cached = 0;
+        for (int i = 0; i < n_files; i++) {
+            n_cached += cache_contains(&opened, filepaths[i]);
+        }
+        assert(cache_save(&opened, path) == n_cached);
+        assert(cache_flush(&opened) == 0);
+        assert(!cache_contains(&opened, filepaths[0]));
+        cache_destroy(&opened);
+    }
+
+    /* Anything that isn't a snapshot is rejected. */
+    cache_t bad;
+    assert(cache_init(&bad, cache_size, max_size, 0, 0, POLICY_MINIO, open_flags) == 0);
+    assert(cache_open(&bad, filepaths[0]) == -EINVAL);
+    cache_destroy(&bad);
+
+    cache_destroy(&saved);
+    unlink(path);
+    free(data);
+}
+
+/* Test that a named cache is shared by processes that attach to it by name,
+   rather than through fork, and is torn down once the last reference is
+   dropped, including references held by processes that died. */
+void
+test_named(size_t cache_size,
+           size_t max_size,
+           char **filepaths,
+           int n_files,
+           int flags)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "test-%d", getpid());
+
+    cache_t *cache;
+    assert(cache_create(&cache, name, cache_size, max_size, 0, n_files, POLICY_MINIO, flags) == 0);
+    assert(cache_create(&cache, name, cache_size, max_size, 0, n_files, POLICY_MINIO, flags) == -EEXIST);
+    assert(cache_create(&cache, "bad/name", cache_size, max_size, 0, n_files, POLICY_MINIO, flags) == -EINVAL);
+    size_t first;
+    assert(cache_register(cache, filepaths, n_files, &first) == 0);
+
+    /* Children attach afresh, mapping the cache wherever they like. One exits
+       without detaching. */
+    pid_t pids[N_PROCS];
+    for (int i = 0; i < N_PROCS; i++) {
+        if ((pids[i] = fork()) == 0) {
+            cache_t *attached;
+            uint8_t *data;
+            assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+            if (cache_attach(&attached, name) < 0) {
+                _exit(EXIT_FAILURE);
+            }
+            for (int round = 0; round < 2; round++) {
+                for (int j = 0; j < n_files; j++) {
+                    if (strcmp(cache_id_path(attached, first + j), filepaths[j]) != 0) {
+                        _exit(EXIT_FAILURE);
+                    }
+                    ssize_t size = cache_read(attached, filepaths[j], data, max_size);
+                    if (size <= 0 || !verify_integrity(filepaths[j], data, size)) {
+                        _exit(EXIT_FAILURE);
+                    }
+                }
+            }
+            if (i > 0) {
+                cache_destroy(attached);
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        assert(pids[i] > 0);
+    }
+    for (int i = 0; i < N_PROCS; i++) {
+        int status;
+        assert(waitpid(pids[i], &status, 0) == pids[i]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    /* Whatever the children cached is visible here. */
+    cache_stats_t stats;
+    cache_get_stats(cache, &stats);
+    assert(stats.n_accs == N_PROCS * 2 * n_files);
+    if (cache_size >= 8 * MB) {
+        assert(cache_contains(cache, filepaths[0]));
+    }
+
+    /* A second handle in this process holds its own reference. */
+    cache_t *other;
+    assert(cache_attach(&other, name) == 0);
+    assert(other != cache);
+    assert(cache_contains(other, filepaths[0]) == cache_contains(cache, filepaths[0]));
+    cache_destroy(cache);
+    assert(cache_attach(&cache, name) == 0);
+    cache_destroy(cache);
+    cache_destroy(other);
+    assert(cache_attach(&cache, name) == -ENOENT);
+}
+
+/* Returns the number of shm objects backing CACHE's entries. */
+int
+count_shm_objects(cache_t *cache)
+{
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "minio_%llx_", (unsigned long long) cache->id);
+    DIR *dir = opendir("/dev/shm");
+    assert(dir != NULL);
+    int n = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        n += strncmp(ent->d_name, prefix, strlen(prefix)) == 0;
+    }
+    closedir(dir);
 
-    clock_gettime(CLOCK_REALTIME, &start);
-    assert(cache_read(cache, filepath, data, max_size) != -1);
-    clock_gettime(CLOCK_REALTIME, &end);
+    return n;
+}
 
-    return (start.tv_nsec + start.tv_sec * 1e9) - (end.tv_nsec + end.tv_sec * 1e9);
+/* Wait until CACHE has reclaimed what its last flush detached. */
+void
+await_reclaim(cache_t *cache)
+{
+    while (atomic_load(&cache->reclaim_pid) != 0) {
+        sched_yield();
+    }
 }
 
-/* Test that hot accesses for items that fit in the cache are faster than their
-   cold accesses, and that uncached items are approximately the same. */
+/* Test that a flush frees every shm object, and that resizing the cache in
+   use changes what it admits, evicting down to the new size under an evicting
+   POLICY. Expects the 2 MB, 4 MB and 20 MB test files, in that order, and a
+   CACHE_SIZE that holds all of them. */
 void
-test_timing(size_t cache_size,
+test_resize(size_t cache_size,
             size_t max_size,
             char **filepaths,
-            bool *should_cache,
-            int n_files)
+            int n_files,
+            policy_t policy,
+            int flags)
 {
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
 
+    cache_t cache;
+    assert(cache_init(&cache, cache_size, max_size, 0, 0, policy, flags) == 0);
+    assert(cache_resize(&cache, 0) == -EINVAL);
+    if (flags & CACHE_ARENA) {
+        assert(cache_resize(&cache, cache_size + 1) == -EINVAL);
+    }
 
-    /* Access times in nanoseconds. */
-    long times_hot[n_files];
-    long times_cold[n_files];
+    for (int i = 0; i < n_files; i++) {
+        assert(cache_read(&cache, filepaths[i], data, max_size) > 0);
+    }
+    if (!(flags & CACHE_ARENA)) {
+        assert(count_shm_objects(&cache) == n_files);
+    }
+    assert(cache_flush(&cache) == 0);
+    await_reclaim(&cache);
+    assert(count_shm_objects(&cache) == 0);
 
-    /* Where we're reading the file into from the cache. */
+    /* Shrinking evicts under an evicting policy, and otherwise leaves what's
+       cached until a flush. Either way the largest file no longer fits. */
+    for (int i = 0; i < n_files; i++) {
+        assert(cache_read(&cache, filepaths[i], data, max_size) > 0);
+    }
+    assert(cache_resize(&cache, 8 * MB) == 0);
+    if (policy == POLICY_MINIO) {
+        assert(cache_contains(&cache, filepaths[n_files - 1]));
+        assert(cache_flush(&cache) == 0);
+    } else {
+        assert(cache.used <= 8 * MB);
+    }
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n_files; i++) {
+            ssize_t size = cache_read(&cache, filepaths[i], data, max_size);
+            assert(size > 0 && verify_integrity(filepaths[i], data, size));
+            assert(cache_contains(&cache, filepaths[i]) == (i < n_files - 1));
+        }
+    }
+
+    /* Growing makes room straight away. */
+    assert(cache_resize(&cache, cache_size) == 0);
+    for (int i = 0; i < n_files; i++) {
+        assert(cache_read(&cache, filepaths[i], data, max_size) > 0);
+        assert(cache_contains(&cache, filepaths[i]));
+    }
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Test that a cache accounts for the memory it page-locks (or couldn't), with
+   or without an arena (FLAGS), and that auto-sizing stays within the limits
+   of the sandbox. Uses N_FILES of FILEPATHS, of at most MAX_SIZE bytes. */
+void
+test_memory(size_t cache_size,
+            size_t max_size,
+            char **filepaths,
+            int n_files,
+            int flags)
+{
     uint8_t *data;
     assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
 
-    /* Cache being tested. */
+    size_t fit = cache_fit_size(cache_size, max_size, 0, POLICY_MINIO, flags);
+    assert(fit > 0 && fit <= cache_size);
+
     cache_t cache;
-    assert(cache_init(&cache, cache_size, max_size, 0, POLICY_MINIO) == 0);
+    cache_memory_t memory;
+    assert(cache_init(&cache, fit, max_size, 0, 0, POLICY_MINIO, flags | CACHE_PIN_FALLBACK) == 0);
+    cache_get_memory(&cache, &memory);
+    assert(memory.pinned + memory.unpinned > 0);
+    size_t idle = memory.pinned + memory.unpinned;
 
-    /* Cold accesses. */
+    /* Every cached byte is either pinned or counted as not. */
+    for (int i = 0; i < n_files; i++) {
+        ssize_t size = cache_read(&cache, filepaths[i], data, max_size);
+        assert(size > 0 && verify_integrity(filepaths[i], data, size));
+    }
+    cache_get_memory(&cache, &memory);
+    assert(memory.resident > 0);
+    if (!(flags & CACHE_ARENA)) {
+        assert(memory.pinned + memory.unpinned >= idle + cache.used);
+    }
+
+    assert(cache_flush(&cache) == 0);
+    await_reclaim(&cache);
+    cache_get_memory(&cache, &memory);
+    assert(memory.pinned + memory.unpinned == idle);
+
+    cache_destroy(&cache);
+    free(data);
+}
+
+/* Send a raw peer request for PATH, carrying TOKEN, to the node listening on
+   127.0.0.1:PORT. Returns the size in its reply (or negative errno), or
+   -ECONNRESET if the node hung up. */
+int64_t
+peer_request(int port, char *token, char *path, size_t max_size)
+{
+    struct {
+        uint32_t magic;
+        uint32_t len;
+        uint64_t max_size;
+        char     token[PEER_TOKEN_LEN];
+    } req = {0x4d494e50, strlen(path), max_size};
+    strncpy(req.token, token, PEER_TOKEN_LEN - 1);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    assert(send(fd, &req, sizeof(req), 0) == sizeof(req));
+    assert(send(fd, path, req.len, 0) == req.len);
+    int64_t size;
+    ssize_t n = recv(fd, &size, sizeof(size), MSG_WAITALL);
+    close(fd);
+
+    return n == sizeof(size) ? size : -ECONNRESET;
+}
+
+/* Test that a peer tier reads misses on files another node owns from that
+   node's cache, with or without an arena (FLAGS), caching every file on its
+   owner alone, and that reads fall back locally once the owner is gone. Nodes
+   only serve requests carrying their token, for paths they own that are
+   registered (or cached) there. Uses N_FILES of FILEPATHS, of at most
+   MAX_SIZE bytes. */
+void
+test_peers(size_t cache_size,
+           size_t max_size,
+           char **filepaths,
+           int n_files,
+           int flags)
+{
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+
+    char addrs[2][32];
+    char *peers[2] = {addrs[0], addrs[1]};
+    int port = 20000 + (getpid() * 2 + (flags != 0)) % 20000;
+    snprintf(addrs[0], sizeof(addrs[0]), "127.0.0.1:%d", port);
+    snprintf(addrs[1], sizeof(addrs[1]), "127.0.0.1:%d", port + 20000);
+
+    char long_token[PEER_TOKEN_LEN + 1];
+    memset(long_token, 't', PEER_TOKEN_LEN);
+    long_token[PEER_TOKEN_LEN] = '\0';
+
+    cache_t a, b;
+    assert(cache_init(&a, cache_size, max_size, 0, 0, POLICY_MINIO, flags) == 0);
+    assert(cache_init(&b, cache_size, max_size, 0, n_files, POLICY_MINIO, flags) == 0);
+    assert(cache_add_peers(&a, peers, 2, 2, "secret") == -EINVAL);
+    assert(cache_add_peers(&a, peers, 2, 0, NULL) == -EINVAL);
+    assert(cache_add_peers(&a, peers, 2, 0, "") == -EINVAL);
+    assert(cache_add_peers(&a, peers, 2, 0, long_token) == -EINVAL);
+    assert(cache_add_peers(&a, peers, 2, 0, "secret") == 0);
+    assert(cache_add_peers(&a, peers, 2, 0, "secret") == -EEXIST);
+    assert(cache_add_peers(&b, peers, 2, 1, "secret") == 0);
+
+    /* B won't read files it hasn't been told about (whoever owns them), and
+       hangs up on requests without its token. */
     for (int i = 0; i < n_files; i++) {
-        times_cold[i] = timed_access(&cache, filepaths[i], data, max_size);
+        assert(peer_request(port + 20000, "secret", filepaths[i], max_size) == -ENODATA);
+        assert(!cache_contains(&b, filepaths[i]));
     }
+    assert(peer_request(port + 20000, "guess", filepaths[0], max_size) == -ECONNRESET);
 
-    /* Hot accesses. */
+    /* Paths registered once B is serving are picked up as they're asked for. */
+    size_t first;
+    assert(cache_register(&b, filepaths, n_files, &first) == 0);
+
+    /* Every file is cached once, on A if it's A's and on B if it's read
+       through B's tier. */
+    for (int i = 0; i < n_files; i++) {
+        ssize_t size = cache_read(&a, filepaths[i], data, max_size);
+        assert(size > 0 && verify_integrity(filepaths[i], data, size));
+    }
+    int n_remote = 0;
     for (int i = 0; i < n_files; i++) {
-        times_hot[i] = timed_access(&cache, filepaths[i], data, max_size);
+        assert(cache_contains(&a, filepaths[i]) != cache_contains(&b, filepaths[i]));
+        n_remote += cache_contains(&b, filepaths[i]);
     }
+    cache_stats_t stats;
+    cache_get_stats(&a, &stats);
+    assert(stats.n_peer_hits == (uint64_t) n_remote && stats.n_peer_fails == 0);
 
-    /* Check timing. */
+    /* Batches read B's files from B as well, once A's own are read. */
+    assert(cache_flush(&a) == 0);
+    uint8_t *datas[n_files];
+    cache_req_t reqs[n_files];
     for (int i = 0; i < n_files; i++) {
-        double speedup = (1e-9 * times_cold[i]) / (1e-9 * times_hot[i]);
-        printf("Speedup for item %d is %.02lfx (cached? %d).\n", i, speedup, should_cache[i]);
+        assert(posix_memalign((void **) &datas[i], BLOCK_SIZE, max_size) == 0);
+        reqs[i] = (cache_req_t) {filepaths[i], datas[i], max_size, 0};
     }
+    assert(cache_read_batch(&a, reqs, n_files) == 0);
+    for (int i = 0; i < n_files; i++) {
+        assert(reqs[i].result > 0 && verify_integrity(filepaths[i], datas[i], reqs[i].result));
+        assert(cache_contains(&a, filepaths[i]) != cache_contains(&b, filepaths[i]));
+        free(datas[i]);
+    }
+    cache_get_stats(&a, &stats);
+    assert(stats.n_peer_hits == 2 * (uint64_t) n_remote && stats.n_peer_fails == 0);
+
+    /* Without B, its files are read (and cached) here instead. */
+    cache_destroy(&b);
+    for (int i = 0; i < n_files; i++) {
+        ssize_t size = cache_read(&a, filepaths[i], data, max_size);
+        assert(size > 0 && verify_integrity(filepaths[i], data, size));
+        assert(cache_contains(&a, filepaths[i]));
+    }
+    cache_get_stats(&a, &stats);
+    assert(stats.n_peer_hits == 2 * (uint64_t) n_remote && (n_remote == 0 || stats.n_peer_fails >= 1));
 
+    cache_destroy(&a);
     free(data);
 }
 
-/* Verify that DATA contains the same data as the file at FILEPATH. */
-bool
-verify_integrity(char *filepath, uint8_t *data, ssize_t size)
+/* Test that evicting caches stay usable by the processes sharing them when
+   another dies holding the eviction lock: one that left its state half
+   updated, one in the middle of a flush, and ones killed at random while
+   storing. Expects N_FILES of FILEPATHS not to fit in a cache of CACHE_SIZE
+   bytes all at once. */
+void
+test_dead_writer(size_t cache_size,
+                 size_t max_size,
+                 char **filepaths,
+                 int n_files,
+                 policy_t policy)
 {
-    /* Read a fresh copy of the data from storage. */
-    uint8_t *baseline = malloc(size);
-    assert(baseline != NULL);
-    int fd = open(filepath, O_RDONLY);
-    read(fd, baseline, size);
+    uint8_t *data;
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+    cache_t *cache = mmap_alloc(sizeof(cache_t));
+    assert(cache != NULL);
+    assert(cache_init(cache, cache_size, max_size, 0, 0, policy, CACHE_ARENA) == 0);
+    for (int i = 0; i < n_files; i++) {
+        assert(cache_read(cache, filepaths[i], data, max_size) > 0);
+    }
 
-    /* Check each byte matches. */
-    for (size_t i = 0; i < size; i++) {
-        if (data[i] != baseline[i]) {
-            printf("byte offset %ld is incorrect (data = 0x%hx, truth = 0x%hx)\n",
-                   i,
-                   data[i],
-                   baseline[i]);
-            free(baseline);
-            return false;
+    /* A writer that dies having lost track of every entry and slab, and a
+       flush that dies before it's cleared anything. */
+    for (int i = 0; i < 2; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            pthread_mutex_lock(&cache->evict_lock);
+            if (i == 0) {
+                atomic_fetch_add(&cache->n_writers, 1);
+                cache->n_order = 0;
+                cache->n_free_entries = 0;
+                memset(cache->slab_partial, 0, sizeof(cache->slab_partial));
+            } else {
+                atomic_fetch_add(&cache->epoch, 1);
+            }
+            _exit(EXIT_SUCCESS);
         }
+        int status;
+        assert(pid > 0 && waitpid(pid, &status, 0) == pid);
+        assert(cache_read(cache, filepaths[0], data, max_size) > 0);
     }
+    assert(cache->epoch % 2 == 0 && cache->n_writers == 0);
 
-    free(baseline);
-    return true;
+    /* Writers killed partway through storing, under keys of their own so that
+       they never hit, and so never pin anything. */
+    memset(data, 'x', max_size);
+    for (int i = 0; i < 8; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            char key[32];
+            for (int k = 0; ; k++) {
+                snprintf(key, sizeof(key), "dead-%d-%d", i, k);
+                cache_store(cache, key, data, (k % 4 + 1) * MB);
+            }
+        }
+        assert(pid > 0);
+        usleep(1000 + 3000 * i);
+        kill(pid, SIGKILL);
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+    }
+
+    /* Eviction still makes room, and whatever is cached is intact. */
+    cache_stats_t stats;
+    cache_get_stats(cache, &stats);
+    size_t evictions = stats.n_evictions;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n_files; i++) {
+            ssize_t size = cache_read(cache, filepaths[i], data, max_size);
+            assert(size > 0 && verify_integrity(filepaths[i], data, size));
+            assert(cache_contains(cache, filepaths[i]));
+        }
+    }
+    cache_get_stats(cache, &stats);
+    assert(stats.n_evictions > evictions && stats.n_fail == 0);
+    assert(cache->used <= cache->size && cache->n_writers == 0);
+    assert(cache_flush(cache) == 0);
+    assert(cache->used == 0);
+
+    cache_destroy(cache);
+    munmap(cache, sizeof(cache_t));
+    free(data);
 }
 
+/* Test that a flush whose process dies before reclaiming what it detached
+   doesn't leave the cache stuck or leak shm objects: the next store to reuse
+   an entry takes the reclaim over. */
+#define N_FLUSH_KEYS (512)
 void
-test_integrity(size_t cache_size,
-              size_t max_size,
-              char **filepaths,
-              int n_files)
+test_dead_flush(void)
+{
+    cache_t *cache = mmap_alloc(sizeof(cache_t));
+    assert(cache != NULL);
+    assert(cache_init(cache, 32 * MB, 1 * MB, 0, 0, POLICY_MINIO, 0) == 0);
+
+    uint8_t data[BLOCK_SIZE], copy[BLOCK_SIZE];
+    char key[32];
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < N_FLUSH_KEYS; i++) {
+            snprintf(key, sizeof(key), "flush-%d", i);
+            memset(data, round * N_FLUSH_KEYS + i, sizeof(data));
+            assert(cache_store(cache, key, data, sizeof(data)) == 0);
+        }
+        if (round == 1) {
+            break;
+        }
+
+        /* The child exits as soon as the flush returns, taking its reclaim
+           thread with it. */
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(cache_flush(cache) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        int status;
+        assert(pid > 0 && waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+        assert(!cache_contains(cache, "flush-0"));
+    }
+
+    for (int i = 0; i < N_FLUSH_KEYS; i++) {
+        size_t size;
+        snprintf(key, sizeof(key), "flush-%d", i);
+        memset(data, N_FLUSH_KEYS + i, sizeof(data));
+        assert(cache_load(cache, key, copy, &size, sizeof(copy)) == 0);
+        assert(size == sizeof(data) && memcmp(data, copy, size) == 0);
+    }
+    assert(count_shm_objects(cache) == N_FLUSH_KEYS);
+    assert(cache_flush(cache) == 0);
+    await_reclaim(cache);
+    assert(count_shm_objects(cache) == 0);
+
+    cache_destroy(cache);
+    munmap(cache, sizeof(cache_t));
+}
+
+/* Test that evicting policies make room for new files, choosing victims in
+   the right order and never evicting pinned entries, in an arena with FLAGS,
+   and that they refuse to run without one. Uses N_POLICY_FILES generated files of FILE_SIZE bytes, of which
+   only three fit at once. */
+#define N_POLICY_FILES (8)
+#define POLICY_FILE_SIZE (1 * MB)
+void
+test_policy(policy_t policy, int flags)
 {
-    /* Where we're reading the file into from the cache. */
     uint8_t *data;
-    assert(posix_memalign((void **) &data, BLOCK_SIZE, max_size) == 0);
+    assert(posix_memalign((void **) &data, BLOCK_SIZE, POLICY_FILE_SIZE) == 0);
+
+    /* Generate the files next to the test images, where O_DIRECT works. */
+    char dir[] = "../test-images/policy-XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char paths[N_POLICY_FILES][64];
+    char *files[N_POLICY_FILES];
+    for (int i = 0; i < N_POLICY_FILES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/%d.bin", dir, i);
+        files[i] = paths[i];
+        memset(data, 'a' + i, POLICY_FILE_SIZE);
+        int fd = open(files[i], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        assert(fd >= 0);
+        assert(write(fd, data, POLICY_FILE_SIZE) == POLICY_FILE_SIZE);
+        close(fd);
+    }
 
-    /* Cache being tested. */
     cache_t cache;
-    assert(cache_init(&cache, cache_size, max_size, 0, POLICY_MINIO) == 0);
+    assert(cache_init(&cache, 3 * POLICY_FILE_SIZE + POLICY_FILE_SIZE / 2,
+                      POLICY_FILE_SIZE, 0, 0, policy, flags & ~CACHE_ARENA) == -EINVAL);
+    cache_destroy(&cache);
+    assert(cache_init(&cache, 3 * POLICY_FILE_SIZE + POLICY_FILE_SIZE / 2,
+                      POLICY_FILE_SIZE, 0, 0, policy, flags) == 0);
 
-    /* Cold accesses. */
-    for (int i = 0; i < n_files; i++) {
-        ssize_t size = cache_read(&cache, filepaths[i], data, max_size);
-        assert(size > 0);
-        verify_integrity(filepaths[i], data, size);
+    /* Fill the cache, hit the oldest file, then force an eviction. FIFO evicts
+       the oldest file regardless, CLOCK spares it for having been hit. */
+    for (int i = 0; i < 3; i++) {
+        assert(cache_read(&cache, files[i], data, POLICY_FILE_SIZE) == POLICY_FILE_SIZE);
+    }
+    assert(cache_read(&cache, files[0], data, POLICY_FILE_SIZE) == POLICY_FILE_SIZE);
+    cache_stats_t stats;
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_hits == 1);
+    assert(cache_read(&cache, files[3], data, POLICY_FILE_SIZE) == POLICY_FILE_SIZE);
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_evictions == 1);
+    assert(cache_contains(&cache, files[3]));
+    if (policy == POLICY_FIFO) {
+        assert(!cache_contains(&cache, files[0]) && cache_contains(&cache, files[1]));
+    } else {
+        assert(cache_contains(&cache, files[0]) && !cache_contains(&cache, files[1]));
     }
 
-    /* Hot accesses. */
-    for (int i = 0; i < n_files; i++) {
-        ssize_t size = cache_read(&cache, filepaths[i], data, max_size);
-        assert(size > 0);
-        verify_integrity(filepaths[i], data, size);
+    /* A pinned entry survives the rest of the files passing through. */
+    cache_view_t view;
+    assert(cache_acquire(&cache, files[3], &view) == 0);
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < N_POLICY_FILES; i++) {
+            ssize_t size = cache_read(&cache, files[i], data, POLICY_FILE_SIZE);
+            assert(size == POLICY_FILE_SIZE);
+            assert(verify_integrity(files[i], data, size));
+            assert(cache_contains(&cache, files[i]));
+        }
+    }
+    assert(cache_contains(&cache, files[3]));
+    assert(verify_integrity(files[3], view.ptr, view.size));
+    assert(cache.used <= cache.size);
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_fail == 0);
+    if (flags & CACHE_ARENA) {
+        assert(cache.used <= stats.arena_held && stats.arena_held <= cache.size);
+    }
+    cache_release(&cache, &view);
+    assert(cache_flush(&cache) == 0);
+    assert(cache.used == 0);
+    cache_get_stats(&cache, &stats);
+    assert(stats.arena_held == 0);
+
+    /* Space freed by eviction is reused by files of other sizes. */
+    cache_get_stats(&cache, &stats);
+    size_t n_evictions = stats.n_evictions;
+    for (int i = 0; i < N_POLICY_FILES; i++) {
+        memset(data, 'A' + i, POLICY_FILE_SIZE);
+        int fd = open(files[i], O_WRONLY | O_TRUNC);
+        assert(fd >= 0);
+        size_t size = (POLICY_FILE_SIZE >> (i % 4)) - (i / 4) * 1000;
+        assert(write(fd, data, size) == (ssize_t) size);
+        close(fd);
     }
+    for (int round = 0; round < 4 * N_POLICY_FILES; round++) {
+        char *file = files[(round * 5) % N_POLICY_FILES];
+        ssize_t size = cache_read(&cache, file, data, POLICY_FILE_SIZE);
+        assert(size > 0 && verify_integrity(file, data, size));
+    }
+    cache_get_stats(&cache, &stats);
+    assert(stats.n_fail == 0 && stats.n_evictions > n_evictions && cache.used <= cache.size);
 
+    cache_destroy(&cache);
+    for (int i = 0; i < N_POLICY_FILES; i++) {
+        unlink(files[i]);
+    }
+    rmdir(dir);
     free(data);
 }
 
@@ -171,16 +1913,6 @@ main(int argc, char **argv)
         "../test-images/20MB.bmp"
     };
 
-    bool should_cache[N_TEST_FILES] = {
-        true,
-        true,
-        false
-    };
-
-    /* Timing tests. */
-    printf("testing timing...\n");
-    test_timing(8 * MB, 32 * MB, test_files, should_cache, N_TEST_FILES);
-
     /* Integrity tests. */
     printf("testing integrity...\n");
     size_t integrity_configs[6] = {
@@ -193,7 +1925,193 @@ main(int argc, char **argv)
     };
     for (int i = 0; i < 6; i++) {
         printf("\t%ld KB cache...", integrity_configs[i] / KB);
-        test_integrity(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES);
+        test_integrity(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        printf(" OK.\n");
+    }
+    printf("testing arena integrity...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_integrity(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing huge pages...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_integrity(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_HUGE_2MB);
+        test_integrity(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA | CACHE_HUGE_2MB);
+        test_views(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA | CACHE_HUGE_2MB);
+        printf(" OK.\n");
+    }
+    cache_t huge;
+    assert(cache_init(&huge, 32 * MB, 32 * MB, 0, 0, POLICY_MINIO, CACHE_HUGE_2MB | CACHE_HUGE_1GB) == -EINVAL);
+
+    printf("testing NUMA placement...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_numa(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_numa(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        test_numa(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA | CACHE_HUGE_2MB);
+        printf(" OK.\n");
+    }
+
+    printf("testing reserved slots...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_reserve(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_reserve(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing range reads...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_range(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_range(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        test_range(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_COMPRESS);
+        printf(" OK.\n");
+    }
+
+    printf("testing tar shards...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_shard(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_shard(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing chunked reads...\n");
+    for (int i = 0; i < N_TEST_FILES; i++) {
+        test_read_full(test_files[i]);
+    }
+
+    printf("testing path hashing...\n");
+    test_hash(0);
+    test_hash(CACHE_ARENA);
+
+    printf("testing long paths...\n");
+    test_long_path(32 * MB, 32 * MB, test_files[0], 0);
+    test_long_path(32 * MB, 32 * MB, test_files[0], CACHE_ARENA);
+
+    /* Registered ID tests. */
+    printf("testing registered IDs...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_ids(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_ids(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+    test_register_race();
+    printf("testing admission...\n");
+    test_admission(64 * MB, 32 * MB, test_files, N_TEST_FILES, 0);
+    test_admission(64 * MB, 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+
+    /* View tests. */
+    printf("testing views...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_views(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_views(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing variants...\n");
+    test_variants(test_files[0], 0);
+    test_variants(test_files[0], CACHE_ARENA);
+    test_variants(test_files[0], CACHE_COMPRESS);
+
+    /* Batch tests. */
+    printf("testing batches...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_batch(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_batch(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    /* Prefetch tests. */
+    printf("testing prefetch...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_prefetch(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_prefetch(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    /* Snapshot tests. */
+    printf("testing snapshots...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_snapshot(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0, 0);
+        test_snapshot(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA, 0);
+        test_snapshot(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing compression...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_compress(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_compress(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing spill tier...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_spill(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_spill(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing named caches...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_named(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_named(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing resizing...\n");
+    test_resize(32 * MB, 32 * MB, test_files, N_TEST_FILES, POLICY_MINIO, 0);
+    for (policy_t policy = POLICY_MINIO; policy < N_POLICIES; policy++) {
+        test_resize(32 * MB, 32 * MB, test_files, N_TEST_FILES, policy, CACHE_ARENA);
+    }
+
+    printf("testing memory accounting...\n");
+    test_memory(32 * MB, 32 * MB, test_files, N_TEST_FILES, 0);
+    test_memory(32 * MB, 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+
+    printf("testing peers...\n");
+    test_peers(32 * MB, 32 * MB, test_files, N_TEST_FILES, 0);
+    test_peers(32 * MB, 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+
+    /* Eviction tests. */
+    printf("testing eviction policies...\n");
+    test_policy(POLICY_FIFO, CACHE_ARENA);
+    test_policy(POLICY_CLOCK, CACHE_ARENA);
+
+    /* Multi-process tests. */
+    printf("testing dead flushes...\n");
+    test_dead_flush();
+
+    printf("testing dead writers...\n");
+    test_dead_writer(24 * MB, 32 * MB, test_files, N_TEST_FILES, POLICY_FIFO);
+    test_dead_writer(24 * MB, 32 * MB, test_files, N_TEST_FILES, POLICY_CLOCK);
+
+    printf("testing forked processes...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_fork(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_fork(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
+        printf(" OK.\n");
+    }
+
+    printf("testing coalesced misses...\n");
+    for (int i = 0; i < 6; i++) {
+        printf("\t%ld KB cache...", integrity_configs[i] / KB);
+        test_coalesce(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, 0);
+        test_coalesce(integrity_configs[i], 32 * MB, test_files, N_TEST_FILES, CACHE_ARENA);
         printf(" OK.\n");
     }
 
@@ -22,13 +22,22 @@
    SOFTWARE.
 """
 
+import gc
 import os
 import sys
+import time
+import array
+import threading
 import minio
-import numpy as np
 from typing import List, Dict, Tuple
 from glob import glob
 
+# NumPy is only needed for the interop tests, which are skipped without it.
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
 
 # Get all filepaths descending from the provided ROOT directory.
 def get_all_filepaths(root: str, extension: str = "*"):
@@ -126,9 +135,227 @@ def test_manual_methods(size: int,
 
     return success
 
+MB = 1024 * 1024
+
+# Test that views reference the cached data, keep it pinned (so that a flush
+# fails) for as long as they're alive, even past the cache itself, and that a
+# flush waits for views released while it's in progress.
+def test_views(filepaths: List[str], data: Dict[str, Tuple[bytearray, int]]):
+    cache = minio.PyCache(size=64 * MB, max_usable_file_size=32 * MB)
+    for filepath in filepaths:
+        view, size = cache.read_view(filepath)
+        assert view.readonly and size == len(data[filepath][0])
+        assert bytes(view) == data[filepath][0]
+        del view
+
+    view, size = cache.load_view(filepaths[0])
+    assert bytes(view) == data[filepaths[0]][0]
+    try:
+        cache.flush()
+        assert False, "flush succeeded with a view alive"
+    except BufferError:
+        pass
+
+    # Released by another thread as the flush waits.
+    release = threading.Thread(target=lambda: (time.sleep(0.01), view.release()))
+    release.start()
+    cache.flush()
+    release.join()
+    assert not cache.contains(filepaths[0])
+
+    # Views outlive the cache.
+    cache.read(filepaths[0])
+    view, size = cache.load_view(filepaths[0])
+    del cache
+    gc.collect()
+    assert bytes(view) == data[filepaths[0]][0]
+    view.release()
+
+    return True
+
+# Test that variants keep the shape and format of what was stored, under plain
+# and compressed caches, where loads fall back to a copy, and that they work
+# with NumPy arrays if it's installed.
+def test_variants(filepaths: List[str], data: Dict[str, Tuple[bytearray, int]]):
+    filepath = filepaths[0]
+    for compress in (False, True):
+        cache = minio.PyCache(size=32 * MB, max_usable_file_size=32 * MB, compress=compress, compress_min_size=1)
+        rgb = memoryview(bytes(i % 7 for i in range(24 * 32 * 3))).cast('B', (24, 32, 3))
+        val = memoryview(array.array('f', [i / 3 for i in range(32)])).cast('B').cast('f', (4, 8))
+        assert cache.load_variant(filepath, "rgb") is None
+        assert not cache.contains_variant(filepath, "rgb")
+        assert cache.store_variant(filepath, "rgb", rgb)
+        assert cache.store_variant(filepath, "val", val)
+        assert not cache.store_variant(filepath, "rgb", rgb)
+        assert cache.contains_variant(filepath, "rgb") and not cache.contains(filepath)
+        try:
+            cache.store_variant(filepath, "strided", rgb[::2])
+            assert False, "stored a non-contiguous buffer"
+        except BufferError:
+            pass
+
+        image = cache.load_variant(filepath, "rgb")
+        assert image.shape == (24, 32, 3) and image.format == 'B' and image.itemsize == 1
+        assert image.readonly and image.tolist() == rgb.tolist()
+        values = cache.load_variant(filepath, "val")
+        assert values.shape == (4, 8) and values.format == 'f' and values.itemsize == 4
+        assert values.tolist() == val.tolist()
+
+        # Compressed entries are loaded into a copy, which pins nothing. The
+        # values don't compress, so they're referenced directly either way.
+        del values
+        if compress:
+            cache.flush()
+            assert image.tolist() == rgb.tolist()
+            assert cache.load_variant(filepath, "rgb") is None
+        else:
+            try:
+                cache.flush()
+                assert False, "flush succeeded with a variant alive"
+            except BufferError:
+                pass
+        del image
+        cache.flush()
+
+        if np is not None:
+            array_in = np.arange(6 * 5 * 4, dtype=np.float32).reshape(6, 5, 4)
+            assert cache.store_variant(filepath, "array", array_in)
+            array_out = np.asarray(cache.load_variant(filepath, "array"))
+            assert array_out.shape == array_in.shape and array_out.dtype == array_in.dtype
+            assert np.array_equal(array_in, array_out) and not array_out.flags.writeable
+            del array_out
+
+            view, size = cache.read_view(filepaths[0])
+            assert np.frombuffer(view, dtype=np.uint8).tobytes() == data[filepaths[0]][0]
+            del view
+        del cache
+
+    return True
+
+# Test range reads against slices of the file, including ones that run off its
+# end, and batched reads against reading each file in turn.
+def test_range_many(filepaths: List[str], data: Dict[str, Tuple[bytearray, int]]):
+    for compress in (False, True):
+        cache = minio.PyCache(size=16 * MB, max_usable_file_size=4 * MB, compress=compress)
+        for filepath in filepaths:
+            truth = data[filepath][0]
+            for offset, length in ((0, 10), (len(truth) // 2, 3 * MB), (len(truth) - 3, 100), (len(truth) + 5, 10)):
+                for _ in range(2):
+                    chunk, size = cache.read_range(filepath, offset, length)
+                    assert chunk == truth[offset:offset + length] and size == len(chunk)
+    try:
+        cache.read_range("/nonexistent", 0, 10)
+        assert False, "read a range of a missing file"
+    except FileNotFoundError:
+        pass
+
+    cache = minio.PyCache(size=64 * MB, max_usable_file_size=32 * MB)
+    for _ in range(2):
+        results = cache.read_many(filepaths * 2)
+        assert [chunk for chunk, size in results] == [data[f][0] for f in filepaths * 2]
+    try:
+        cache.read_many([filepaths[0], "/nonexistent"])
+        assert False, "read a missing file"
+    except FileNotFoundError:
+        pass
+
+    return True
+
+# Test that registered paths read by ID like by path, across a flush, and that
+# predicted reuse decides what's admitted.
+def test_ids(filepaths: List[str], data: Dict[str, Tuple[bytearray, int]]):
+    cache = minio.PyCache(size=64 * MB, max_usable_file_size=32 * MB)
+    ids = cache.register_paths(filepaths)
+    assert ids == list(range(len(filepaths)))
+    for _ in range(2):
+        for i, filepath in zip(ids, filepaths):
+            assert cache.read_id(i)[0] == data[filepath][0] and cache.contains_id(i)
+    cache.flush()
+    assert not cache.contains_id(ids[0])
+    try:
+        cache.read_id(len(filepaths))
+        assert False, "read an unregistered ID"
+    except IndexError:
+        pass
+
+    # Only paths predicted to be read again are admitted.
+    reuse = [None] * len(filepaths)
+    reuse[0] = 0
+    cache.set_reuse(ids, reuse)
+    cache.set_admission(1.0)
+    for i, filepath in zip(ids, filepaths):
+        assert cache.read_id(i)[0] == data[filepath][0]
+    assert [cache.contains_id(i) for i in ids] == [i != 0 for i in ids]
+    assert cache.stats()["rejected"] == 1
+    try:
+        cache.set_reuse(ids, [1])
+        assert False, "set reuse with mismatched lengths"
+    except ValueError:
+        pass
+
+    return True
+
+# Test that shrinking the cache stops it admitting what no longer fits, and
+# growing it makes room again.
+def test_resize(filepaths: List[str], data: Dict[str, Tuple[bytearray, int]]):
+    largest = max(filepaths, key=lambda f: len(data[f][0]))
+    size = len(data[largest][0])
+    for arena in (False, True):
+        cache = minio.PyCache(size=4 * size, max_usable_file_size=size, arena=arena)
+        cache.resize(size - 1)
+        assert cache.read(largest)[0] == data[largest][0] and not cache.contains(largest)
+        cache.resize(4 * size)
+        assert cache.read(largest)[0] == data[largest][0] and cache.contains(largest)
+        if arena:
+            try:
+                cache.resize(8 * size)
+                assert False, "grew an arena"
+            except ValueError:
+                pass
+
+    return True
+
+# Test that a peer tier serves a node's registered files to the others, only
+# with the shared token, and that unregistered files are read locally.
+def test_peers(filepaths: List[str], data: Dict[str, Tuple[bytearray, int]]):
+    port = 30000 + os.getpid() % 10000
+    peers = ["127.0.0.1:{}".format(port), "127.0.0.1:{}".format(port + 1)]
+    a = minio.PyCache(size=64 * MB, max_usable_file_size=32 * MB)
+    b = minio.PyCache(size=64 * MB, max_usable_file_size=32 * MB)
+    for token in ("", "x" * 64):
+        try:
+            a.add_peers(peers, 0, token)
+            assert False, "added peers with a bad token"
+        except ValueError:
+            pass
+    a.add_peers(peers, 0, "secret")
+    b.add_peers(peers, 1, "secret")
+
+    for filepath in filepaths:
+        assert a.read(filepath)[0] == data[filepath][0] and not b.contains(filepath)
+    assert a.stats()["peer_hits"] == 0
+    a.flush()
+
+    b.register_paths(filepaths)
+    for filepath in filepaths:
+        assert a.read(filepath)[0] == data[filepath][0]
+    remote = sum(b.contains(filepath) for filepath in filepaths)
+    assert all(a.contains(filepath) != b.contains(filepath) for filepath in filepaths)
+    assert a.stats()["peer_hits"] == remote and a.stats()["peer_fails"] == 0
+
+    return True
+
+def run(test, *args):
+    print("testing {}...".format(test.__name__[len("test_"):]), end="")
+    try:
+        if test(*args):
+            print("OK.")
+            return
+    except AssertionError as e:
+        print(e, end=" ")
+    print("FAIL.")
+
 def main():
-    np.random.seed(42)
-    MB = 1024 * 1024
 
     if len(sys.argv) < 2:
         print("Please provide the filepath of a directory to load from.")
@@ -151,11 +378,13 @@ def main():
             data[filepath] = (bytes, hash(bytes))
 
     # Read everything with various cache sizes and ensure everything matches.
+    # Every file has to fit in the temporary area.
+    max_usable = max([16 * MB] + [len(data[filepath][0]) for filepath in filepaths])
     configs = [
-        (64  * MB, 16 * MB, average_file_size),
-        (128 * MB, 16 * MB, average_file_size),
-        (256 * MB, 16 * MB, average_file_size),
-        (512 * MB, 16 * MB, average_file_size),
+        (64  * MB, max_usable, average_file_size),
+        (128 * MB, max_usable, average_file_size),
+        (256 * MB, max_usable, average_file_size),
+        (512 * MB, max_usable, average_file_size),
     ]
 
     print("-- testing integrity --")
@@ -174,5 +403,12 @@ def main():
         else:
             print("FAIL.")
 
+    print("-- testing buffer-protocol paths --")
+    if np is None:
+        print("NumPy isn't installed; skipping its interop tests.")
+    sample = sorted(filepaths, key=lambda f: len(data[f][0]))[-3:]
+    for test in (test_views, test_variants, test_range_many, test_ids, test_resize, test_peers):
+        run(test, sample, data)
+
 if __name__ == "__main__":
     main()
\ No newline at end of file